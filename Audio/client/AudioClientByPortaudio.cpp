@@ -4,6 +4,11 @@
 #include <string>
 #include <cassert>
 #include <chrono>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+
+#include "../../common/metrics.h"
 
 extern "C" {
 #include <portaudio.h>
@@ -15,21 +20,54 @@ extern "C" {
 #include <Windows.h>
 }
 
+#include "../../common/sample_convert.h"
+#include "../../common/dtx.h"
+#include "../../common/ingest.h"
+#include "../../common/playout_clock.h"
+#include "../../common/sched_policy.h"
+#include "../../common/av_ptr.h"
+#include "../../common/audio_mix.h"
+#include "../../common/net_trace.h"
+
 const char* RTSP_URL = "rtsp://192.168.1.27:8554/mic";
 const int CHANNELS = 2;
 const int RATE = 48000;
 const int FRAMES_PER_BUFFER = 16;
+const int MAX_LATE_MS = 200;
+const int MIX_BLOCK_FRAMES = RATE / 100;
+const int MIX_JITTER_MS = 40;
 const AVSampleFormat INPUT_FORMAT = AV_SAMPLE_FMT_FLTP;
 const AVSampleFormat OUTPUT_FORMAT = AV_SAMPLE_FMT_S16;
 
-struct AudioData {
-    SwrContext* swr_ctx;
-    AVFormatContext* fmt_ctx;
-    AVCodecContext* codec_ctx;
-    AVPacket* pkt;
-    AVFrame* frame;
-    int stream_index;
+using SwrContextPtr = AvPtr<SwrContext, swr_free>;
+
+// Closes the stream, which has to happen before Pa_Terminate
+struct PaStreamClose {
+    void operator()(PaStream* stream) const { Pa_CloseStream(stream); }
 };
+using PaStreamPtr = std::unique_ptr<PaStream, PaStreamClose>;
+
+// Pa_Initialize for as long as this lives; declared before the streams so it goes last
+struct PaSession {
+    PaError err = Pa_Initialize();
+    ~PaSession() {
+        if (err == paNoError) {
+            Pa_Terminate();
+        }
+    }
+};
+
+// Set by Ctrl+C or closing the console; the read loop stops and everything is released on the way out
+std::atomic<bool> quit{ false };
+
+BOOL WINAPI ConsoleCtrlHandler(DWORD dwCtrlType) {
+    if (dwCtrlType == CTRL_C_EVENT || dwCtrlType == CTRL_CLOSE_EVENT) {
+        quit = true;
+        std::cerr << "Exiting..." << std::endl;
+        return TRUE;
+    }
+    return FALSE;
+}
 
 PaStream* initialize_pa_stream(int deviceIndex) {
     PaStream* stream;
@@ -67,7 +105,7 @@ PaStream* initialize_pa_stream(int deviceIndex) {
 }
 
 void list_audio_devices() {
-    Pa_Initialize();
+    PaSession pa;
     SetConsoleOutputCP(CP_UTF8);
     int numDevices = Pa_GetDeviceCount();
     const PaDeviceInfo* deviceInfo;
@@ -84,7 +122,62 @@ void list_audio_devices() {
             << ", Host API: " << Pa_GetHostApiInfo(deviceInfo->hostApi)->name << ")\n";
     }
     SetConsoleOutputCP(GetACP());
-    Pa_Terminate();
+}
+
+// Open the stream with the chosen ingest profile and set up its decoder
+// url is an RTSP session or the SDP of a multicast output, see ingest.h. On failure both contexts are empty.
+// A live stream is recorded if the trace asks for it; a trace file is replayed instead, see net_trace.h.
+bool open_input(const char* url, bool low_latency, bool force_tcp, NetTrace& trace, FormatContextPtr& fmt_ctx, CodecContextPtr& codec_ctx, int& stream_index) {
+    AVDictionary* options = nullptr;
+    AVFormatContext* opened = nullptr;
+    codec_ctx.reset();
+    fmt_ctx.reset();
+    if (ingest_is_sdp(url)) {
+        ingest_set_sdp_options(&options, low_latency);
+    }
+    else {
+        ingest_set_options(&options, low_latency, force_tcp);
+    }
+    int ret = net_trace_is_trace(url) ? net_trace_open_input(&trace, &opened, url) :
+        avformat_open_input(&opened, url, nullptr, &options);
+    av_dict_free(&options);
+    if (ret < 0) {
+        std::cerr << "Failed to open " << url << std::endl;
+        return false;
+    }
+    FormatContextPtr input(opened);
+    if (!trace.replaying && ingest_needs_probe(input.get(), low_latency) && avformat_find_stream_info(input.get(), nullptr) < 0) {
+        std::cerr << "Failed to retrieve input stream information" << std::endl;
+        return false;
+    }
+
+    stream_index = av_find_best_stream(input.get(), AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+    if (stream_index < 0) {
+        std::cerr << "Failed to find an audio stream" << std::endl;
+        return false;
+    }
+
+    const AVCodec* codec = avcodec_find_decoder(input->streams[stream_index]->codecpar->codec_id);
+    if (!codec) {
+        std::cerr << "Failed to find codec" << std::endl;
+        return false;
+    }
+
+    CodecContextPtr decoder(avcodec_alloc_context3(codec));
+    if (!decoder || avcodec_parameters_to_context(decoder.get(), input->streams[stream_index]->codecpar) < 0) {
+        std::cerr << "Failed to copy codec parameters to codec context" << std::endl;
+        return false;
+    }
+    if (avcodec_open2(decoder.get(), codec, nullptr) < 0) {
+        std::cerr << "Failed to open codec" << std::endl;
+        return false;
+    }
+    if (!trace.replaying) {
+        net_trace_record_start(&trace, input.get());
+    }
+    fmt_ctx = std::move(input);
+    codec_ctx = std::move(decoder);
+    return true;
 }
 
 int select_device() {
@@ -95,153 +188,595 @@ int select_device() {
     return deviceIndex;
 }
 
-int main() {
-    using namespace std::chrono;
-    int deviceIndex = select_device();
+// Comfort noise for the gaps of a DTX stream: once the server decides it is silence it only sends a
+// frame of background now and then. When the last frame was background and nothing has been written
+// for longer than a frame, the output is kept from running dry with noise at the background level.
+struct ComfortNoiseFill {
+    std::mutex pa_lock;                         // Serializes the blocking PortAudio calls
+    std::atomic<bool> stop{ false };
+    std::atomic<bool> quiet{ false };           // Last decoded frame was background
+    std::atomic<float> level_db{ DTX_MIN_DB };
+    std::atomic<int64_t> last_write_us{ 0 };
+    std::atomic<int64_t> gap_us{ 0 };           // Silence after the last write before noise starts
+};
 
-    avformat_network_init();
+void comfort_noise_thread(PaStream* stream, ComfortNoiseFill* fill, SchedPolicy* sched, Metric* m_noise, Metric* m_underflows) {
+    const int chunk = RATE / 50;                // 20 ms per write
+    std::vector<int16_t> noise(chunk * CHANNELS);
+    ComfortNoise cn;
+    long max_available = 0;
 
-    AVFormatContext* fmt_ctx = avformat_alloc_context();
-    if (avformat_open_input(&fmt_ctx, RTSP_URL, nullptr, nullptr) < 0) {
-        std::cerr << "Failed to open RTSP stream" << std::endl;
+    if (sched_policy_apply(sched, "playback", -1) < 0) {
+        std::cerr << "Failed to apply the playback scheduling policy to the comfort noise thread" << std::endl;
+    }
+    comfort_noise_init(&cn);
+    while (!fill->stop) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        if (!fill->quiet || av_gettime_relative() - fill->last_write_us < fill->gap_us) {
+            continue;
+        }
+        std::lock_guard<std::mutex> guard(fill->pa_lock);
+        // The largest write-available seen is the buffer size; keep at least one chunk queued
+        long available = Pa_GetStreamWriteAvailable(stream);
+        max_available = std::max(max_available, available);
+        if (available < 0 || available < max_available - chunk) {
+            continue;
+        }
+        comfort_noise_set_level(&cn, fill->level_db);
+        comfort_noise_s16(&cn, noise.data(), CHANNELS, chunk);
+        PaError err = Pa_WriteStream(stream, noise.data(), chunk);
+        if (err == paOutputUnderflowed) {
+            metric_add(m_underflows, 1);
+        }
+        if (err == paNoError || err == paOutputUnderflowed) {
+            metric_add(m_noise, chunk);
+        }
+    }
+}
+
+// One remote mic of the mixer: its own session, decoder and resampler on its own thread, feeding
+// its jitter buffer in the mixer. A lost connection is opened again every second.
+struct MixInput {
+    const char* url;
+    int index;
+    AudioMixer* mixer;
+    SchedPolicy* sched;
+    bool low_latency;
+    bool force_tcp;
+    Metric* m_packets;
+    Metric* m_bytes;
+    Metric* m_decode;
+    Metric* m_errors;
+    NetTrace trace;
+    std::thread thread;
+};
+
+void mix_input_thread(MixInput* in) {
+    using namespace std::chrono;
+    FormatContextPtr fmt_ctx;
+    CodecContextPtr codec_ctx;
+    SwrContextPtr swr_ctx;
+    PacketPtr pkt(av_packet_alloc());
+    FramePtr frame(av_frame_alloc());
+    // Interleaved float at the output rate; 100 ms covers any decoded frame
+    std::vector<float> buffer(RATE / 10 * CHANNELS);
+    int stream_index = -1;
+    bool force_tcp = in->force_tcp;
+    const bool sessionless = ingest_is_sdp(in->url) || net_trace_is_trace(in->url);
+    IngestLoss loss = { 0, 0, 0 };
+
+    if (sched_policy_apply(in->sched, "source", in->index) < 0) {
+        std::cerr << "Failed to apply the source scheduling policy to " << in->url << std::endl;
+    }
+    if (!pkt || !frame) {
+        std::cerr << "Failed to allocate the packet and frame" << std::endl;
+        quit = true;
+        return;
+    }
+    while (!quit) {
+        if (!fmt_ctx) {
+            if (!open_input(in->url, in->low_latency, force_tcp, in->trace, fmt_ctx, codec_ctx, stream_index)) {
+                std::this_thread::sleep_for(seconds(1));
+                continue;
+            }
+            AVChannelLayout out_ch_layout{};
+            av_channel_layout_default(&out_ch_layout, CHANNELS);
+            SwrContext* resampler = nullptr;
+            int ret = swr_alloc_set_opts2(&resampler, &out_ch_layout, AV_SAMPLE_FMT_FLT, RATE,
+                &codec_ctx->ch_layout, codec_ctx->sample_fmt, codec_ctx->sample_rate, 0, nullptr);
+            swr_ctx.reset(resampler);
+            if (ret < 0 || swr_init(swr_ctx.get()) < 0) {
+                std::cerr << "Failed to initialize the resampling context for " << in->url << std::endl;
+                codec_ctx.reset();
+                fmt_ctx.reset();
+                std::this_thread::sleep_for(seconds(1));
+                continue;
+            }
+        }
+        int ret = net_trace_read_frame(&in->trace, fmt_ctx.get(), pkt.get());
+        if (ret == AVERROR(EAGAIN)) {
+            continue;
+        }
+        if (ret < 0) {
+            std::cerr << "Failed to read from " << in->url << ", reconnecting" << std::endl;
+            metric_add(in->m_errors, 1);
+            codec_ctx.reset();
+            fmt_ctx.reset();
+            std::this_thread::sleep_for(seconds(1));
+            continue;
+        }
+        if (pkt->stream_index != stream_index) {
+            av_packet_unref(pkt.get());
+            continue;
+        }
+        int lost = 0;
+        metric_add(in->m_packets, 1);
+        metric_add(in->m_bytes, pkt->size);
+        auto decode_start = high_resolution_clock::now();
+        if (avcodec_send_packet(codec_ctx.get(), pkt.get()) < 0) {
+            metric_add(in->m_errors, 1);
+            lost = 1;
+        }
+        av_packet_unref(pkt.get());
+        while (avcodec_receive_frame(codec_ctx.get(), frame.get()) >= 0) {
+            if ((frame->flags & AV_FRAME_FLAG_CORRUPT) || frame->decode_error_flags) {
+                lost = 1;
+            }
+            int frames;
+            if (frame->sample_rate == RATE && frame->ch_layout.nb_channels == CHANNELS &&
+                frame->format == AV_SAMPLE_FMT_FLTP) {
+                frames = frame->nb_samples;
+                buffer.resize(std::max<size_t>(buffer.size(), frames * CHANNELS));
+                sample_convert_from_fltp((uint8_t*)buffer.data(), AV_SAMPLE_FMT_FLT, (const float* const*)frame->extended_data,
+                    CHANNELS, frames, nullptr);
+            }
+            else {
+                int dst_nb_samples = av_rescale_rnd(swr_get_delay(swr_ctx.get(), frame->sample_rate) +
+                    frame->nb_samples, RATE, frame->sample_rate, AV_ROUND_UP);
+                buffer.resize(std::max<size_t>(buffer.size(), dst_nb_samples * CHANNELS));
+                uint8_t* out = (uint8_t*)buffer.data();
+                frames = swr_convert(swr_ctx.get(), &out, dst_nb_samples, (const uint8_t**)frame->extended_data, frame->nb_samples);
+            }
+            if (frames < 0) {
+                std::cerr << "Error resampling audio from " << in->url << std::endl;
+                metric_add(in->m_errors, 1);
+                break;
+            }
+            audio_mixer_push(in->mixer, in->index, buffer.data(), frames);
+        }
+        metric_observe(in->m_decode, duration_cast<microseconds>(high_resolution_clock::now() - decode_start).count());
+        // Lossy UDP: start over on TCP
+        if (in->low_latency && !force_tcp && !sessionless && ingest_loss_update(&loss, lost, av_gettime_relative())) {
+            std::cerr << "Too much loss over UDP from " << in->url << ", switching to TCP" << std::endl;
+            force_tcp = true;
+            codec_ctx.reset();
+            fmt_ctx.reset();
+        }
+    }
+}
+
+// Mix every source into the output, one block at a time; Pa_WriteStream blocking on a full output
+// buffer sets the pace. The sources keep decoding on their own threads meanwhile.
+int run_mixer(AudioMixer* mixer, std::vector<MixInput>& inputs, int deviceIndex, SchedPolicy* sched,
+    Metric* m_mix, Metric* m_active, Metric* m_write, Metric* m_underflows, Metric* m_errors) {
+    using namespace std::chrono;
+    PaSession pa;
+    PaStreamPtr stream(initialize_pa_stream(deviceIndex));
+    if (!stream) {
         return 1;
     }
-    if (avformat_find_stream_info(fmt_ctx, nullptr) < 0) {
-        std::cerr << "Failed to retrieve input stream information" << std::endl;
-        avformat_close_input(&fmt_ctx);
+    PaError err = Pa_StartStream(stream.get());
+    if (err != paNoError) {
+        std::cerr << "Failed to start stream: " << Pa_GetErrorText(err) << std::endl;
         return 1;
     }
 
-    int stream_index = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
-    if (stream_index < 0) {
-        std::cerr << "Failed to find an audio stream" << std::endl;
-        avformat_close_input(&fmt_ctx);
+    std::vector<int16_t> block(MIX_BLOCK_FRAMES * CHANNELS);
+    if (sched_policy_hot_buffer(sched, "playback", block.data(), block.size() * sizeof(int16_t)) < 0 ||
+        sched_policy_hot_buffer(sched, "playback", mixer->acc, block.size() * sizeof(float)) < 0) {
+        std::cerr << "Failed to lock the mix buffers" << std::endl;
+    }
+    for (MixInput& in : inputs) {
+        in.thread = std::thread(mix_input_thread, &in);
+    }
+
+    int status = 0;
+    while (!quit) {
+        auto mix_start = high_resolution_clock::now();
+        metric_set(m_active, audio_mixer_pull(mixer, block.data()));
+        auto write_start = high_resolution_clock::now();
+        metric_observe(m_mix, duration_cast<microseconds>(write_start - mix_start).count());
+        err = Pa_WriteStream(stream.get(), block.data(), MIX_BLOCK_FRAMES);
+        if (err == paOutputUnderflowed) {
+            metric_add(m_underflows, 1);
+            err = paNoError;
+        }
+        if (err != paNoError) {
+            std::cerr << "Failed to write to stream: " << Pa_GetErrorText(err) << std::endl;
+            metric_add(m_errors, 1);
+            status = 1;
+            break;
+        }
+        metric_observe(m_write, duration_cast<microseconds>(high_resolution_clock::now() - write_start).count());
+    }
+
+    // A failed write stops the sources as well
+    quit = true;
+    for (MixInput& in : inputs) {
+        in.thread.join();
+    }
+    err = Pa_StopStream(stream.get());
+    if (err != paNoError) {
+        std::cerr << "Failed to stop stream: " << Pa_GetErrorText(err) << std::endl;
+    }
+    return status;
+}
+
+int main(int argc, char* argv[]) {
+    using namespace std::chrono;
+    if (!SetConsoleCtrlHandler(ConsoleCtrlHandler, TRUE)) {
+        std::cerr << "Could not set control handler" << std::endl;
+        return 1;
+    }
+    const char* metrics_address = nullptr;
+    const char* clock_address = nullptr;
+    std::vector<const char*> urls;
+    std::vector<float> gains;
+    int jitter_ms = MIX_JITTER_MS;
+    bool low_latency = false;
+    bool force_tcp = false;
+    int max_late_ms = MAX_LATE_MS;
+    const char* trace_path = nullptr;
+    const char* replay_spec = nullptr;
+    SchedPolicy sched = {};
+    for (int i = 1; i < argc; ++i) {
+        if (std::string(argv[i]) == "-u" && i + 1 < argc && urls.size() < AUDIO_MIX_MAX_SOURCES) {
+            urls.push_back(argv[++i]);
+            gains.push_back(0.0f);
+        }
+        else if (std::string(argv[i]) == "-g" && i + 1 < argc && !urls.empty()) {
+            gains.back() = std::stof(argv[++i]);
+        }
+        else if (std::string(argv[i]) == "-j" && i + 1 < argc) {
+            jitter_ms = std::stoi(argv[++i]);
+        }
+        else if (std::string(argv[i]) == "-M" && i + 1 < argc) {
+            metrics_address = argv[++i];
+        }
+        else if (std::string(argv[i]) == "-T" && i + 1 < argc) {
+            trace_path = argv[++i];
+        }
+        else if (std::string(argv[i]) == "-N" && i + 1 < argc) {
+            replay_spec = argv[++i];
+        }
+        else if (std::string(argv[i]) == "-A" && i + 1 < argc) {
+            clock_address = argv[++i];
+        }
+        else if (std::string(argv[i]) == "-L") {
+            low_latency = true;
+        }
+        else if (std::string(argv[i]) == "-l" && i + 1 < argc) {
+            max_late_ms = std::stoi(argv[++i]);
+        }
+        else if (std::string(argv[i]) == "-X" && i + 1 < argc && sched_policy_add(&sched, argv[i + 1]) == 0) {
+            i++;
+        }
+        else {
+            std::cerr << "Usage: " << argv[0] << " [-u rtsp_url | -u sdp | -u trace.avtrace [-g gain_db]]... [-j jitter_ms] [-T trace_file]"
+                " [-N scale[:loss_percent[:jitter_ms[:seed]]]] [-L] [-l max_late_ms]"
+                " [-A clock_address] [-M metrics_address] [-X playback|source:cpus[:class[:priority]] | -X mlock]..." << std::endl;
+            return 1;
+        }
+    }
+    // More than one -u: the sources are mixed, and a mix has no single clock to publish
+    const bool mixing = urls.size() > 1;
+    const char* url = urls.empty() ? RTSP_URL : urls[0];
+    if (mixing && (clock_address || trace_path)) {
+        std::cerr << "-A and -T need a single source" << std::endl;
         return 1;
     }
 
-    const AVCodec* codec = avcodec_find_decoder(fmt_ctx->streams[stream_index]->codecpar->codec_id);
-    if (!codec) {
-        std::cerr << "Failed to find codec" << std::endl;
-        avformat_close_input(&fmt_ctx);
+    // Metrics and live control (loglevel), all registered before the endpoint starts serving
+    static MetricsServer metrics;
+    metrics_init(&metrics, "audio_client", nullptr, nullptr);
+    Metric* m_packets = metrics_counter(&metrics, "packets_total", "Audio packets received");
+    Metric* m_bytes = metrics_counter(&metrics, "bytes_total", "Compressed bytes received");
+    Metric* m_bitrate = metrics_gauge(&metrics, "bitrate_bps", "Received bitrate over the last second");
+    Metric* m_decode = metrics_histogram_us(&metrics, "decode_seconds", "Decode and conversion time per packet",
+        metrics_frame_time_bounds_us, METRICS_FRAME_TIME_BUCKETS);
+    Metric* m_write = metrics_histogram_us(&metrics, "write_seconds", "Time blocked in Pa_WriteStream",
+        metrics_frame_time_bounds_us, METRICS_FRAME_TIME_BUCKETS);
+    Metric* m_iteration = metrics_histogram_us(&metrics, "read_loop_seconds", "One av_read_frame iteration",
+        metrics_frame_time_bounds_us, METRICS_FRAME_TIME_BUCKETS);
+    Metric* m_write_available = metrics_gauge(&metrics, "output_write_available_frames",
+        "Frames the output buffer can take without blocking");
+    Metric* m_errors = metrics_counter(&metrics, "errors_total", "Read, decode or write errors");
+    Metric* m_noise = metrics_counter(&metrics, "comfort_noise_samples_total", "Samples of comfort noise played in DTX gaps");
+    Metric* m_late = metrics_counter(&metrics, "late_frames_total", "Decoded frames dropped for arriving too late");
+    Metric* m_latency = metrics_histogram_us(&metrics, "e2e_latency_seconds", "Sender wall clock of the samples to the speaker",
+        metrics_frame_time_bounds_us, METRICS_FRAME_TIME_BUCKETS);
+    Metric* m_tcp = metrics_gauge(&metrics, "transport_tcp", "1 while receiving over TCP");
+    Metric* m_underflows = metrics_counter(&metrics, "output_underflows_total", "Writes that found the output buffer run dry");
+    MetricRate bitrate_rate = { 0, 0 };
+    NetTrace trace;
+    net_trace_init(&trace, &metrics);
+    trace.record_path = trace_path;
+    if (replay_spec && net_trace_parse_replay(&trace, replay_spec) < 0) {
+        std::cerr << "Invalid replay options " << replay_spec << ", expected scale[:loss_percent[:jitter_ms[:seed]]]" << std::endl;
+        return 1;
+    }
+    static AudioMixer mixer;
+    std::vector<MixInput> inputs;
+    Metric* m_mix = nullptr;
+    Metric* m_active = nullptr;
+    if (mixing) {
+        m_mix = metrics_histogram_us(&metrics, "mix_seconds", "Mixing one block of every source",
+            metrics_frame_time_bounds_us, METRICS_FRAME_TIME_BUCKETS);
+        m_active = metrics_gauge(&metrics, "mix_active_sources", "Sources that contributed to the last block");
+        if (audio_mixer_init(&mixer, &metrics, CHANNELS, MIX_BLOCK_FRAMES, jitter_ms * RATE / 1000) < 0) {
+            std::cerr << "Failed to allocate the mixer" << std::endl;
+            return 1;
+        }
+        inputs.reserve(urls.size());
+        for (size_t i = 0; i < urls.size(); ++i) {
+            int index = audio_mixer_add_source(&mixer, &metrics, gains[i]);
+            if (index < 0) {
+                std::cerr << "Failed to allocate the jitter buffer for " << urls[i] << std::endl;
+                audio_mixer_free(&mixer);
+                return 1;
+            }
+            // Each source replays on its own, with the same options
+            inputs.push_back({ urls[i], index, &mixer, &sched, low_latency, force_tcp, m_packets, m_bytes, m_decode, m_errors, trace, std::thread() });
+        }
+    }
+    if (metrics_address && metrics_start(&metrics, metrics_address) < 0) {
+        std::cerr << "Failed to start metrics endpoint on " << metrics_address << std::endl;
         return 1;
     }
 
-    AVCodecContext* codec_ctx = avcodec_alloc_context3(codec);
-    if (avcodec_parameters_to_context(codec_ctx, fmt_ctx->streams[stream_index]->codecpar) < 0) {
-        std::cerr << "Failed to copy codec parameters to codec context" << std::endl;
-        avcodec_free_context(&codec_ctx);
-        avformat_close_input(&fmt_ctx);
+    // Publish the playout position for the video client, audio is the master
+    PlayoutClock playout_clock;
+    if (clock_address && playout_clock_open(&playout_clock, clock_address, 1) < 0) {
+        std::cerr << "Failed to open the playout clock socket for " << clock_address << std::endl;
         return 1;
     }
-    if (avcodec_open2(codec_ctx, codec, nullptr) < 0) {
-        std::cerr << "Failed to open codec" << std::endl;
-        avcodec_free_context(&codec_ctx);
-        avformat_close_input(&fmt_ctx);
+
+    // This thread reads, decodes and writes to the output
+    if (sched_policy_apply(&sched, "playback", -1) < 0) {
+        std::cerr << "Failed to apply the playback scheduling policy" << std::endl;
+    }
+
+    int deviceIndex = select_device();
+
+    avformat_network_init();
+
+    if (mixing) {
+        int status = run_mixer(&mixer, inputs, deviceIndex, &sched, m_mix, m_active, m_write, m_underflows, m_errors);
+        audio_mixer_free(&mixer);
+        avformat_network_deinit();
+        metrics_stop(&metrics);
+        return status;
+    }
+
+    FormatContextPtr fmt_ctx;
+    CodecContextPtr codec_ctx;
+    int stream_index = -1;
+    // A multicast SDP or a replayed trace has no session to move to TCP
+    const bool sessionless = ingest_is_sdp(url) || net_trace_is_trace(url);
+    if (!open_input(url, low_latency, force_tcp, trace, fmt_ctx, codec_ctx, stream_index)) {
         return 1;
     }
+    metric_set(m_tcp, !sessionless && (!low_latency || force_tcp));
+    IngestClock clock;
+    IngestLoss loss = { 0, 0, 0 };
+    ingest_clock_init(&clock);
 
-    AVChannelLayout out_ch_layout = { .order = AV_CHANNEL_ORDER_NATIVE, .nb_channels = CHANNELS, .u = {.mask = AV_CH_LAYOUT_STEREO } };
+    AVChannelLayout out_ch_layout{};
+    av_channel_layout_default(&out_ch_layout, CHANNELS);
     AVChannelLayout in_ch_layout = codec_ctx->ch_layout;
 
-    SwrContext* swr_ctx = nullptr;
-    if (swr_alloc_set_opts2(&swr_ctx, &out_ch_layout, OUTPUT_FORMAT, RATE,
-        &in_ch_layout, codec_ctx->sample_fmt, codec_ctx->sample_rate, 0, nullptr) < 0) {
+    SwrContext* resampler = nullptr;
+    int ret = swr_alloc_set_opts2(&resampler, &out_ch_layout, OUTPUT_FORMAT, RATE,
+        &in_ch_layout, codec_ctx->sample_fmt, codec_ctx->sample_rate, 0, nullptr);
+    SwrContextPtr swr_ctx(resampler);
+    if (ret < 0 || swr_init(swr_ctx.get()) < 0) {
         std::cerr << "Failed to initialize the resampling context" << std::endl;
-        avcodec_free_context(&codec_ctx);
-        avformat_close_input(&fmt_ctx);
         return 1;
     }
 
-    if (swr_init(swr_ctx) < 0) {
-        std::cerr << "Failed to initialize the resampling context" << std::endl;
-        swr_free(&swr_ctx);
-        avcodec_free_context(&codec_ctx);
-        avformat_close_input(&fmt_ctx);
+    PacketPtr pkt(av_packet_alloc());
+    FramePtr frame(av_frame_alloc());
+    if (!pkt || !frame) {
+        std::cerr << "Failed to allocate the packet and frame" << std::endl;
         return 1;
     }
 
-    AVPacket* pkt = av_packet_alloc();
-    AVFrame* frame = av_frame_alloc();
-
-    AudioData audio_data = { swr_ctx, fmt_ctx, codec_ctx, pkt, frame, stream_index };
-
-    Pa_Initialize();
-    PaStream* stream = initialize_pa_stream(deviceIndex);
-    if (stream == nullptr) {
-        av_frame_free(&frame);
-        av_packet_free(&pkt);
-        swr_free(&swr_ctx);
-        avcodec_free_context(&codec_ctx);
-        avformat_close_input(&fmt_ctx);
-        avformat_network_deinit();
+    PaSession pa;
+    PaStreamPtr stream(initialize_pa_stream(deviceIndex));
+    if (!stream) {
         return 1;
     }
 
-    PaError err = Pa_StartStream(stream);
+    PaError err = Pa_StartStream(stream.get());
     if (err != paNoError) {
         std::cerr << "Failed to start stream: " << Pa_GetErrorText(err) << std::endl;
-        Pa_CloseStream(stream);
-        Pa_Terminate();
-        av_frame_free(&frame);
-        av_packet_free(&pkt);
-        swr_free(&swr_ctx);
-        avcodec_free_context(&codec_ctx);
-        avformat_close_input(&fmt_ctx);
-        avformat_network_deinit();
         return 1;
     }
 
     std::vector<uint8_t> buffer(FRAMES_PER_BUFFER * CHANNELS * av_get_bytes_per_sample(OUTPUT_FORMAT));
+    // Room for 100 ms frames, so the buffer stays where it was placed
+    buffer.reserve(RATE / 10 * CHANNELS * av_get_bytes_per_sample(OUTPUT_FORMAT));
+    if (sched_policy_hot_buffer(&sched, "playback", buffer.data(), buffer.capacity()) < 0) {
+        std::cerr << "Failed to lock the output buffer" << std::endl;
+    }
     std::vector<uint8_t*> buffer_ptrs(1, buffer.data());
-
-    while (true) {
+    SampleDither dither;
+    sample_dither_init(&dither, 1);
+    long max_available = 0;
+    // The client's own VAD tells background frames from speech and tracks the background level
+    Vad vad;
+    vad_init(&vad, 1024.0f / RATE);
+    ComfortNoiseFill fill;
+    std::thread noise_thread(comfort_noise_thread, stream.get(), &fill, &sched, m_noise, m_underflows);
+
+    while (!quit) {
         auto start_time = high_resolution_clock::now();
-        if (av_read_frame(fmt_ctx, pkt) >= 0) {
+        bool reopen = false;
+        ret = net_trace_read_frame(&trace, fmt_ctx.get(), pkt.get());
+        if (ret >= 0) {
             if (pkt->stream_index == stream_index) {
-                if (avcodec_send_packet(codec_ctx, pkt) >= 0) {
-                    while (avcodec_receive_frame(codec_ctx, frame) >= 0) {
-                        int dst_nb_samples = av_rescale_rnd(swr_get_delay(swr_ctx, frame->sample_rate) +
-                            frame->nb_samples, RATE, frame->sample_rate, AV_ROUND_UP);
+                AVStream* in_stream = fmt_ctx->streams[stream_index];
+                int lost = 0;
+                metric_add(m_packets, 1);
+                metric_add(m_bytes, pkt->size);
+                if (avcodec_send_packet(codec_ctx.get(), pkt.get()) >= 0) {
+                    auto decode_start = high_resolution_clock::now();
+                    while (avcodec_receive_frame(codec_ctx.get(), frame.get()) >= 0) {
+                        if ((frame->flags & AV_FRAME_FLAG_CORRUPT) || frame->decode_error_flags) {
+                            lost = 1;
+                        }
+                        // Samples that are already too late would only pile up in the output buffer
+                        int64_t pts_us = frame->best_effort_timestamp == AV_NOPTS_VALUE ? AV_NOPTS_VALUE :
+                            av_rescale_q(frame->best_effort_timestamp, in_stream->time_base, AV_TIME_BASE_Q);
+                        if (low_latency && pts_us != AV_NOPTS_VALUE &&
+                            ingest_clock_lateness(&clock, pts_us, av_gettime_relative()) > max_late_ms * 1000LL) {
+                            metric_add(m_late, 1);
+                            continue;
+                        }
+                        // The comfort noise follows the decoded level whichever way the frame is converted;
+                        // AAC always decodes to planar float
+                        if (frame->format == AV_SAMPLE_FMT_FLTP) {
+                            vad_update(&vad, dtx_level_db((const float* const*)frame->extended_data, frame->ch_layout.nb_channels,
+                                frame->nb_samples));
+                            fill.quiet = !vad.speech;
+                            fill.level_db = vad.floor_db;
+                            fill.gap_us = av_rescale(frame->nb_samples, 1500000, frame->sample_rate);
+                        }
+                        // Same rate and channel count: a dithered interleave is all that is needed
+                        if (frame->sample_rate == RATE && frame->ch_layout.nb_channels == CHANNELS &&
+                            frame->format == AV_SAMPLE_FMT_FLTP) {
+                            buffer.resize(frame->nb_samples * CHANNELS * av_get_bytes_per_sample(OUTPUT_FORMAT));
+                            ret = sample_convert_from_fltp(buffer.data(), OUTPUT_FORMAT, (const float* const*)frame->extended_data,
+                                CHANNELS, frame->nb_samples, &dither);
+                            if (ret == 0) {
+                                ret = frame->nb_samples;
+                            }
+                        }
+                        else {
+                            int dst_nb_samples = av_rescale_rnd(swr_get_delay(swr_ctx.get(), frame->sample_rate) +
+                                frame->nb_samples, RATE, frame->sample_rate, AV_ROUND_UP);
 
-                        std::vector<uint8_t> buffer(dst_nb_samples * CHANNELS * av_get_bytes_per_sample(OUTPUT_FORMAT));
-                        std::vector<uint8_t*> buffer_ptrs(1, buffer.data());
+                            buffer.resize(dst_nb_samples * CHANNELS * av_get_bytes_per_sample(OUTPUT_FORMAT));
+                            buffer_ptrs[0] = buffer.data();
 
-                        int ret = swr_convert(swr_ctx, buffer_ptrs.data(), dst_nb_samples,
-                            (const uint8_t**)frame->data, frame->nb_samples);
+                            ret = swr_convert(swr_ctx.get(), buffer_ptrs.data(), dst_nb_samples,
+                                (const uint8_t**)frame->data, frame->nb_samples);
+                        }
 
                         if (ret < 0) {
                             std::cerr << "Error resampling audio" << std::endl;
+                            metric_add(m_errors, 1);
                             break;
                         }
-
-                        PaError err = Pa_WriteStream(stream, buffer.data(), ret);
+                        auto write_start = high_resolution_clock::now();
+                        metric_observe(m_decode, duration_cast<microseconds>(write_start - decode_start).count());
+                        PaError err;
+                        long queued;
+                        {
+                            std::lock_guard<std::mutex> guard(fill.pa_lock);
+                            metric_set(m_write_available, Pa_GetStreamWriteAvailable(stream.get()));
+                            err = Pa_WriteStream(stream.get(), buffer.data(), ret);
+                            // The largest write-available seen is the buffer size
+                            long available = Pa_GetStreamWriteAvailable(stream.get());
+                            max_available = std::max(max_available, available);
+                            queued = max_available - available;
+                        }
+                        // The samples were still written, after a gap
+                        if (err == paOutputUnderflowed) {
+                            metric_add(m_underflows, 1);
+                            err = paNoError;
+                        }
+                        fill.last_write_us = av_gettime_relative();
                         if (err != paNoError) {
                             std::cerr << "Failed to write to stream: " << Pa_GetErrorText(err) << std::endl;
+                            metric_add(m_errors, 1);
                             break;
                         }
+                        // The RTCP sender reports map PTS to the sender's wall clock
+                        if (fmt_ctx->start_time_realtime != AV_NOPTS_VALUE && pts_us != AV_NOPTS_VALUE) {
+                            int64_t now = av_gettime();
+                            int64_t media_end_us = fmt_ctx->start_time_realtime + pts_us +
+                                av_rescale(frame->nb_samples, 1000000, frame->sample_rate);
+                            // The end of this frame reaches the speaker once everything queued has played
+                            int64_t delay_us = std::max<int64_t>(av_rescale(queued, 1000000, RATE),
+                                (int64_t)(Pa_GetStreamInfo(stream.get())->outputLatency * 1000000));
+                            metric_observe(m_latency, now + delay_us - media_end_us);
+                            if (clock_address) {
+                                playout_clock_publish(&playout_clock, media_end_us - delay_us, now);
+                            }
+                        }
+                        decode_start = high_resolution_clock::now();
+                        metric_observe(m_write, duration_cast<microseconds>(decode_start - write_start).count());
                     }
                 }
+                else {
+                    metric_add(m_errors, 1);
+                    lost = 1;
+                }
+                // Lossy UDP: start over on TCP
+                if (low_latency && !force_tcp && !sessionless && ingest_loss_update(&loss, lost, av_gettime_relative())) {
+                    std::cerr << "Too much loss over UDP, switching to TCP" << std::endl;
+                    force_tcp = true;
+                    reopen = true;
+                }
+            }
+            av_packet_unref(pkt.get());
+        }
+        else if (ret != AVERROR(EAGAIN)) {
+            // End of stream or a dropped connection: every further read fails at once, so open it again
+            std::cerr << "Failed to read from the stream, reconnecting" << std::endl;
+            metric_add(m_errors, 1);
+            std::this_thread::sleep_for(seconds(1));
+            reopen = true;
+        }
+        if (reopen) {
+            // Once a second until it opens or we are told to quit
+            while (!quit && !open_input(url, low_latency, force_tcp, trace, fmt_ctx, codec_ctx, stream_index)) {
+                std::cerr << "Reconnection failed, retrying" << std::endl;
+                std::this_thread::sleep_for(seconds(1));
+            }
+            if (quit) {
+                break;
             }
-            av_packet_unref(pkt);
+            metric_set(m_tcp, !sessionless && (!low_latency || force_tcp));
+            ingest_clock_init(&clock);
+            continue;
         }
         auto end_time = high_resolution_clock::now();
-        duration<double, std::milli> time_spent = end_time - start_time;
-        printf("Time spent in one frame of av_read_frame: %f ms\n", time_spent.count());
+        metric_observe(m_iteration, duration_cast<microseconds>(end_time - start_time).count());
+        metric_rate_tick(&bitrate_rate, m_bitrate, m_bytes, 8, av_gettime_relative());
+        if (av_log_get_level() >= AV_LOG_DEBUG) {
+            duration<double, std::milli> time_spent = end_time - start_time;
+            printf("Time spent in one frame of av_read_frame: %f ms\n", time_spent.count());
+        }
     }
 
-    err = Pa_StopStream(stream);
+    fill.stop = true;
+    noise_thread.join();
+    err = Pa_StopStream(stream.get());
     if (err != paNoError) {
         std::cerr << "Failed to stop stream: " << Pa_GetErrorText(err) << std::endl;
     }
-    Pa_CloseStream(stream);
-    Pa_Terminate();
 
-    av_frame_free(&frame);
-    av_packet_free(&pkt);
-    swr_free(&swr_ctx);
-    avcodec_free_context(&codec_ctx);
-    avformat_close_input(&fmt_ctx);
+    // The RTSP teardown still needs the network; the stream and PortAudio go with their owners
+    codec_ctx.reset();
+    fmt_ctx.reset();
+    net_trace_record_stop(&trace);
     avformat_network_deinit();
+    if (clock_address) {
+        playout_clock_close(&playout_clock);
+    }
+    metrics_stop(&metrics);
 
     return 0;
 }
@@ -1,12 +1,23 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
+#include <signal.h>
 #include <unistd.h>
 #include <time.h>
+#include <alsa/asoundlib.h>
 #include <libavdevice/avdevice.h>
 #include <libswscale/swscale.h>
 #include <libavutil/imgutils.h>
 #include <libswresample/swresample.h>
-#include <libavutil/fifo.h>
+#include <libavutil/time.h>
+
+#include "../../common/sample_convert.h"
+#include "../../common/metrics.h"
+#include "../../common/record_tee.h"
+#include "../../common/dtx.h"
+#include "../../common/sched_policy.h"
+#include "../../common/fast_start.h"
  
 AVFormatContext *out_context = NULL;
 AVCodecContext *c = NULL;
@@ -14,36 +25,160 @@ struct SwrContext *swr_ctx = NULL;
 AVStream *out_stream = NULL;
 AVFrame *output_frame = NULL;
 int fsize = 0, thread_encode_exit = 0;
-AVFifoBuffer *fifo = NULL;
 pthread_mutex_t lock;
+pthread_cond_t fifo_cond;
  
+// Capture side state, shared with the encoder thread under `lock`
+int use_mmap = 0;                          // 1: direct ALSA mmap capture, 0: libavdevice alsa demuxer
+int capture_rate = 0;
+int capture_channels = 0;
+enum AVSampleFormat capture_fmt = AV_SAMPLE_FMT_NONE;
+int bytes_per_frame = 0;                   // Bytes per interleaved sample frame
+int64_t fifo_tail_us = AV_NOPTS_VALUE;     // Capture time of the sample just after the newest one in the fifo
+
+// The fifo is a ring of FIFO_FRAMES encoder frames, allocated once. The capture side appends any
+// number of bytes; the encoder takes one frame at a time, always from a frame boundary, so a frame
+// never wraps and is converted straight out of the ring while the capture side keeps writing.
+#define FIFO_FRAMES 8
+uint8_t *fifo = NULL;
+int fifo_size = 0;                         // Bytes, FIFO_FRAMES * fsize
+int64_t fifo_read = 0, fifo_write = 0;     // Bytes ever taken / appended
+int64_t fifo_busy_pos = 0;                 // Start of the frame the encoder is converting, if fifo_busy
+int fifo_busy = 0;
+
+// Metrics and live control
+MetricsServer metrics;
+Metric *m_packets, *m_bytes, *m_bitrate, *m_target_bitrate, *m_encode, *m_latency, *m_fifo_depth, *m_overruns;
+volatile int64_t pending_bitrate = 0;
+
+// Local recording of the published packets
+RecordTee record;
+
+// Thread placement: "capture" is the main thread, "encode" the encoder thread
+SchedPolicy sched;
+Metric *m_xruns;
+
+// Multicast output: plain RTP to a group instead of publishing over RTSP, receivers join with the SDP
+int multicast = 0;
+MetricsDocument *sdp_document;
+
+// Discontinuous transmission: frames the VAD calls silence are not encoded, except one background
+// frame (SID) every DTX_SID_INTERVAL frames for the client's comfort noise. The AAC encoder hands
+// out a frame's packet two calls later, so the frames right after a sent one are still encoded to
+// push it out, and their own packets are dropped.
+#define DTX_PREROLL_FRAMES 3                // Skipped frames kept for the start of a talk spurt
+#define DTX_FLUSH_FRAMES 2
+#define DTX_SID_INTERVAL 16                 // ~340 ms at 48 kHz
+#define DTX_SEND_SLOTS 8
+int dtx = 0;
+Vad vad;
+AVFrame *dtx_hold[DTX_PREROLL_FRAMES];
+int64_t dtx_send_pts[DTX_SEND_SLOTS];       // Frames whose packets are published
+int dtx_send_next = 0;
+int64_t dtx_last_encoded = AV_NOPTS_VALUE;
+Metric *m_frames, *m_encoded, *m_vad_active, *m_onsets;
+
+// Encoder thread state
+int64_t first_us = AV_NOPTS_VALUE;          // Capture time of PTS 0
+int64_t latency_sum = 0, latency_max = 0;
+int latency_count = 0;
+
+// Time to first packet and what it is spent on
+StartupClock startup;
+
+// Ctrl+C or SIGTERM: capture stops and everything is flushed and freed on the way out
+volatile sig_atomic_t stop_requested = 0;
+
 void *thread_encode(void *);
 
-// gcc audio1.c -o audio1 -I /usr/local/include -L /usr/local/lib -lavdevice -lavformat -lavcodec -lavutil -lswscale -lswresample -lpthread
+static void request_stop(int sig)
+{
+    (void)sig;
+    stop_requested = 1;
+}
 
-// ffplay -fflags nobuffer -flags low_delay -framedrop -strict experimental rtsp://localhost:8554/mic
-int main(void)
+// Current time on the clock the capture timestamps come from: ALSA mmap timestamps are
+// CLOCK_MONOTONIC, while the alsa demuxer stamps its packets with av_gettime()
+static int64_t capture_clock_us(void)
+{
+    struct timespec ts;
+    if (!use_mmap)
+        return av_gettime();
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Append interleaved samples to the fifo and wake the encoder thread.
+// tail_us is the capture time of the sample right after the last one in data.
+// When the encoder falls behind the oldest samples are dropped, so latency stays bounded.
+static void fifo_push(const uint8_t *data, int size, int64_t tail_us)
+{
+    pthread_mutex_lock(&lock);
+    if (size > fifo_size - fsize)
+    {
+        // More than the ring holds next to a frame being converted: keep the newest part, and drop
+        // everything queued, which is older still
+        metric_add(m_overruns, size - (fifo_size - fsize) + fifo_write - fifo_read);
+        data += size - (fifo_size - fsize);
+        size = fifo_size - fsize;
+        fifo_write = fifo_busy ? fifo_busy_pos + fsize : (fifo_write + fsize - 1) / fsize * fsize;
+        fifo_read = fifo_write;
+    }
+    else if (fifo_write + size > (fifo_busy ? fifo_busy_pos : fifo_read) + fifo_size)
+    {
+        if (fifo_busy)
+        {
+            // The new samples would wrap onto the frame being converted: drop everything queued
+            // and start over right behind that frame
+            metric_add(m_overruns, fifo_write - fifo_read);
+            fifo_read = fifo_write = fifo_busy_pos + fsize;
+        }
+        else
+        {
+            // Drop the oldest whole frames, so the encoder still finds frames on their boundaries
+            int64_t drop = (fifo_write + size - fifo_read - fifo_size + fsize - 1) / fsize * fsize;
+            metric_add(m_overruns, drop);
+            fifo_read += drop;
+        }
+    }
+    int offset = (int)(fifo_write % fifo_size);
+    int first = FFMIN(size, fifo_size - offset);
+    memcpy(fifo + offset, data, first);
+    memcpy(fifo, data + first, size - first);
+    fifo_write += size;
+    fifo_tail_us = tail_us;
+    metric_set(m_fifo_depth, (fifo_write - fifo_read) / bytes_per_frame);
+    if (fifo_write - fifo_read >= fsize)
+        pthread_cond_signal(&fifo_cond);
+    pthread_mutex_unlock(&lock);
+}
+
+static int audio_control(const char *key, const char *value, void *opaque)
+{
+    (void)opaque;
+    if (strcmp(key, "bitrate") == 0)
+    {
+        int64_t bitrate = strtoll(value, NULL, 10);
+        if (bitrate <= 0)
+            return -1;
+        metrics_atomic_store(&pending_bitrate, bitrate);
+        return 0;
+    }
+    // Every AAC frame is a keyframe, so there is nothing to force
+    return -1;
+}
+
+// Open the input with the libavdevice alsa demuxer (period size is whatever it picks)
+static int open_alsa_demuxer(const char *input_format_name, const char *device_name,
+                             const char *in_sample_rate, const char *in_channels,
+                             AVFormatContext **in_context, int *streamid)
 {
-    const char *input_format_name = "alsa"; 
-    const char *device_name = "hw:0,0,0";
-    const char *in_sample_rate = "48000";
-    const char *in_channels = "2";
-    const char *url = "rtsp://localhost:8554/mic"; 
-    int ret = -1;
-    int streamid = -1;
     AVDictionary *options = NULL;
     AVInputFormat *fmt = NULL;
-    AVFormatContext *in_context = NULL;
-    AVCodec *codec = NULL;
     AVStream *stream = NULL;
-    int64_t channel_layout;
- 
-    // Print ffmpeg version information
-    printf("ffmpeg version: %s\n", av_version_info());
- 
-    // Register all devices
-    avdevice_register_all();
- 
+    int64_t t;
+    int ret;
+
     // Find input format
     fmt = av_find_input_format(input_format_name);
     if (!fmt)
@@ -51,13 +186,14 @@ int main(void)
         printf("av_find_input_format error");
         return -1;
     }
- 
+
     // Set microphone audio parameters
     av_dict_set(&options, "sample_rate", in_sample_rate, 0);
     av_dict_set(&options, "channels", in_channels, 0);
- 
+
     // Open input stream and initialize format context
-    ret = avformat_open_input(&in_context, device_name, fmt, &options);
+    t = av_gettime_relative();
+    ret = avformat_open_input(in_context, device_name, fmt, &options);
     if (ret != 0)
     {
         // Release options in case of error, otherwise avformat_open_input will release it internally
@@ -65,42 +201,382 @@ int main(void)
         printf("avformat_open_input error\n");
         return -1;
     }
- 
-    // Find stream information
-    if (avformat_find_stream_info(in_context, 0) < 0)
+    t = startup_clock_phase(&startup, STARTUP_DEVICE, t);
+
+    // Find stream information, unless the device already gave rate, channels and sample format
+    if (capture_needs_probe(*in_context))
     {
-        printf("avformat_find_stream_info failed\n");
-        return -1;
+        if (avformat_find_stream_info(*in_context, 0) < 0)
+        {
+            printf("avformat_find_stream_info failed\n");
+            return -1;
+        }
+        startup_clock_phase(&startup, STARTUP_PROBE, t);
     }
- 
+
     // Find the audio stream index
-    streamid = av_find_best_stream(in_context, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
-    if (streamid < 0)
+    *streamid = av_find_best_stream(*in_context, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+    if (*streamid < 0)
     {
         printf("cannot find audio stream");
-        goto end;
+        return -1;
     }
-    stream = in_context->streams[streamid];
+    stream = (*in_context)->streams[*streamid];
     printf("audio stream, sample_rate: %d, channels: %d, format: %s\n",
            stream->codecpar->sample_rate, stream->codecpar->channels,
            av_get_sample_fmt_name((enum AVSampleFormat)stream->codecpar->format));
+    return 0;
+}
+
+// Fast start: the demuxer opens on its own thread while the encoder and the output are set up
+typedef struct DemuxerOpen
+{
+    const char *input_format_name, *device_name, *in_sample_rate, *in_channels;
+    AVFormatContext *in_context;
+    int streamid;
+    int ret;
+} DemuxerOpen;
+
+static void *open_alsa_demuxer_thread(void *arg)
+{
+    DemuxerOpen *open = (DemuxerOpen *)arg;
+    open->ret = open_alsa_demuxer(open->input_format_name, open->device_name, open->in_sample_rate,
+                                  open->in_channels, &open->in_context, &open->streamid);
+    return NULL;
+}
+
+// Capture parameters from the opened demuxer. The encoder may already be set up for capture_rate
+// and capture_channels as requested, in which case check is set and the device has to match them.
+static int take_demuxer_params(AVFormatContext *in_context, int streamid, int check)
+{
+    AVCodecParameters *par = in_context->streams[streamid]->codecpar;
+
+    if (check && (par->sample_rate != capture_rate || par->channels != capture_channels))
+    {
+        printf("device delivers %d Hz, %d channels, not %d Hz, %d channels; -F needs what the device supports\n",
+               par->sample_rate, par->channels, capture_rate, capture_channels);
+        return -1;
+    }
+    capture_rate = par->sample_rate;
+    capture_channels = par->channels;
+    capture_fmt = (enum AVSampleFormat)par->format;
+    return 0;
+}
+
+// Open a hw: device in mmap mode with an explicit period/buffer size.
+// Monotonic timestamps are enabled so PTS reflects when the samples were captured,
+// not when we got around to reading them. The sample format is the first of S16, S32 and
+// float the device supports, all of which the encoder thread converts without swresample.
+static snd_pcm_t *open_alsa_mmap(const char *device_name, unsigned int *rate, unsigned int channels,
+                                 snd_pcm_uframes_t *period, snd_pcm_uframes_t *buffer, enum AVSampleFormat *fmt)
+{
+    static const struct
+    {
+        snd_pcm_format_t alsa;
+        enum AVSampleFormat av;
+    } formats[] = {
+        {SND_PCM_FORMAT_S16_LE, AV_SAMPLE_FMT_S16},
+        {SND_PCM_FORMAT_S32_LE, AV_SAMPLE_FMT_S32},
+        {SND_PCM_FORMAT_FLOAT_LE, AV_SAMPLE_FMT_FLT},
+    };
+    snd_pcm_t *pcm = NULL;
+    snd_pcm_hw_params_t *hw_params;
+    snd_pcm_sw_params_t *sw_params;
+    int err, f = 0;
+
+    err = snd_pcm_open(&pcm, device_name, SND_PCM_STREAM_CAPTURE, 0);
+    if (err < 0)
+    {
+        printf("snd_pcm_open error (%s)\n", snd_strerror(err));
+        return NULL;
+    }
+
+    snd_pcm_hw_params_alloca(&hw_params);
+    if ((err = snd_pcm_hw_params_any(pcm, hw_params)) < 0 ||
+        (err = snd_pcm_hw_params_set_access(pcm, hw_params, SND_PCM_ACCESS_MMAP_INTERLEAVED)) < 0)
+    {
+        printf("snd_pcm_hw_params error (%s)\n", snd_strerror(err));
+        snd_pcm_close(pcm);
+        return NULL;
+    }
+    while (f < (int)FF_ARRAY_ELEMS(formats) && snd_pcm_hw_params_test_format(pcm, hw_params, formats[f].alsa) < 0)
+        f++;
+    if (f == (int)FF_ARRAY_ELEMS(formats))
+    {
+        printf("%s supports none of S16_LE, S32_LE and FLOAT_LE\n", device_name);
+        snd_pcm_close(pcm);
+        return NULL;
+    }
+    *fmt = formats[f].av;
+    if ((err = snd_pcm_hw_params_set_format(pcm, hw_params, formats[f].alsa)) < 0 ||
+        (err = snd_pcm_hw_params_set_channels(pcm, hw_params, channels)) < 0 ||
+        (err = snd_pcm_hw_params_set_rate_near(pcm, hw_params, rate, NULL)) < 0 ||
+        (err = snd_pcm_hw_params_set_period_size_near(pcm, hw_params, period, NULL)) < 0 ||
+        (err = snd_pcm_hw_params_set_buffer_size_near(pcm, hw_params, buffer)) < 0 ||
+        (err = snd_pcm_hw_params(pcm, hw_params)) < 0)
+    {
+        printf("snd_pcm_hw_params error (%s)\n", snd_strerror(err));
+        snd_pcm_close(pcm);
+        return NULL;
+    }
+
+    snd_pcm_sw_params_alloca(&sw_params);
+    if ((err = snd_pcm_sw_params_current(pcm, sw_params)) < 0 ||
+        (err = snd_pcm_sw_params_set_avail_min(pcm, sw_params, *period)) < 0 ||
+        (err = snd_pcm_sw_params_set_tstamp_mode(pcm, sw_params, SND_PCM_TSTAMP_ENABLE)) < 0 ||
+        (err = snd_pcm_sw_params_set_tstamp_type(pcm, sw_params, SND_PCM_TSTAMP_TYPE_MONOTONIC)) < 0 ||
+        (err = snd_pcm_sw_params(pcm, sw_params)) < 0)
+    {
+        printf("snd_pcm_sw_params error (%s)\n", snd_strerror(err));
+        snd_pcm_close(pcm);
+        return NULL;
+    }
+    return pcm;
+}
+
+static int alsa_mmap_recover(snd_pcm_t *pcm, int err)
+{
+    printf("alsa capture error (%s), restarting\n", snd_strerror(err));
+    metric_add(m_xruns, 1);
+    if ((err = snd_pcm_recover(pcm, err, 1)) < 0 || (err = snd_pcm_start(pcm)) < 0)
+    {
+        printf("snd_pcm_recover error (%s)\n", snd_strerror(err));
+        return err;
+    }
+    return 0;
+}
+
+// Capture loop of the mmap backend: once a period is available, every contiguous
+// chunk of the DMA buffer is copied straight into the fifo, no intermediate packet
+static void capture_alsa_mmap(snd_pcm_t *pcm, snd_pcm_uframes_t period)
+{
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t offset, frames, consumed, avail_ts;
+    snd_pcm_sframes_t avail, committed;
+    snd_htimestamp_t tstamp;
+    int64_t oldest_us;
+    int err;
+
+    err = snd_pcm_start(pcm);
+    if (err < 0)
+    {
+        printf("snd_pcm_start error (%s)\n", snd_strerror(err));
+        return;
+    }
+
+    while (!thread_encode_exit && !stop_requested)
+    {
+        avail = snd_pcm_avail_update(pcm);
+        if (avail < 0)
+        {
+            if (alsa_mmap_recover(pcm, avail) < 0)
+                break;
+            continue;
+        }
+        if ((snd_pcm_uframes_t)avail < period)
+        {
+            err = snd_pcm_wait(pcm, 1000);
+            if (err < 0 && alsa_mmap_recover(pcm, err) < 0)
+                break;
+            continue;
+        }
+
+        // The timestamp was taken when avail_ts frames were ready, so the oldest of them
+        // was captured avail_ts sample periods earlier
+        if (snd_pcm_htimestamp(pcm, &avail_ts, &tstamp) < 0 || (tstamp.tv_sec == 0 && tstamp.tv_nsec == 0))
+        {
+            oldest_us = capture_clock_us() - av_rescale(avail, 1000000, capture_rate);
+        }
+        else
+        {
+            oldest_us = (int64_t)tstamp.tv_sec * 1000000 + tstamp.tv_nsec / 1000 -
+                        av_rescale(avail_ts, 1000000, capture_rate);
+        }
+
+        consumed = 0;
+        err = 0;
+        while (consumed < (snd_pcm_uframes_t)avail)
+        {
+            frames = avail - consumed;
+            err = snd_pcm_mmap_begin(pcm, &areas, &offset, &frames);
+            if (err < 0)
+                break;
+            // Interleaved access: all channels share the first area
+            const uint8_t *src = (const uint8_t *)areas[0].addr + (areas[0].first + offset * areas[0].step) / 8;
+            consumed += frames;
+            fifo_push(src, frames * bytes_per_frame, oldest_us + av_rescale(consumed, 1000000, capture_rate));
+            committed = snd_pcm_mmap_commit(pcm, offset, frames);
+            if (committed < 0 || (snd_pcm_uframes_t)committed != frames)
+            {
+                err = committed < 0 ? committed : -EPIPE;
+                break;
+            }
+        }
+        if (err < 0 && alsa_mmap_recover(pcm, err) < 0)
+            break;
+    }
+    snd_pcm_drop(pcm);
+}
+
+// gcc audio1.c -o audio1 -I /usr/local/include -L /usr/local/lib -lavdevice -lavformat -lavcodec -lavutil -lswscale -lswresample -lasound -lpthread
+
+// ffplay -fflags nobuffer -flags low_delay -framedrop -strict experimental rtsp://localhost:8554/mic
+int main(int argc, char *argv[])
+{
+    const char *input_format_name = "alsa"; 
+    const char *device_name = "hw:0,0,0";
+    const char *in_sample_rate = "48000";
+    const char *in_channels = "2";
+    const char *url = "rtsp://localhost:8554/mic"; 
+    const char *metrics_address = NULL;
+    const char *record_dir = NULL;
+    int record_segment_seconds = 60;
+    int record_write_delay_ms = 0;
+    char group[64], multicast_url[128];
+    int group_port = 0, group_ttl = 1;
+    int ret = -1;
+    int streamid = -1;
+    AVFormatContext *in_context = NULL;
+    AVPacket *read_pkt = NULL;
+    AVCodec *codec = NULL;
+    int64_t channel_layout;
+    snd_pcm_t *pcm = NULL;
+    snd_pcm_uframes_t period = 64;             // mmap period in frames, 64 frames = 1.3 ms at 48 kHz
+    snd_pcm_uframes_t buffer = 0;              // mmap ring size in frames, 0 = 4 periods
+    pthread_t tid;
+    int thread_started = 0;
+    int header_written = 0;
+    int fast_start = 0;
+    DemuxerOpen demuxer;
+    pthread_t demuxer_thread;
+    int demuxer_opening = 0;
+    int64_t program_start = av_gettime_relative();  // Time to first packet counts from here
+    int64_t t;
  
-    // Get default channel layout based on number of channels
-    channel_layout = av_get_default_channel_layout(stream->codecpar->channels);
-    // Initialize resampling context, converting input audio format to the format required by the encoder
-    swr_ctx = swr_alloc_set_opts(NULL,
-                                 channel_layout, AV_SAMPLE_FMT_FLTP, stream->codecpar->sample_rate,
-                                 channel_layout, stream->codecpar->format, stream->codecpar->sample_rate,
-                                 0, NULL);
-    if (!swr_ctx || swr_init(swr_ctx) < 0)
-    {
-        printf("allocate resampler context failed\n");
+    // Command line argument parsing
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-u") == 0 && i + 1 < argc)
+            url = argv[++i];
+        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+            device_name = argv[++i];
+        else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc)
+            input_format_name = argv[++i];
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+            in_sample_rate = argv[++i];
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+            in_channels = argv[++i];
+        else if (strcmp(argv[i], "-m") == 0)
+            use_mmap = 1;
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+            period = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+            buffer = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-M") == 0 && i + 1 < argc)
+            metrics_address = argv[++i];
+        else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc)
+            record_dir = argv[++i];
+        else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc)
+            record_segment_seconds = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-T") == 0 && i + 1 < argc)
+            record_write_delay_ms = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-D") == 0)
+            dtx = 1;
+        else if (strcmp(argv[i], "-F") == 0)
+            fast_start = 1;
+        else if (strcmp(argv[i], "-X") == 0 && i + 1 < argc && sched_policy_add(&sched, argv[i + 1]) == 0)
+            i++;
+        else if (strcmp(argv[i], "-G") == 0 && i + 1 < argc &&
+                 sscanf(argv[++i], "%63[^:]:%d:%d", group, &group_port, &group_ttl) >= 2)
+        {
+            snprintf(multicast_url, sizeof(multicast_url), "rtp://%s:%d?ttl=%d&pkt_size=1472", group, group_port, group_ttl);
+            url = multicast_url;
+            multicast = 1;
+        }
+        else
+        {
+            printf("Usage: %s [-u rtsp_url] [-d device] [-i input_format] [-r sample_rate] [-c channels] [-m] [-p period_frames] [-b buffer_frames] [-M metrics_address]"
+                   " [-R record_dir] [-S segment_seconds] [-T record_write_delay_ms] [-D] [-G group:port[:ttl]] [-F]"
+                   " [-X stage:cpus[:class[:priority]] | -X mlock]...\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // Metrics and live control, all registered before the endpoint starts serving
+    metrics_init(&metrics, "audio_server", audio_control, NULL);
+    m_packets = metrics_counter(&metrics, "packets_total", "AAC packets written");
+    m_bytes = metrics_counter(&metrics, "bytes_total", "Encoded bytes written to the output");
+    m_bitrate = metrics_gauge(&metrics, "bitrate_bps", "Output bitrate over the last second");
+    m_target_bitrate = metrics_gauge(&metrics, "target_bitrate_bps", "Encoder bitrate setting");
+    m_encode = metrics_histogram_us(&metrics, "encode_seconds", "Conversion and encode time per frame",
+                                    metrics_frame_time_bounds_us, METRICS_FRAME_TIME_BUCKETS);
+    m_latency = metrics_histogram_us(&metrics, "capture_latency_seconds", "Capture to packet latency",
+                                     metrics_frame_time_bounds_us, METRICS_FRAME_TIME_BUCKETS);
+    m_fifo_depth = metrics_gauge(&metrics, "fifo_depth_samples", "Samples waiting for the encoder");
+    m_overruns = metrics_counter(&metrics, "fifo_overrun_bytes_total", "Bytes dropped because the encoder fell behind");
+    m_frames = metrics_counter(&metrics, "frames_total", "Audio frames taken from the fifo");
+    m_encoded = metrics_counter(&metrics, "encoded_frames_total", "Frames passed to the encoder");
+    m_vad_active = metrics_gauge(&metrics, "vad_active", "1 while the VAD is sending speech, DTX only");
+    m_onsets = metrics_counter(&metrics, "vad_onsets_total", "Talk spurts started after silence, DTX only");
+    m_xruns = metrics_counter(&metrics, "capture_xruns_total", "ALSA capture overruns and restarts, mmap only");
+    record_tee_init(&record, &metrics);
+    startup_clock_init(&startup, &metrics, program_start);
+    record.write_delay_us = record_write_delay_ms * 1000;
+    if (multicast)
+        sdp_document = metrics_document(&metrics, "/audio.sdp", "application/sdp");
+    if (metrics_address && metrics_start(&metrics, metrics_address) < 0)
+    {
+        printf("metrics_start failed on %s\n", metrics_address);
+        return -1;
+    }
+ 
+    // Print ffmpeg version information
+    printf("ffmpeg version: %s\n", av_version_info());
+ 
+    // Register all devices
+    avdevice_register_all();
+ 
+    if (use_mmap)
+    {
+        unsigned int rate = atoi(in_sample_rate);
+        if (!buffer)
+            buffer = period * 4;
+        t = av_gettime_relative();
+        pcm = open_alsa_mmap(device_name, &rate, atoi(in_channels), &period, &buffer, &capture_fmt);
+        if (!pcm)
+            goto end;
+        startup_clock_phase(&startup, STARTUP_DEVICE, t);
+        capture_rate = rate;
+        capture_channels = atoi(in_channels);
+        printf("alsa mmap capture, sample_rate: %d, channels: %d, format: %s, period: %lu frames, buffer: %lu frames\n",
+               capture_rate, capture_channels, av_get_sample_fmt_name(capture_fmt), (unsigned long)period, (unsigned long)buffer);
+    }
+    else if (fast_start)
+    {
+        // Set up the encoder for the requested parameters; the device has to match them
+        capture_rate = atoi(in_sample_rate);
+        capture_channels = atoi(in_channels);
+        demuxer = (DemuxerOpen){input_format_name, device_name, in_sample_rate, in_channels, NULL, -1, -1};
+        if (pthread_create(&demuxer_thread, NULL, open_alsa_demuxer_thread, &demuxer) != 0)
+        {
+            printf("pthread_create failed\n");
+            goto end;
+        }
+        demuxer_opening = 1;
+    }
+    else if (open_alsa_demuxer(input_format_name, device_name, in_sample_rate, in_channels,
+                               &in_context, &streamid) < 0 ||
+             take_demuxer_params(in_context, streamid, 0) < 0)
+    {
         goto end;
     }
  
+    // Get default channel layout based on number of channels
+    channel_layout = av_get_default_channel_layout(capture_channels);
+
     // Allocate output format context
     // RTSP-rtsp, RTMP-flv, HLS-m3u8, UDP-mpegts, TCP-mpegts, FILE-mp4, MP4-mp4, MP3-mp3, AAC-adts, AC3-ac3, FLAC-flac, WAV-wav, OGG-ogg, WEBM-webm, MPEG-mpeg, MPEGTS-mpegts
-    avformat_alloc_output_context2(&out_context, NULL, "rtsp", url); 
+    avformat_alloc_output_context2(&out_context, NULL, multicast ? "rtp" : "rtsp", url); 
     if (!out_context)
     {
         printf("avformat_alloc_output_context2 failed\n");
@@ -136,28 +612,33 @@ int main(void)
     c->codec_id = AV_CODEC_ID_AAC;
     c->codec_type = AVMEDIA_TYPE_AUDIO;
     c->sample_fmt = AV_SAMPLE_FMT_FLTP;
-    c->sample_rate = stream->codecpar->sample_rate;
-    c->channels = stream->codecpar->channels;
+    c->sample_rate = capture_rate;
+    c->channels = capture_channels;
     c->channel_layout = channel_layout;
+    c->time_base = (AVRational){1, capture_rate}; // PTS counts samples
     c->bit_rate = 128 * 1000; // 128k
+    metric_set(m_target_bitrate, c->bit_rate);
     c->profile = FF_PROFILE_AAC_LOW;
     c->thread_count = 4;
 
     av_opt_set(out_context->priv_data, "rtsp_transport", "udp", 0); // Use UDP to reduce latency
     av_opt_set(out_context->priv_data, "muxdelay", "0", 0);         // Set mux delay to 0
 
-    if (out_context->oformat->flags & AVFMT_GLOBALHEADER)
+    // The SDP of a multicast output carries the AAC config, which needs the global header
+    if ((out_context->oformat->flags & AVFMT_GLOBALHEADER) || multicast)
     {
         printf("set AV_CODEC_FLAG_GLOBAL_HEADER\n");
         c->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
     }
  
     // Open the encoder
+    t = av_gettime_relative();
     if (avcodec_open2(c, codec, NULL) < 0)
     {
         printf("avcodec_open2 failed\n");
         goto end;
     }
+    startup_clock_phase(&startup, STARTUP_ENCODER, t);
  
     // Copy encoder parameters to stream
     ret = avcodec_parameters_from_context(out_stream->codecpar, c);
@@ -174,12 +655,6 @@ int main(void)
         printf("av_frame_alloc failed\n");
         goto end;
     }
-    AVPacket *recv_ptk = av_packet_alloc();
-    if (!recv_ptk)
-    {
-        printf("av_packet_alloc failed\n");
-        goto end;
-    }
  
     // Set frame parameters, used by av_frame_get_buffer when allocating buffer
     output_frame->format = c->sample_fmt;
@@ -193,20 +668,32 @@ int main(void)
         printf("av_frame_get_buffer failed\n");
         goto end;
     }
- 
-    // Calculate the size of PCM data required per AAC frame = number of samples * size per sample * number of channels
-    fsize = c->frame_size * av_get_bytes_per_sample(stream->codecpar->format) *
-            stream->codecpar->channels;
-    printf("frame size: %d\n", fsize);
- 
-    fifo = av_fifo_alloc(fsize * 5);
-    if (!fifo)
+
+    // DTX: a few frames are held back during silence for the start of the next talk spurt
+    for (int i = 0; dtx && i < DTX_PREROLL_FRAMES; i++)
     {
-        printf("av_fifo_alloc failed\n");
-        goto end;
+        dtx_hold[i] = av_frame_alloc();
+        if (!dtx_hold[i])
+        {
+            printf("av_frame_alloc failed\n");
+            goto end;
+        }
+        dtx_hold[i]->format = c->sample_fmt;
+        dtx_hold[i]->nb_samples = c->frame_size;
+        dtx_hold[i]->channel_layout = c->channel_layout;
+        if (av_frame_get_buffer(dtx_hold[i], 0) < 0)
+        {
+            printf("av_frame_get_buffer failed\n");
+            goto end;
+        }
+        dtx_hold[i]->pts = AV_NOPTS_VALUE;
     }
+    for (int i = 0; i < DTX_SEND_SLOTS; i++)
+        dtx_send_pts[i] = AV_NOPTS_VALUE;
+    vad_init(&vad, (float)c->frame_size / c->sample_rate);
  
     // Open the url
+    t = av_gettime_relative();
     if (!(out_context->oformat->flags & AVFMT_NOFILE))
     {
         ret = avio_open(&out_context->pb, url, AVIO_FLAG_WRITE);
@@ -224,34 +711,154 @@ int main(void)
         printf("avformat_write_header failed\n");
         goto end;
     }
+    header_written = 1;
+    startup_clock_phase(&startup, STARTUP_OUTPUT, t);
+
+    // Receivers of a multicast output join with this SDP, printed and served on the metrics endpoint
+    if (multicast)
+    {
+        char sdp[4096];
+        ret = av_sdp_create(&out_context, 1, sdp, sizeof(sdp));
+        if (ret < 0)
+        {
+            printf("av_sdp_create failed (errmsg '%s')\n", av_err2str(ret));
+            goto end;
+        }
+        printf("%s", sdp);
+        metrics_document_publish(sdp_document, sdp);
+    }
+
+    // Fast start: the output is up, now the device has to be as well
+    if (demuxer_opening)
+    {
+        pthread_join(demuxer_thread, NULL);
+        demuxer_opening = 0;
+        in_context = demuxer.in_context;
+        streamid = demuxer.streamid;
+        if (demuxer.ret < 0 || take_demuxer_params(in_context, streamid, 1) < 0)
+            goto end;
+    }
+    bytes_per_frame = av_get_bytes_per_sample(capture_fmt) * capture_channels;
+
+    // Rate and layout are the same on both sides, so converting to the encoder's FLTP is just a
+    // deinterleave. Only formats the fast path does not know go through a resampling context.
+    if (!sample_convert_supported(capture_fmt))
+    {
+        swr_ctx = swr_alloc_set_opts(NULL,
+                                     channel_layout, AV_SAMPLE_FMT_FLTP, capture_rate,
+                                     channel_layout, capture_fmt, capture_rate,
+                                     0, NULL);
+        if (!swr_ctx || swr_init(swr_ctx) < 0)
+        {
+            printf("allocate resampler context failed\n");
+            goto end;
+        }
+    }
+
+    // Calculate the size of PCM data required per AAC frame = number of samples * size per sample * number of channels
+    fsize = c->frame_size * bytes_per_frame;
+    printf("frame size: %d\n", fsize);
+ 
+    fifo_size = fsize * FIFO_FRAMES;
+    fifo = av_malloc(fifo_size);
+    if (!fifo)
+    {
+        printf("fifo allocation failed\n");
+        goto end;
+    }
+ 
+    // Record the published packets locally, up to ~5 seconds or 1 MB queued for the disk
+    if (record_dir &&
+        record_tee_start(&record, record_dir, "audio", out_stream->codecpar, c->time_base,
+                         record_segment_seconds, 256, 1 << 20) < 0)
+    {
+        printf("record_tee_start failed\n");
+        goto end;
+    }
  
-    pthread_t tid;
     // Initialize mutex
     pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&fifo_cond, NULL);
     // Create thread
-    pthread_create(&tid, NULL, thread_encode, NULL);
+    if (pthread_create(&tid, NULL, thread_encode, NULL) != 0)
+    {
+        printf("pthread_create failed\n");
+        goto end;
+    }
+    thread_started = 1;
+
+    // The capture stage is applied after the encoder thread was created, so it does not inherit it
+    ret = sched_policy_apply(&sched, "capture", -1);
+    if (ret < 0)
+        printf("capture thread: scheduling policy not applied (%s)\n", av_err2str(ret));
+    ret = sched_policy_hot_buffer(&sched, "capture", fifo, fifo_size);
+    if (ret < 0)
+        printf("fifo: hot buffer not placed (%s)\n", av_err2str(ret));
  
-    // Read frame, resample, encode, and send
-    AVPacket read_pkt;
+    signal(SIGINT, request_stop);
+    signal(SIGTERM, request_stop);
 
-    while ((av_read_frame(in_context, &read_pkt) >= 0) && (!thread_encode_exit))
+    // Read frame, resample, encode, and send
+    if (use_mmap)
+    {
+        capture_alsa_mmap(pcm, period);
+    }
+    else
     {
-        if (read_pkt.stream_index == streamid)
+        AVStream *stream = in_context->streams[streamid];
+
+        read_pkt = av_packet_alloc();
+        if (!read_pkt)
         {
-            pthread_mutex_lock(&lock);
-            av_fifo_generic_write(fifo, read_pkt.buf->data, read_pkt.size, NULL);
-            pthread_mutex_unlock(&lock);
+            printf("av_packet_alloc failed\n");
+            goto end;
+        }
+        // The exit flags are checked first, so a packet is never read and then left behind
+        while (!thread_encode_exit && !stop_requested && av_read_frame(in_context, read_pkt) >= 0)
+        {
+            if (read_pkt->stream_index == streamid)
+            {
+                // The demuxer stamps the first sample of each packet
+                int64_t tail_us = av_rescale_q(read_pkt->pts, stream->time_base, AV_TIME_BASE_Q) +
+                                  av_rescale(read_pkt->size / bytes_per_frame, 1000000, capture_rate);
+                fifo_push(read_pkt->data, read_pkt->size, tail_us);
+            }
+            av_packet_unref(read_pkt);
         }
-        av_packet_unref(&read_pkt);
     }
-    thread_encode_exit = 1;
  
 end:
-    pthread_join(tid, NULL);
-    if (fifo)
+    if (demuxer_opening)
+    {
+        pthread_join(demuxer_thread, NULL);
+        in_context = demuxer.in_context;
+    }
+    metrics_stop(&metrics);
+    if (thread_started)
+    {
+        pthread_mutex_lock(&lock);
+        thread_encode_exit = 1;
+        pthread_cond_signal(&fifo_cond);
+        pthread_mutex_unlock(&lock);
+        pthread_join(tid, NULL);
+        pthread_cond_destroy(&fifo_cond);
+        pthread_mutex_destroy(&lock);
+        if (dtx)
+            printf("dtx: %" PRId64 " frames, %" PRId64 " encoded, %" PRId64 " packets, %" PRId64 " bytes, %" PRId64 " talk spurts\n",
+                   metric_get(m_frames), metric_get(m_encoded), metric_get(m_packets), metric_get(m_bytes),
+                   metric_get(m_onsets));
+    }
+    // Tells the RTSP server the session is over; the encoder thread no longer writes
+    if (header_written)
+    {
+        av_write_trailer(out_context);
+    }
+    record_tee_stop(&record);
+    if (pcm)
     {
-        av_fifo_free(fifo);
+        snd_pcm_close(pcm);
     }
+    av_freep(&fifo);
     if (swr_ctx)
     {
         swr_free(&swr_ctx);
@@ -260,6 +867,12 @@ end:
     {
         av_frame_free(&output_frame);
     }
+    for (int i = 0; i < DTX_PREROLL_FRAMES; i++)
+    {
+        av_frame_free(&dtx_hold[i]);
+    }
+    av_packet_free(&read_pkt);
+    avcodec_free_context(&c);
     if (in_context)
     {
         avformat_close_input(&in_context);
@@ -272,63 +885,208 @@ end:
         }
         avformat_free_context(out_context);
     }
-    pthread_mutex_destroy(&lock);
     return 0;
 }
 
+static void dtx_mark_send(int64_t pts)
+{
+    dtx_send_pts[dtx_send_next++ % DTX_SEND_SLOTS] = pts;
+}
+
+static int dtx_should_send(int64_t pts)
+{
+    for (int i = 0; i < DTX_SEND_SLOTS; i++)
+        if (dtx_send_pts[i] == pts)
+            return 1;
+    return 0;
+}
+
+// Encode one frame and publish the packet the encoder returns, if any. With DTX only packets of
+// frames marked for sending go out; the very first one (negative PTS) carries the encoder delay.
+static int encode_frame(AVFrame *frame, int send)
+{
+    AVPacket pkt;
+    int got_packet = 0;
+    int64_t latency_us;
+    int ret;
+
+    if (dtx && send)
+        dtx_mark_send(frame->pts);
+    av_init_packet(&pkt);
+    pkt.data = NULL;
+    pkt.size = 0;
+    ret = avcodec_encode_audio2(c, &pkt, frame, &got_packet);
+    if (ret < 0)
+    {
+        printf("avcodec_encode_audio2 failed\n");
+        return ret;
+    }
+    metric_add(m_encoded, 1);
+    dtx_last_encoded = frame->pts;
+    if (!got_packet)
+        return 0;
+    if (dtx && pkt.pts >= 0 && !dtx_should_send(pkt.pts))
+    {
+        av_packet_unref(&pkt);
+        return 0;
+    }
+
+    // Capture-to-packet latency, including the encoder lookahead
+    latency_us = capture_clock_us() - (first_us + av_rescale(pkt.pts, 1000000, c->sample_rate));
+    metric_observe(m_latency, latency_us);
+    record_tee_push(&record, &pkt);
+    latency_sum += latency_us;
+    latency_max = FFMAX(latency_max, latency_us);
+    if (++latency_count == 250)
+    {
+        printf("capture-to-packet latency: avg %.2f ms, max %.2f ms, fifo overruns: %" PRId64 " bytes, capture xruns: %" PRId64 "\n",
+               latency_sum / 1000.0 / latency_count, latency_max / 1000.0, metric_get(m_overruns), metric_get(m_xruns));
+        latency_sum = latency_max = 0;
+        latency_count = 0;
+    }
+
+    av_packet_rescale_ts(&pkt, c->time_base, out_stream->time_base);
+    pkt.stream_index = out_stream->index;
+    metric_add(m_packets, 1);
+    metric_add(m_bytes, pkt.size);
+    ret = av_interleaved_write_frame(out_context, &pkt);
+    av_packet_unref(&pkt);
+    if (ret < 0)
+    {
+        printf("av_interleaved_write_frame failed\n");
+        return ret;
+    }
+    startup_clock_first_packet(&startup, "audio");
+    return 0;
+}
+
+// Run the VAD on a converted frame and encode what has to be encoded. Skipped frames are kept for
+// DTX_PREROLL_FRAMES frames: when speech starts they are sent ahead of it, so an onset that is
+// still under the threshold is not clipped. Timestamps keep counting samples through the gaps.
+static int dtx_encode(AVFrame *frame)
+{
+    static int64_t frame_count = 0;
+    static int silent = 0;                  // Frames since the talk spurt ended
+    static int since_sent = 0;              // Frames since the last one marked for sending
+    int active, send, ret;
+
+    active = vad_update(&vad, dtx_level_db((const float *const *)frame->data, c->channels, c->frame_size));
+    metric_set(m_vad_active, active);
+    if (active)
+    {
+        if (silent)
+        {
+            metric_add(m_onsets, 1);
+            for (int i = DTX_PREROLL_FRAMES; i > 0; i--)
+            {
+                AVFrame *held = dtx_hold[(frame_count - i) % DTX_PREROLL_FRAMES];
+                if (frame_count < i || held->pts == AV_NOPTS_VALUE)
+                    continue;
+                if (dtx_last_encoded != AV_NOPTS_VALUE && held->pts <= dtx_last_encoded)
+                    dtx_mark_send(held->pts);           // Already in the encoder, packet not out yet
+                else if ((ret = encode_frame(held, 1)) < 0)
+                    return ret;
+            }
+        }
+        silent = 0;
+        send = 1;
+    }
+    else
+    {
+        send = silent++ % DTX_SID_INTERVAL == 0;
+    }
+    since_sent = send ? 0 : since_sent + 1;
+
+    // Remember the frame for a later pre-roll; frames that get encoded only need their PTS
+    AVFrame *slot = dtx_hold[frame_count++ % DTX_PREROLL_FRAMES];
+    slot->pts = frame->pts;
+    if (send || since_sent <= DTX_FLUSH_FRAMES)
+        return encode_frame(frame, send);
+    return av_frame_copy(slot, frame);
+}
+
 void *thread_encode(void *arg)
 {
+    (void)arg;
     int ret;
-    AVPacket pkt;
-    int got_packet;
-    uint8_t *fdata = malloc(fsize);
+    int64_t head_us, pts, next_pts = AV_NOPTS_VALUE;
+    int64_t t0, bitrate;
+    MetricRate bitrate_rate = {0, 0};
+
+    ret = sched_policy_apply(&sched, "encode", -1);
+    if (ret < 0)
+        printf("encode thread: scheduling policy not applied (%s)\n", av_err2str(ret));
+    ret = 0;
+    for (int i = 0; i < AV_NUM_DATA_POINTERS && output_frame->buf[i] && ret >= 0; i++)
+        ret = sched_policy_hot_buffer(&sched, "encode", output_frame->buf[i]->data, output_frame->buf[i]->size);
+    if (ret < 0)
+        printf("encode thread: hot buffers not placed (%s)\n", av_err2str(ret));
     while (1)
     {
-        if (thread_encode_exit)
-            break;
         pthread_mutex_lock(&lock);
-        if (av_fifo_size(fifo) >= fsize)
+        while (!thread_encode_exit && fifo_write - fifo_read < fsize)
+            pthread_cond_wait(&fifo_cond, &lock);
+        if (thread_encode_exit)
         {
-            av_fifo_generic_read(fifo, fdata, fsize, NULL);
             pthread_mutex_unlock(&lock);
-            // Resample
-            const uint8_t *in[] = {fdata};
-            uint8_t **out = output_frame->data;
-            int len = swr_convert(swr_ctx, out, output_frame->nb_samples,
-                                  in, c->frame_size);
-            if (len < 0)
-            {
-                printf("swr_convert failed\n");
-                break;
-            }
-            // Encode
-            av_init_packet(&pkt);
-            pkt.data = NULL;
-            pkt.size = 0;
-            got_packet = 0;
-            ret = avcodec_encode_audio2(c, &pkt, output_frame, &got_packet);
-            if (ret < 0)
-            {
-                printf("avcodec_encode_audio2 failed\n");
-                break;
-            }
-            if (got_packet)
-            {
-                ret = av_interleaved_write_frame(out_context, &pkt);
-                if (ret < 0)
-                {
-                    printf("av_interleaved_write_frame failed\n");
-                    break;
-                }
-                av_packet_unref(&pkt);
-            }
+            break;
         }
+        t0 = av_gettime_relative();
+        // Capture time of the oldest sample in the fifo, which is the first sample of this frame
+        head_us = fifo_tail_us - av_rescale((fifo_write - fifo_read) / bytes_per_frame, 1000000, capture_rate);
+        // Take the oldest frame where it lies in the ring; fifo_push leaves it alone until it is converted
+        const uint8_t *in[] = {fifo + fifo_read % fifo_size};
+        fifo_busy_pos = fifo_read;
+        fifo_busy = 1;
+        fifo_read += fsize;
+        metric_set(m_fifo_depth, (fifo_write - fifo_read) / bytes_per_frame);
+        pthread_mutex_unlock(&lock);
+        // Convert outside the lock so the capture thread never waits on it
+        uint8_t **out = output_frame->data;
+        int len;
+        if (swr_ctx)
+            len = swr_convert(swr_ctx, out, output_frame->nb_samples, in, c->frame_size);
         else
+            len = sample_convert_to_fltp((float **)out, in[0], capture_fmt, capture_channels, c->frame_size);
+        pthread_mutex_lock(&lock);
+        fifo_busy = 0;
+        pthread_mutex_unlock(&lock);
+        if (len < 0)
         {
-            pthread_mutex_unlock(&lock);
-            usleep(5000);
+            printf("sample conversion failed\n");
+            break;
+        }
+
+        // PTS follows the capture clock, snapped to the running sample count while the two agree
+        // within half a frame, so timestamp jitter does not turn into PTS jitter
+        if (first_us == AV_NOPTS_VALUE)
+            first_us = head_us;
+        pts = av_rescale(head_us - first_us, c->sample_rate, 1000000);
+        if (next_pts != AV_NOPTS_VALUE && pts < next_pts + c->frame_size / 2)
+            pts = next_pts;
+        output_frame->pts = pts;
+        next_pts = pts + c->frame_size;
+
+        // Apply a bitrate change from the control endpoint, the AAC encoder reads it every frame
+        bitrate = metrics_atomic_exchange(&pending_bitrate, 0);
+        if (bitrate)
+        {
+            c->bit_rate = bitrate;
+            metric_set(m_target_bitrate, bitrate);
+            printf("bitrate set to %" PRId64 "\n", bitrate);
         }
+        metric_add(m_frames, 1);
+
+        if (!dtx)
+            ret = encode_frame(output_frame, 1);
+        else
+            ret = dtx_encode(output_frame);
+        if (ret < 0)
+            break;
+        metric_observe(m_encode, av_gettime_relative() - t0);
+        metric_rate_tick(&bitrate_rate, m_bitrate, m_bytes, 8, av_gettime_relative());
     }
-    free(fdata);
+    // Stop the capture loop as well if we bailed out on an error
+    thread_encode_exit = 1;
     return NULL;
 }
@@ -6,6 +6,14 @@ extern "C" {
 #include <time.h>
 }
 
+#include "../../common/metrics.h"
+#include "../../common/ingest.h"
+#include "../../common/playout_clock.h"
+#include "../../common/decode_governor.h"
+#include "../../common/sched_policy.h"
+#include "../../common/av_ptr.h"
+#include "../../common/net_trace.h"
+
 #include <softcam/softcam.h>
 #include <csignal>
 #include <cstdio>
@@ -20,8 +28,18 @@ extern "C" {
 const int WIDTH = 640;
 const int HEIGHT = 480;
 const int FPS = 30;
+const int MAX_LATE_MS = 100;
+const int SYNC_TOLERANCE_MS = 40;
+const int SYNC_MAX_WAIT_MS = 500;          // Further ahead of the audio means the clocks do not match
 const char* DEFAULT_RTSP_URL = "rtsp://192.168.1.33:8554/live";
 
+using SwsContextPtr = std::unique_ptr<SwsContext, AvFree<SwsContext, sws_freeContext>>;
+
+struct CameraDelete {
+    void operator()(void* cam) const { scDeleteCamera(cam); }
+};
+using CameraPtr = std::unique_ptr<void, CameraDelete>;
+
 // Global variable to capture Ctrl+C interrupt signal
 bool quit = false;
 
@@ -35,67 +53,78 @@ BOOL WINAPI ConsoleCtrlHandler(DWORD dwCtrlType) {
     return FALSE;  // Pass the signal to the next handler
 }
 
-// Function: Initialize FFmpeg and open RTSP stream
-bool init_ffmpeg(const std::string& rtsp_url, AVFormatContext*& fmt_ctx, AVCodecContext*& codec_ctx, int& video_stream_index) {
-    fmt_ctx = nullptr;
-    codec_ctx = nullptr;
+// Function: Initialize FFmpeg and open RTSP stream. On failure both contexts are empty.
+// A live stream is recorded if the trace asks for it; a trace file is replayed instead, see net_trace.h.
+bool init_ffmpeg(const std::string& rtsp_url, bool low_latency, bool force_tcp, NetTrace& trace,
+    FormatContextPtr& fmt_ctx, CodecContextPtr& codec_ctx, int& video_stream_index) {
+    codec_ctx.reset();
+    fmt_ctx.reset();
     video_stream_index = -1;
 
-    // Open RTSP stream
+    // Open the RTSP stream, the SDP of a multicast output or a recorded trace
     AVDictionary* options = nullptr;
-    // Parameter settings
-    av_dict_set(&options, "rtsp_transport", "tcp", 0);
-    av_dict_set(&options, "max_delay", "1000000", 0);  // Reduce maximum delay to 1 second
-    av_dict_set(&options, "buffer_size", "102400", 0); // Limit buffer size
+    // Parameter settings, see ingest.h for both profiles
+    if (ingest_is_sdp(rtsp_url.c_str())) {
+        ingest_set_sdp_options(&options, low_latency);
+    }
+    else {
+        ingest_set_options(&options, low_latency, force_tcp);
+    }
 
-    if (avformat_open_input(&fmt_ctx, rtsp_url.c_str(), nullptr, &options) < 0) {
-        std::printf("Failed to open RTSP stream\n");
+    AVFormatContext* opened = nullptr;
+    int ret = net_trace_is_trace(rtsp_url.c_str()) ? net_trace_open_input(&trace, &opened, rtsp_url.c_str()) :
+        avformat_open_input(&opened, rtsp_url.c_str(), nullptr, &options);
+    av_dict_free(&options);
+    if (ret < 0) {
+        std::printf("Failed to open %s\n", rtsp_url.c_str());
         return false;
     }
+    FormatContextPtr input(opened);
 
-    if (avformat_find_stream_info(fmt_ctx, nullptr) < 0) {
+    if (!trace.replaying && ingest_needs_probe(input.get(), low_latency) && avformat_find_stream_info(input.get(), nullptr) < 0) {
         std::printf("Failed to retrieve input stream information\n");
-        avformat_close_input(&fmt_ctx);
         return false;
     }
 
     // Find video stream
-    for (unsigned int i = 0; i < fmt_ctx->nb_streams; ++i) {
-        if (fmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+    for (unsigned int i = 0; i < input->nb_streams; ++i) {
+        if (input->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
             video_stream_index = i;
             break;
         }
     }
     if (video_stream_index == -1) {
         std::printf("Failed to find a video stream\n");
-        avformat_close_input(&fmt_ctx);
         return false;
     }
 
     // Get decoder
-    AVCodecParameters* codecpar = fmt_ctx->streams[video_stream_index]->codecpar;
+    AVCodecParameters* codecpar = input->streams[video_stream_index]->codecpar;
     const AVCodec* codec = avcodec_find_decoder(codecpar->codec_id);
     if (!codec) {
         std::printf("Failed to find codec\n");
-        avformat_close_input(&fmt_ctx);
         return false;
     }
 
-    codec_ctx = avcodec_alloc_context3(codec);
-    if (avcodec_parameters_to_context(codec_ctx, codecpar) < 0) {
+    CodecContextPtr decoder(avcodec_alloc_context3(codec));
+    if (!decoder || avcodec_parameters_to_context(decoder.get(), codecpar) < 0) {
         std::printf("Failed to copy codec parameters to codec context\n");
-        avcodec_free_context(&codec_ctx);
-        avformat_close_input(&fmt_ctx);
         return false;
     }
+    if (low_latency) {
+        decoder->flags |= AV_CODEC_FLAG_LOW_DELAY;
+    }
 
-    if (avcodec_open2(codec_ctx, codec, nullptr) < 0) {
+    if (avcodec_open2(decoder.get(), codec, nullptr) < 0) {
         std::printf("Failed to open codec\n");
-        avcodec_free_context(&codec_ctx);
-        avformat_close_input(&fmt_ctx);
         return false;
     }
 
+    if (!trace.replaying) {
+        net_trace_record_start(&trace, input.get());
+    }
+    fmt_ctx = std::move(input);
+    codec_ctx = std::move(decoder);
     return true;
 }
 
@@ -108,9 +137,18 @@ int main(int argc, char* argv[]) {
 
     // Command line argument parsing
     std::string rtsp_url = "";
+    const char* metrics_address = nullptr;
+    const char* clock_address = nullptr;
+    int sync_ms = SYNC_TOLERANCE_MS;
     int width = WIDTH;
     int height = HEIGHT;
     int fps = FPS;
+    bool low_latency = false;
+    bool force_tcp = false;
+    int max_late_ms = MAX_LATE_MS;
+    const char* trace_path = nullptr;
+    const char* replay_spec = nullptr;
+    SchedPolicy sched = {};
 
     for (int i = 1; i < argc; ++i) {
         if (std::string(argv[i]) == "-u" && i + 1 < argc) {
@@ -125,100 +163,267 @@ int main(int argc, char* argv[]) {
         else if (std::string(argv[i]) == "-f" && i + 1 < argc) {
             fps = std::stoi(argv[++i]);
         }
+        else if (std::string(argv[i]) == "-L") {
+            low_latency = true;
+        }
+        else if (std::string(argv[i]) == "-l" && i + 1 < argc) {
+            max_late_ms = std::stoi(argv[++i]);
+        }
+        else if (std::string(argv[i]) == "-A" && i + 1 < argc) {
+            clock_address = argv[++i];
+        }
+        else if (std::string(argv[i]) == "-s" && i + 1 < argc) {
+            sync_ms = std::stoi(argv[++i]);
+        }
+        else if (std::string(argv[i]) == "-M" && i + 1 < argc) {
+            metrics_address = argv[++i];
+        }
+        else if (std::string(argv[i]) == "-T" && i + 1 < argc) {
+            trace_path = argv[++i];
+        }
+        else if (std::string(argv[i]) == "-N" && i + 1 < argc) {
+            replay_spec = argv[++i];
+        }
+        else if (std::string(argv[i]) == "-X" && i + 1 < argc && sched_policy_add(&sched, argv[i + 1]) == 0) {
+            i++;
+        }
         else {
-            std::printf("Usage: %s [-u rtsp_url] [-w width] [-h height] [-f fps]\n", argv[0]);
+            std::printf("Usage: %s [-u rtsp_url [-T trace_file] | -u sdp | -u trace.avtrace [-N scale[:loss_percent[:jitter_ms[:seed]]]]] [-w width] [-h height] [-f fps] [-L] [-l max_late_ms] [-A clock_address [-s sync_ms]] [-M metrics_address] [-X decode:cpus[:class[:priority]] | -X mlock]...\n", argv[0]);
             return 1;
         }
     }
 
     if (rtsp_url.empty()) {
-        std::printf("Usage: %s [-u rtsp_url] [-w width] [-h height] [-f fps]\n", argv[0]);
+        std::printf("Usage: %s [-u rtsp_url [-T trace_file] | -u sdp | -u trace.avtrace [-N scale[:loss_percent[:jitter_ms[:seed]]]]] [-w width] [-h height] [-f fps] [-L] [-l max_late_ms] [-A clock_address [-s sync_ms]] [-M metrics_address] [-X decode:cpus[:class[:priority]] | -X mlock]...\n", argv[0]);
         return 1;
     }
 
+    // Metrics and live control (loglevel), all registered before the endpoint starts serving
+    static MetricsServer metrics;
+    metrics_init(&metrics, "video_client", nullptr, nullptr);
+    Metric* m_frames = metrics_counter(&metrics, "frames_total", "Frames decoded and sent to Softcam");
+    Metric* m_fps = metrics_gauge(&metrics, "fps", "Frames presented over the last second");
+    Metric* m_decode = metrics_histogram_us(&metrics, "decode_seconds", "Decode time per packet",
+        metrics_frame_time_bounds_us, METRICS_FRAME_TIME_BUCKETS);
+    Metric* m_convert = metrics_histogram_us(&metrics, "convert_seconds", "Conversion to BGR24 per frame",
+        metrics_frame_time_bounds_us, METRICS_FRAME_TIME_BUCKETS);
+    Metric* m_bytes = metrics_counter(&metrics, "bytes_total", "Compressed bytes received");
+    Metric* m_bitrate = metrics_gauge(&metrics, "bitrate_bps", "Received bitrate over the last second");
+    Metric* m_drops = metrics_counter(&metrics, "dropped_packets_total", "Packets the decoder rejected");
+    Metric* m_reconnects = metrics_counter(&metrics, "reconnects_total", "RTSP reconnections");
+    Metric* m_late = metrics_counter(&metrics, "late_frames_total", "Decoded frames dropped for arriving too late");
+    Metric* m_latency = metrics_histogram_us(&metrics, "e2e_latency_seconds", "Sender wall clock of the frame to presentation",
+        metrics_frame_time_bounds_us, METRICS_FRAME_TIME_BUCKETS);
+    Metric* m_tcp = metrics_gauge(&metrics, "transport_tcp", "1 while receiving over TCP");
+    Metric* m_av_offset = metrics_gauge(&metrics, "av_offset_ms", "Media time of the last presented frame minus the audio clock");
+    Metric* m_av_offset_abs = metrics_histogram_us(&metrics, "av_offset_seconds", "Distance from the audio clock at presentation",
+        metrics_frame_time_bounds_us, METRICS_FRAME_TIME_BUCKETS);
+    Metric* m_sync_drops = metrics_counter(&metrics, "sync_dropped_frames_total", "Frames dropped for being behind the audio clock");
+    Metric* m_decode_level = metrics_gauge(&metrics, "decode_level", "Decode degradation level, 0 = full quality");
+    Metric* m_decode_load = metrics_gauge(&metrics, "decode_load_percent", "Decode and conversion time per frame interval");
+    Metric* m_level_changes = metrics_counter(&metrics, "decode_level_changes_total", "Decode level changes");
+    MetricRate fps_rate = { 0, 0 }, bitrate_rate = { 0, 0 };
+    NetTrace trace;
+    net_trace_init(&trace, &metrics);
+    trace.record_path = trace_path;
+    if (replay_spec && net_trace_parse_replay(&trace, replay_spec) < 0) {
+        std::printf("Invalid replay options %s, expected scale[:loss_percent[:jitter_ms[:seed]]]\n", replay_spec);
+        return 1;
+    }
+    if (metrics_address && metrics_start(&metrics, metrics_address) < 0) {
+        std::printf("Failed to start metrics endpoint on %s\n", metrics_address);
+        return 1;
+    }
+
+    // Playout clock published by the audio client, audio is the master
+    PlayoutClock playout_clock;
+    if (clock_address && playout_clock_open(&playout_clock, clock_address, 0) < 0) {
+        std::printf("Failed to listen for the playout clock on %s\n", clock_address);
+        return 1;
+    }
+
+    // This thread reads, decodes, converts and presents
+    if (sched_policy_apply(&sched, "decode", -1) < 0) {
+        std::printf("Failed to apply the decode scheduling policy\n");
+    }
+
     // Initialize FFmpeg library
     avformat_network_init();
 
-    AVFormatContext* fmt_ctx = nullptr;
-    AVCodecContext* codec_ctx = nullptr;
+    FormatContextPtr fmt_ctx;
+    CodecContextPtr codec_ctx;
     int video_stream_index = -1;
 
-    if (!init_ffmpeg(rtsp_url, fmt_ctx, codec_ctx, video_stream_index)) {
+    // A multicast SDP or a replayed trace has no session to move to TCP
+    const bool sessionless = ingest_is_sdp(rtsp_url.c_str()) || net_trace_is_trace(rtsp_url.c_str());
+    if (!init_ffmpeg(rtsp_url, low_latency, force_tcp, trace, fmt_ctx, codec_ctx, video_stream_index)) {
         return 1;
     }
+    metric_set(m_tcp, !sessionless && (!low_latency || force_tcp));
+    IngestClock clock;
+    IngestLoss loss = { 0, 0, 0 };
+    ingest_clock_init(&clock);
+    DecodeGovernor governor;
+    decode_governor_init(&governor, fps);
 
     // Create Softcam instance
-    scCamera cam = scCreateCamera(width, height, fps);
+    CameraPtr cam(scCreateCamera(width, height, fps));
     if (!cam) {
         std::printf("Failed to create camera\n");
-        avcodec_free_context(&codec_ctx);
-        avformat_close_input(&fmt_ctx);
         return 1;
     }
     std::printf("Softcam is now active.\n");
-    scWaitForConnection(cam);
+    scWaitForConnection(cam.get());
 
-    // Initialize conversion context
-    SwsContext* sws_ctx = sws_getContext(codec_ctx->width, codec_ctx->height, codec_ctx->pix_fmt,
-        width, height, AV_PIX_FMT_BGR24, SWS_BICUBIC, nullptr, nullptr, nullptr);
+    // Conversion context, set up from the first decoded frame: without probing the size is only
+    // known once the decoder has seen the SPS
+    SwsContextPtr sws_ctx;
 
-    AVPacket* packet = av_packet_alloc();
-    AVFrame* frame = av_frame_alloc();
-    AVFrame* rgb_frame = av_frame_alloc();
+    PacketPtr packet(av_packet_alloc());
+    FramePtr frame(av_frame_alloc());
+    FramePtr rgb_frame(av_frame_alloc());
+    if (!packet || !frame || !rgb_frame) {
+        std::printf("Failed to allocate the packet and frames\n");
+        return 1;
+    }
     std::vector<uint8_t> buffer(av_image_get_buffer_size(AV_PIX_FMT_BGR24, width, height, 1));
     av_image_fill_arrays(rgb_frame->data, rgb_frame->linesize, buffer.data(), AV_PIX_FMT_BGR24, width, height, 1);
+    if (sched_policy_hot_buffer(&sched, "decode", buffer.data(), buffer.size()) < 0) {
+        std::printf("Failed to lock the output buffer\n");
+    }
 
     // Main loop, capture and process video frames
     while (!quit) {
         try {
             // Read video frame
-            if (av_read_frame(fmt_ctx, packet) < 0) {
+            if (net_trace_read_frame(&trace, fmt_ctx.get(), packet.get()) < 0) {
                 throw std::runtime_error("Failed to read frame from stream");
             }
 
             if (packet->stream_index == video_stream_index) {
-                if (avcodec_send_packet(codec_ctx, packet) == 0) {
-                    while (avcodec_receive_frame(codec_ctx, frame) == 0) {
-                        sws_scale(sws_ctx, frame->data, frame->linesize, 0, codec_ctx->height,
+                AVStream* stream = fmt_ctx->streams[video_stream_index];
+                int lost = 0;
+                int64_t busy_us = 0;            // Decode and conversion, not the waits for the audio clock
+                metric_add(m_bytes, packet->size);
+                int64_t t0 = av_gettime_relative();
+                if (avcodec_send_packet(codec_ctx.get(), packet.get()) == 0) {
+                    while (avcodec_receive_frame(codec_ctx.get(), frame.get()) == 0) {
+                        int64_t t1 = av_gettime_relative();
+                        metric_observe(m_decode, t1 - t0);
+                        busy_us += t1 - t0;
+                        if ((frame->flags & AV_FRAME_FLAG_CORRUPT) || frame->decode_error_flags) {
+                            lost = 1;
+                        }
+                        // Still decoded, since later frames reference it, but not worth converting
+                        int64_t pts_us = frame->best_effort_timestamp == AV_NOPTS_VALUE ? AV_NOPTS_VALUE :
+                            av_rescale_q(frame->best_effort_timestamp, stream->time_base, AV_TIME_BASE_Q);
+                        if (low_latency && pts_us != AV_NOPTS_VALUE &&
+                            ingest_clock_lateness(&clock, pts_us, t1) > max_late_ms * 1000LL) {
+                            metric_add(m_late, 1);
+                            t0 = av_gettime_relative();
+                            continue;
+                        }
+                        // Against the audio clock: behind it by more than the tolerance is dropped,
+                        // ahead of it waits after conversion until it is due
+                        int64_t media_us = fmt_ctx->start_time_realtime != AV_NOPTS_VALUE && pts_us != AV_NOPTS_VALUE ?
+                            fmt_ctx->start_time_realtime + pts_us : AV_NOPTS_VALUE;
+                        int64_t audio_us = clock_address && media_us != AV_NOPTS_VALUE ?
+                            playout_clock_media_now(&playout_clock, av_gettime()) : AV_NOPTS_VALUE;
+                        if (audio_us != AV_NOPTS_VALUE && media_us - audio_us < -sync_ms * 1000LL) {
+                            metric_add(m_sync_drops, 1);
+                            t0 = av_gettime_relative();
+                            continue;
+                        }
+                        // Hands the old context back, or frees it and returns a new one
+                        sws_ctx.reset(sws_getCachedContext(sws_ctx.release(), frame->width, frame->height, (AVPixelFormat)frame->format,
+                            width, height, AV_PIX_FMT_BGR24, decode_governor_sws_flags(&governor), nullptr, nullptr, nullptr));
+                        if (!sws_ctx) {
+                            throw std::runtime_error("Failed to create conversion context");
+                        }
+                        sws_scale(sws_ctx.get(), frame->data, frame->linesize, 0, frame->height,
                             rgb_frame->data, rgb_frame->linesize);
-                        scSendFrame(cam, rgb_frame->data[0]);
+                        metric_observe(m_convert, av_gettime_relative() - t1);
+                        busy_us += av_gettime_relative() - t1;
+                        if (audio_us != AV_NOPTS_VALUE) {
+                            audio_us = playout_clock_media_now(&playout_clock, av_gettime());
+                            if (audio_us != AV_NOPTS_VALUE && media_us > audio_us &&
+                                media_us - audio_us < SYNC_MAX_WAIT_MS * 1000LL) {
+                                std::this_thread::sleep_for(std::chrono::microseconds(media_us - audio_us));
+                                audio_us = playout_clock_media_now(&playout_clock, av_gettime());
+                            }
+                            if (audio_us != AV_NOPTS_VALUE) {
+                                int64_t offset_us = media_us - audio_us;
+                                metric_set(m_av_offset, offset_us / 1000);
+                                metric_observe(m_av_offset_abs, offset_us < 0 ? -offset_us : offset_us);
+                            }
+                        }
+                        scSendFrame(cam.get(), rgb_frame->data[0]);
+                        t0 = av_gettime_relative();
+                        metric_add(m_frames, 1);
+                        // The RTCP sender reports map PTS to the sender's wall clock
+                        if (fmt_ctx->start_time_realtime != AV_NOPTS_VALUE && pts_us != AV_NOPTS_VALUE) {
+                            metric_observe(m_latency, av_gettime() - (fmt_ctx->start_time_realtime + pts_us));
+                        }
                     }
                 }
+                else {
+                    metric_add(m_drops, 1);
+                    lost = 1;
+                }
+                // Step the decode quality down or up depending on how much of the frame interval this took
+                busy_us += av_gettime_relative() - t0;
+                if (decode_governor_update(&governor, busy_us)) {
+                    decode_governor_apply(&governor, codec_ctx.get());
+                    metric_set(m_decode_level, governor.level);
+                    metric_add(m_level_changes, 1);
+                    std::printf("Decode level %d, load %.0f%%\n", governor.level, governor.load * 100);
+                }
+                metric_set(m_decode_load, (int64_t)(governor.load * 100));
+                if (low_latency && !force_tcp && !sessionless && ingest_loss_update(&loss, lost, av_gettime_relative())) {
+                    force_tcp = true;
+                    throw std::runtime_error("Too much loss over UDP, switching to TCP");
+                }
+                metric_rate_tick(&fps_rate, m_fps, m_frames, 1, av_gettime_relative());
+                metric_rate_tick(&bitrate_rate, m_bitrate, m_bytes, 8, av_gettime_relative());
             }
 
-            av_packet_unref(packet);
+            av_packet_unref(packet.get());
         }
         catch (const std::exception& e) {
             std::printf("Error: %s\n", e.what());
+            av_packet_unref(packet.get());
 
             // Close existing FFmpeg context
-            avcodec_free_context(&codec_ctx);
-            avformat_close_input(&fmt_ctx);
+            codec_ctx.reset();
+            fmt_ctx.reset();
 
             // Wait and attempt to reconnect
             std::this_thread::sleep_for(std::chrono::seconds(1));
             std::printf("Attempting to reconnect...\n");
+            metric_add(m_reconnects, 1);
 
             // Reinitialize FFmpeg and RTSP stream
-            while (!quit && !init_ffmpeg(rtsp_url, fmt_ctx, codec_ctx, video_stream_index)) {
+            while (!quit && !init_ffmpeg(rtsp_url, low_latency, force_tcp, trace, fmt_ctx, codec_ctx, video_stream_index)) {
                 std::printf("Reconnection failed, retrying...\n");
                 std::this_thread::sleep_for(std::chrono::seconds(1));
             }
-
+            // Stopped while reconnecting: there is no decoder to set up
             if (quit) {
                 break;
             }
+            metric_set(m_tcp, !sessionless && (!low_latency || force_tcp));
+            ingest_clock_init(&clock);
+            decode_governor_apply(&governor, codec_ctx.get());
         }
     }
 
-    // Release resources
-    av_frame_free(&frame);
-    av_frame_free(&rgb_frame);
-    av_packet_free(&packet);
-    sws_freeContext(sws_ctx);
-    avcodec_free_context(&codec_ctx);
-    avformat_close_input(&fmt_ctx);
-    scDeleteCamera(cam);
+    // Release resources; the decoder side goes with its owners
+    cam.reset();
+    net_trace_record_stop(&trace);
+    if (clock_address) {
+        playout_clock_close(&playout_clock);
+    }
+    metrics_stop(&metrics);
     std::printf("Softcam has been shut down.\n");
 
     return 0;
@@ -1,7 +1,12 @@
+#define _GNU_SOURCE                                           // sendmmsg() for the batched RTP output
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/resource.h>
 
 #include <libavdevice/avdevice.h>
 #include <libavcodec/avcodec.h>
@@ -9,58 +14,280 @@
 #include <libavutil/opt.h>
 #include <libavutil/mem.h>
 #include <libavutil/imgutils.h>
+#include <libavutil/parseutils.h>
+#include <libavutil/time.h>
 #include <libswscale/swscale.h>
 
-// gcc test3.c -o test3 -I /usr/local/include -L /usr/local/lib -lavdevice -lavformat -lavcodec -lavutil -lswscale
-// ffplay -fflags nobuffer -flags low_delay -framedrop -strict experimental rtsp://localhost:8554/live
-int main()
+#include "../../common/metrics.h"
+#include "../../common/record_tee.h"
+#include "../../common/work_pool.h"
+#include "../../common/frame_diff.h"
+#include "../../common/sched_policy.h"
+#include "../../common/rtp_egress.h"
+#include "../../common/mem_budget.h"
+#include "../../common/fast_start.h"
+
+#define VIDEO_MAX_STREAMS 8
+#define VIDEO_MAX_BANDS 8
+#define VIDEO_MAX_ROIS 32
+#define VIDEO_STATIC_KEEPALIVE_US 1000000                     // Longest gap between sent frames with -V and a static picture
+#define VIDEO_POOL_INFLIGHT 4                                 // Pooled packets the encoder and muxer hold at once
+
+// Requests from the control endpoint, picked up by every stream before its next frame
+static volatile int64_t requested_bitrate = 0;
+static volatile int64_t keyframe_requests = 0;
+
+// Ctrl+C or SIGTERM: capture stops and every stream is flushed and freed on the way out
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int sig)
 {
-    const char *input_format_name = "video4linux2";           // Input format name, for Linux use video4linux2 or v4l2
-    const char *device_name = "/dev/video0";                  // Camera device name
-    const char *camera_resolution = "640x480";                // Camera resolution
-    enum AVPixelFormat camera_pix_fmt = AV_PIX_FMT_YUYV422;   // Camera pixel format
-    const char *url = "rtsp://localhost:8554/live";           // Change the streaming address to RTSP
-    int frame_rate = 30;                                      // Frame rate
-    int ret = -1;                                             // Return result for input stream context
-    int video_streamid = -1;
-    int64_t frame_index = 0;
-    AVDictionary *options = NULL;
-    AVInputFormat *fmt = NULL;
-    AVFormatContext *in_context = NULL, *out_context = NULL;
-    struct SwsContext *sws_ctx = NULL;
-    AVCodecContext *codec_context = NULL;
-    AVStream *out_stream = NULL;
-    AVCodec *codec = NULL;
-    AVStream *video_stream = NULL;
-    AVFrame *input_frame = NULL;
-    AVFrame *frame_yuv420p = NULL;
-    AVPacket *packet = NULL;
-    AVPacket pkt;
+    (void)sig;
+    stop_requested = 1;
+}
 
-    // Timestamp calculation
-    clock_t start_time;
-    clock_t end_time;
+static int video_control(const char *key, const char *value, void *opaque)
+{
+    (void)opaque;
+    if (strcmp(key, "bitrate") == 0)
+    {
+        int64_t bitrate = strtoll(value, NULL, 10);
+        if (bitrate <= 0)
+            return -1;
+        metrics_atomic_store(&requested_bitrate, bitrate);
+        return 0;
+    }
+    if (strcmp(key, "keyframe") == 0)
+    {
+        metrics_atomic_add(&keyframe_requests, 1);
+        return 0;
+    }
+    return -1;
+}
 
-    // Print ffmpeg version information
-    printf("ffmpeg version: %s\n", av_version_info());
+// Turns capture timestamps (V4L2 buffer times on CLOCK_MONOTONIC) into encoder PTS, so the stream
+// follows the camera's real timing instead of assuming every frame arrives exactly 1/fps apart
+typedef struct CaptureClock
+{
+    int vfr;                    // 1: PTS are the capture times, 0: capture times snapped to the 1/fps grid
+    AVRational in_tb;           // Time base of the capture timestamps
+    AVRational enc_tb;          // Encoder time base
+    int64_t period_us;          // Nominal frame interval
+    int64_t first_ts;           // First capture timestamp, AV_NOPTS_VALUE until the first frame
+    int64_t last_ts;
+    int64_t last_pts;
+} CaptureClock;
 
-    // Register all devices
-    avdevice_register_all();
+// Returns the PTS for a frame captured at ts, or AV_NOPTS_VALUE if it should not be encoded (a repeat of
+// the previous frame). *interval_us is the time since the previous frame and *missing the frames skipped.
+static int64_t capture_clock_pts(CaptureClock *cc, int64_t ts, int64_t *interval_us, int *missing)
+{
+    int64_t pts, n;
+
+    *interval_us = 0;
+    *missing = 0;
+    if (cc->first_ts == AV_NOPTS_VALUE)
+    {
+        cc->first_ts = cc->last_ts = ts;
+        cc->last_pts = 0;
+        return 0;
+    }
+    // Same or older buffer timestamp: the driver handed the same frame again
+    if (ts <= cc->last_ts)
+        return AV_NOPTS_VALUE;
+    *interval_us = av_rescale_q(ts - cc->last_ts, cc->in_tb, (AVRational){1, 1000000});
+    cc->last_ts = ts;
+
+    // Frame periods since the previous capture: none is a repeat, more than one means drops
+    n = (*interval_us + cc->period_us / 2) / cc->period_us;
+    if (n == 0)
+        return AV_NOPTS_VALUE;
+
+    pts = av_rescale_q_rnd(ts - cc->first_ts, cc->in_tb, cc->enc_tb, AV_ROUND_NEAR_INF);
+    // On the 1/fps grid, jitter can put a frame in the previous frame's slot: take the next one, which
+    // keeps PTS at most one slot ahead of capture time. A camera faster than -f loses the extra frames.
+    if (!cc->vfr && pts == cc->last_pts)
+        pts++;
+    if (pts <= cc->last_pts)
+        return AV_NOPTS_VALUE;
+    *missing = (int)(n - 1);
+    cc->last_pts = pts;
+    return pts;
+}
+
+// Settings shared by every camera
+typedef struct VideoOptions
+{
+    const char *input_format_name;                            // Input format name, for Linux use video4linux2 or v4l2
+    char camera_resolution[32];                               // Camera resolution
+    enum AVPixelFormat camera_pix_fmt;                        // Camera pixel format
+    int frame_rate;                                           // Frame rate
+    int vfr;                                                  // Variable frame rate output, PTS straight from capture times
+    int thread_count;                                         // Encoder threads per camera
+    int nb_bands;                                             // Conversion split into this many pool tasks
+    int static_threshold;                                     // Change detection: mean abs difference per block, 0 = off
+    const char *record_dir;                                   // Directory for local fMP4 recordings, NULL = off
+    int record_segment_seconds;                               // Recording segment length
+    int record_write_delay_ms;                                // Artificial delay per recorded write (testing)
+    int egress;                                               // Batched RTP output instead of the RTSP muxer
+    int64_t egress_pace_bps;                                  // Pacing of the batched output, 0 = off
+    int multicast;                                            // Batched output to a multicast group, no RTSP session
+    int64_t mem_budget;                                       // Frame and packet memory of all cameras, 0 = unlimited
+    int subpel;                                               // Budget mode: x264 subpixel motion estimation (half-pel planes)
+    int pool_slots, pool_slot_bytes;                          // Budget mode: packet pool of each camera
+    int fast_start;                                           // Open the camera while the encoder and output open
+} VideoOptions;
+
+typedef struct VideoStream VideoStream;
+
+// A horizontal band of the YUYV422 to YUV420P conversion, converted on its own
+typedef struct ConvertBand
+{
+    VideoStream *vs;
+    struct SwsContext *sws_ctx;
+    int y, h;
+} ConvertBand;
+
+// One camera: capture, conversion, encoder and RTSP output
+struct VideoStream
+{
+    int index;
+    const char *device_name;                                  // Camera device name
+    const char *url;                                          // Streaming address
+    char url_buf[1024];
+    int priority;                                             // Pool priority, 0 = high
+    int64_t budget_us;                                        // Frames older than this when their turn comes are skipped, 0 = no limit
+    char labels[32];
+    char record_prefix[32];
+
+    AVFormatContext *in_context, *out_context;
+    AVStream *video_stream, *out_stream;
+    int video_streamid;
+    AVCodecContext *codec_context;
+    AVFrame *input_frame;
+    AVFrame *frame_yuv420p;
+    AVPacket *packet;                                         // Encoder output
+    AVPacket *captured;                                       // Read from the camera
+    ConvertBand bands[VIDEO_MAX_BANDS];
+    int nb_bands;
+    int header_written;
+    CaptureClock capture_clock;
+    FrameDiff diff;                                           // Changed blocks against the last frame sent, ref NULL = off
+    int64_t last_sent_us;
+    int64_t keyframe_requests_seen;
+    int64_t capture_dropped, capture_repeated, last_report_us;
+    RecordTee record;
+    RtpEgress egress;
+    MetricsDocument *sdp;                                     // Multicast mode: SDP for the receivers
+    PacketPool packets;                                       // Budget mode: the encoder's output packets
+    StartupClock startup;
+
+    Metric *m_frames, *m_fps, *m_convert, *m_encode, *m_bytes, *m_bitrate, *m_target_bitrate, *m_keyframes, *m_drops;
+    Metric *m_capture_interval, *m_capture_dropped, *m_capture_repeated, *m_latency, *m_late;
+    Metric *m_static, *m_changed;
+    MetricRate fps_rate, bitrate_rate;
+
+    // Multi-camera mode: the capture thread leaves the newest frame here and the pool picks it up
+    WorkPool *pool;
+    pthread_t capture_thread;
+    pthread_mutex_t lock;
+    AVPacket *pending;
+    AVPacket *job_packet;                                     // The pending frame while a job encodes it
+    int64_t pending_arrival_us;
+    int has_pending;
+    int busy;                                                 // A job for this camera is queued or running
+    WorkGroup group;
+    volatile int64_t failed;
+};
+
+static void video_stream_init_metrics(VideoStream *vs, MetricsServer *metrics)
+{
+    vs->m_frames = metrics_counter(metrics, "frames_total", "Frames encoded");
+    vs->m_fps = metrics_gauge(metrics, "fps", "Frames encoded over the last second");
+    vs->m_convert = metrics_histogram_us(metrics, "convert_seconds", "YUYV to YUV420P conversion time",
+                                         metrics_frame_time_bounds_us, METRICS_FRAME_TIME_BUCKETS);
+    vs->m_encode = metrics_histogram_us(metrics, "encode_seconds", "Encoder send/receive time per frame",
+                                        metrics_frame_time_bounds_us, METRICS_FRAME_TIME_BUCKETS);
+    vs->m_bytes = metrics_counter(metrics, "bytes_total", "Encoded bytes written to the output");
+    vs->m_bitrate = metrics_gauge(metrics, "bitrate_bps", "Output bitrate over the last second");
+    vs->m_target_bitrate = metrics_gauge(metrics, "target_bitrate_bps", "Encoder bitrate setting");
+    vs->m_keyframes = metrics_counter(metrics, "keyframes_total", "Keyframes written");
+    vs->m_drops = metrics_counter(metrics, "dropped_frames_total", "Capture frames that could not be encoded");
+    vs->m_capture_interval = metrics_histogram_us(metrics, "capture_interval_seconds", "Time between capture timestamps",
+                                                  metrics_frame_time_bounds_us, METRICS_FRAME_TIME_BUCKETS);
+    vs->m_capture_dropped = metrics_counter(metrics, "capture_dropped_frames_total", "Frames the camera skipped, from gaps in the capture timestamps");
+    vs->m_capture_repeated = metrics_counter(metrics, "capture_repeated_frames_total", "Frames delivered again by the camera, not encoded");
+    vs->m_latency = metrics_histogram_us(metrics, "frame_latency_seconds", "Capture to RTSP write time per frame",
+                                         metrics_frame_time_bounds_us, METRICS_FRAME_TIME_BUCKETS);
+    vs->m_late = metrics_counter(metrics, "late_frames_total", "Frames skipped because they were over the latency budget");
+    vs->m_static = metrics_counter(metrics, "static_frames_total", "Frames without any changed block, not converted");
+    vs->m_changed = metrics_gauge(metrics, "changed_blocks_percent", "Share of 16x16 blocks changed in the last frame");
+    record_tee_init(&vs->record, metrics);
+    rtp_egress_init(&vs->egress, metrics);
+    packet_pool_init(&vs->packets, metrics);
+}
+
+// Frame and packet memory one camera needs with these settings. The camera's own capture buffers
+// are mapped from the driver and not counted.
+static int64_t video_stream_memory(const VideoOptions *o, int width, int height)
+{
+    int64_t bytes = (int64_t)width * height * 3 / 2;                            // Converted frame
+    bytes += mem_budget_x264_bytes(width, height, 1, o->subpel);
+    bytes += (int64_t)o->pool_slots * o->pool_slot_bytes;                       // Also holds the recording queue
+    if (o->static_threshold)
+        bytes += (int64_t)width * 2 * height;                                   // Change detection reference
+    if (o->egress)
+        bytes += (int64_t)RTP_EGRESS_MAX_PACKETS * RTP_EGRESS_PACKET_SIZE;
+    return bytes;
+}
+
+// Fit the budget mode settings into o->mem_budget, cheapest loss first: subpixel motion estimation,
+// then the recording queue. Returns -1 if even the leanest settings do not fit.
+static int video_fit_budget(VideoOptions *o, int width, int height, int nb_streams)
+{
+    // A slot takes an eighth of a raw frame; VBV keeps frames well below that at sane bitrates
+    o->pool_slot_bytes = FFALIGN(width * height * 3 / 2 / 8, 4096);
+    o->pool_slots = VIDEO_POOL_INFLIGHT + (o->record_dir ? o->frame_rate : 0);
+    o->subpel = 1;
+    if (nb_streams * video_stream_memory(o, width, height) > o->mem_budget)
+    {
+        o->subpel = 0;
+        printf("memory budget: subpixel motion estimation off\n");
+    }
+    if (nb_streams * video_stream_memory(o, width, height) > o->mem_budget && o->record_dir)
+    {
+        o->pool_slots = VIDEO_POOL_INFLIGHT + FFMAX(o->frame_rate / 4, 2);
+        printf("memory budget: recording queue cut to %d packets\n", o->pool_slots - VIDEO_POOL_INFLIGHT);
+    }
+    printf("memory budget: %d x %.1f MB of %.1f MB (x264 %.1f MB, packet pool %d x %d KB)\n",
+           nb_streams, video_stream_memory(o, width, height) / 1048576.0, o->mem_budget / 1048576.0,
+           mem_budget_x264_bytes(width, height, 1, o->subpel) / 1048576.0, o->pool_slots, o->pool_slot_bytes / 1024);
+    return nb_streams * video_stream_memory(o, width, height) > o->mem_budget ? -1 : 0;
+}
+
+// Open the camera; the probe is skipped when the device already describes the stream
+static int video_stream_open_input(VideoStream *vs, const VideoOptions *o)
+{
+    AVDictionary *options = NULL;
+    AVInputFormat *fmt = NULL;
+    int64_t t;
+    int ret;
 
     // Find input format
-    fmt = av_find_input_format(input_format_name);
+    fmt = av_find_input_format(o->input_format_name);
     if (!fmt)
     {
         printf("av_find_input_format error");
         return -1;
     }
 
-    // Set resolution
-    av_dict_set(&options, "video_size", camera_resolution, 0);
+    // Set resolution and frame rate
+    av_dict_set(&options, "video_size", o->camera_resolution, 0);
+    av_dict_set_int(&options, "framerate", o->frame_rate, 0);
 
     // Open input stream and initialize format context
-    start_time = clock();
-    ret = avformat_open_input(&in_context, device_name, fmt, &options);
+    t = av_gettime_relative();
+    ret = avformat_open_input(&vs->in_context, vs->device_name, fmt, &options);
     if (ret != 0)
     {
         // Release options in case of error, in case of success avformat_open_input will release them internally
@@ -68,53 +295,95 @@ int main()
         printf("avformat_open_input error");
         return -1;
     }
-    end_time = clock();
-    double time_spent = (double)(end_time - start_time) / CLOCKS_PER_SEC * 1000; // Convert to milliseconds
-    printf("Time spent in avformat_open_input: %f ms\n", time_spent);
+    t = startup_clock_phase(&vs->startup, STARTUP_DEVICE, t);
 
     // Find stream information
-    if (avformat_find_stream_info(in_context, 0) < 0)
+    if (capture_needs_probe(vs->in_context))
     {
-        printf("avformat_find_stream_info failed\n");
-        return -1;
+        if (avformat_find_stream_info(vs->in_context, 0) < 0)
+        {
+            printf("avformat_find_stream_info failed\n");
+            return -1;
+        }
+        startup_clock_phase(&vs->startup, STARTUP_PROBE, t);
     }
 
     // Find video stream index
-    video_streamid = av_find_best_stream(in_context, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
-    if (video_streamid < 0)
+    vs->video_streamid = av_find_best_stream(vs->in_context, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (vs->video_streamid < 0)
     {
         printf("cannot find video stream");
-        goto end;
+        return -1;
     }
-    video_stream = in_context->streams[video_streamid];
+    vs->video_stream = vs->in_context->streams[vs->video_streamid];
     printf("input stream, width: %d, height: %d, format: %s\n",
-           video_stream->codecpar->width, video_stream->codecpar->height,
-           av_get_pix_fmt_name((enum AVPixelFormat)video_stream->codecpar->format));
+           vs->video_stream->codecpar->width, vs->video_stream->codecpar->height,
+           av_get_pix_fmt_name((enum AVPixelFormat)vs->video_stream->codecpar->format));
 
     // Check if the actual format obtained matches the set camera pixel format
-    if (video_stream->codecpar->format != camera_pix_fmt)
+    if (vs->video_stream->codecpar->format != o->camera_pix_fmt)
     {
         printf("pixel format error");
-        goto end;
+        return -1;
     }
+    return 0;
+}
+
+typedef struct VideoInputOpen
+{
+    VideoStream *vs;
+    const VideoOptions *o;
+    int ret;
+} VideoInputOpen;
+
+static void *video_stream_open_input_thread(void *arg)
+{
+    VideoInputOpen *open = (VideoInputOpen *)arg;
+    open->ret = video_stream_open_input(open->vs, open->o);
+    return NULL;
+}
+
+// Set up conversion, the encoder and the RTSP output for width x height frames, then write the
+// stream header. Does not touch the input, which may still be opening on another thread.
+static int video_stream_open_output(VideoStream *vs, const VideoOptions *o, int width, int height)
+{
+    AVCodec *codec = NULL;
+    int64_t t;
+    int ret, band_h;
 
-    // Initialize scaling context
-    sws_ctx = sws_getContext(
-        video_stream->codecpar->width, video_stream->codecpar->height, camera_pix_fmt,
-        video_stream->codecpar->width, video_stream->codecpar->height, AV_PIX_FMT_YUV420P,
-        SWS_BILINEAR, NULL, NULL, NULL);
-    if (!sws_ctx)
+    // Initialize scaling contexts, one per band of even height so chroma rows are not split
+    vs->nb_bands = o->nb_bands;
+    band_h = height / vs->nb_bands & ~1;
+    for (int i = 0; i < vs->nb_bands; i++)
     {
-        printf("sws_getContext error\n");
-        goto end;
+        ConvertBand *b = &vs->bands[i];
+        b->vs = vs;
+        b->y = i * band_h;
+        b->h = i == vs->nb_bands - 1 ? height - b->y : band_h;
+        b->sws_ctx = sws_getContext(
+            width, b->h, o->camera_pix_fmt,
+            width, b->h, AV_PIX_FMT_YUV420P,
+            SWS_BILINEAR, NULL, NULL, NULL);
+        if (!b->sws_ctx)
+        {
+            printf("sws_getContext error\n");
+            return -1;
+        }
     }
 
-    // Allocate output format context
-    avformat_alloc_output_context2(&out_context, NULL, "rtsp", url);
-    if (!out_context)
+    // Allocate output format context; the batched output packetizes with the plain RTP muxer and
+    // leaves its URL empty, so the SDP has the control lines for SETUP. A multicast output keeps the
+    // URL, which gives the SDP its group, TTL and port instead.
+    if (o->multicast)
+        avformat_alloc_output_context2(&vs->out_context, NULL, "rtp", vs->url);
+    else if (o->egress)
+        avformat_alloc_output_context2(&vs->out_context, NULL, "rtp", NULL);
+    else
+        avformat_alloc_output_context2(&vs->out_context, NULL, "rtsp", vs->url);
+    if (!vs->out_context)
     {
         printf("avformat_alloc_output_context2 failed\n");
-        goto end;
+        return -1;
     }
 
     // Find encoder
@@ -122,213 +391,889 @@ int main()
     if (!codec)
     {
         printf("Codec not found\n");
-        goto end;
+        return -1;
     }
     printf("codec name: %s\n", codec->name);
 
     // Create new video stream
-    out_stream = avformat_new_stream(out_context, NULL);
-    if (!out_stream)
+    vs->out_stream = avformat_new_stream(vs->out_context, NULL);
+    if (!vs->out_stream)
     {
         printf("avformat_new_stream failed\n");
-        goto end;
+        return -1;
     }
 
     // Allocate encoder context
-    codec_context = avcodec_alloc_context3(codec);
-    if (!codec_context)
+    vs->codec_context = avcodec_alloc_context3(codec);
+    if (!vs->codec_context)
     {
         printf("avcodec_alloc_context3 failed\n");
-        goto end;
+        return -1;
     }
 
     // Set encoder parameters
+    AVCodecContext *codec_context = vs->codec_context;
     codec_context->codec_id = AV_CODEC_ID_H264;
     codec_context->codec_type = AVMEDIA_TYPE_VIDEO;
     codec_context->pix_fmt = AV_PIX_FMT_YUV420P;
-    codec_context->width = video_stream->codecpar->width;
-    codec_context->height = video_stream->codecpar->height;
-    codec_context->time_base = (AVRational){1, frame_rate};         // Set time base
-    codec_context->framerate = (AVRational){frame_rate, 1};         // Set frame rate
+    codec_context->width = width;
+    codec_context->height = height;
+    codec_context->time_base = o->vfr ? (AVRational){1, 90000}      // Set time base, RTP clock rate for VFR
+                                      : (AVRational){1, o->frame_rate};
+    codec_context->framerate = (AVRational){o->frame_rate, 1};      // Set frame rate
     codec_context->bit_rate = 750 * 1000;                           // Set bit rate
-    codec_context->gop_size = frame_rate;                           // Set GOP size
+    codec_context->gop_size = o->frame_rate;                        // Set GOP size
     codec_context->max_b_frames = 0;                                // Set max B frames, set to 0 if not needed
-    codec_context->thread_count = 4; // Enable multi-threaded encoding
+    codec_context->thread_count = o->thread_count; // Enable multi-threaded encoding
 
     av_opt_set(codec_context->priv_data, "profile", "baseline", 0); // Set H264 quality profile
     av_opt_set(codec_context->priv_data, "tune", "zerolatency", 0); // Set H264 encoding optimization parameters
+    if (o->mem_budget)
+    {
+        // One reference, no lookahead of any kind (scene cuts and mbtree need the low resolution
+        // copies), threads on slices of the same frame, and VBV to bound the packet size
+        codec_context->rc_max_rate = codec_context->bit_rate;
+        codec_context->rc_buffer_size = (int)(codec_context->bit_rate / 2);
+        av_opt_set(codec_context->priv_data, "x264-params",
+                   o->subpel ? "ref=1:bframes=0:rc-lookahead=0:sync-lookahead=0:sliced-threads=1:scenecut=0:mbtree=0"
+                             : "ref=1:bframes=0:rc-lookahead=0:sync-lookahead=0:sliced-threads=1:scenecut=0:mbtree=0:subme=0", 0);
+        if (packet_pool_start(&vs->packets, o->pool_slots, o->pool_slot_bytes) < 0)
+        {
+            printf("packet_pool_start error\n");
+            return -1;
+        }
+        if (packet_pool_attach(&vs->packets, codec_context, codec) < 0)
+            printf("%s allocates its own packets, packet pool not used\n", codec->name);
+    }
     // Set delay optimization parameters for the format context
-    av_opt_set(out_context->priv_data, "rtsp_transport", "udp", 0); // Use UDP transport to reduce delay
-    av_opt_set(out_context->priv_data, "muxdelay", "0", 0);         // Set muxing delay to 0
+    av_opt_set(vs->out_context->priv_data, "rtsp_transport", "udp", 0); // Use UDP transport to reduce delay
+    av_opt_set(vs->out_context->priv_data, "muxdelay", "0", 0);         // Set muxing delay to 0
     // Check if the output context's format requires AV_CODEC_FLAG_GLOBAL_HEADER
     // AV_CODEC_FLAG_GLOBAL_HEADER: Instead of adding PPS and SPS before each keyframe, they are added in the extradate byte section
-    if (out_context->oformat->flags & AVFMT_GLOBALHEADER)
+    if ((vs->out_context->oformat->flags & AVFMT_GLOBALHEADER) || o->egress)
     {
         printf("set AV_CODEC_FLAG_GLOBAL_HEADER\n");
         codec_context->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
     }
 
     // Open encoder
+    t = av_gettime_relative();
     if (avcodec_open2(codec_context, codec, NULL) < 0)
     {
         printf("avcodec_open2 failed\n");
-        goto end;
+        return -1;
     }
+    startup_clock_phase(&vs->startup, STARTUP_ENCODER, t);
 
     // Copy encoder parameters to stream
-    ret = avcodec_parameters_from_context(out_stream->codecpar, codec_context);
+    ret = avcodec_parameters_from_context(vs->out_stream->codecpar, codec_context);
     if (ret < 0)
     {
         printf("avcodec_parameters_from_context failed\n");
-        goto end;
+        return -1;
     }
 
     // Allocate memory
-    input_frame = av_frame_alloc();
-    frame_yuv420p = av_frame_alloc();
-    if (!input_frame || !frame_yuv420p)
+    vs->input_frame = av_frame_alloc();
+    vs->frame_yuv420p = av_frame_alloc();
+    if (!vs->input_frame || !vs->frame_yuv420p)
     {
         printf("av_frame_alloc error\n");
-        goto end;
+        return -1;
     }
-    packet = av_packet_alloc();
-    if (!packet)
+    vs->packet = av_packet_alloc();
+    vs->captured = av_packet_alloc();
+    vs->pending = av_packet_alloc();
+    vs->job_packet = av_packet_alloc();
+    if (!vs->packet || !vs->captured || !vs->pending || !vs->job_packet)
     {
         printf("av_packet_alloc failed\n");
-        goto end;
+        return -1;
     }
 
     // Set frame format
-    input_frame->format = camera_pix_fmt;
-    input_frame->width = video_stream->codecpar->width;
-    input_frame->height = video_stream->codecpar->height;
+    vs->input_frame->format = o->camera_pix_fmt;
+    vs->input_frame->width = width;
+    vs->input_frame->height = height;
 
-    frame_yuv420p->format = AV_PIX_FMT_YUV420P;
-    frame_yuv420p->width = video_stream->codecpar->width;
-    frame_yuv420p->height = video_stream->codecpar->height;
+    vs->frame_yuv420p->format = AV_PIX_FMT_YUV420P;
+    vs->frame_yuv420p->width = width;
+    vs->frame_yuv420p->height = height;
 
     // Allocate frame memory
-    ret = av_frame_get_buffer(frame_yuv420p, 0);
+    ret = av_frame_get_buffer(vs->frame_yuv420p, 0);
     if (ret < 0)
     {
         printf("av_frame_get_buffer error\n");
-        goto end;
+        return -1;
     }
+    metric_set(vs->m_target_bitrate, codec_context->bit_rate);
 
     // Open URL
-    if (!(out_context->oformat->flags & AVFMT_NOFILE))
+    t = av_gettime_relative();
+    if (o->multicast)
+    {
+        ret = rtp_egress_open_udp(&vs->egress, vs->out_context, vs->url, o->egress_pace_bps, 500000 / o->frame_rate);
+        if (ret < 0)
+        {
+            printf("rtp_egress_open_udp error (%s)\n", av_err2str(ret));
+            return -1;
+        }
+        printf("multicast RTP output to %s, UDP GSO %s\n", vs->url, vs->egress.gso ? "on" : "off");
+    }
+    else if (o->egress)
+    {
+        // Packets are due well before the next frame; spread them over at most half the interval
+        ret = rtp_egress_open(&vs->egress, vs->out_context, vs->url, o->egress_pace_bps, 500000 / o->frame_rate);
+        if (ret < 0)
+        {
+            printf("rtp_egress_open error (%s)\n", av_err2str(ret));
+            return -1;
+        }
+        printf("batched RTP output to %s, UDP GSO %s\n", vs->url, vs->egress.gso ? "on" : "off");
+    }
+    else if (!(vs->out_context->oformat->flags & AVFMT_NOFILE))
     {
-        ret = avio_open(&out_context->pb, url, AVIO_FLAG_WRITE);
+        ret = avio_open(&vs->out_context->pb, vs->url, AVIO_FLAG_WRITE);
         if (ret < 0)
         {
             printf("avio_open error\n");
-            goto end;
+            return -1;
         }
     }
 
     // Write file header
-    ret = avformat_write_header(out_context, NULL);
+    ret = avformat_write_header(vs->out_context, NULL);
     if (ret < 0)
     {
         printf("avformat_write_header error\n");
-        goto end;
+        return -1;
     }
+    vs->header_written = 1;
+    startup_clock_phase(&vs->startup, STARTUP_OUTPUT, t);
     printf("avformat_write_header success\n");
 
-    // Start encoding
-    start_time = clock();
-    while (av_read_frame(in_context, &pkt) == 0)
+    // Receivers of a multicast output join with this SDP, printed and served on the metrics endpoint
+    if (o->multicast)
     {
-        ret = avcodec_send_packet(codec_context, &pkt);
-        if (ret < 0)
+        char sdp[4096];
+        if (av_sdp_create(&vs->out_context, 1, sdp, sizeof(sdp)) < 0)
         {
-            printf("avcodec_send_packet failed\n");
-            break;
+            printf("av_sdp_create error\n");
+            return -1;
         }
-        while (ret >= 0)
+        printf("%s", sdp);
+        metrics_document_publish(vs->sdp, sdp);
+    }
+
+    // Record the published packets locally, up to 4 seconds or 16 MB queued for the disk; in budget
+    // mode what the packet pool has room for
+    if (o->record_dir &&
+        record_tee_start(&vs->record, o->record_dir, vs->record_prefix, vs->out_stream->codecpar, codec_context->time_base,
+                         o->record_segment_seconds,
+                         o->mem_budget ? o->pool_slots - VIDEO_POOL_INFLIGHT : o->frame_rate * 4,
+                         o->mem_budget ? (int64_t)(o->pool_slots - VIDEO_POOL_INFLIGHT) * o->pool_slot_bytes : 16 << 20) < 0)
+    {
+        printf("record_tee_start error\n");
+        return -1;
+    }
+
+    // Compare 16x16 pixel blocks (32 bytes of YUYV) with the last frame sent
+    if (o->static_threshold &&
+        frame_diff_init(&vs->diff, vs->input_frame->width * 2, vs->input_frame->height, 32, 16, o->static_threshold) < 0)
+    {
+        printf("frame_diff_init error\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Open the camera, the encoder and the RTSP output, then write the stream header. With fast start
+// the camera opens on its own thread, the rest is set up for the requested size meanwhile, and
+// the camera has to deliver exactly that size.
+static int video_stream_open(VideoStream *vs, const VideoOptions *o)
+{
+    VideoInputOpen open = {vs, o, -1};
+    pthread_t thread;
+    int width, height, ret;
+
+    if (o->fast_start && av_parse_video_size(&width, &height, o->camera_resolution) == 0 &&
+        pthread_create(&thread, NULL, video_stream_open_input_thread, &open) == 0)
+    {
+        ret = video_stream_open_output(vs, o, width, height);
+        pthread_join(thread, NULL);
+        if (ret < 0 || open.ret < 0)
+            return -1;
+        if (vs->video_stream->codecpar->width != width || vs->video_stream->codecpar->height != height)
         {
-            ret = avcodec_receive_frame(codec_context, frame_yuv420p);
-            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-            {
-                // Need more packets to continue encoding, skip this iteration
-                break;
-            }
-            else if (ret < 0)
-            {
-                printf("Error during encoding\n");
-                goto end;
-            }
+            printf("camera delivers %dx%d, not %s; -F needs a size the camera supports\n",
+                   vs->video_stream->codecpar->width, vs->video_stream->codecpar->height, o->camera_resolution);
+            return -1;
+        }
+    }
+    else if (video_stream_open_input(vs, o) < 0 ||
+             video_stream_open_output(vs, o, vs->video_stream->codecpar->width, vs->video_stream->codecpar->height) < 0)
+        return -1;
 
-            // Scale the frame from the input format (YUYV422) to YUV420P
-            sws_scale(sws_ctx, (const uint8_t *const *)input_frame->data, input_frame->linesize, 0,
-                      video_stream->codecpar->height, frame_yuv420p->data, frame_yuv420p->linesize);
+    // PTS come from the capture timestamps of the input stream
+    vs->capture_clock.vfr = o->vfr;
+    vs->capture_clock.in_tb = vs->video_stream->time_base;
+    vs->capture_clock.enc_tb = vs->codec_context->time_base;
+    vs->capture_clock.period_us = 1000000 / o->frame_rate;
+    vs->capture_clock.first_ts = AV_NOPTS_VALUE;
+    return 0;
+}
 
-            // Set frame PTS (presentation timestamp)
-            frame_yuv420p->pts = frame_index++;
+static void convert_band(void *arg, int worker)
+{
+    (void)worker;
+    ConvertBand *b = (ConvertBand *)arg;
+    AVFrame *in = b->vs->input_frame, *out = b->vs->frame_yuv420p;
+    const uint8_t *src[4] = {in->data[0] + b->y * in->linesize[0], NULL, NULL, NULL};
+    uint8_t *dst[4] = {out->data[0] + b->y * out->linesize[0],
+                       out->data[1] + b->y / 2 * out->linesize[1],
+                       out->data[2] + b->y / 2 * out->linesize[2], NULL};
 
-            // Send the frame to the encoder
-            ret = avcodec_send_frame(codec_context, frame_yuv420p);
-            if (ret < 0)
-            {
-                printf("Error sending frame to encoder\n");
-                goto end;
-            }
+    sws_scale(b->sws_ctx, src, in->linesize, 0, b->h, dst, out->linesize);
+}
 
-            // Receive the encoded packet
-            ret = avcodec_receive_packet(codec_context, packet);
-            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-            {
-                // Continue if more frames need to be encoded
+// Scale the frame from the input format (YUYV422) to YUV420P, spreading the bands over the pool.
+// With change detection, bands without a changed block keep what the previous frame left there.
+static void video_stream_convert(VideoStream *vs, int worker)
+{
+    int todo[VIDEO_MAX_BANDS], nb_todo = 0, first = 0;
+
+    for (int i = 0; i < vs->nb_bands; i++)
+        if (!vs->diff.ref || frame_diff_rows_dirty(&vs->diff, vs->bands[i].y, vs->bands[i].h))
+            todo[nb_todo++] = i;
+    if (!nb_todo)
+        return;
+    if (vs->pool && worker >= 0 && nb_todo > 1)
+    {
+        metrics_atomic_store(&vs->group.remaining, nb_todo - 1);
+        for (first = nb_todo - 1; first > 0; first--)
+        {
+            if (work_pool_submit(vs->pool, worker, vs->priority, convert_band, &vs->bands[todo[first]], &vs->group) < 0)
+                break;
+        }
+        // Bands that did not fit in the queue are converted here
+        metrics_atomic_add(&vs->group.remaining, -first);
+    }
+    else
+        first = nb_todo - 1;
+    for (int i = 0; i <= first; i++)
+        convert_band(&vs->bands[todo[i]], worker);
+    if (vs->pool && worker >= 0 && nb_todo > 1)
+        work_pool_wait(vs->pool, worker, vs->priority, &vs->group);
+}
+
+// Tell the encoder where the picture changed: changed areas keep the normal quantizer, the static
+// rest gets a coarser one, so sensor noise there costs nothing. Runs of changed blocks on a block row
+// become one region each; past VIDEO_MAX_ROIS their bounding box is used instead.
+static void video_stream_set_roi(VideoStream *vs)
+{
+    const FrameDiff *d = &vs->diff;
+    AVFrame *frame = vs->frame_yuv420p;
+    AVRegionOfInterest rois[VIDEO_MAX_ROIS + 1];
+    AVFrameSideData *sd;
+    int nb = 0, overflow = 0;
+    int bw = d->block_w / 2, bh = d->block_h;               // Block size in pixels
+    int top = d->rows, bottom = -1, left = d->cols, right = -1;
+
+    av_frame_remove_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+    if (!d->ref || d->nb_dirty == 0 || d->nb_dirty == d->cols * d->rows)
+        return;
+    for (int r = 0; r < d->rows; r++)
+    {
+        for (int c = 0; c < d->cols; c++)
+        {
+            int c0 = c;
+            if (!d->dirty[r * d->cols + c])
                 continue;
-            }
-            else if (ret < 0)
+            while (c + 1 < d->cols && d->dirty[r * d->cols + c + 1])
+                c++;
+            top = FFMIN(top, r);
+            bottom = FFMAX(bottom, r);
+            left = FFMIN(left, c0);
+            right = FFMAX(right, c);
+            if (nb == VIDEO_MAX_ROIS)
             {
-                printf("Error receiving encoded packet\n");
-                goto end;
+                overflow = 1;
+                continue;
             }
+            rois[nb++] = (AVRegionOfInterest){sizeof(AVRegionOfInterest), r * bh, FFMIN((r + 1) * bh, frame->height),
+                                              c0 * bw, FFMIN((c + 1) * bw, frame->width), (AVRational){0, 1}};
+        }
+    }
+    if (overflow)
+    {
+        nb = 1;
+        rois[0] = (AVRegionOfInterest){sizeof(AVRegionOfInterest), top * bh, FFMIN((bottom + 1) * bh, frame->height),
+                                       left * bw, FFMIN((right + 1) * bw, frame->width), (AVRational){0, 1}};
+    }
+    // The first region covering a macroblock wins, so the whole-frame one goes last
+    rois[nb++] = (AVRegionOfInterest){sizeof(AVRegionOfInterest), 0, frame->height, 0, frame->width, (AVRational){1, 10}};
 
-            // Rescale PTS to match the output stream timebase
-            av_packet_rescale_ts(packet, codec_context->time_base, out_stream->time_base);
-            packet->stream_index = out_stream->index;
+    sd = av_frame_new_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST, nb * sizeof(AVRegionOfInterest));
+    if (sd)
+        memcpy(sd->data, rois, nb * sizeof(AVRegionOfInterest));
+}
+
+// Convert, encode and publish one captured packet; worker is the pool worker running this, or -1.
+// Takes ownership of pkt. Returns a negative value when the stream cannot continue.
+static int video_stream_encode(VideoStream *vs, AVPacket *pkt, int64_t arrival_us, int worker)
+{
+    AVCodecContext *codec_context = vs->codec_context;
+    int64_t t0, t1, t2, ts, pts, interval_us;
+    int missing, ret;
+
+    if (pkt->stream_index != vs->video_streamid)
+    {
+        av_packet_unref(pkt);
+        return 0;
+    }
+    if (pkt->size < av_image_get_buffer_size(vs->input_frame->format, vs->input_frame->width, vs->input_frame->height, 1))
+    {
+        // Truncated capture buffer, e.g. the driver returned a short frame
+        metric_add(vs->m_drops, 1);
+        av_packet_unref(pkt);
+        return 0;
+    }
+
+    // Timestamp the frame from its capture time, falling back to the arrival time; both are on
+    // CLOCK_MONOTONIC. The clock's time base is settled by the first frame (microseconds if it has
+    // no PTS) and every later timestamp, of either kind, is rescaled into it.
+    if (vs->capture_clock.first_ts == AV_NOPTS_VALUE && pkt->pts == AV_NOPTS_VALUE)
+        vs->capture_clock.in_tb = (AVRational){1, 1000000};
+    if (pkt->pts != AV_NOPTS_VALUE)
+        ts = av_rescale_q(pkt->pts, vs->video_stream->time_base, vs->capture_clock.in_tb);
+    else
+        ts = av_rescale_q(arrival_us, (AVRational){1, 1000000}, vs->capture_clock.in_tb);
+    pts = capture_clock_pts(&vs->capture_clock, ts, &interval_us, &missing);
+    if (interval_us)
+        metric_observe(vs->m_capture_interval, interval_us);
+    if (pts == AV_NOPTS_VALUE)
+    {
+        metric_add(vs->m_capture_repeated, 1);
+        vs->capture_repeated++;
+        av_packet_unref(pkt);
+        return 0;
+    }
+    if (missing)
+    {
+        metric_add(vs->m_capture_dropped, missing);
+        vs->capture_dropped += missing;
+    }
+
+    // Apply live control requests
+    int64_t bitrate = metrics_atomic_load(&requested_bitrate);
+    if (bitrate && bitrate != codec_context->bit_rate)
+    {
+        // libx264 reconfigures rate control when bit_rate changes between frames
+        codec_context->bit_rate = bitrate;
+        if (codec_context->rc_max_rate)
+        {
+            codec_context->rc_max_rate = bitrate;
+            codec_context->rc_buffer_size = (int)(bitrate / 2);
+        }
+        metric_set(vs->m_target_bitrate, bitrate);
+        printf("bitrate set to %" PRId64 "\n", bitrate);
+    }
+    int64_t keyframes = metrics_atomic_load(&keyframe_requests);
+    vs->frame_yuv420p->pict_type = keyframes != vs->keyframe_requests_seen ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+    vs->keyframe_requests_seen = keyframes;
 
-            // Write the encoded packet to the output stream
-            ret = av_interleaved_write_frame(out_context, packet);
-            if (ret < 0)
+    // Point the input frame at the captured YUYV buffer, no copy
+    t0 = av_gettime_relative();
+    av_image_fill_arrays(vs->input_frame->data, vs->input_frame->linesize, pkt->data, vs->input_frame->format,
+                         vs->input_frame->width, vs->input_frame->height, 1);
+
+    // Nothing changed since the last frame sent: with -V drop it (the next frame sent still carries
+    // its own capture time), otherwise encode the previous picture again, which x264 codes as skips
+    if (vs->diff.ref)
+    {
+        int dirty = frame_diff_update(&vs->diff, vs->input_frame->data[0], vs->input_frame->linesize[0]);
+        metric_set(vs->m_changed, dirty * 100LL / (vs->diff.cols * vs->diff.rows));
+        if (!dirty)
+        {
+            metric_add(vs->m_static, 1);
+            if (vs->capture_clock.vfr && vs->frame_yuv420p->pict_type != AV_PICTURE_TYPE_I &&
+                t0 - vs->last_sent_us < VIDEO_STATIC_KEEPALIVE_US)
             {
-                printf("Error writing frame\n");
-                goto end;
+                av_packet_unref(pkt);
+                return 0;
             }
+        }
+    }
+    ret = av_frame_make_writable(vs->frame_yuv420p);
+    if (ret < 0)
+    {
+        printf("av_frame_make_writable error\n");
+        av_packet_unref(pkt);
+        return ret;
+    }
+    video_stream_convert(vs, worker);
+    video_stream_set_roi(vs);
+    av_packet_unref(pkt);
+    t1 = av_gettime_relative();
+    metric_observe(vs->m_convert, t1 - t0);
+
+    // Set frame PTS (presentation timestamp)
+    vs->frame_yuv420p->pts = pts;
 
-            // Free the packet
-            av_packet_unref(packet);
+    // Send the frame to the encoder
+    ret = avcodec_send_frame(codec_context, vs->frame_yuv420p);
+    if (ret < 0)
+    {
+        printf("Error sending frame to encoder\n");
+        return ret;
+    }
+
+    // Receive the encoded packets
+    AVPacket *packet = vs->packet;
+    while ((ret = avcodec_receive_packet(codec_context, packet)) == 0)
+    {
+        record_tee_push(&vs->record, packet);
+
+        // Rescale PTS to match the output stream timebase
+        av_packet_rescale_ts(packet, codec_context->time_base, vs->out_stream->time_base);
+        packet->stream_index = vs->out_stream->index;
+        metric_add(vs->m_bytes, packet->size);
+        if (packet->flags & AV_PKT_FLAG_KEY)
+            metric_add(vs->m_keyframes, 1);
+
+        // Write the encoded packet to the output stream
+        ret = av_interleaved_write_frame(vs->out_context, packet);
+        if (ret < 0)
+        {
+            printf("Error writing frame\n");
+            return ret;
         }
+        startup_clock_first_packet(&vs->startup, vs->record_prefix);
+
+        // Free the packet
+        av_packet_unref(packet);
     }
-    end_time = clock();
-    double encoding_time = (double)(end_time - start_time) / CLOCKS_PER_SEC * 1000;
-    printf("Encoding completed in: %f ms\n", encoding_time);
+    if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+    {
+        printf("Error receiving encoded packet\n");
+        return ret;
+    }
+    // The whole access unit in one go
+    if (vs->egress.pb && (ret = rtp_egress_flush(&vs->egress)) < 0)
+    {
+        printf("rtp_egress_flush error (%s)\n", av_err2str(ret));
+        return ret;
+    }
+    t2 = av_gettime_relative();
+    vs->last_sent_us = t2;
+    metric_observe(vs->m_encode, t2 - t1);
+    metric_observe(vs->m_latency, t2 - arrival_us);
+    metric_add(vs->m_frames, 1);
+    metric_rate_tick(&vs->fps_rate, vs->m_fps, vs->m_frames, 1, t2);
+    metric_rate_tick(&vs->bitrate_rate, vs->m_bitrate, vs->m_bytes, 8, t2);
+
+    // Report camera drops and repeats at most once per second
+    if ((vs->capture_dropped || vs->capture_repeated) && t2 - vs->last_report_us >= 1000000)
+    {
+        printf("capture %s: %" PRId64 " frames dropped, %" PRId64 " repeated\n",
+               vs->device_name, vs->capture_dropped, vs->capture_repeated);
+        vs->capture_dropped = vs->capture_repeated = 0;
+        vs->last_report_us = t2;
+    }
+    return 0;
+}
+
+// Pool job: encode the newest frame of a camera, and queue itself again if another one arrived
+// meanwhile. When the queue is full it keeps going here instead, so a loaded pool never recurses.
+static void video_stream_job(void *arg, int worker)
+{
+    VideoStream *vs = (VideoStream *)arg;
+    AVPacket *pkt = vs->job_packet;
+    int64_t arrival_us;
+    int again;
+
+    do
+    {
+        pthread_mutex_lock(&vs->lock);
+        av_packet_move_ref(pkt, vs->pending);
+        arrival_us = vs->pending_arrival_us;
+        vs->has_pending = 0;
+        pthread_mutex_unlock(&vs->lock);
+
+        if (vs->budget_us && av_gettime_relative() - arrival_us > vs->budget_us)
+        {
+            // Already too late to be useful; leave the cores to the cameras that can still make it
+            metric_add(vs->m_late, 1);
+            av_packet_unref(pkt);
+        }
+        else if (!metrics_atomic_load(&vs->failed) && video_stream_encode(vs, pkt, arrival_us, worker) < 0)
+            metrics_atomic_store(&vs->failed, 1);
+        av_packet_unref(pkt);
+
+        pthread_mutex_lock(&vs->lock);
+        again = vs->has_pending;
+        vs->busy = again;
+        pthread_mutex_unlock(&vs->lock);
+    } while (again && work_pool_submit(vs->pool, worker < 0 ? vs->index : worker, vs->priority, video_stream_job, vs, NULL) < 0);
+}
+
+static SchedPolicy sched;
+
+static void sched_apply(const char *stage, int index)
+{
+    int ret = sched_policy_apply(&sched, stage, index);
+    if (ret < 0)
+        printf("%s thread: scheduling policy not applied (%s)\n", stage, av_err2str(ret));
+}
+
+static void video_worker_init(void *arg, int worker)
+{
+    (void)arg;
+    sched_apply("encode", worker);
+}
+
+// The converted frame and the change detection reference are touched by every frame the encode
+// stage handles
+static void video_stream_place_buffers(VideoStream *vs)
+{
+    int ret = 0;
+    for (int i = 0; i < AV_NUM_DATA_POINTERS && vs->frame_yuv420p->buf[i] && ret >= 0; i++)
+        ret = sched_policy_hot_buffer(&sched, "encode", vs->frame_yuv420p->buf[i]->data, vs->frame_yuv420p->buf[i]->size);
+    if (ret >= 0 && vs->diff.ref)
+        ret = sched_policy_hot_buffer(&sched, "encode", vs->diff.ref, (size_t)vs->diff.width * vs->diff.height);
+    if (ret < 0)
+        printf("stream %d: hot buffers not placed (%s)\n", vs->index, av_err2str(ret));
+}
+
+// Multi-camera mode: read frames as they come and hand only the newest one to the pool
+static void *video_stream_capture_thread(void *arg)
+{
+    VideoStream *vs = (VideoStream *)arg;
+    AVPacket *pkt = vs->captured;
+    int submit;
+
+    sched_apply("capture", -1);
+    while (!stop_requested && !metrics_atomic_load(&vs->failed) && av_read_frame(vs->in_context, pkt) == 0)
+    {
+        int64_t arrival_us = av_gettime_relative();
+        if (pkt->stream_index != vs->video_streamid)
+        {
+            av_packet_unref(pkt);
+            continue;
+        }
+        pthread_mutex_lock(&vs->lock);
+        if (vs->has_pending)
+        {
+            // The pool has not got to the previous frame yet: replace it rather than queue behind it
+            metric_add(vs->m_drops, 1);
+            av_packet_unref(vs->pending);
+        }
+        av_packet_move_ref(vs->pending, pkt);
+        vs->pending_arrival_us = arrival_us;
+        vs->has_pending = 1;
+        submit = !vs->busy;
+        vs->busy = 1;
+        pthread_mutex_unlock(&vs->lock);
+        if (submit && work_pool_submit(vs->pool, vs->index, vs->priority, video_stream_job, vs, NULL) < 0)
+            video_stream_job(vs, -1);
+    }
+    return NULL;
+}
 
+static void video_stream_close(VideoStream *vs)
+{
     // Write trailer and flush
-    av_write_trailer(out_context);
+    if (vs->header_written)
+        av_write_trailer(vs->out_context);
+    if (vs->out_context && vs->out_context->pb == vs->egress.pb)
+        vs->out_context->pb = NULL;
+    rtp_egress_close(&vs->egress);
+    record_tee_stop(&vs->record);
+    frame_diff_free(&vs->diff);
+    for (int i = 0; i < vs->nb_bands; i++)
+        if (vs->bands[i].sws_ctx)
+            sws_freeContext(vs->bands[i].sws_ctx);
+    if (vs->input_frame)
+        av_frame_free(&vs->input_frame);
+    if (vs->frame_yuv420p)
+        av_frame_free(&vs->frame_yuv420p);
+    av_packet_free(&vs->packet);
+    av_packet_free(&vs->captured);
+    av_packet_free(&vs->pending);
+    av_packet_free(&vs->job_packet);
+    if (vs->codec_context)
+        avcodec_free_context(&vs->codec_context);
+    if (vs->in_context)
+        avformat_close_input(&vs->in_context);
+    if (vs->out_context && !(vs->out_context->oformat->flags & AVFMT_NOFILE))
+        avio_close(vs->out_context->pb);
+    if (vs->out_context)
+        avformat_free_context(vs->out_context);
+    packet_pool_free(&vs->packets);
+}
+
+static WorkPool pool;
+// gcc video.c -o video -I /usr/local/include -L /usr/local/lib -lavdevice -lavformat -lavcodec -lavutil -lswscale -lpthread
+// ffplay -fflags nobuffer -flags low_delay -framedrop -strict experimental rtsp://localhost:8554/live
+int main(int argc, char *argv[])
+{
+    VideoOptions o = {
+        .input_format_name = "video4linux2",
+        .camera_resolution = "640x480",
+        .camera_pix_fmt = AV_PIX_FMT_YUYV422,
+        .frame_rate = 30,
+        .thread_count = 4,                                    // Enable multi-threaded encoding
+        .nb_bands = 1,
+        .record_segment_seconds = 60,
+    };
+    const char *url = "rtsp://localhost:8554/live";           // Change the streaming address to RTSP
+    const char *metrics_address = NULL;                       // Metrics/control endpoint, e.g. 9100 or unix:/tmp/video.sock
+    int width = 640, height = 480;
+    char group[64] = "";                                      // Multicast group, port of the first camera and TTL
+    int group_port = 0, group_ttl = 1;
+    int nb_workers = (int)sysconf(_SC_NPROCESSORS_ONLN);      // Encode pool size in multi-camera mode
+    int ret = -1;
+    int pool_started = 0, nb_threads = 0;
+    VideoStream streams[VIDEO_MAX_STREAMS];
+    int nb_streams = 0;
+    VideoStream *vs = NULL;
+    MetricsServer metrics;
+    struct rusage usage;
+    int64_t program_start = av_gettime_relative();            // Time to first packet counts from here
+    int64_t run_start;
+
+    memset(streams, 0, sizeof(streams));
+
+    // Command line argument parsing; -u, -P and -B after a -d apply to that camera
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-u") == 0 && i + 1 < argc)
+        {
+            if (vs)
+                vs->url = argv[++i];
+            else
+                url = argv[++i];
+        }
+        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc && nb_streams < VIDEO_MAX_STREAMS)
+        {
+            vs = &streams[nb_streams++];
+            vs->device_name = argv[++i];
+            vs->priority = WORK_POOL_PRIORITIES - 1;
+        }
+        else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc && vs)
+            vs->priority = atoi(argv[++i]) ? WORK_POOL_PRIORITIES - 1 : 0;
+        else if (strcmp(argv[i], "-B") == 0 && i + 1 < argc && vs)
+            vs->budget_us = atoi(argv[++i]) * 1000LL;
+        else if (strcmp(argv[i], "-W") == 0 && i + 1 < argc)
+            nb_workers = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+            width = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-h") == 0 && i + 1 < argc)
+            height = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+            o.frame_rate = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-V") == 0)
+            o.vfr = 1;
+        else if (strcmp(argv[i], "-Z") == 0 && i + 1 < argc)
+            o.static_threshold = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc)
+            o.input_format_name = argv[++i];
+        else if (strcmp(argv[i], "-M") == 0 && i + 1 < argc)
+            metrics_address = argv[++i];
+        else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc)
+            o.record_dir = argv[++i];
+        else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc)
+            o.record_segment_seconds = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-T") == 0 && i + 1 < argc)
+            o.record_write_delay_ms = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-E") == 0 && i + 1 < argc)
+        {
+            o.egress = 1;
+            o.egress_pace_bps = (int64_t)(atof(argv[++i]) * 1000000);
+        }
+        else if (strcmp(argv[i], "-G") == 0 && i + 1 < argc &&
+                 sscanf(argv[i + 1], "%63[^:]:%d:%d", group, &group_port, &group_ttl) >= 2)
+        {
+            o.egress = o.multicast = 1;
+            i++;
+        }
+        else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+            o.mem_budget = atoll(argv[++i]) << 20;
+        else if (strcmp(argv[i], "-F") == 0)
+            o.fast_start = 1;
+        else if (strcmp(argv[i], "-X") == 0 && i + 1 < argc && sched_policy_add(&sched, argv[i + 1]) == 0)
+            i++;
+        else
+        {
+            printf("Usage: %s [-u rtsp_url] [-i input_format] [-d device [-u rtsp_url] [-P priority] [-B budget_ms]]..."
+                   " [-W workers] [-w width] [-h height] [-f fps] [-V] [-Z change_threshold] [-M metrics_address]"
+                   " [-R record_dir] [-S segment_seconds] [-T record_write_delay_ms] [-E pace_mbps] [-G group:port[:ttl]] [-m budget_mb] [-F]"
+                   " [-X stage:cpus[:class[:priority]] | -X mlock]...\n", argv[0]);
+            return 1;
+        }
+    }
+    snprintf(o.camera_resolution, sizeof(o.camera_resolution), "%dx%d", width, height);
+    if (!nb_streams)
+        streams[nb_streams++].device_name = "/dev/video0";
+
+    // With several cameras, the encoders run single threaded on one shared pool instead of each
+    // bringing its own threads, and the conversion is split in bands the pool can spread out
+    if (nb_streams > 1)
+    {
+        o.thread_count = 1;
+        o.nb_bands = 4;
+    }
+    // Change detection converts only the bands that changed, so cut the frame finer
+    if (o.static_threshold)
+        o.nb_bands = VIDEO_MAX_BANDS;
+    if (o.mem_budget)
+    {
+        mem_budget_malloc_tune();
+        if (video_fit_budget(&o, width, height, nb_streams) < 0)
+        {
+            printf("%d camera(s) at %dx%d do not fit a %" PRId64 " MB memory budget\n", nb_streams, width, height, o.mem_budget >> 20);
+            return 1;
+        }
+    }
+    for (int i = 0; i < nb_streams; i++)
+    {
+        vs = &streams[i];
+        vs->index = i;
+        // Multicast: one group, every camera on its own RTP/RTCP port pair
+        if (o.multicast)
+        {
+            snprintf(vs->url_buf, sizeof(vs->url_buf), "rtp://%s:%d?ttl=%d", group, group_port + 2 * i, group_ttl);
+            vs->url = vs->url_buf;
+        }
+        else if (!vs->url && nb_streams > 1)
+        {
+            snprintf(vs->url_buf, sizeof(vs->url_buf), "%s/%d", url, i);
+            vs->url = vs->url_buf;
+        }
+        else if (!vs->url)
+            vs->url = url;
+        snprintf(vs->labels, sizeof(vs->labels), "stream=\"%d\"", i);
+        if (nb_streams > 1)
+            snprintf(vs->record_prefix, sizeof(vs->record_prefix), "video-%d", i);
+        else
+            snprintf(vs->record_prefix, sizeof(vs->record_prefix), "video");
+        pthread_mutex_init(&vs->lock, NULL);
+    }
+
+    // Metrics and live control, all registered before the endpoint starts serving
+    metrics_init(&metrics, "video_server", video_control, NULL);
+    for (int i = 0; i < nb_streams; i++)
+    {
+        metrics_set_labels(&metrics, nb_streams > 1 ? streams[i].labels : NULL);
+        video_stream_init_metrics(&streams[i], &metrics);
+        startup_clock_init(&streams[i].startup, &metrics, program_start);
+        if (o.multicast)
+        {
+            char path[64];
+            snprintf(path, sizeof(path), "/%s.sdp", streams[i].record_prefix);
+            streams[i].sdp = metrics_document(&metrics, path, "application/sdp");
+        }
+        streams[i].record.write_delay_us = o.record_write_delay_ms * 1000;
+    }
+    metrics_set_labels(&metrics, NULL);
+    if (nb_streams > 1)
+    {
+        if (work_pool_start(&pool, nb_workers, &metrics, video_worker_init, NULL) < 0)
+        {
+            printf("work_pool_start failed\n");
+            goto end;
+        }
+        pool_started = 1;
+        for (int i = 0; i < nb_streams; i++)
+            streams[i].pool = &pool;
+        printf("%d cameras on %d workers\n", nb_streams, pool.nb_workers);
+    }
+    if (metrics_address && metrics_start(&metrics, metrics_address) < 0)
+    {
+        printf("metrics_start failed on %s\n", metrics_address);
+        goto end;
+    }
+
+    // Print ffmpeg version information
+    printf("ffmpeg version: %s\n", av_version_info());
+
+    // Register all devices
+    avdevice_register_all();
+
+    // A single camera's encoder brings its own threads, started while the stream opens; they
+    // inherit the encode stage from this thread, which then moves on to capture
+    if (nb_streams == 1)
+        sched_apply("encode", -1);
+    for (int i = 0; i < nb_streams; i++)
+    {
+        if (video_stream_open(&streams[i], &o) < 0)
+            goto end;
+        video_stream_place_buffers(&streams[i]);
+    }
+    if (nb_streams == 1)
+        sched_apply("capture", -1);
+
+    signal(SIGINT, request_stop);
+    signal(SIGTERM, request_stop);
+
+    // Start encoding
+    run_start = av_gettime_relative();
+    if (nb_streams == 1)
+    {
+        while (!stop_requested && av_read_frame(streams[0].in_context, streams[0].captured) == 0)
+        {
+            if (video_stream_encode(&streams[0], streams[0].captured, av_gettime_relative(), -1) < 0)
+                goto end;
+        }
+    }
+    else
+    {
+        for (; nb_threads < nb_streams; nb_threads++)
+        {
+            if (pthread_create(&streams[nb_threads].capture_thread, NULL, video_stream_capture_thread,
+                               &streams[nb_threads]) != 0)
+            {
+                printf("pthread_create failed\n");
+                goto end;
+            }
+        }
+    }
+    ret = 0;
 
 end:
+    // Capture stops at end of input or error, then the pool finishes what was handed to it
+    for (int i = 0; i < nb_threads; i++)
+        pthread_join(streams[i].capture_thread, NULL);
+    if (pool_started)
+        work_pool_stop(&pool);
+    if (ret == 0)
+    {
+        printf("Encoding completed in: %f ms\n", (av_gettime_relative() - run_start) / 1000.0);
+
+        // Totals to compare one process for N cameras with N processes
+        getrusage(RUSAGE_SELF, &usage);
+        printf("cpu: %.2f s user, %.2f s system over %.2f s, peak RSS %.1f MB\n",
+               usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6, usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6,
+               (av_gettime_relative() - run_start) / 1e6, usage.ru_maxrss / 1024.0);
+        for (int i = 0; i < nb_streams; i++)
+        {
+            int64_t p99 = metric_quantile(streams[i].m_latency, 0.99);
+            printf("stream %d: %" PRId64 " frames, %" PRId64 " static, %" PRId64 " dropped, %" PRId64 " late, p99 latency %s%.0f ms\n",
+                   i, metric_get(streams[i].m_frames), metric_get(streams[i].m_static), metric_get(streams[i].m_drops),
+                   metric_get(streams[i].m_late),
+                   p99 < 0 ? "> " : "<= ", (p99 < 0 ? metrics_frame_time_bounds_us[METRICS_FRAME_TIME_BUCKETS - 1] : p99) / 1000.0);
+        }
+    }
+
     // Cleanup and free resources
-    if (sws_ctx)
-        sws_freeContext(sws_ctx);
-    if (input_frame)
-        av_frame_free(&input_frame);
-    if (frame_yuv420p)
-        av_frame_free(&frame_yuv420p);
-    if (packet)
-        av_packet_free(&packet);
-    if (codec_context)
-        avcodec_free_context(&codec_context);
-    if (in_context)
-        avformat_close_input(&in_context);
-    if (out_context && !(out_context->oformat->flags & AVFMT_NOFILE))
-        avio_close(out_context->pb);
-    if (out_context)
-        avformat_free_context(out_context);
+    metrics_stop(&metrics);
+    for (int i = 0; i < nb_streams; i++)
+    {
+        video_stream_close(&streams[i]);
+        pthread_mutex_destroy(&streams[i].lock);
+    }
 
     printf("Cleanup completed\n");
-    return 0;
+    return ret;
 }
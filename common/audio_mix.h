@@ -0,0 +1,260 @@
+// Mixer for several remote mics played into one output.
+//
+// Every source decodes on its own thread and pushes interleaved float frames into a ring of its
+// own, which only that thread writes and only the mixer reads, so neither side ever locks. The
+// ring is also the source's jitter buffer: a source joins the mix once it holds target_frames, a
+// source that runs dry is mixed for what it has, padded with silence and primed again, and one
+// that piles up more than max_frames (its sender's clock runs faster than the output's) is cut
+// back to target_frames. Every pull mixes one block of block_frames: each source is scaled by its
+// gain and added (SSE2/AVX2 on x86, NEON on aarch64, plain loops elsewhere), the sum goes through
+// a soft clipper that leaves everything below AUDIO_MIX_KNEE untouched and bends the rest towards
+// full scale, and the result is converted to S16. All memory is allocated before the first pull.
+//
+// Header only so every program keeps building from a single source file.
+#ifndef RTSP_AVBRIDGE_AUDIO_MIX_H
+#define RTSP_AVBRIDGE_AUDIO_MIX_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#ifdef __cplusplus
+}
+#endif
+
+#include "metrics.h"
+#include "sample_convert.h"
+
+#define AUDIO_MIX_MAX_SOURCES 16
+#define AUDIO_MIX_BURST_FRAMES 4096         // Ring room on top of max_frames for one decoded frame
+#define AUDIO_MIX_KNEE 0.6f                 // Soft clipping starts here, about -4.4 dBFS
+
+// Single producer, single consumer ring of interleaved float frames
+typedef struct MixRing
+{
+    float *data;
+    int64_t capacity;                       // Frames, a power of two
+    int channels;
+    volatile int64_t write_pos;             // Frames ever written, stored by the source thread only
+    volatile int64_t read_pos;              // Frames ever mixed or skipped, stored by the mixer only
+} MixRing;
+
+typedef struct MixSource
+{
+    MixRing ring;
+    float gain;                             // Linear
+    int primed;                             // Mixer side: holding enough to be mixed
+    char labels[32];                        // source="n", kept here for the metrics registry
+    Metric *m_fill, *m_underruns, *m_skipped, *m_dropped;
+} MixSource;
+
+typedef struct AudioMixer
+{
+    int channels;
+    int block_frames;
+    int64_t target_frames;
+    int64_t max_frames;
+    MixSource sources[AUDIO_MIX_MAX_SOURCES];
+    int nb_sources;
+    float *acc;                             // One block, interleaved
+    SampleDither dither;
+    Metric *m_clipped;
+} AudioMixer;
+
+static inline int audio_mixer_init(AudioMixer *m, MetricsServer *metrics, int channels, int block_frames, int target_frames)
+{
+    memset(m, 0, sizeof(*m));
+    m->channels = channels;
+    m->block_frames = block_frames;
+    m->target_frames = target_frames > block_frames ? target_frames : block_frames;
+    m->max_frames = 2 * m->target_frames + block_frames;
+    m->acc = (float *)av_mallocz((size_t)block_frames * channels * sizeof(float));
+    if (!m->acc)
+        return AVERROR(ENOMEM);
+    sample_dither_init(&m->dither, 1);
+    m->m_clipped = metrics_counter(metrics, "mix_clipped_samples_total", "Mixed samples past the soft clipping knee");
+    return 0;
+}
+
+// Add a source with its gain in dB; returns its index or a negative AVERROR. Before the first pull.
+static inline int audio_mixer_add_source(AudioMixer *m, MetricsServer *metrics, float gain_db)
+{
+    MixSource *s;
+    int64_t capacity = 1024;
+
+    if (m->nb_sources >= AUDIO_MIX_MAX_SOURCES)
+        return AVERROR(EINVAL);
+    s = &m->sources[m->nb_sources];
+    while (capacity < m->max_frames + AUDIO_MIX_BURST_FRAMES)
+        capacity *= 2;
+    s->ring.data = (float *)av_mallocz((size_t)capacity * m->channels * sizeof(float));
+    if (!s->ring.data)
+        return AVERROR(ENOMEM);
+    s->ring.capacity = capacity;
+    s->ring.channels = m->channels;
+    s->gain = powf(10.0f, gain_db / 20.0f);
+    snprintf(s->labels, sizeof(s->labels), "source=\"%d\"", m->nb_sources);
+    metrics_set_labels(metrics, s->labels);
+    s->m_fill = metrics_gauge(metrics, "mix_buffered_frames", "Frames waiting in the source's jitter buffer");
+    s->m_underruns = metrics_counter(metrics, "mix_underruns_total", "Blocks the source could not fill");
+    s->m_skipped = metrics_counter(metrics, "mix_skipped_frames_total", "Frames skipped to bring the source back to the target");
+    s->m_dropped = metrics_counter(metrics, "mix_dropped_frames_total", "Decoded frames that found the jitter buffer full");
+    metrics_set_labels(metrics, NULL);
+    return m->nb_sources++;
+}
+
+static inline void audio_mixer_free(AudioMixer *m)
+{
+    for (int i = 0; i < m->nb_sources; i++)
+        av_freep(&m->sources[i].ring.data);
+    av_freep(&m->acc);
+    m->nb_sources = 0;
+}
+
+// Source thread: queue decoded frames; returns how many fit, the rest is dropped
+static inline int audio_mixer_push(AudioMixer *m, int index, const float *src, int frames)
+{
+    MixSource *s = &m->sources[index];
+    MixRing *r = &s->ring;
+    int64_t write = metrics_atomic_load(&r->write_pos);
+    int64_t space = r->capacity - (write - metrics_atomic_load_acquire(&r->read_pos));
+    int n = frames < space ? frames : (int)space;
+    int64_t offset = write & (r->capacity - 1);
+    int first = r->capacity - offset < n ? (int)(r->capacity - offset) : n;
+
+    memcpy(r->data + offset * r->channels, src, (size_t)first * r->channels * sizeof(float));
+    memcpy(r->data, src + (size_t)first * r->channels, (size_t)(n - first) * r->channels * sizeof(float));
+    metrics_atomic_exchange(&r->write_pos, write + n);
+    if (n < frames)
+        metric_add(s->m_dropped, frames - n);
+    return n;
+}
+
+// acc += src * gain over n samples
+static inline void audio_mix_add(float *acc, const float *src, float gain, int n)
+{
+    int i = 0;
+#if defined(SC_AVX2)
+    __m256 g8 = _mm256_set1_ps(gain);
+    for (; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(acc + i, _mm256_add_ps(_mm256_loadu_ps(acc + i), _mm256_mul_ps(_mm256_loadu_ps(src + i), g8)));
+#endif
+#if defined(SC_SSE2)
+    __m128 g4 = _mm_set1_ps(gain);
+    for (; i + 4 <= n; i += 4)
+        _mm_storeu_ps(acc + i, _mm_add_ps(_mm_loadu_ps(acc + i), _mm_mul_ps(_mm_loadu_ps(src + i), g4)));
+#elif defined(SC_NEON)
+    for (; i + 4 <= n; i += 4)
+        vst1q_f32(acc + i, vmlaq_n_f32(vld1q_f32(acc + i), vld1q_f32(src + i), gain));
+#endif
+    for (; i < n; i++)
+        acc[i] += src[i] * gain;
+}
+
+// Below the knee a sample is left as it is; above it, the excess e (in units of the headroom
+// 1 - knee) is mapped to e / (1 + e), which starts with slope 1 and never reaches full scale.
+// Returns how many samples were past the knee.
+static inline int audio_mix_soft_clip(float *buf, int n)
+{
+    const float knee = AUDIO_MIX_KNEE, room = 1.0f - AUDIO_MIX_KNEE;
+    int clipped = 0, i = 0;
+#if defined(SC_SSE2)
+    const __m128 sign = _mm_set1_ps(-0.0f), k = _mm_set1_ps(knee), r = _mm_set1_ps(room);
+    const __m128 inv = _mm_set1_ps(1.0f / room), one = _mm_set1_ps(1.0f);
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128 v = _mm_loadu_ps(buf + i);
+        __m128 a = _mm_andnot_ps(sign, v);
+        int over = _mm_movemask_ps(_mm_cmpgt_ps(a, k));
+        if (!over)
+            continue;
+        // Bits set in a 4-bit mask, looked up in a nibble table
+        clipped += (int)((0x4332322132212110ull >> (over * 4)) & 0xf);
+        __m128 e = _mm_mul_ps(_mm_max_ps(_mm_sub_ps(a, k), _mm_setzero_ps()), inv);
+        __m128 y = _mm_add_ps(_mm_min_ps(a, k), _mm_mul_ps(r, _mm_div_ps(e, _mm_add_ps(one, e))));
+        _mm_storeu_ps(buf + i, _mm_or_ps(y, _mm_and_ps(sign, v)));
+    }
+#elif defined(SC_NEON)
+    const float32x4_t k = vdupq_n_f32(knee), one = vdupq_n_f32(1.0f);
+    for (; i + 4 <= n; i += 4)
+    {
+        float32x4_t v = vld1q_f32(buf + i);
+        float32x4_t a = vabsq_f32(v);
+        uint32x4_t over = vcgtq_f32(a, k);
+        if (!vmaxvq_u32(over))
+            continue;
+        clipped += (int)vaddvq_u32(vshrq_n_u32(over, 31));
+        float32x4_t e = vmulq_n_f32(vmaxq_f32(vsubq_f32(a, k), vdupq_n_f32(0.0f)), 1.0f / room);
+        float32x4_t y = vaddq_f32(vminq_f32(a, k), vmulq_n_f32(vdivq_f32(e, vaddq_f32(one, e)), room));
+        vst1q_f32(buf + i, vbslq_f32(vcltq_f32(v, vdupq_n_f32(0.0f)), vnegq_f32(y), y));
+    }
+#endif
+    for (; i < n; i++)
+    {
+        float a = fabsf(buf[i]);
+        if (a <= knee)
+            continue;
+        float e = (a - knee) / room;
+        float y = knee + room * e / (1.0f + e);
+        buf[i] = buf[i] < 0 ? -y : y;
+        clipped++;
+    }
+    return clipped;
+}
+
+// Mixer thread: mix one block of every source into out (block_frames interleaved S16 frames).
+// Returns the number of sources that contributed.
+static inline int audio_mixer_pull(AudioMixer *m, int16_t *out)
+{
+    const int n = m->block_frames * m->channels;
+    const float *acc = m->acc;
+    int active = 0;
+
+    memset(m->acc, 0, (size_t)n * sizeof(float));
+    for (int i = 0; i < m->nb_sources; i++)
+    {
+        MixSource *s = &m->sources[i];
+        MixRing *r = &s->ring;
+        int64_t read = metrics_atomic_load(&r->read_pos);
+        int64_t fill = metrics_atomic_load_acquire(&r->write_pos) - read;
+
+        metric_set(s->m_fill, fill);
+        if (!s->primed)
+        {
+            if (fill < m->target_frames)
+                continue;
+            s->primed = 1;
+        }
+        if (fill > m->max_frames)
+        {
+            metric_add(s->m_skipped, fill - m->target_frames);
+            read += fill - m->target_frames;
+            fill = m->target_frames;
+        }
+        if (fill < m->block_frames)
+        {
+            // Play out what is left and wait for the buffer to fill up again
+            metric_add(s->m_underruns, 1);
+            s->primed = 0;
+        }
+        int frames = fill < m->block_frames ? (int)fill : m->block_frames;
+        int64_t offset = read & (r->capacity - 1);
+        int first = r->capacity - offset < frames ? (int)(r->capacity - offset) : frames;
+        audio_mix_add(m->acc, r->data + offset * m->channels, s->gain, first * m->channels);
+        audio_mix_add(m->acc + first * m->channels, r->data, s->gain, (frames - first) * m->channels);
+        metrics_atomic_exchange(&r->read_pos, read + frames);
+        active += frames > 0;
+    }
+    metric_add(m->m_clipped, audio_mix_soft_clip(m->acc, n));
+    // Interleaved samples convert like one long mono channel
+    sc_fltp_to_s16(out, &acc, 1, n, &m->dither);
+    return active;
+}
+
+#endif // RTSP_AVBRIDGE_AUDIO_MIX_H
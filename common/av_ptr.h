@@ -0,0 +1,39 @@
+// Owning pointers for the FFmpeg objects of the C++ clients.
+//
+// Each is a std::unique_ptr whose deleter calls the matching FFmpeg free function, so an object is
+// released on every return and every reconnect without a cleanup block per exit. Functions that
+// take a pointer to the pointer (avformat_open_input, swr_alloc_set_opts2) fill a raw pointer that
+// is then handed to reset(). Other libraries' objects use AvPtr with their own free function.
+//
+// Header only so every program keeps building from a single source file.
+#ifndef RTSP_AVBRIDGE_AV_PTR_H
+#define RTSP_AVBRIDGE_AV_PTR_H
+
+#include <memory>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+// Deleter for the free functions that take the address of the pointer and clear it
+template <typename T, void (*Free)(T**)>
+struct AvFreeRef {
+    void operator()(T* p) const { Free(&p); }
+};
+
+// Deleter for the free functions that take the pointer itself
+template <typename T, void (*Free)(T*)>
+struct AvFree {
+    void operator()(T* p) const { Free(p); }
+};
+
+template <typename T, void (*Free)(T**)>
+using AvPtr = std::unique_ptr<T, AvFreeRef<T, Free>>;
+
+using FormatContextPtr = AvPtr<AVFormatContext, avformat_close_input>;
+using CodecContextPtr = AvPtr<AVCodecContext, avcodec_free_context>;
+using PacketPtr = AvPtr<AVPacket, av_packet_free>;
+using FramePtr = AvPtr<AVFrame, av_frame_free>;
+
+#endif // RTSP_AVBRIDGE_AV_PTR_H
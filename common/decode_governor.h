@@ -0,0 +1,115 @@
+// Decode load governor for the video client.
+//
+// Each packet's decode and conversion time is compared with the frame interval. When the smoothed
+// load stays high the client steps down one level at a time: first the deblocking filter is
+// skipped, then frames nothing else references are not decoded at all, then the BGR conversion
+// uses the cheapest scaler. Once the load has stayed low for a while it steps back up. A step up
+// that is undone right away doubles the time to wait before the next one, so a host sitting on
+// the edge does not flip between two levels every few seconds.
+//
+// Header only so every program keeps building from a single source file.
+#ifndef RTSP_AVBRIDGE_DECODE_GOVERNOR_H
+#define RTSP_AVBRIDGE_DECODE_GOVERNOR_H
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <libavcodec/avcodec.h>
+#include <libswscale/swscale.h>
+#ifdef __cplusplus
+}
+#endif
+
+enum DecodeLevel
+{
+    DECODE_FULL,
+    DECODE_SKIP_LOOP_FILTER,
+    DECODE_SKIP_NONREF,
+    DECODE_FAST_CONVERT,
+    DECODE_LEVELS
+};
+
+#define DECODE_GOVERNOR_HIGH 0.85           // Load (busy time / frame interval) that is too close to falling behind
+#define DECODE_GOVERNOR_LOW 0.6             // Load with room for the next better level
+#define DECODE_GOVERNOR_ESCALATE_FRAMES 15
+#define DECODE_GOVERNOR_RECOVER_FRAMES 90
+#define DECODE_GOVERNOR_RECOVER_MAX_FRAMES 1800
+
+typedef struct DecodeGovernor
+{
+    int level;
+    int64_t budget_us;              // Frame interval
+    double load;                    // Smoothed busy time / budget
+    int over, under;                // Consecutive packets above HIGH / below LOW
+    int recover_frames;             // Packets below LOW needed to step back up
+    int64_t packets;
+    int64_t last_recover;           // Packet count at the last step up
+} DecodeGovernor;
+
+static inline void decode_governor_init(DecodeGovernor *g, int fps)
+{
+    memset(g, 0, sizeof(*g));
+    g->budget_us = 1000000 / (fps > 0 ? fps : 30);
+    g->recover_frames = DECODE_GOVERNOR_RECOVER_FRAMES;
+    g->last_recover = -DECODE_GOVERNOR_RECOVER_MAX_FRAMES;
+}
+
+// Feed the busy time of one packet; returns 1 when the level changed
+static inline int decode_governor_update(DecodeGovernor *g, int64_t busy_us)
+{
+    g->packets++;
+    g->load += 0.1 * ((double)busy_us / g->budget_us - g->load);
+    if (g->load > DECODE_GOVERNOR_HIGH)
+    {
+        g->over++;
+        g->under = 0;
+    }
+    else if (g->load < DECODE_GOVERNOR_LOW)
+    {
+        g->under++;
+        g->over = 0;
+    }
+    else
+    {
+        g->over = g->under = 0;
+    }
+
+    if (g->over >= DECODE_GOVERNOR_ESCALATE_FRAMES && g->level < DECODE_LEVELS - 1)
+    {
+        // The last step up was undone right away: wait longer next time. One that held for a
+        // minute starts over; checking that when stepping up instead would always find a minute
+        // once the wait itself is at its maximum
+        if (g->packets - g->last_recover < 2 * DECODE_GOVERNOR_RECOVER_FRAMES)
+            g->recover_frames = FFMIN(g->recover_frames * 2, DECODE_GOVERNOR_RECOVER_MAX_FRAMES);
+        else if (g->packets - g->last_recover > DECODE_GOVERNOR_RECOVER_MAX_FRAMES)
+            g->recover_frames = DECODE_GOVERNOR_RECOVER_FRAMES;
+        g->level++;
+        g->over = 0;
+        return 1;
+    }
+    if (g->under >= g->recover_frames && g->level > 0)
+    {
+        g->level--;
+        g->under = 0;
+        g->last_recover = g->packets;
+        return 1;
+    }
+    return 0;
+}
+
+// Decoder side of the level, can be changed between packets
+static inline void decode_governor_apply(const DecodeGovernor *g, AVCodecContext *ctx)
+{
+    ctx->skip_loop_filter = g->level >= DECODE_SKIP_LOOP_FILTER ? AVDISCARD_ALL : AVDISCARD_DEFAULT;
+    ctx->skip_frame = g->level >= DECODE_SKIP_NONREF ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+}
+
+static inline int decode_governor_sws_flags(const DecodeGovernor *g)
+{
+    return g->level >= DECODE_FAST_CONVERT ? SWS_FAST_BILINEAR : SWS_BICUBIC;
+}
+
+#endif // RTSP_AVBRIDGE_DECODE_GOVERNOR_H
@@ -0,0 +1,110 @@
+// Voice activity detection and comfort noise for discontinuous transmission (DTX).
+//
+// The server measures each frame's level against a noise floor that follows the background: it
+// drops quickly when the room gets quieter and rises slowly, so a steady fan or hum becomes the
+// floor while speech, which is well above it and never stationary for long, does not. Frames
+// more than threshold_db over the floor are speech; a hangover keeps the talk spurt open through
+// short pauses and word endings. During silence the server only sends an occasional frame of the
+// background (a silence descriptor, SID) and the client plays comfort noise at that level in
+// between instead of decoding anything.
+//
+// Header only so every program keeps building from a single source file.
+#ifndef RTSP_AVBRIDGE_DTX_H
+#define RTSP_AVBRIDGE_DTX_H
+
+#include <math.h>
+#include <stdint.h>
+
+#define DTX_MIN_DB -100.0f
+
+typedef struct Vad
+{
+    float floor_db;                 // Background level estimate
+    float threshold_db;             // Margin over the floor that counts as speech
+    float min_speech_db;            // Anything quieter is never speech
+    float rise_db;                  // How fast the floor may rise, per frame
+    int hangover_frames;            // Frames still sent after the last speech frame
+    int hangover;
+    int speech;                     // Last frame on its own, without the hangover
+} Vad;
+
+static inline void vad_init(Vad *v, float frame_seconds)
+{
+    v->floor_db = 0.0f;                           // Falls to the real floor within a few frames
+    v->threshold_db = 6.0f;
+    v->min_speech_db = -55.0f;
+    v->rise_db = 1.0f * frame_seconds;            // 1 dB per second
+    v->hangover_frames = (int)(0.3f / frame_seconds + 0.5f);
+    v->hangover = v->hangover_frames;             // Start talking, until the floor has settled
+    v->speech = 0;
+}
+
+// RMS level of planar float samples in dBFS
+static inline float dtx_level_db(const float *const *planes, int channels, int nb_samples)
+{
+    double sum = 0.0;
+    for (int ch = 0; ch < channels; ch++)
+        for (int i = 0; i < nb_samples; i++)
+            sum += (double)planes[ch][i] * planes[ch][i];
+    sum /= (double)channels * nb_samples;
+    return sum > 1e-10 ? (float)(10.0 * log10(sum)) : DTX_MIN_DB;
+}
+
+// Feed one frame's level; returns 1 while the frame has to be sent (speech or hangover)
+static inline int vad_update(Vad *v, float level_db)
+{
+    int speech = level_db > v->floor_db + v->threshold_db && level_db > v->min_speech_db;
+
+    v->speech = speech;
+    // Rising also during speech lets the floor climb out of a level change it took for speech
+    if (level_db < v->floor_db)
+        v->floor_db += 0.3f * (level_db - v->floor_db);
+    else
+        v->floor_db = fminf(v->floor_db + v->rise_db, level_db);
+    if (speech)
+        v->hangover = v->hangover_frames;
+    else if (v->hangover > 0)
+        v->hangover--;
+    return speech || v->hangover > 0;
+}
+
+// Low-passed white noise, which sounds closer to room tone than flat white noise
+typedef struct ComfortNoise
+{
+    uint32_t seed;
+    float gain;                     // Peak of the white source, set from the SID level
+    float lp;
+} ComfortNoise;
+
+static inline void comfort_noise_init(ComfortNoise *cn)
+{
+    cn->seed = 0x9e3779b9u;
+    cn->gain = 0.0f;
+    cn->lp = 0.0f;
+}
+
+static inline void comfort_noise_set_level(ComfortNoise *cn, float level_db)
+{
+    // Uniform noise in [-g, g] has an RMS of g / sqrt(3); the one-pole low pass below keeps about
+    // 1 / sqrt(3) of it
+    cn->gain = level_db <= DTX_MIN_DB ? 0.0f : powf(10.0f, level_db / 20.0f) * 3.0f;
+}
+
+// Interleaved S16 comfort noise, the same in every channel
+static inline void comfort_noise_s16(ComfortNoise *cn, int16_t *out, int channels, int nb_samples)
+{
+    for (int i = 0; i < nb_samples; i++)
+    {
+        cn->seed ^= cn->seed << 13;
+        cn->seed ^= cn->seed >> 17;
+        cn->seed ^= cn->seed << 5;
+        float white = ((float)(cn->seed >> 8) / 8388608.0f - 1.0f) * cn->gain;
+        cn->lp += 0.5f * (white - cn->lp);
+        float v = cn->lp * 32767.0f;
+        int16_t s = (int16_t)(v > 32767.0f ? 32767.0f : v < -32768.0f ? -32768.0f : v);
+        for (int ch = 0; ch < channels; ch++)
+            out[i * channels + ch] = s;
+    }
+}
+
+#endif // RTSP_AVBRIDGE_DTX_H
@@ -0,0 +1,89 @@
+// Startup of the servers: what the time to the first packet is spent on.
+//
+// A capture device opened with explicit parameters already describes its stream once
+// avformat_open_input() returns: raw video with its size and pixel format, PCM with its rate and
+// channel count. avformat_find_stream_info() would then only read frames to learn what is known,
+// which on a camera means waiting out the sensor start-up several times over, so
+// capture_needs_probe() tells when it can be skipped.
+//
+// StartupClock times the phases (device open, probe, encoder open, output session) and, when the
+// first packet has been written, prints them with the wall-clock time since the program started.
+// With -F the device opens on its own thread while the encoder and the RTSP session are set up,
+// so the phases overlap and add up to more than the total.
+//
+// Header only so every program keeps building from a single source file.
+#ifndef RTSP_AVBRIDGE_FAST_START_H
+#define RTSP_AVBRIDGE_FAST_START_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <libavformat/avformat.h>
+#include <libavutil/time.h>
+
+#include "metrics.h"
+
+enum StartupPhase
+{
+    STARTUP_DEVICE,                 // avformat_open_input on the capture device
+    STARTUP_PROBE,                  // avformat_find_stream_info, when needed
+    STARTUP_ENCODER,                // avcodec_open2
+    STARTUP_OUTPUT,                 // Output open and header: RTSP ANNOUNCE/SETUP/RECORD
+    STARTUP_PHASES
+};
+
+typedef struct StartupClock
+{
+    int64_t start_us;               // av_gettime_relative() when the program started
+    int64_t phase_us[STARTUP_PHASES];
+    int64_t first_packet_us;        // Since start_us, 0 until the first packet is written
+    Metric *m_first_packet;
+} StartupClock;
+
+// Whether the demuxer left anything for avformat_find_stream_info() to find out
+static inline int capture_needs_probe(const AVFormatContext *s)
+{
+    for (unsigned int i = 0; i < s->nb_streams; i++)
+    {
+        const AVCodecParameters *par = s->streams[i]->codecpar;
+        if (par->codec_type == AVMEDIA_TYPE_VIDEO &&
+            (par->codec_id != AV_CODEC_ID_RAWVIDEO || !par->width || !par->height || par->format < 0))
+            return 1;
+        if (par->codec_type == AVMEDIA_TYPE_AUDIO &&
+            (!av_get_bits_per_sample(par->codec_id) || !par->sample_rate || !par->channels || par->format < 0))
+            return 1;
+        if (par->codec_type != AVMEDIA_TYPE_VIDEO && par->codec_type != AVMEDIA_TYPE_AUDIO)
+            return 1;
+    }
+    return 0;
+}
+
+static inline void startup_clock_init(StartupClock *c, MetricsServer *metrics, int64_t start_us)
+{
+    memset(c, 0, sizeof(*c));
+    c->start_us = start_us;
+    c->m_first_packet = metrics_gauge(metrics, "time_to_first_packet_ms", "Program start to the first packet written");
+}
+
+// End a phase that began at since_us; returns the current time for the next one
+static inline int64_t startup_clock_phase(StartupClock *c, enum StartupPhase phase, int64_t since_us)
+{
+    int64_t now = av_gettime_relative();
+    c->phase_us[phase] = now - since_us;
+    return now;
+}
+
+// Call after every packet written; only the first one counts
+static inline void startup_clock_first_packet(StartupClock *c, const char *name)
+{
+    if (c->first_packet_us)
+        return;
+    c->first_packet_us = av_gettime_relative() - c->start_us;
+    metric_set(c->m_first_packet, c->first_packet_us / 1000);
+    printf("%s: first packet %.1f ms after start (device %.1f ms, probe %.1f ms, encoder %.1f ms, output %.1f ms)\n",
+           name, c->first_packet_us / 1000.0, c->phase_us[STARTUP_DEVICE] / 1000.0, c->phase_us[STARTUP_PROBE] / 1000.0,
+           c->phase_us[STARTUP_ENCODER] / 1000.0, c->phase_us[STARTUP_OUTPUT] / 1000.0);
+}
+
+#endif // RTSP_AVBRIDGE_FAST_START_H
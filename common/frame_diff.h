@@ -0,0 +1,160 @@
+// Block change detection on raw capture frames.
+//
+// Each frame is cut into blocks and every block is compared with the same block of a reference
+// frame by sum of absolute differences (SSE2/AVX2 psadbw on x86, NEON on aarch64, plain loops
+// elsewhere). Blocks whose SAD passes the threshold are marked dirty and copied into the
+// reference; the others keep their old reference content, so slow drift still adds up until the
+// block counts as changed. Works on any packed format, sizes are in bytes.
+//
+// Header only so every program keeps building from a single source file.
+#ifndef RTSP_AVBRIDGE_FRAME_DIFF_H
+#define RTSP_AVBRIDGE_FRAME_DIFF_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <libavutil/mem.h>
+#include <libavutil/error.h>
+#ifdef __cplusplus
+}
+#endif
+
+#if defined(__AVX2__)
+#define FD_AVX2 1
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FD_SSE2 1
+#include <emmintrin.h>
+#ifdef FD_AVX2
+#include <immintrin.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define FD_NEON 1
+#include <arm_neon.h>
+#endif
+
+typedef struct FrameDiff
+{
+    int width;                      // Row length in bytes
+    int height;
+    int block_w;                    // Block width in bytes, multiple of 16
+    int block_h;
+    int cols, rows;
+    int64_t threshold;              // Block SAD above which the block has changed
+    uint8_t *ref;                   // Reference frame, width bytes per row
+    uint8_t *dirty;                 // cols * rows flags from the last frame_diff_update()
+    int nb_dirty;
+    int has_ref;
+} FrameDiff;
+
+// SAD of one row segment of n bytes
+static inline int64_t fd_row_sad(const uint8_t *a, const uint8_t *b, int n)
+{
+    int64_t sad = 0;
+    int i = 0;
+#if defined(FD_AVX2)
+    __m256i acc = _mm256_setzero_si256();
+    for (; i + 32 <= n; i += 32)
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                                    _mm256_loadu_si256((const __m256i *)(b + i))));
+    __m128i acc128 = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    for (; i + 16 <= n; i += 16)
+        acc128 = _mm_add_epi64(acc128, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(a + i)),
+                                                    _mm_loadu_si128((const __m128i *)(b + i))));
+    sad = _mm_cvtsi128_si32(acc128) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(acc128, acc128));
+#elif defined(FD_SSE2)
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 16 <= n; i += 16)
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(a + i)),
+                                              _mm_loadu_si128((const __m128i *)(b + i))));
+    sad = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(acc, acc));
+#elif defined(FD_NEON)
+    uint32x4_t acc = vdupq_n_u32(0);
+    for (; i + 16 <= n; i += 16)
+        acc = vpadalq_u16(acc, vpaddlq_u8(vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i))));
+    sad = vaddvq_u32(acc);
+#endif
+    // abs() of the difference, not a compare: on noisy pixels a branch is mispredicted half the time
+    for (; i < n; i++)
+        sad += abs(a[i] - b[i]);
+    return sad;
+}
+
+// SAD of a w x h block, giving up as soon as it is over limit
+static inline int64_t fd_block_sad(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride,
+                                   int w, int h, int64_t limit)
+{
+    int64_t sad = 0;
+    for (int y = 0; y < h && sad <= limit; y++)
+        sad += fd_row_sad(a + (ptrdiff_t)y * a_stride, b + (ptrdiff_t)y * b_stride, w);
+    return sad;
+}
+
+// threshold is the mean absolute difference per byte a block must exceed to count as changed
+static inline int frame_diff_init(FrameDiff *d, int width, int height, int block_w, int block_h, int threshold)
+{
+    memset(d, 0, sizeof(*d));
+    d->width = width;
+    d->height = height;
+    d->block_w = block_w;
+    d->block_h = block_h;
+    d->cols = (width + block_w - 1) / block_w;
+    d->rows = (height + block_h - 1) / block_h;
+    d->threshold = (int64_t)threshold * block_w * block_h;
+    d->ref = (uint8_t *)av_malloc((size_t)width * height);
+    d->dirty = (uint8_t *)av_malloc((size_t)d->cols * d->rows);
+    if (!d->ref || !d->dirty)
+        return AVERROR(ENOMEM);
+    return 0;
+}
+
+// Compare src with the reference, mark and take over the changed blocks. Returns the number of dirty
+// blocks; the first frame is all dirty.
+static inline int frame_diff_update(FrameDiff *d, const uint8_t *src, int stride)
+{
+    d->nb_dirty = 0;
+    for (int r = 0; r < d->rows; r++)
+    {
+        int y = r * d->block_h;
+        int h = y + d->block_h <= d->height ? d->block_h : d->height - y;
+        for (int c = 0; c < d->cols; c++)
+        {
+            int x = c * d->block_w;
+            int w = x + d->block_w <= d->width ? d->block_w : d->width - x;
+            const uint8_t *s = src + (ptrdiff_t)y * stride + x;
+            uint8_t *ref = d->ref + (ptrdiff_t)y * d->width + x;
+            int dirty = !d->has_ref ||
+                        fd_block_sad(s, stride, ref, d->width, w, h, d->threshold) > d->threshold;
+            d->dirty[r * d->cols + c] = (uint8_t)dirty;
+            if (!dirty)
+                continue;
+            d->nb_dirty++;
+            for (int i = 0; i < h; i++)
+                memcpy(ref + (ptrdiff_t)i * d->width, s + (ptrdiff_t)i * stride, w);
+        }
+    }
+    d->has_ref = 1;
+    return d->nb_dirty;
+}
+
+// Whether any block overlapping rows [y, y + h) changed in the last update
+static inline int frame_diff_rows_dirty(const FrameDiff *d, int y, int h)
+{
+    int r1 = (y + h + d->block_h - 1) / d->block_h;
+    for (int r = y / d->block_h; r < r1 && r < d->rows; r++)
+        if (memchr(d->dirty + r * d->cols, 1, d->cols))
+            return 1;
+    return 0;
+}
+
+static inline void frame_diff_free(FrameDiff *d)
+{
+    av_freep(&d->ref);
+    av_freep(&d->dirty);
+}
+
+#endif // RTSP_AVBRIDGE_FRAME_DIFF_H
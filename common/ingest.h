@@ -0,0 +1,151 @@
+// RTSP ingest profiles for the clients.
+//
+// The default profile is what the clients always did: RTSP interleaved over TCP with up to a second
+// of demuxer buffering, which survives any network. The low-latency profile asks for RTP over UDP
+// (the demuxer still retries over TCP if no UDP packet ever arrives), bounds the RTP reorder queue
+// to a few packets and milliseconds, turns off input buffering and takes the codec parameters from
+// the SDP instead of probing. The clients then drop decoded frames that arrive later than they are
+// worth, and reconnect over TCP when UDP turns out to lose packets.
+//
+// Instead of an RTSP URL the clients also take the SDP of a server's multicast output, as a file or
+// from the server's metrics endpoint (http://host:9100/video.sdp). The demuxer then joins the group
+// named in the SDP and there is no session and no TCP to fall back to.
+//
+// Header only so every program keeps building from a single source file.
+#ifndef RTSP_AVBRIDGE_INGEST_H
+#define RTSP_AVBRIDGE_INGEST_H
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <libavformat/avformat.h>
+#include <libavutil/dict.h>
+#ifdef __cplusplus
+}
+#endif
+
+#define INGEST_REORDER_PACKETS "16"
+#define INGEST_REORDER_DELAY_US "50000"
+#define INGEST_UDP_BUFFER_BYTES "1048576"          // Room for a keyframe burst, adds no delay
+#define INGEST_TIMEOUT_US "2000000"
+
+#define INGEST_LOSS_WINDOW_US 5000000
+#define INGEST_LOSS_MIN_ERRORS 3
+#define INGEST_LOSS_MAX_PERCENT 2
+
+static inline void ingest_set_options(AVDictionary **options, int low_latency, int force_tcp)
+{
+    if (!low_latency)
+    {
+        av_dict_set(options, "rtsp_transport", "tcp", 0);
+        av_dict_set(options, "max_delay", "1000000", 0);    // Reduce maximum delay to 1 second
+        av_dict_set(options, "buffer_size", "102400", 0);   // Limit buffer size
+        return;
+    }
+    av_dict_set(options, "rtsp_transport", force_tcp ? "tcp" : "udp+tcp", 0);
+    av_dict_set(options, "reorder_queue_size", INGEST_REORDER_PACKETS, 0);
+    av_dict_set(options, "max_delay", INGEST_REORDER_DELAY_US, 0);
+    av_dict_set(options, "buffer_size", INGEST_UDP_BUFFER_BYTES, 0);
+    av_dict_set(options, "timeout", INGEST_TIMEOUT_US, 0);
+    av_dict_set(options, "fflags", "nobuffer", 0);
+    av_dict_set(options, "probesize", "32", 0);
+    av_dict_set(options, "analyzeduration", "100000", 0);
+}
+
+// Whether url names an SDP, by its extension, rather than an RTSP session
+static inline int ingest_is_sdp(const char *url)
+{
+    size_t n = strlen(url);
+    return n > 4 && strcmp(url + n - 4, ".sdp") == 0;
+}
+
+// Options for opening an SDP. The demuxer opens the RTP sockets itself, which needs the protocols
+// whitelisted; the receive buffer takes a keyframe burst, which a multicast receiver cannot ask
+// to have resent.
+static inline void ingest_set_sdp_options(AVDictionary **options, int low_latency)
+{
+    av_dict_set(options, "protocol_whitelist", "file,http,https,tcp,tls,udp,rtp", 0);
+    av_dict_set(options, "buffer_size", INGEST_UDP_BUFFER_BYTES, 0);
+    if (!low_latency)
+    {
+        av_dict_set(options, "max_delay", "1000000", 0);
+        return;
+    }
+    av_dict_set(options, "reorder_queue_size", INGEST_REORDER_PACKETS, 0);
+    av_dict_set(options, "max_delay", INGEST_REORDER_DELAY_US, 0);
+    av_dict_set(options, "fflags", "nobuffer", 0);
+    av_dict_set(options, "probesize", "32", 0);
+    av_dict_set(options, "analyzeduration", "100000", 0);
+}
+
+// Whether avformat_find_stream_info() is still needed. The low-latency profile trusts what the SDP
+// says about each stream (codec, extradata, audio rate and channels); the decoder finds the rest.
+static inline int ingest_needs_probe(const AVFormatContext *s, int low_latency)
+{
+    if (!low_latency)
+        return 1;
+    for (unsigned int i = 0; i < s->nb_streams; i++)
+    {
+        const AVCodecParameters *par = s->streams[i]->codecpar;
+        if (par->codec_id == AV_CODEC_ID_NONE)
+            return 1;
+        if (par->codec_type == AVMEDIA_TYPE_AUDIO && (!par->sample_rate || !par->ch_layout.nb_channels))
+            return 1;
+    }
+    return 0;
+}
+
+// How late a frame is compared with the earliest any frame has arrived relative to its timestamp.
+// The baseline creeps up by 100 ppm of elapsed time, so clock drift between sender and receiver
+// does not add up to lateness, and a timestamp jump of more than 10 s starts a new baseline.
+typedef struct IngestClock
+{
+    int64_t offset_us;              // Smallest arrival time minus PTS seen
+    int64_t last_us;
+} IngestClock;
+
+static inline void ingest_clock_init(IngestClock *c)
+{
+    c->offset_us = AV_NOPTS_VALUE;
+    c->last_us = AV_NOPTS_VALUE;
+}
+
+static inline int64_t ingest_clock_lateness(IngestClock *c, int64_t pts_us, int64_t now_us)
+{
+    int64_t delay = now_us - pts_us;
+
+    if (c->offset_us != AV_NOPTS_VALUE)
+        c->offset_us += (now_us - c->last_us) / 10000;
+    c->last_us = now_us;
+    if (c->offset_us == AV_NOPTS_VALUE || delay < c->offset_us || delay - c->offset_us > 10000000)
+        c->offset_us = delay;
+    return delay - c->offset_us;
+}
+
+// Packets that failed to decode (or decoded into corrupt frames) over a window, the only sign of
+// RTP loss the public API gives
+typedef struct IngestLoss
+{
+    int64_t window_start_us;
+    int packets;
+    int errors;
+} IngestLoss;
+
+// Count one packet; returns 1 once the current window has lost too much for UDP to be worth it
+static inline int ingest_loss_update(IngestLoss *l, int error, int64_t now_us)
+{
+    if (now_us - l->window_start_us > INGEST_LOSS_WINDOW_US)
+    {
+        l->window_start_us = now_us;
+        l->packets = 0;
+        l->errors = 0;
+    }
+    l->packets++;
+    l->errors += error != 0;
+    return l->errors >= INGEST_LOSS_MIN_ERRORS && l->errors * 100 > l->packets * INGEST_LOSS_MAX_PERCENT;
+}
+
+#endif // RTSP_AVBRIDGE_INGEST_H
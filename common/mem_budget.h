@@ -0,0 +1,174 @@
+// Memory budget for the video server: a fixed pool for the encoder's output packets and estimates
+// of the frame memory the encoder needs.
+//
+// Normally libavcodec allocates every encoded packet on the heap and frees it once the muxer (and
+// the recording) is done with it, and x264 keeps as many frames as its lookahead, B-frames and
+// references ask for. In budget mode the packets come from slots allocated once at startup and
+// handed out without locking; a slot is returned wherever the last reference is dropped, which
+// may be the recording thread. A packet larger than a slot, or one that finds every slot in use,
+// is allocated as usual and counted, so the stream never stops over it. The x264 frames are bounded
+// by the encoder settings, and mem_budget_x264_bytes() estimates what they cost.
+//
+// mem_budget_malloc_tune() also keeps glibc from holding on to freed memory: large blocks always
+// come from mmap() and go back on free(), and there are at most two malloc arenas.
+//
+// Header only so every program keeps building from a single source file.
+#ifndef RTSP_AVBRIDGE_MEM_BUDGET_H
+#define RTSP_AVBRIDGE_MEM_BUDGET_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/buffer.h>
+#include <libavutil/mem.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "metrics.h"
+
+// AVCodecContext.get_encode_buffer() appeared in libavcodec 58.134 (FFmpeg 4.4)
+#define MEM_BUDGET_HAVE_ENCODE_BUFFER (LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(58, 134, 100))
+
+#define MEM_BUDGET_MAX_SLOTS 64
+#define MEM_BUDGET_X264_PAD 32              // x264 pads every plane by this much on each side
+
+typedef struct PacketPoolSlot
+{
+    struct PacketPool *pool;
+    volatile int64_t in_use;
+} PacketPoolSlot;
+
+typedef struct PacketPool
+{
+    uint8_t *data;                          // nb_slots slots of slot_size bytes, padding included
+    int slot_size;
+    int nb_slots;
+    PacketPoolSlot slots[MEM_BUDGET_MAX_SLOTS];
+    Metric *m_in_use, *m_overflows;
+} PacketPool;
+
+static inline void packet_pool_init(PacketPool *p, MetricsServer *metrics)
+{
+    memset(p, 0, sizeof(*p));
+    p->m_in_use = metrics_gauge(metrics, "packet_pool_slots_in_use", "Pooled packets held by the muxer or the recording");
+    p->m_overflows = metrics_counter(metrics, "packet_pool_overflows_total", "Packets allocated outside the pool, too large or pool exhausted");
+}
+
+// Allocate every slot up front and touch it, so the pool is resident from the start and RSS
+// does not grow later; returns 0 or AVERROR(ENOMEM)
+static inline int packet_pool_start(PacketPool *p, int nb_slots, int slot_size)
+{
+    p->nb_slots = nb_slots < MEM_BUDGET_MAX_SLOTS ? nb_slots : MEM_BUDGET_MAX_SLOTS;
+    p->slot_size = slot_size;
+    for (int i = 0; i < p->nb_slots; i++)
+        p->slots[i].pool = p;
+    p->data = (uint8_t *)av_malloc((size_t)p->nb_slots * slot_size);
+    if (!p->data)
+        return AVERROR(ENOMEM);
+    memset(p->data, 0, (size_t)p->nb_slots * slot_size);
+    return 0;
+}
+
+static inline void packet_pool_release(void *opaque, uint8_t *data)
+{
+    PacketPoolSlot *slot = (PacketPoolSlot *)opaque;
+    (void)data;
+    metric_add(slot->pool->m_in_use, -1);
+    metrics_atomic_exchange(&slot->in_use, 0);
+}
+
+// A reference to a free slot for size bytes plus padding, NULL if there is none
+static inline AVBufferRef *packet_pool_get(PacketPool *p, int size)
+{
+    if (size + AV_INPUT_BUFFER_PADDING_SIZE > p->slot_size)
+        return NULL;
+    for (int i = 0; i < p->nb_slots; i++)
+    {
+        if (metrics_atomic_exchange(&p->slots[i].in_use, 1))
+            continue;
+        AVBufferRef *buf = av_buffer_create(p->data + (size_t)i * p->slot_size, p->slot_size,
+                                            packet_pool_release, &p->slots[i], 0);
+        if (!buf)
+        {
+            metrics_atomic_exchange(&p->slots[i].in_use, 0);
+            return NULL;
+        }
+        metric_add(p->m_in_use, 1);
+        return buf;
+    }
+    return NULL;
+}
+
+#if MEM_BUDGET_HAVE_ENCODE_BUFFER
+// AVCodecContext.get_encode_buffer with the pool in AVCodecContext.opaque
+static inline int packet_pool_get_encode_buffer(AVCodecContext *ctx, AVPacket *pkt, int flags)
+{
+    PacketPool *p = (PacketPool *)ctx->opaque;
+    AVBufferRef *buf = packet_pool_get(p, pkt->size);
+
+    if (!buf)
+    {
+        metric_add(p->m_overflows, 1);
+        return avcodec_default_get_encode_buffer(ctx, pkt, flags);
+    }
+    pkt->buf = buf;
+    pkt->data = buf->data;
+    memset(pkt->data + pkt->size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    return 0;
+}
+#endif
+
+// Hand the encoder's packets out of the pool; returns 0 if the encoder takes them that way
+static inline int packet_pool_attach(PacketPool *p, AVCodecContext *ctx, const AVCodec *codec)
+{
+#if MEM_BUDGET_HAVE_ENCODE_BUFFER
+    if (p->data && (codec->capabilities & AV_CODEC_CAP_DR1))
+    {
+        ctx->opaque = p;
+        ctx->get_encode_buffer = packet_pool_get_encode_buffer;
+        return 0;
+    }
+#else
+    (void)p;
+    (void)ctx;
+    (void)codec;
+#endif
+    return AVERROR(ENOSYS);
+}
+
+// Only once no packet from the pool is referenced any more
+static inline void packet_pool_free(PacketPool *p)
+{
+    av_freep(&p->data);
+    p->nb_slots = 0;
+}
+
+// One x264 frame: padded luma and chroma planes, plus three half-pixel interpolated luma planes
+// when subpixel motion estimation is on
+static inline int64_t mem_budget_x264_frame_bytes(int width, int height, int subpel)
+{
+    int64_t luma = (int64_t)(FFALIGN(width, 16) + 2 * MEM_BUDGET_X264_PAD) * (FFALIGN(height, 16) + 2 * MEM_BUDGET_X264_PAD);
+    return luma * (subpel ? 4 : 1) + luma / 2;
+}
+
+// Frames x264 keeps with refs reference frames, no B-frames and no lookahead: the references, the
+// one being reconstructed and the input copy. Sliced threads share these; frame threads would not.
+static inline int64_t mem_budget_x264_bytes(int width, int height, int refs, int subpel)
+{
+    return (refs + 2) * mem_budget_x264_frame_bytes(width, height, subpel);
+}
+
+static inline void mem_budget_malloc_tune(void)
+{
+#ifdef __GLIBC__
+    mallopt(M_MMAP_THRESHOLD, 128 * 1024);      // Fixed, not raised after large frees
+    mallopt(M_TRIM_THRESHOLD, 256 * 1024);
+    mallopt(M_ARENA_MAX, 2);
+#endif
+}
+
+#endif // RTSP_AVBRIDGE_MEM_BUDGET_H
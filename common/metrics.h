@@ -0,0 +1,680 @@
+// Runtime metrics and live control for the servers and clients.
+//
+// A background thread serves a tiny HTTP endpoint on 127.0.0.1:<port> (or, on Linux,
+// a Unix socket given as unix:<path>):
+//   GET /metrics                  Prometheus text format
+//   GET /control?key=value&...    live commands, e.g. bitrate=500000, keyframe=1, loglevel=debug
+//   GET /<document>               small documents the program publishes, e.g. /video.sdp
+//
+// The hot path only ever does relaxed atomic adds and stores on preallocated metrics; the
+// HTTP thread reads them when it is scraped. Control commands are handed to a callback on
+// the HTTP thread, which should only store the request somewhere the hot path polls
+// (metrics_atomic_exchange), never touch codec state directly.
+//
+// Header only so every program keeps building from a single source file. On Windows include
+// it before <windows.h>, or define WIN32_LEAN_AND_MEAN, so winsock2.h does not clash with winsock.h.
+#ifndef RTSP_AVBRIDGE_METRICS_H
+#define RTSP_AVBRIDGE_METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <libavutil/log.h>
+#include <libavutil/time.h>
+#ifdef __cplusplus
+}
+#endif
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#include <psapi.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#pragma comment(lib, "ws2_32.lib")
+#pragma comment(lib, "psapi.lib")
+#endif
+#define strtok_r strtok_s
+typedef SOCKET metrics_socket_t;
+#define METRICS_INVALID_SOCKET INVALID_SOCKET
+#define metrics_closesocket closesocket
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+typedef int metrics_socket_t;
+#define METRICS_INVALID_SOCKET (-1)
+#define metrics_closesocket close
+#endif
+
+#define METRICS_MAX 256
+#define METRICS_MAX_BUCKETS 16
+#define METRICS_MAX_DOCUMENTS 8
+#define METRICS_DOCUMENT_SIZE 4096
+#define METRICS_CLIENT_TIMEOUT_US 1000000   // A client gets this long to send its request
+
+// Relaxed atomics, enough for independent counters read by a scraper
+#if defined(_MSC_VER) && !defined(__clang__)
+static inline int64_t metrics_atomic_load(volatile int64_t *p) { return *p; }
+static inline void metrics_atomic_store(volatile int64_t *p, int64_t v) { *p = v; }
+static inline void metrics_atomic_add(volatile int64_t *p, int64_t v) { _InterlockedExchangeAdd64((volatile long long *)p, v); }
+static inline int64_t metrics_atomic_exchange(volatile int64_t *p, int64_t v) { return _InterlockedExchange64((volatile long long *)p, v); }
+static inline int64_t metrics_atomic_load_acquire(volatile int64_t *p) { return _InterlockedCompareExchange64((volatile long long *)p, 0, 0); }
+#else
+static inline int64_t metrics_atomic_load(volatile int64_t *p) { return __atomic_load_n(p, __ATOMIC_RELAXED); }
+static inline void metrics_atomic_store(volatile int64_t *p, int64_t v) { __atomic_store_n(p, v, __ATOMIC_RELAXED); }
+static inline void metrics_atomic_add(volatile int64_t *p, int64_t v) { __atomic_fetch_add(p, v, __ATOMIC_RELAXED); }
+static inline int64_t metrics_atomic_exchange(volatile int64_t *p, int64_t v) { return __atomic_exchange_n(p, v, __ATOMIC_ACQ_REL); }
+static inline int64_t metrics_atomic_load_acquire(volatile int64_t *p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+#endif
+
+typedef enum MetricType
+{
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+    METRIC_HISTOGRAM,
+} MetricType;
+
+typedef struct Metric
+{
+    const char *name;
+    const char *help;
+    const char *labels;                             // e.g. stream="1", NULL for none
+    MetricType type;
+    double scale;                                   // Exported value = stored value * scale
+    volatile int64_t value;                         // Counter / gauge
+    int64_t bounds[METRICS_MAX_BUCKETS];            // Histogram upper bounds, in stored units
+    int nb_bounds;
+    volatile int64_t buckets[METRICS_MAX_BUCKETS + 1];
+    volatile int64_t count;
+    volatile int64_t sum;
+} Metric;
+
+// Handles one control command; returns 0 if it was accepted
+typedef int (*MetricsControlFn)(const char *key, const char *value, void *opaque);
+
+// A document served as is, e.g. the SDP of a multicast output. Its content is only known once the
+// output is open, so it is published once, after the endpoint may already be serving: the data is
+// written first and the size last, and the HTTP thread treats size 0 as not there yet.
+typedef struct MetricsDocument
+{
+    char path[64];
+    const char *content_type;
+    char data[METRICS_DOCUMENT_SIZE];
+    volatile int64_t size;
+} MetricsDocument;
+
+typedef struct MetricsServer
+{
+    Metric metrics[METRICS_MAX];
+    int nb_metrics;
+    MetricsDocument documents[METRICS_MAX_DOCUMENTS];
+    int nb_documents;
+    const char *prefix;
+    const char *labels;                             // Labels given to metrics registered from now on
+    MetricsControlFn control;
+    void *control_opaque;
+    metrics_socket_t listen_fd;
+    volatile int64_t stop;
+    int running;
+#ifdef _WIN32
+    HANDLE thread;
+#else
+    pthread_t thread;
+    char unix_path[108];
+#endif
+} MetricsServer;
+
+// Per-second rate of a counter, published into a gauge from the hot loop
+typedef struct MetricRate
+{
+    int64_t last_us;
+    int64_t last_value;
+} MetricRate;
+
+// Everything is registered before metrics_start(), so the registry itself needs no locking
+static inline Metric *metrics_add(MetricsServer *s, MetricType type, const char *name, const char *help,
+                                  double scale)
+{
+    Metric *m;
+    if (s->nb_metrics >= METRICS_MAX)
+        return NULL;
+    m = &s->metrics[s->nb_metrics++];
+    memset(m, 0, sizeof(*m));
+    m->name = name;
+    m->help = help;
+    m->labels = s->labels;
+    m->type = type;
+    m->scale = scale;
+    return m;
+}
+
+// Label the metrics registered after this call, so several pipelines can share one name; NULL stops labelling
+static inline void metrics_set_labels(MetricsServer *s, const char *labels)
+{
+    s->labels = labels;
+}
+
+static inline Metric *metrics_counter(MetricsServer *s, const char *name, const char *help)
+{
+    return metrics_add(s, METRIC_COUNTER, name, help, 1.0);
+}
+
+static inline Metric *metrics_gauge(MetricsServer *s, const char *name, const char *help)
+{
+    return metrics_add(s, METRIC_GAUGE, name, help, 1.0);
+}
+
+// Histogram of microsecond samples, exported in seconds as Prometheus expects
+static inline Metric *metrics_histogram_us(MetricsServer *s, const char *name, const char *help,
+                                           const int64_t *bounds_us, int nb_bounds)
+{
+    Metric *m = metrics_add(s, METRIC_HISTOGRAM, name, help, 1e-6);
+    if (!m)
+        return NULL;
+    m->nb_bounds = nb_bounds < METRICS_MAX_BUCKETS ? nb_bounds : METRICS_MAX_BUCKETS;
+    memcpy(m->bounds, bounds_us, m->nb_bounds * sizeof(*bounds_us));
+    return m;
+}
+
+// Register a document served at path, e.g. "/video.sdp"
+static inline MetricsDocument *metrics_document(MetricsServer *s, const char *path, const char *content_type)
+{
+    MetricsDocument *d;
+    if (s->nb_documents >= METRICS_MAX_DOCUMENTS)
+        return NULL;
+    d = &s->documents[s->nb_documents++];
+    snprintf(d->path, sizeof(d->path), "%s", path);
+    d->content_type = content_type;
+    return d;
+}
+
+// Publish the content, once; returns -1 if it does not fit. Accepts NULL like the update helpers.
+static inline int metrics_document_publish(MetricsDocument *d, const char *text)
+{
+    size_t size = strlen(text);
+    if (!d)
+        return 0;
+    if (!size || size > sizeof(d->data) || metrics_atomic_load_acquire(&d->size))
+        return -1;
+    memcpy(d->data, text, size);
+    metrics_atomic_exchange(&d->size, (int64_t)size);
+    return 0;
+}
+
+// Bucket layout that suits per-frame timings: 1 ms .. 1 s
+static const int64_t metrics_frame_time_bounds_us[] = {
+    1000, 2000, 5000, 10000, 20000, 33000, 50000, 100000, 200000, 500000, 1000000};
+#define METRICS_FRAME_TIME_BUCKETS (int)(sizeof(metrics_frame_time_bounds_us) / sizeof(metrics_frame_time_bounds_us[0]))
+
+// All update helpers accept NULL so callers do not have to care whether metrics are enabled
+static inline void metric_add(Metric *m, int64_t v)
+{
+    if (m)
+        metrics_atomic_add(&m->value, v);
+}
+
+static inline void metric_set(Metric *m, int64_t v)
+{
+    if (m)
+        metrics_atomic_store(&m->value, v);
+}
+
+static inline int64_t metric_get(Metric *m)
+{
+    return m ? metrics_atomic_load(&m->value) : 0;
+}
+
+static inline void metric_observe(Metric *m, int64_t v)
+{
+    int i;
+    if (!m)
+        return;
+    for (i = 0; i < m->nb_bounds && v > m->bounds[i]; i++)
+        ;
+    metrics_atomic_add(&m->buckets[i], 1);
+    metrics_atomic_add(&m->count, 1);
+    metrics_atomic_add(&m->sum, v);
+}
+
+// Upper bound of the bucket holding quantile q of a histogram, in stored units; -1 if empty or past the last bound
+static inline int64_t metric_quantile(Metric *m, double q)
+{
+    int64_t count, cumulative = 0;
+    if (!m || !(count = metrics_atomic_load(&m->count)))
+        return -1;
+    for (int i = 0; i < m->nb_bounds; i++)
+    {
+        cumulative += metrics_atomic_load(&m->buckets[i]);
+        if (cumulative >= q * count)
+            return m->bounds[i];
+    }
+    return -1;
+}
+
+// Publish counter's per-second rate (times mul, e.g. 8 for bytes -> bits) into gauge about once a second
+static inline void metric_rate_tick(MetricRate *r, Metric *gauge, Metric *counter, int64_t mul, int64_t now_us)
+{
+    int64_t value;
+    if (!gauge || !counter)
+        return;
+    if (!r->last_us)
+    {
+        r->last_us = now_us;
+        r->last_value = metric_get(counter);
+        return;
+    }
+    if (now_us - r->last_us < 1000000)
+        return;
+    value = metric_get(counter);
+    metric_set(gauge, (value - r->last_value) * mul * 1000000 / (now_us - r->last_us));
+    r->last_us = now_us;
+    r->last_value = value;
+}
+
+static inline int64_t metrics_rss_bytes(void)
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+        return (int64_t)pmc.WorkingSetSize;
+    return 0;
+#else
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f)
+        return 0;
+    if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+        resident = 0;
+    fclose(f);
+    return (int64_t)resident * sysconf(_SC_PAGESIZE);
+#endif
+}
+
+// Log level names accepted by the loglevel command; the programs gate their own chatty
+// printf output on av_log_get_level() as well
+static inline int metrics_parse_log_level(const char *name)
+{
+    static const struct { const char *name; int level; } levels[] = {
+        {"quiet", AV_LOG_QUIET}, {"error", AV_LOG_ERROR}, {"warning", AV_LOG_WARNING},
+        {"info", AV_LOG_INFO}, {"verbose", AV_LOG_VERBOSE}, {"debug", AV_LOG_DEBUG}};
+    for (size_t i = 0; i < sizeof(levels) / sizeof(levels[0]); i++)
+    {
+        if (strcmp(name, levels[i].name) == 0)
+            return levels[i].level;
+    }
+    return -100;
+}
+
+typedef struct MetricsBuffer
+{
+    char *data;
+    size_t size, capacity;
+} MetricsBuffer;
+
+static inline void metrics_printf(MetricsBuffer *b, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+    for (;;)
+    {
+        va_start(ap, fmt);
+        n = vsnprintf(b->data + b->size, b->capacity - b->size, fmt, ap);
+        va_end(ap);
+        if (n < 0)
+            return;
+        if (b->size + n < b->capacity)
+            break;
+        size_t capacity = (b->capacity + n) * 2;
+        char *data = (char *)realloc(b->data, capacity);
+        if (!data)
+            return;
+        b->data = data;
+        b->capacity = capacity;
+    }
+    b->size += n;
+}
+
+static inline void metrics_render(MetricsServer *s, MetricsBuffer *b)
+{
+    for (int i = 0; i < s->nb_metrics; i++)
+    {
+        static const char *types[] = {"counter", "gauge", "histogram"};
+        int seen = 0;
+        for (int j = 0; j < i && !seen; j++)
+            seen = strcmp(s->metrics[j].name, s->metrics[i].name) == 0;
+        if (seen)
+            continue;
+        metrics_printf(b, "# HELP %s_%s %s\n# TYPE %s_%s %s\n", s->prefix, s->metrics[i].name, s->metrics[i].help,
+                       s->prefix, s->metrics[i].name, types[s->metrics[i].type]);
+
+        // Every series of the family, one per label set, goes right after its HELP/TYPE
+        for (int k = i; k < s->nb_metrics; k++)
+        {
+            Metric *m = &s->metrics[k];
+            const char *labels = m->labels ? m->labels : "";
+            const char *sep = m->labels ? "," : "";
+            if (strcmp(m->name, s->metrics[i].name) != 0)
+                continue;
+            if (m->type != METRIC_HISTOGRAM)
+            {
+                metrics_printf(b, "%s_%s%s%s%s %.9g\n", s->prefix, m->name, m->labels ? "{" : "", labels,
+                               m->labels ? "}" : "", metrics_atomic_load(&m->value) * m->scale);
+                continue;
+            }
+            int64_t cumulative = 0;
+            for (int j = 0; j < m->nb_bounds; j++)
+            {
+                cumulative += metrics_atomic_load(&m->buckets[j]);
+                metrics_printf(b, "%s_%s_bucket{%s%sle=\"%.9g\"} %lld\n", s->prefix, m->name, labels, sep,
+                               m->bounds[j] * m->scale, (long long)cumulative);
+            }
+            cumulative += metrics_atomic_load(&m->buckets[m->nb_bounds]);
+            metrics_printf(b, "%s_%s_bucket{%s%sle=\"+Inf\"} %lld\n", s->prefix, m->name, labels, sep,
+                           (long long)cumulative);
+            metrics_printf(b, "%s_%s_sum%s%s%s %.9g\n%s_%s_count%s%s%s %lld\n",
+                           s->prefix, m->name, m->labels ? "{" : "", labels, m->labels ? "}" : "",
+                           metrics_atomic_load(&m->sum) * m->scale,
+                           s->prefix, m->name, m->labels ? "{" : "", labels, m->labels ? "}" : "",
+                           (long long)metrics_atomic_load(&m->count));
+        }
+    }
+    metrics_printf(b, "# HELP process_resident_memory_bytes Resident set size\n"
+                      "# TYPE process_resident_memory_bytes gauge\nprocess_resident_memory_bytes %lld\n",
+                   (long long)metrics_rss_bytes());
+    metrics_printf(b, "# HELP %s_log_level Current av_log level\n# TYPE %s_log_level gauge\n%s_log_level %d\n",
+                   s->prefix, s->prefix, s->prefix, av_log_get_level());
+}
+
+static inline void metrics_url_decode(char *s)
+{
+    char *out = s;
+    for (; *s; s++)
+    {
+        if (*s == '+')
+        {
+            *out++ = ' ';
+        }
+        else if (*s == '%' && s[1] && s[2])
+        {
+            char hex[3] = {s[1], s[2], 0};
+            *out++ = (char)strtol(hex, NULL, 16);
+            s += 2;
+        }
+        else
+        {
+            *out++ = *s;
+        }
+    }
+    *out = 0;
+}
+
+// Apply every key=value pair of a /control query; the loglevel command is handled here
+static inline int metrics_control(MetricsServer *s, char *query, MetricsBuffer *b)
+{
+    int failed = 0;
+    char *save = NULL;
+    for (char *pair = strtok_r(query, "&", &save); pair; pair = strtok_r(NULL, "&", &save))
+    {
+        char *value = strchr(pair, '=');
+        int ret = -1;
+        if (value)
+            *value++ = 0;
+        else
+            value = (char *)"";
+        metrics_url_decode(pair);
+        metrics_url_decode(value);
+        if (strcmp(pair, "loglevel") == 0)
+        {
+            int level = metrics_parse_log_level(value);
+            if (level != -100)
+            {
+                av_log_set_level(level);
+                ret = 0;
+            }
+        }
+        else if (s->control)
+        {
+            ret = s->control(pair, value, s->control_opaque);
+        }
+        metrics_printf(b, "%s=%s %s\n", pair, value, ret == 0 ? "ok" : "rejected");
+        failed |= ret != 0;
+    }
+    return failed ? -1 : 0;
+}
+
+static inline void metrics_handle_client(MetricsServer *s, metrics_socket_t fd)
+{
+    char request[2048];
+    int len = 0, n;
+    int status = 200;
+    const char *reason = "OK";
+    const char *content_type = "text/plain; version=0.0.4";
+    MetricsBuffer body = {NULL, 0, 0};
+    MetricsDocument *document = NULL;
+    char header[256];
+    int64_t deadline = av_gettime_relative() + METRICS_CLIENT_TIMEOUT_US;
+#ifdef _WIN32
+    DWORD send_timeout = METRICS_CLIENT_TIMEOUT_US / 1000;
+#else
+    struct timeval send_timeout = {METRICS_CLIENT_TIMEOUT_US / 1000000, METRICS_CLIENT_TIMEOUT_US % 1000000};
+#endif
+
+    // Clients are served one at a time on this thread, so one that stalls must not hold up the
+    // others or metrics_stop(): give up on the request at the deadline, and on a send that blocks
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, (const char *)&send_timeout, sizeof(send_timeout));
+
+    // Only the request line matters, read until the end of the headers or the buffer is full
+    while (len < (int)sizeof(request) - 1)
+    {
+        int64_t left = deadline - av_gettime_relative();
+        fd_set rfds;
+        struct timeval tv;
+        if (left <= 0)
+            break;
+        tv.tv_sec = (long)(left / 1000000);
+        tv.tv_usec = (long)(left % 1000000);
+        FD_ZERO(&rfds);
+        FD_SET(fd, &rfds);
+        if (select((int)fd + 1, &rfds, NULL, NULL, &tv) <= 0)
+            break;
+        n = recv(fd, request + len, sizeof(request) - 1 - len, 0);
+        if (n <= 0)
+            break;
+        len += n;
+        request[len] = 0;
+        if (strstr(request, "\r\n\r\n"))
+            break;
+    }
+    request[len] = 0;
+
+    char *path = strchr(request, ' ');
+    char *end = path ? strchr(path + 1, ' ') : NULL;
+    if (!path || !end)
+    {
+        status = 400;
+        reason = "Bad Request";
+        metrics_printf(&body, "bad request\n");
+    }
+    else
+    {
+        *end = 0;
+        path++;
+        char *query = strchr(path, '?');
+        if (query)
+            *query++ = 0;
+        for (int i = 0; i < s->nb_documents && !document; i++)
+            if (strcmp(path, s->documents[i].path) == 0 && metrics_atomic_load_acquire(&s->documents[i].size))
+                document = &s->documents[i];
+        if (document)
+        {
+            content_type = document->content_type;
+            metrics_printf(&body, "%.*s", (int)document->size, document->data);
+        }
+        else if (strcmp(path, "/metrics") == 0)
+        {
+            metrics_render(s, &body);
+        }
+        else if (strcmp(path, "/control") == 0 && query)
+        {
+            if (metrics_control(s, query, &body) < 0)
+            {
+                status = 400;
+                reason = "Bad Request";
+            }
+        }
+        else
+        {
+            status = 404;
+            reason = "Not Found";
+            metrics_printf(&body, "try /metrics or /control?key=value\n");
+        }
+    }
+
+    n = snprintf(header, sizeof(header),
+                 "HTTP/1.0 %d %s\r\nContent-Type: %s\r\nContent-Length: %d\r\n"
+                 "Connection: close\r\n\r\n",
+                 status, reason, content_type, (int)body.size);
+    send(fd, header, n, 0);
+    for (size_t off = 0; off < body.size;)
+    {
+        n = send(fd, body.data + off, (int)(body.size - off), 0);
+        if (n <= 0)
+            break;
+        off += n;
+    }
+    free(body.data);
+    metrics_closesocket(fd);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI metrics_thread(void *arg)
+#else
+static void *metrics_thread(void *arg)
+#endif
+{
+    MetricsServer *s = (MetricsServer *)arg;
+    while (!metrics_atomic_load(&s->stop))
+    {
+        fd_set rfds;
+        struct timeval tv = {0, 200000};
+        FD_ZERO(&rfds);
+        FD_SET(s->listen_fd, &rfds);
+        // Wake up regularly to notice metrics_stop()
+        if (select((int)s->listen_fd + 1, &rfds, NULL, NULL, &tv) <= 0)
+            continue;
+        metrics_socket_t fd = accept(s->listen_fd, NULL, NULL);
+        if (fd == METRICS_INVALID_SOCKET)
+            continue;
+        metrics_handle_client(s, fd);
+    }
+    return 0;
+}
+
+// Prepare an empty registry. prefix is prepended to every metric name, e.g. "video_server".
+static inline void metrics_init(MetricsServer *s, const char *prefix, MetricsControlFn control, void *opaque)
+{
+    memset(s, 0, sizeof(*s));
+    s->prefix = prefix;
+    s->control = control;
+    s->control_opaque = opaque;
+    s->listen_fd = METRICS_INVALID_SOCKET;
+}
+
+// Start serving on "port", "host:port" or (not on Windows) "unix:/path"
+static inline int metrics_start(MetricsServer *s, const char *address)
+{
+#ifdef _WIN32
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+        return -1;
+#else
+    if (strncmp(address, "unix:", 5) == 0)
+    {
+        struct sockaddr_un addr_un;
+        memset(&addr_un, 0, sizeof(addr_un));
+        addr_un.sun_family = AF_UNIX;
+        snprintf(addr_un.sun_path, sizeof(addr_un.sun_path), "%s", address + 5);
+        snprintf(s->unix_path, sizeof(s->unix_path), "%s", address + 5);
+        unlink(addr_un.sun_path);
+        s->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (s->listen_fd < 0 || bind(s->listen_fd, (struct sockaddr *)&addr_un, sizeof(addr_un)) < 0)
+            goto fail;
+    }
+    else
+#endif
+    {
+        struct sockaddr_in sin;
+        char host[64] = "127.0.0.1";
+        const char *colon = strrchr(address, ':');
+        int one = 1;
+        if (colon)
+            snprintf(host, sizeof(host), "%.*s", (int)(colon - address), address);
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons((unsigned short)atoi(colon ? colon + 1 : address));
+        if (inet_pton(AF_INET, host, &sin.sin_addr) != 1)
+            goto fail;
+        s->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (s->listen_fd == METRICS_INVALID_SOCKET)
+            goto fail;
+        setsockopt(s->listen_fd, SOL_SOCKET, SO_REUSEADDR, (const char *)&one, sizeof(one));
+        if (bind(s->listen_fd, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+            goto fail;
+    }
+    if (listen(s->listen_fd, 4) < 0)
+        goto fail;
+    metrics_atomic_store(&s->stop, 0);
+
+#ifdef _WIN32
+    s->thread = CreateThread(NULL, 0, metrics_thread, s, 0, NULL);
+    if (!s->thread)
+        goto fail;
+#else
+    if (pthread_create(&s->thread, NULL, metrics_thread, s) != 0)
+        goto fail;
+#endif
+    s->running = 1;
+    return 0;
+
+fail:
+    if (s->listen_fd != METRICS_INVALID_SOCKET)
+        metrics_closesocket(s->listen_fd);
+    s->listen_fd = METRICS_INVALID_SOCKET;
+    return -1;
+}
+
+static inline void metrics_stop(MetricsServer *s)
+{
+    if (!s->running)
+        return;
+    metrics_atomic_store(&s->stop, 1);
+#ifdef _WIN32
+    WaitForSingleObject(s->thread, INFINITE);
+    CloseHandle(s->thread);
+#else
+    pthread_join(s->thread, NULL);
+    if (s->unix_path[0])
+        unlink(s->unix_path);
+#endif
+    metrics_closesocket(s->listen_fd);
+    s->listen_fd = METRICS_INVALID_SOCKET;
+    s->running = 0;
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
+
+#endif // RTSP_AVBRIDGE_METRICS_H
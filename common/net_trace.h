@@ -0,0 +1,369 @@
+// Network traces: what a client's demuxer delivered and when, recorded once and replayed with the
+// same timing.
+//
+// Recording keeps every packet av_read_frame() returns from a live input, with the time it
+// returned it: after RTP reassembly and reordering, so the arrival times hold the network and the
+// demuxer alike, and what a replay exercises is everything after them (decode, conversion,
+// presentation). The file starts with the codec parameters of every stream, followed by one record
+// per packet: arrival time as a delta, stream, flags, timestamps, size and payload, about 30 bytes
+// on top of the payload. Changes of the RTCP wall clock mapping (start_time_realtime) get records
+// of their own. Only the first session of a run is recorded; a reconnect ends the trace.
+//
+// net_trace_open_input() opens a trace where avformat_open_input() would open the stream. The
+// context holds the recorded streams and reads the file through its own AVIOContext, so
+// avformat_close_input() releases it like any other. net_trace_read_frame() takes the place of
+// av_read_frame() for live inputs and traces alike. On a replay it hands out each packet at its
+// recorded arrival time multiplied by scale (0 = as fast as possible), drops loss_percent of them
+// and delays each by a random 0 .. jitter_us. Packets stay in order, so one that is held up holds
+// up the ones behind it too. The draws come from seed, so replays with the same options drop the
+// same packets and see the same delays. The wall clock mapping is moved to the replay's start,
+// which keeps e2e latency meaningful at a scale of 1.
+//
+// Header only so every program keeps building from a single source file.
+#ifndef RTSP_AVBRIDGE_NET_TRACE_H
+#define RTSP_AVBRIDGE_NET_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <libavformat/avformat.h>
+#include <libavutil/avutil.h>
+#include <libavutil/time.h>
+#ifdef __cplusplus
+}
+#endif
+
+#include "metrics.h"
+
+// AVCodecParameters.ch_layout replaced channels and channel_layout in libavutil 57.24 (FFmpeg 5.1)
+#define NET_TRACE_HAVE_CH_LAYOUT (LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 24, 100))
+
+#define NET_TRACE_MAGIC "AVBTRC01"
+#define NET_TRACE_MAX_STREAMS 16
+#define NET_TRACE_MAX_PACKET (64 << 20)
+#define NET_TRACE_CLOCK 0xff                // Stream of a start_time_realtime record
+
+// Packet record flags
+#define NET_TRACE_KEY 1
+#define NET_TRACE_CORRUPT 2
+#define NET_TRACE_PTS 4
+#define NET_TRACE_DTS 8
+
+typedef struct NetTrace
+{
+    // Recording
+    const char *record_path;                // Trace to record the next live input into, NULL for none
+    AVIOContext *out;
+    int64_t record_start_us;                // av_gettime_relative() when recording started
+    int64_t last_arrival_us;                // Arrival of the previous record, since the start
+    int64_t last_realtime;                  // start_time_realtime as last recorded
+    int64_t recorded;                       // Packets
+    // Replay
+    int replaying;
+    double scale;
+    double loss_percent;
+    int64_t jitter_us;
+    uint32_t seed;
+    uint32_t rng;
+    int64_t replay_start_us;                // av_gettime_relative() when the trace was opened
+    int64_t replay_shift_us;                // Wall clock of the replay minus that of the recording
+    int64_t arrival_us;                     // Recorded arrival of the last record read
+    Metric *m_recorded, *m_dropped;
+} NetTrace;
+
+static inline void net_trace_init(NetTrace *t, MetricsServer *metrics)
+{
+    memset(t, 0, sizeof(*t));
+    t->scale = 1.0;
+    t->seed = 1;
+    t->m_recorded = metrics_counter(metrics, "trace_recorded_packets_total", "Packets written to the trace");
+    t->m_dropped = metrics_counter(metrics, "trace_dropped_packets_total", "Replayed packets dropped to simulate loss");
+}
+
+// "scale[:loss_percent[:jitter_ms[:seed]]]"; returns 0 or AVERROR(EINVAL)
+static inline int net_trace_parse_replay(NetTrace *t, const char *spec)
+{
+    double scale = 1.0, loss = 0, jitter_ms = 0;
+    unsigned int seed = 1;
+    if (sscanf(spec, "%lf:%lf:%lf:%u", &scale, &loss, &jitter_ms, &seed) < 1 ||
+        scale < 0 || loss < 0 || loss > 100 || jitter_ms < 0)
+        return AVERROR(EINVAL);
+    t->scale = scale;
+    t->loss_percent = loss;
+    t->jitter_us = (int64_t)(jitter_ms * 1000);
+    t->seed = seed ? seed : 1;
+    return 0;
+}
+
+// Whether url names a trace, by its extension
+static inline int net_trace_is_trace(const char *url)
+{
+    size_t n = strlen(url);
+    return n > 8 && strcmp(url + n - 8, ".avtrace") == 0;
+}
+
+// Uniform in [0, 1) from a xorshift32 generator
+static inline double net_trace_random(NetTrace *t)
+{
+    t->rng ^= t->rng << 13;
+    t->rng ^= t->rng >> 17;
+    t->rng ^= t->rng << 5;
+    return (t->rng >> 8) / 16777216.0;
+}
+
+static inline void net_trace_record_stop(NetTrace *t)
+{
+    if (!t->out)
+        return;
+    if (avio_closep(&t->out) < 0)
+        printf("Failed to finish the trace %s\n", t->record_path);
+    else
+        printf("Trace %s: %lld packets recorded\n", t->record_path, (long long)t->recorded);
+}
+
+// Start recording a live input that was just opened. The first call writes the header; the
+// next one, after a reconnect, ends the trace.
+static inline int net_trace_record_start(NetTrace *t, AVFormatContext *s)
+{
+    int ret;
+    if (t->out)
+    {
+        net_trace_record_stop(t);
+        t->record_path = NULL;
+    }
+    if (!t->record_path)
+        return 0;
+    if (s->nb_streams > NET_TRACE_MAX_STREAMS)
+        return AVERROR(EINVAL);
+    ret = avio_open(&t->out, t->record_path, AVIO_FLAG_WRITE);
+    if (ret < 0)
+    {
+        printf("Failed to create the trace %s\n", t->record_path);
+        t->record_path = NULL;
+        return ret;
+    }
+    t->record_start_us = av_gettime_relative();
+    t->last_arrival_us = 0;
+    t->last_realtime = AV_NOPTS_VALUE;
+    avio_write(t->out, (const unsigned char *)NET_TRACE_MAGIC, 8);
+    avio_wl64(t->out, (uint64_t)av_gettime());
+    avio_wl32(t->out, s->nb_streams);
+    for (unsigned int i = 0; i < s->nb_streams; i++)
+    {
+        const AVCodecParameters *par = s->streams[i]->codecpar;
+#if NET_TRACE_HAVE_CH_LAYOUT
+        int channels = par->ch_layout.nb_channels;
+        uint64_t mask = par->ch_layout.order == AV_CHANNEL_ORDER_NATIVE ? par->ch_layout.u.mask : 0;
+#else
+        int channels = par->channels;
+        uint64_t mask = par->channel_layout;
+#endif
+        avio_wl32(t->out, par->codec_type);
+        avio_wl32(t->out, par->codec_id);
+        avio_wl32(t->out, par->codec_tag);
+        avio_wl32(t->out, par->format);
+        avio_wl32(t->out, par->width);
+        avio_wl32(t->out, par->height);
+        avio_wl32(t->out, par->sample_rate);
+        avio_wl32(t->out, channels);
+        avio_wl64(t->out, mask);
+        avio_wl32(t->out, s->streams[i]->time_base.num);
+        avio_wl32(t->out, s->streams[i]->time_base.den);
+        avio_wl32(t->out, par->extradata_size);
+        avio_write(t->out, par->extradata, par->extradata_size);
+    }
+    return 0;
+}
+
+static inline void net_trace_record_packet(NetTrace *t, AVFormatContext *s, const AVPacket *pkt)
+{
+    int64_t arrival = av_gettime_relative() - t->record_start_us;
+    int flags = ((pkt->flags & AV_PKT_FLAG_KEY) ? NET_TRACE_KEY : 0) |
+                ((pkt->flags & AV_PKT_FLAG_CORRUPT) ? NET_TRACE_CORRUPT : 0) |
+                (pkt->pts != AV_NOPTS_VALUE ? NET_TRACE_PTS : 0) | (pkt->dts != AV_NOPTS_VALUE ? NET_TRACE_DTS : 0);
+
+    // The first RTCP sender report arrives some time into the session
+    if (s->start_time_realtime != t->last_realtime)
+    {
+        avio_wl32(t->out, (uint32_t)(arrival - t->last_arrival_us));
+        avio_w8(t->out, NET_TRACE_CLOCK);
+        avio_w8(t->out, 0);
+        avio_wl64(t->out, (uint64_t)s->start_time_realtime);
+        t->last_arrival_us = arrival;
+        t->last_realtime = s->start_time_realtime;
+    }
+    avio_wl32(t->out, (uint32_t)(arrival - t->last_arrival_us));
+    avio_w8(t->out, pkt->stream_index);
+    avio_w8(t->out, flags);
+    if (flags & NET_TRACE_PTS)
+        avio_wl64(t->out, (uint64_t)pkt->pts);
+    if (flags & NET_TRACE_DTS)
+        avio_wl64(t->out, (uint64_t)pkt->dts);
+    avio_wl32(t->out, (uint32_t)pkt->duration);
+    avio_wl32(t->out, pkt->size);
+    avio_write(t->out, pkt->data, pkt->size);
+    t->last_arrival_us = arrival;
+    t->recorded++;
+    metric_add(t->m_recorded, 1);
+}
+
+// Open a trace for replay in place of avformat_open_input(); *ps stays NULL on failure
+static inline int net_trace_open_input(NetTrace *t, AVFormatContext **ps, const char *url)
+{
+    AVFormatContext *s = avformat_alloc_context();
+    char magic[8];
+    int64_t record_wall_us;
+    unsigned int nb_streams;
+    int ret;
+
+    *ps = NULL;
+    if (!s)
+        return AVERROR(ENOMEM);
+    ret = avio_open(&s->pb, url, AVIO_FLAG_READ);
+    if (ret < 0)
+        goto fail;
+    ret = AVERROR_INVALIDDATA;
+    if (avio_read(s->pb, (unsigned char *)magic, 8) != 8 || memcmp(magic, NET_TRACE_MAGIC, 8) != 0)
+        goto fail;
+    record_wall_us = (int64_t)avio_rl64(s->pb);
+    nb_streams = avio_rl32(s->pb);
+    if (nb_streams > NET_TRACE_MAX_STREAMS)
+        goto fail;
+    for (unsigned int i = 0; i < nb_streams; i++)
+    {
+        AVStream *st = avformat_new_stream(s, NULL);
+        AVCodecParameters *par;
+        int channels, extradata_size;
+        uint64_t mask;
+        if (!st)
+        {
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+        par = st->codecpar;
+        par->codec_type = (enum AVMediaType)(int)avio_rl32(s->pb);
+        par->codec_id = (enum AVCodecID)avio_rl32(s->pb);
+        par->codec_tag = avio_rl32(s->pb);
+        par->format = (int)avio_rl32(s->pb);
+        par->width = (int)avio_rl32(s->pb);
+        par->height = (int)avio_rl32(s->pb);
+        par->sample_rate = (int)avio_rl32(s->pb);
+        channels = (int)avio_rl32(s->pb);
+        mask = avio_rl64(s->pb);
+#if NET_TRACE_HAVE_CH_LAYOUT
+        if (mask)
+            av_channel_layout_from_mask(&par->ch_layout, mask);
+        else if (channels)
+            av_channel_layout_default(&par->ch_layout, channels);
+#else
+        par->channels = channels;
+        par->channel_layout = mask;
+#endif
+        st->time_base.num = (int)avio_rl32(s->pb);
+        st->time_base.den = (int)avio_rl32(s->pb);
+        extradata_size = (int)avio_rl32(s->pb);
+        if (extradata_size < 0 || extradata_size > NET_TRACE_MAX_PACKET || avio_feof(s->pb))
+            goto fail;
+        if (extradata_size)
+        {
+            par->extradata = (uint8_t *)av_mallocz(extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
+            if (!par->extradata)
+            {
+                ret = AVERROR(ENOMEM);
+                goto fail;
+            }
+            par->extradata_size = extradata_size;
+            if (avio_read(s->pb, par->extradata, extradata_size) != extradata_size)
+                goto fail;
+        }
+    }
+    s->start_time_realtime = AV_NOPTS_VALUE;
+    t->replaying = 1;
+    t->rng = t->seed;
+    t->arrival_us = 0;
+    t->replay_start_us = av_gettime_relative();
+    t->replay_shift_us = av_gettime() - record_wall_us;
+    *ps = s;
+    return 0;
+
+fail:
+    avformat_close_input(&s);
+    return ret;
+}
+
+static inline int net_trace_replay_packet(NetTrace *t, AVFormatContext *s, AVPacket *pkt)
+{
+    AVIOContext *pb = s->pb;
+    for (;;)
+    {
+        uint32_t delta = avio_rl32(pb);
+        int stream = avio_r8(pb), flags = avio_r8(pb), size, ret;
+        int64_t pts, dts, duration;
+
+        // Also the end of a trace that was cut off mid-record
+        if (avio_feof(pb))
+            return AVERROR_EOF;
+        t->arrival_us += delta;
+        if (stream == NET_TRACE_CLOCK)
+        {
+            int64_t realtime = (int64_t)avio_rl64(pb);
+            s->start_time_realtime = realtime == AV_NOPTS_VALUE ? realtime : realtime + t->replay_shift_us;
+            continue;
+        }
+        pts = (flags & NET_TRACE_PTS) ? (int64_t)avio_rl64(pb) : AV_NOPTS_VALUE;
+        dts = (flags & NET_TRACE_DTS) ? (int64_t)avio_rl64(pb) : AV_NOPTS_VALUE;
+        duration = (int32_t)avio_rl32(pb);
+        size = (int)avio_rl32(pb);
+        if (avio_feof(pb))
+            return AVERROR_EOF;
+        if (stream >= (int)s->nb_streams || size < 0 || size > NET_TRACE_MAX_PACKET)
+            return AVERROR_INVALIDDATA;
+        if (t->loss_percent > 0 && net_trace_random(t) * 100 < t->loss_percent)
+        {
+            avio_skip(pb, size);
+            metric_add(t->m_dropped, 1);
+            continue;
+        }
+        ret = av_new_packet(pkt, size);
+        if (ret < 0)
+            return ret;
+        if (avio_read(pb, pkt->data, size) != size)
+        {
+            av_packet_unref(pkt);
+            return AVERROR_EOF;
+        }
+        pkt->stream_index = stream;
+        pkt->pts = pts;
+        pkt->dts = dts;
+        pkt->duration = duration;
+        pkt->flags = ((flags & NET_TRACE_KEY) ? AV_PKT_FLAG_KEY : 0) | ((flags & NET_TRACE_CORRUPT) ? AV_PKT_FLAG_CORRUPT : 0);
+        if (t->scale > 0)
+        {
+            int64_t due = t->replay_start_us + (int64_t)(t->arrival_us * t->scale);
+            if (t->jitter_us)
+                due += (int64_t)(net_trace_random(t) * t->jitter_us);
+            int64_t wait = due - av_gettime_relative();
+            if (wait > 0)
+                av_usleep((unsigned int)wait);
+        }
+        return 0;
+    }
+}
+
+// av_read_frame() that records what a live input delivers, or replays a trace
+static inline int net_trace_read_frame(NetTrace *t, AVFormatContext *s, AVPacket *pkt)
+{
+    int ret;
+    if (t->replaying)
+        return net_trace_replay_packet(t, s, pkt);
+    ret = av_read_frame(s, pkt);
+    if (ret >= 0 && t->out)
+        net_trace_record_packet(t, s, pkt);
+    return ret;
+}
+
+#endif // RTSP_AVBRIDGE_NET_TRACE_H
@@ -0,0 +1,107 @@
+// Playout clock shared by the audio and video clients running on one machine.
+//
+// Audio is the master: after every write the audio client publishes which media time is coming out
+// of the speaker right now, as a datagram to a local UDP port. Media time is the sender's wall clock
+// of the samples (the RTCP sender reports give start_time_realtime), so it is comparable across the
+// two RTSP sessions. The video client extrapolates the last sample to the present and presents,
+// holds or drops each frame against it. Without fresh samples it falls back to presenting frames as
+// they decode.
+//
+// Header only so every program keeps building from a single source file.
+#ifndef RTSP_AVBRIDGE_PLAYOUT_CLOCK_H
+#define RTSP_AVBRIDGE_PLAYOUT_CLOCK_H
+
+#include "metrics.h"
+
+#define PLAYOUT_CLOCK_MAGIC 0x504c4b31u         // "PLK1"
+#define PLAYOUT_CLOCK_STALE_US 2000000          // Older samples mean there is no audio master
+
+typedef struct PlayoutClockSample
+{
+    uint32_t magic;
+    uint32_t reserved;
+    int64_t media_us;               // Media time playing out at at_us
+    int64_t at_us;                  // av_gettime() of the measurement
+} PlayoutClockSample;
+
+typedef struct PlayoutClock
+{
+    metrics_socket_t fd;
+    struct sockaddr_in addr;
+    PlayoutClockSample last;
+} PlayoutClock;
+
+// "port" or "host:port"; the publisher sends there, the follower binds it
+static inline int playout_clock_open(PlayoutClock *c, const char *address, int publisher)
+{
+    char host[64] = "127.0.0.1";
+    const char *colon = strrchr(address, ':');
+
+    memset(c, 0, sizeof(*c));
+    c->last.at_us = AV_NOPTS_VALUE;
+#ifdef _WIN32
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+        return -1;
+#endif
+    if (colon)
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - address), address);
+    c->addr.sin_family = AF_INET;
+    c->addr.sin_port = htons((unsigned short)atoi(colon ? colon + 1 : address));
+    c->fd = METRICS_INVALID_SOCKET;
+    if (inet_pton(AF_INET, host, &c->addr.sin_addr) != 1)
+        return -1;
+    c->fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (c->fd == METRICS_INVALID_SOCKET)
+        return -1;
+    if (!publisher && bind(c->fd, (struct sockaddr *)&c->addr, sizeof(c->addr)) < 0)
+    {
+        metrics_closesocket(c->fd);
+        c->fd = METRICS_INVALID_SOCKET;
+        return -1;
+    }
+    return 0;
+}
+
+static inline void playout_clock_publish(PlayoutClock *c, int64_t media_us, int64_t now_us)
+{
+    PlayoutClockSample sample = {PLAYOUT_CLOCK_MAGIC, 0, media_us, now_us};
+    if (c->fd != METRICS_INVALID_SOCKET)
+        sendto(c->fd, (const char *)&sample, sizeof(sample), 0, (struct sockaddr *)&c->addr, sizeof(c->addr));
+}
+
+// Media time the audio master plays at now_us, or AV_NOPTS_VALUE without a recent sample
+static inline int64_t playout_clock_media_now(PlayoutClock *c, int64_t now_us)
+{
+    PlayoutClockSample sample;
+    struct timeval tv = {0, 0};
+    fd_set fds;
+
+    if (c->fd == METRICS_INVALID_SOCKET)
+        return AV_NOPTS_VALUE;
+    for (;;)
+    {
+        FD_ZERO(&fds);
+        FD_SET(c->fd, &fds);
+        if (select((int)c->fd + 1, &fds, NULL, NULL, &tv) <= 0)
+            break;
+        if (recv(c->fd, (char *)&sample, sizeof(sample), 0) == (int)sizeof(sample) &&
+            sample.magic == PLAYOUT_CLOCK_MAGIC)
+            c->last = sample;
+    }
+    if (c->last.at_us == AV_NOPTS_VALUE || now_us - c->last.at_us > PLAYOUT_CLOCK_STALE_US)
+        return AV_NOPTS_VALUE;
+    return c->last.media_us + (now_us - c->last.at_us);
+}
+
+static inline void playout_clock_close(PlayoutClock *c)
+{
+    if (c->fd != METRICS_INVALID_SOCKET)
+        metrics_closesocket(c->fd);
+    c->fd = METRICS_INVALID_SOCKET;
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
+
+#endif // RTSP_AVBRIDGE_PLAYOUT_CLOCK_H
@@ -0,0 +1,254 @@
+// Local recording tee for the servers.
+//
+// The encode loop hands every packet it publishes to record_tee_push(), which takes a new
+// reference to it (no copy of the payload) and puts it in a bounded single-producer /
+// single-consumer ring. A dedicated I/O thread drains the ring into fragmented MP4 segments
+// (prefix-YYYYmmdd-HHMMSS.mp4), starting a new segment on the first keyframe after
+// segment_seconds. When the ring is full, or holds more than max_bytes, packets are dropped
+// instead of waiting, and video drops until the next keyframe so segments stay decodable:
+// a slow disk costs recorded frames, never live latency.
+//
+// Header only so every program keeps building from a single source file. Linux only.
+#ifndef RTSP_AVBRIDGE_RECORD_TEE_H
+#define RTSP_AVBRIDGE_RECORD_TEE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <libavformat/avformat.h>
+#include <libavutil/time.h>
+
+#include "metrics.h"
+
+typedef struct RecordTee
+{
+    // Configuration, fixed once the I/O thread runs
+    const char *dir;
+    const char *prefix;
+    int segment_seconds;
+    int64_t max_bytes;
+    int write_delay_us;             // Artificial delay per write, to check behaviour on slow disks
+    AVCodecParameters *par;
+    AVRational time_base;           // Time base of the pushed packets
+
+    // Ring of preallocated packets: head is written by the producer only, tail by the I/O thread only
+    AVPacket **slots;
+    unsigned int capacity;
+    unsigned int head;
+    unsigned int tail;
+    volatile int64_t queued_bytes;
+    int need_keyframe;              // Producer side: dropping until the next keyframe
+
+    volatile int64_t stop;
+    int running;
+    pthread_t thread;
+
+    // I/O thread state
+    AVFormatContext *seg;
+    int64_t seg_start_ts;
+
+    Metric *m_depth, *m_dropped, *m_written, *m_segments, *m_write_time;
+} RecordTee;
+
+// Zero the tee and register its metrics; call before metrics_start()
+static inline void record_tee_init(RecordTee *t, MetricsServer *metrics)
+{
+    memset(t, 0, sizeof(*t));
+    t->m_depth = metrics_gauge(metrics, "record_queue_packets", "Packets waiting for the recording thread");
+    t->m_dropped = metrics_counter(metrics, "record_dropped_packets_total", "Packets not recorded because of backpressure");
+    t->m_written = metrics_counter(metrics, "record_bytes_total", "Bytes written to recordings");
+    t->m_segments = metrics_counter(metrics, "record_segments_total", "Recording segments started");
+    t->m_write_time = metrics_histogram_us(metrics, "record_write_seconds", "Time per recorded packet write",
+                                           metrics_frame_time_bounds_us, METRICS_FRAME_TIME_BUCKETS);
+}
+
+static inline void record_tee_close_segment(RecordTee *t)
+{
+    if (!t->seg)
+        return;
+    av_write_trailer(t->seg);
+    avio_closep(&t->seg->pb);
+    avformat_free_context(t->seg);
+    t->seg = NULL;
+}
+
+static inline int record_tee_open_segment(RecordTee *t, int64_t start_ts)
+{
+    char filename[1024], stamp[32];
+    time_t now = time(NULL);
+    struct tm tm;
+    AVStream *st;
+    AVDictionary *opts = NULL;
+    int ret;
+
+    localtime_r(&now, &tm);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+    snprintf(filename, sizeof(filename), "%s/%s-%s.mp4", t->dir, t->prefix, stamp);
+
+    ret = avformat_alloc_output_context2(&t->seg, NULL, "mp4", filename);
+    if (ret < 0)
+        return ret;
+    st = avformat_new_stream(t->seg, NULL);
+    if (!st || (ret = avcodec_parameters_copy(st->codecpar, t->par)) < 0)
+        goto fail;
+    st->codecpar->codec_tag = 0;
+    st->time_base = t->time_base;
+    if ((ret = avio_open(&t->seg->pb, filename, AVIO_FLAG_WRITE)) < 0)
+        goto fail;
+    // Fragmented so a segment cut short by a crash or power loss is still playable
+    av_dict_set(&opts, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+    ret = avformat_write_header(t->seg, &opts);
+    av_dict_free(&opts);
+    if (ret < 0)
+        goto fail;
+
+    t->seg_start_ts = start_ts;
+    metric_add(t->m_segments, 1);
+    printf("recording to %s\n", filename);
+    return 0;
+
+fail:
+    printf("cannot open recording segment %s\n", filename);
+    if (t->seg->pb)
+        avio_closep(&t->seg->pb);
+    avformat_free_context(t->seg);
+    t->seg = NULL;
+    return ret < 0 ? ret : AVERROR(ENOMEM);
+}
+
+static inline void record_tee_write(RecordTee *t, AVPacket *pkt)
+{
+    int key = pkt->flags & AV_PKT_FLAG_KEY;
+    int64_t ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+    int64_t start = av_gettime_relative();
+
+    // Cut a new segment on the first keyframe past the segment length
+    if (t->seg && key &&
+        av_compare_ts(ts - t->seg_start_ts, t->time_base, t->segment_seconds, (AVRational){1, 1}) >= 0)
+        record_tee_close_segment(t);
+    if (!t->seg)
+    {
+        if (!key || record_tee_open_segment(t, ts) < 0)
+            return;
+    }
+
+    // Segments start at zero
+    if (pkt->pts != AV_NOPTS_VALUE)
+        pkt->pts -= t->seg_start_ts;
+    if (pkt->dts != AV_NOPTS_VALUE)
+        pkt->dts -= t->seg_start_ts;
+    av_packet_rescale_ts(pkt, t->time_base, t->seg->streams[0]->time_base);
+    pkt->stream_index = 0;
+    if (t->write_delay_us)
+        usleep(t->write_delay_us);
+    if (av_write_frame(t->seg, pkt) < 0)
+    {
+        printf("recording write failed, starting a new segment\n");
+        record_tee_close_segment(t);
+        return;
+    }
+    metric_add(t->m_written, pkt->size);
+    metric_observe(t->m_write_time, av_gettime_relative() - start);
+}
+
+static void *record_tee_thread(void *arg)
+{
+    RecordTee *t = (RecordTee *)arg;
+    for (;;)
+    {
+        unsigned int head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+        if (t->tail == head)
+        {
+            // Only exit once everything queued before stop has been written
+            if (metrics_atomic_load(&t->stop))
+                break;
+            usleep(5000);
+            continue;
+        }
+        AVPacket *pkt = t->slots[t->tail % t->capacity];
+        int size = pkt->size;
+        record_tee_write(t, pkt);
+        av_packet_unref(pkt);
+        metrics_atomic_add(&t->queued_bytes, -size);
+        __atomic_store_n(&t->tail, t->tail + 1, __ATOMIC_RELEASE);
+        metric_set(t->m_depth, head - t->tail);
+    }
+    record_tee_close_segment(t);
+    return NULL;
+}
+
+// Start recording packets of the given stream parameters into dir
+static inline int record_tee_start(RecordTee *t, const char *dir, const char *prefix, const AVCodecParameters *par,
+                                   AVRational time_base, int segment_seconds, unsigned int capacity, int64_t max_bytes)
+{
+    t->dir = dir;
+    t->prefix = prefix;
+    t->segment_seconds = segment_seconds > 0 ? segment_seconds : 60;
+    t->max_bytes = max_bytes;
+    t->time_base = time_base;
+    t->capacity = capacity;
+    t->need_keyframe = 1;
+    t->par = avcodec_parameters_alloc();
+    t->slots = (AVPacket **)av_calloc(capacity, sizeof(*t->slots));
+    if (!t->par || !t->slots || avcodec_parameters_copy(t->par, par) < 0)
+        return AVERROR(ENOMEM);
+    for (unsigned int i = 0; i < capacity; i++)
+    {
+        t->slots[i] = av_packet_alloc();
+        if (!t->slots[i])
+            return AVERROR(ENOMEM);
+    }
+    if (pthread_create(&t->thread, NULL, record_tee_thread, t) != 0)
+        return AVERROR(EAGAIN);
+    t->running = 1;
+    return 0;
+}
+
+// Queue a reference to pkt for recording. Never blocks; drops under backpressure.
+static inline void record_tee_push(RecordTee *t, const AVPacket *pkt)
+{
+    unsigned int tail;
+    if (!t->running)
+        return;
+    tail = __atomic_load_n(&t->tail, __ATOMIC_ACQUIRE);
+    if (t->need_keyframe && !(pkt->flags & AV_PKT_FLAG_KEY))
+    {
+        metric_add(t->m_dropped, 1);
+        return;
+    }
+    if (t->head - tail >= t->capacity ||
+        metrics_atomic_load(&t->queued_bytes) + pkt->size > t->max_bytes ||
+        av_packet_ref(t->slots[t->head % t->capacity], pkt) < 0)
+    {
+        metric_add(t->m_dropped, 1);
+        t->need_keyframe = 1;
+        return;
+    }
+    t->need_keyframe = 0;
+    metrics_atomic_add(&t->queued_bytes, pkt->size);
+    __atomic_store_n(&t->head, t->head + 1, __ATOMIC_RELEASE);
+    metric_set(t->m_depth, t->head - tail);
+}
+
+// Flush what is queued, finish the current segment and release everything
+static inline void record_tee_stop(RecordTee *t)
+{
+    if (t->running)
+    {
+        metrics_atomic_store(&t->stop, 1);
+        pthread_join(t->thread, NULL);
+        t->running = 0;
+    }
+    if (t->slots)
+    {
+        for (unsigned int i = 0; i < t->capacity; i++)
+            av_packet_free(&t->slots[i]);
+        av_freep(&t->slots);
+    }
+    avcodec_parameters_free(&t->par);
+}
+
+#endif // RTSP_AVBRIDGE_RECORD_TEE_H
@@ -0,0 +1,459 @@
+// Batched RTP over UDP output for the video server.
+//
+// libavformat's RTSP muxer sends every RTP packet with its own sendto(), so a keyframe of a few
+// hundred packets costs a few hundred syscalls in the middle of the encode loop. Here the RTSP
+// session (ANNOUNCE, SETUP over UDP, RECORD) is set up directly, libavformat's "rtp" muxer still
+// does the packetization, but it writes into a custom AVIOContext that only queues the packets.
+// rtp_egress_flush() then sends everything queued for the access unit with sendmmsg(). Where the
+// kernel supports UDP GSO (Linux 4.18+), runs of equally sized packets, which is most of a
+// fragmented frame, go out as one message of up to 64 segments that the kernel splits. With a
+// pacing rate the packets leave in small batches spaced at that rate, but never stretched over more
+// than the given limit, so a keyframe does not arrive at the server as one burst.
+//
+// RTCP sender reports are rare and go out right away on the RTCP socket. Authentication and TCP
+// interleaving are not supported; use the libavformat muxer for those. Without RTSP, the same
+// output sends to a fixed address instead, typically a multicast group.
+//
+// Header only so every program keeps building from a single source file. Linux only, and needs
+// _GNU_SOURCE defined before the first include for sendmmsg().
+#ifndef RTSP_AVBRIDGE_RTP_EGRESS_H
+#define RTSP_AVBRIDGE_RTP_EGRESS_H
+
+#include <errno.h>
+#include <netdb.h>
+#include <strings.h>
+#include <netinet/udp.h>
+
+#include <libavformat/avformat.h>
+#include <libavutil/mem.h>
+#include <libavutil/parseutils.h>
+#include <libavutil/random_seed.h>
+#include <libavutil/time.h>
+
+#include "metrics.h"
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+
+#define RTP_EGRESS_PACKET_SIZE 1472         // 1500 byte MTU minus IP and UDP headers
+#define RTP_EGRESS_MAX_PACKETS 512          // Queued per flush; a larger frame flushes early
+#define RTP_EGRESS_GSO_SEGMENTS 64          // Kernel limit per GSO message
+#define RTP_EGRESS_GSO_BYTES 65000
+#define RTP_EGRESS_PACE_PACKETS 8           // Packets per paced batch
+#define RTP_EGRESS_REPLY_SIZE 4096
+
+typedef struct RtpEgress
+{
+    int rtsp_fd, rtp_fd, rtcp_fd;
+    struct sockaddr_in rtp_addr, rtcp_addr;
+    char url[1024];
+    char session[128];
+    int cseq;
+    int gso;                                // UDP GSO accepted by the kernel
+    int64_t pace_bps;                       // 0 = send each batch at once
+    int64_t pace_max_us;                    // Longest one flush may be spread out
+
+    AVIOContext *pb;
+    uint8_t *slots;                         // RTP_EGRESS_MAX_PACKETS packets of RTP_EGRESS_PACKET_SIZE
+    int lens[RTP_EGRESS_MAX_PACKETS];
+    int nb_packets;
+
+    Metric *m_syscalls, *m_packets, *m_messages, *m_send;
+} RtpEgress;
+
+static inline void rtp_egress_init(RtpEgress *e, MetricsServer *metrics)
+{
+    memset(e, 0, sizeof(*e));
+    e->rtsp_fd = e->rtp_fd = e->rtcp_fd = -1;
+    e->m_syscalls = metrics_counter(metrics, "egress_syscalls_total", "Send syscalls of the batched RTP output");
+    e->m_packets = metrics_counter(metrics, "egress_packets_total", "RTP and RTCP packets sent by the batched output");
+    e->m_messages = metrics_counter(metrics, "egress_messages_total", "UDP messages handed to the kernel, one per GSO run");
+    e->m_send = metrics_histogram_us(metrics, "egress_send_seconds", "Time to send one frame's packets, pacing included",
+                                     metrics_frame_time_bounds_us, METRICS_FRAME_TIME_BUCKETS);
+}
+
+// Send [first, end) of the queue from the RTP socket, one sendmmsg() for all of it unless the
+// kernel takes only part
+static inline int rtp_egress_send(RtpEgress *e, int first, int end)
+{
+    struct mmsghdr msgs[RTP_EGRESS_MAX_PACKETS];
+    struct iovec iov[RTP_EGRESS_MAX_PACKETS];
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(uint16_t))];
+        struct cmsghdr align;
+    } control[RTP_EGRESS_MAX_PACKETS];
+    int msg_first[RTP_EGRESS_MAX_PACKETS];
+    int nb_msgs = 0, sent = 0;
+
+    memset(msgs, 0, sizeof(*msgs) * (end - first));
+    for (int i = first; i < end;)
+    {
+        struct msghdr *m = &msgs[nb_msgs].msg_hdr;
+        int n = 1, bytes = e->lens[i];
+        // A GSO run is equally sized segments, the last one may be shorter
+        while (e->gso && i + n < end && n < RTP_EGRESS_GSO_SEGMENTS && e->lens[i + n - 1] == e->lens[i] &&
+               e->lens[i + n] <= e->lens[i] && bytes + e->lens[i + n] <= RTP_EGRESS_GSO_BYTES)
+            bytes += e->lens[i + n++];
+        for (int k = 0; k < n; k++)
+        {
+            iov[i + k].iov_base = e->slots + (size_t)(i + k) * RTP_EGRESS_PACKET_SIZE;
+            iov[i + k].iov_len = e->lens[i + k];
+        }
+        m->msg_name = &e->rtp_addr;
+        m->msg_namelen = sizeof(e->rtp_addr);
+        m->msg_iov = &iov[i];
+        m->msg_iovlen = n;
+        if (n > 1)
+        {
+            struct cmsghdr *cm;
+            m->msg_control = control[nb_msgs].buf;
+            m->msg_controllen = sizeof(control[nb_msgs].buf);
+            cm = CMSG_FIRSTHDR(m);
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            *(uint16_t *)CMSG_DATA(cm) = (uint16_t)e->lens[i];
+        }
+        msg_first[nb_msgs++] = i;
+        i += n;
+    }
+
+    while (sent < nb_msgs)
+    {
+        int ret = sendmmsg(e->rtp_fd, msgs + sent, nb_msgs - sent, 0);
+        metric_add(e->m_syscalls, 1);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            // The route cannot segment after all: send the rest packet by packet from now on
+            if (e->gso && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP))
+            {
+                e->gso = 0;
+                return rtp_egress_send(e, msg_first[sent], end);
+            }
+            // A port unreachable from an earlier packet; the server may come back, drop one message
+            if (errno == ECONNREFUSED)
+            {
+                sent++;
+                continue;
+            }
+            return AVERROR(errno);
+        }
+        metric_add(e->m_messages, ret);
+        sent += ret;
+    }
+    metric_add(e->m_packets, end - first);
+    return 0;
+}
+
+// Send everything the muxer queued, paced if a rate is set
+static inline int rtp_egress_flush(RtpEgress *e)
+{
+    int64_t start = av_gettime_relative(), bytes = 0;
+    int ret = 0;
+
+    for (int i = 0; i < e->nb_packets && ret >= 0;)
+    {
+        int end = e->pace_bps ? FFMIN(i + RTP_EGRESS_PACE_PACKETS, e->nb_packets) : e->nb_packets;
+        if (e->pace_bps && bytes)
+        {
+            int64_t due = start + bytes * 8 * 1000000 / e->pace_bps;
+            int64_t now = av_gettime_relative();
+            if (due > now && due - start < e->pace_max_us)
+                av_usleep((unsigned int)(due - now));
+        }
+        ret = rtp_egress_send(e, i, end);
+        for (; i < end; i++)
+            bytes += e->lens[i];
+    }
+    if (e->nb_packets)
+        metric_observe(e->m_send, av_gettime_relative() - start);
+    e->nb_packets = 0;
+    return ret;
+}
+
+// AVIOContext write callback: the RTP muxer flushes after every packet, so each call is one packet
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+static int rtp_egress_write(void *opaque, const uint8_t *buf, int size)
+#else
+static int rtp_egress_write(void *opaque, uint8_t *buf, int size)
+#endif
+{
+    RtpEgress *e = (RtpEgress *)opaque;
+    int ret;
+
+    if (size > RTP_EGRESS_PACKET_SIZE)
+        return AVERROR(EINVAL);
+    // RTCP packet types 200-204 in the second byte
+    if (size >= 2 && buf[1] >= 200 && buf[1] <= 204)
+    {
+        if (sendto(e->rtcp_fd, buf, size, 0, (struct sockaddr *)&e->rtcp_addr, sizeof(e->rtcp_addr)) < 0 &&
+            errno != ECONNREFUSED)
+            return AVERROR(errno);
+        metric_add(e->m_syscalls, 1);
+        metric_add(e->m_packets, 1);
+        metric_add(e->m_messages, 1);
+        return size;
+    }
+    if (e->nb_packets == RTP_EGRESS_MAX_PACKETS && (ret = rtp_egress_flush(e)) < 0)
+        return ret;
+    memcpy(e->slots + (size_t)e->nb_packets * RTP_EGRESS_PACKET_SIZE, buf, size);
+    e->lens[e->nb_packets++] = size;
+    return size;
+}
+
+// Value of a header in an RTSP reply, up to the end of the line
+static inline const char *rtp_egress_header(const char *reply, const char *name, char *value, int size)
+{
+    size_t len = strlen(name);
+    for (const char *line = reply; line && *line; line = strchr(line, '\n'), line = line ? line + 1 : NULL)
+    {
+        if (!strncasecmp(line, name, len) && line[len] == ':')
+        {
+            const char *v = line + len + 1;
+            int n = 0;
+            while (*v == ' ')
+                v++;
+            while (v[n] && v[n] != '\r' && v[n] != '\n' && n < size - 1)
+                n++;
+            snprintf(value, size, "%.*s", n, v);
+            return value;
+        }
+    }
+    return NULL;
+}
+
+// One RTSP request; returns the status code or a negative AVERROR, the reply headers in reply
+static inline int rtp_egress_request(RtpEgress *e, const char *method, const char *uri, const char *headers,
+                                     const char *body, char *reply)
+{
+    char request[8192];
+    int n = 0, len, content_length = 0, status;
+    char *end;
+    char value[32];
+
+    reply[0] = 0;
+    len = snprintf(request, sizeof(request), "%s %s RTSP/1.0\r\nCSeq: %d\r\nUser-Agent: rtsp-avbridge\r\n%s%s%s%s",
+                   method, uri, ++e->cseq, e->session[0] ? "Session: " : "", e->session, e->session[0] ? "\r\n" : "",
+                   headers ? headers : "");
+    if (body)
+        len += snprintf(request + len, sizeof(request) - len, "Content-Length: %d\r\n\r\n%s", (int)strlen(body), body);
+    else
+        len += snprintf(request + len, sizeof(request) - len, "\r\n");
+    if (len >= (int)sizeof(request))
+        return AVERROR(ENOMEM);
+    if (send(e->rtsp_fd, request, len, 0) != len)
+        return AVERROR(EIO);
+
+    // Headers, then whatever body the reply has
+    while (!(end = strstr(reply, "\r\n\r\n")))
+    {
+        int ret;
+        if (n == RTP_EGRESS_REPLY_SIZE - 1 || (ret = (int)recv(e->rtsp_fd, reply + n, RTP_EGRESS_REPLY_SIZE - 1 - n, 0)) <= 0)
+            return AVERROR(EIO);
+        n += ret;
+        reply[n] = 0;
+    }
+    if (rtp_egress_header(reply, "Content-Length", value, sizeof(value)))
+        content_length = atoi(value);
+    for (int rest = content_length - (int)(reply + n - (end + 4)); rest > 0;)
+    {
+        char skip[512];
+        int ret = (int)recv(e->rtsp_fd, skip, FFMIN(rest, (int)sizeof(skip)), 0);
+        if (ret <= 0)
+            return AVERROR(EIO);
+        rest -= ret;
+    }
+    end[2] = 0;
+    if (sscanf(reply, "RTSP/1.0 %d", &status) != 1)
+        return AVERROR_INVALIDDATA;
+    return status;
+}
+
+// Two adjacent UDP ports, RTP on the even one
+static inline int rtp_egress_bind(RtpEgress *e)
+{
+    int port = 20000 + 2 * (int)(av_get_random_seed() % 20000);
+    struct sockaddr_in addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    for (int tries = 0; tries < 100; tries++, port = port + 2 < 60000 ? port + 2 : 20000)
+    {
+        e->rtp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+        e->rtcp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (e->rtp_fd < 0 || e->rtcp_fd < 0)
+            return AVERROR(errno);
+        addr.sin_port = htons(port);
+        if (bind(e->rtp_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+        {
+            addr.sin_port = htons(port + 1);
+            if (bind(e->rtcp_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+                return port;
+        }
+        close(e->rtp_fd);
+        close(e->rtcp_fd);
+        e->rtp_fd = e->rtcp_fd = -1;
+    }
+    return AVERROR(EADDRINUSE);
+}
+
+// The queue, and the AVIOContext the muxer writes one packet per flush into, a buffer of exactly
+// one packet. Points s->pb at it.
+static inline int rtp_egress_alloc(RtpEgress *e, AVFormatContext *s)
+{
+    uint8_t *buffer;
+
+    e->slots = (uint8_t *)av_malloc((size_t)RTP_EGRESS_MAX_PACKETS * RTP_EGRESS_PACKET_SIZE);
+    buffer = (uint8_t *)av_malloc(RTP_EGRESS_PACKET_SIZE);
+    if (!e->slots || !buffer)
+    {
+        av_free(buffer);
+        return AVERROR(ENOMEM);
+    }
+    e->pb = avio_alloc_context(buffer, RTP_EGRESS_PACKET_SIZE, 1, e, NULL, rtp_egress_write, NULL);
+    if (!e->pb)
+    {
+        av_free(buffer);
+        return AVERROR(ENOMEM);
+    }
+    e->pb->max_packet_size = RTP_EGRESS_PACKET_SIZE;
+    s->pb = e->pb;
+    return 0;
+}
+
+// Publish the single stream of s (an "rtp" muxer context, header not written yet) to url, and
+// point s->pb at the batching output. pace_bps 0 turns pacing off.
+static inline int rtp_egress_open(RtpEgress *e, AVFormatContext *s, const char *url, int64_t pace_bps, int64_t pace_max_us)
+{
+    char host[256], path[1024], sdp[4096], headers[256], reply[RTP_EGRESS_REPLY_SIZE], value[256];
+    char port_str[16];
+    struct addrinfo hints, *ai = NULL;
+    struct sockaddr_in peer;
+    socklen_t peer_len = sizeof(peer);
+    int port, client_port, server_rtp, server_rtcp, ret, sndbuf = 4 << 20, off = 0;
+
+    e->pace_bps = pace_bps;
+    e->pace_max_us = pace_max_us;
+    snprintf(e->url, sizeof(e->url), "%s", url);
+    av_url_split(NULL, 0, NULL, 0, host, sizeof(host), &port, path, sizeof(path), url);
+    snprintf(port_str, sizeof(port_str), "%d", port > 0 ? port : 554);
+    if ((ret = rtp_egress_alloc(e, s)) < 0)
+        return ret;
+
+    // Without a destination in the context the SDP gets the a=control lines SETUP needs
+    if ((ret = av_sdp_create(&s, 1, sdp, sizeof(sdp))) < 0)
+        return ret;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port_str, &hints, &ai) != 0)
+        return AVERROR(EHOSTUNREACH);
+    e->rtsp_fd = socket(AF_INET, SOCK_STREAM, 0);
+    ret = e->rtsp_fd < 0 ? AVERROR(errno) : connect(e->rtsp_fd, ai->ai_addr, ai->ai_addrlen) < 0 ? AVERROR(errno) : 0;
+    freeaddrinfo(ai);
+    if (ret < 0 || getpeername(e->rtsp_fd, (struct sockaddr *)&peer, &peer_len) < 0)
+        return ret < 0 ? ret : AVERROR(errno);
+
+    if ((client_port = rtp_egress_bind(e)) < 0)
+        return client_port;
+    setsockopt(e->rtp_fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    e->gso = setsockopt(e->rtp_fd, SOL_UDP, UDP_SEGMENT, &off, sizeof(off)) == 0;
+
+    ret = rtp_egress_request(e, "ANNOUNCE", url, "Content-Type: application/sdp\r\n", sdp, reply);
+    if (ret != 200)
+        return ret < 0 ? ret : AVERROR(EPERM);
+    snprintf(headers, sizeof(headers), "Transport: RTP/AVP/UDP;unicast;client_port=%d-%d;mode=record\r\n",
+             client_port, client_port + 1);
+    snprintf(path, sizeof(path), "%s/streamid=0", url);
+    ret = rtp_egress_request(e, "SETUP", path, headers, NULL, reply);
+    if (ret != 200)
+        return ret < 0 ? ret : AVERROR(EPERM);
+    if (rtp_egress_header(reply, "Session", value, sizeof(value)))
+        snprintf(e->session, sizeof(e->session), "%.*s", (int)strcspn(value, ";"), value);
+    if (!rtp_egress_header(reply, "Transport", value, sizeof(value)) || !strstr(value, "server_port=") ||
+        sscanf(strstr(value, "server_port=") + 12, "%d-%d", &server_rtp, &server_rtcp) != 2)
+        return AVERROR_INVALIDDATA;
+    e->rtp_addr = peer;
+    e->rtp_addr.sin_port = htons(server_rtp);
+    e->rtcp_addr = peer;
+    e->rtcp_addr.sin_port = htons(server_rtcp);
+    ret = rtp_egress_request(e, "RECORD", url, "Range: npt=0.000-\r\n", NULL, reply);
+    if (ret != 200)
+        return ret < 0 ? ret : AVERROR(EPERM);
+    return 0;
+}
+
+// Send the single stream of s straight to "rtp://host:port[?ttl=n]", RTCP to port + 1, without
+// any session; for a multicast group every receiver joins, with the SDP from av_sdp_create(). s is
+// an "rtp" muxer context with that url, header not written yet; s->pb is pointed at the batching
+// output. The TTL (default 1, this subnet) only matters for multicast.
+static inline int rtp_egress_open_udp(RtpEgress *e, AVFormatContext *s, const char *url, int64_t pace_bps, int64_t pace_max_us)
+{
+    char host[256], path[1024], value[16];
+    const char *query;
+    int port, ret, sndbuf = 4 << 20, off = 0, ttl = 1;
+
+    e->pace_bps = pace_bps;
+    e->pace_max_us = pace_max_us;
+    snprintf(e->url, sizeof(e->url), "%s", url);
+    av_url_split(NULL, 0, NULL, 0, host, sizeof(host), &port, path, sizeof(path), url);
+    if ((query = strchr(path, '?')) && av_find_info_tag(value, sizeof(value), "ttl", query))
+        ttl = atoi(value);
+    if (port <= 0 || port > 65534)
+        return AVERROR(EINVAL);
+    e->rtp_addr.sin_family = AF_INET;
+    e->rtp_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &e->rtp_addr.sin_addr) != 1)
+        return AVERROR(EINVAL);
+    e->rtcp_addr = e->rtp_addr;
+    e->rtcp_addr.sin_port = htons(port + 1);
+    if ((ret = rtp_egress_alloc(e, s)) < 0)
+        return ret;
+
+    e->rtp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    e->rtcp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (e->rtp_fd < 0 || e->rtcp_fd < 0)
+        return AVERROR(errno);
+    if (IN_MULTICAST(ntohl(e->rtp_addr.sin_addr.s_addr)) &&
+        (setsockopt(e->rtp_fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0 ||
+         setsockopt(e->rtcp_fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0))
+        return AVERROR(errno);
+    setsockopt(e->rtp_fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    e->gso = setsockopt(e->rtp_fd, SOL_UDP, UDP_SEGMENT, &off, sizeof(off)) == 0;
+    return 0;
+}
+
+// After av_write_trailer(): send what is left, end the session and free everything
+static inline void rtp_egress_close(RtpEgress *e)
+{
+    char reply[RTP_EGRESS_REPLY_SIZE];
+
+    if (e->rtp_fd >= 0)
+        rtp_egress_flush(e);
+    if (e->rtsp_fd >= 0 && e->session[0])
+        rtp_egress_request(e, "TEARDOWN", e->url, NULL, NULL, reply);
+    if (e->rtsp_fd >= 0)
+        close(e->rtsp_fd);
+    if (e->rtp_fd >= 0)
+        close(e->rtp_fd);
+    if (e->rtcp_fd >= 0)
+        close(e->rtcp_fd);
+    e->rtsp_fd = e->rtp_fd = e->rtcp_fd = -1;
+    if (e->pb)
+    {
+        av_freep(&e->pb->buffer);
+        avio_context_free(&e->pb);
+    }
+    av_freep(&e->slots);
+}
+
+#endif // RTSP_AVBRIDGE_RTP_EGRESS_H
@@ -0,0 +1,376 @@
+// Sample format conversion without swresample.
+//
+// When the sample rate and channel layout do not change, going from the capture / playback
+// format to the codec's planar float is only a (de)interleave plus a scale. These kernels do
+// that directly (SSE2/AVX2 on x86, NEON on aarch64, plain loops elsewhere), and the callers
+// keep swr_convert for the cases where the rate or the layout really changes.
+//
+// Header only so every program keeps building from a single source file.
+#ifndef RTSP_AVBRIDGE_SAMPLE_CONVERT_H
+#define RTSP_AVBRIDGE_SAMPLE_CONVERT_H
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <libavutil/samplefmt.h>
+#include <libavutil/error.h>
+#ifdef __cplusplus
+}
+#endif
+
+#if defined(__AVX2__)
+#define SC_AVX2 1
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SC_SSE2 1
+#include <emmintrin.h>
+#ifdef SC_AVX2
+#include <immintrin.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define SC_NEON 1
+#include <arm_neon.h>
+#endif
+
+// TPDF dither state for float -> S16, one xorshift32 generator per SIMD lane
+typedef struct SampleDither
+{
+    uint32_t state[4];
+} SampleDither;
+
+static inline void sample_dither_init(SampleDither *d, uint32_t seed)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        // Any non-zero state works for xorshift, just keep the lanes apart
+        d->state[i] = (seed + (uint32_t)i) * 2654435761u | 1u;
+    }
+}
+
+static inline uint32_t sc_xorshift32(uint32_t *x)
+{
+    *x ^= *x << 13;
+    *x ^= *x >> 17;
+    *x ^= *x << 5;
+    return *x;
+}
+
+// Uniform float in [0, 1) from the top 23 bits of a random word
+static inline float sc_uniform(uint32_t x)
+{
+    union { uint32_t u; float f; } v;
+    v.u = (x >> 9) | 0x3f800000u;
+    return v.f - 1.0f;
+}
+
+static inline int16_t sc_flt_to_s16(float v, float dither)
+{
+    v = v * 32768.0f + dither;
+    v = v < -32768.0f ? -32768.0f : (v > 32767.0f ? 32767.0f : v);
+    // Round half to even, as cvtps2dq and fcvtns do in the SIMD paths
+    return (int16_t)lrintf(v);
+}
+
+static inline float sc_scalar_dither(SampleDither *d)
+{
+    if (!d)
+        return 0.0f;
+    // Difference of two uniforms: triangular noise of +-1 LSB
+    return sc_uniform(sc_xorshift32(&d->state[0])) - sc_uniform(sc_xorshift32(&d->state[0]));
+}
+
+#ifdef SC_SSE2
+static inline __m128 sc_uniform_sse2(__m128i *state)
+{
+    __m128i x = *state;
+    x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+    x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+    *state = x;
+    return _mm_sub_ps(_mm_castsi128_ps(_mm_or_si128(_mm_srli_epi32(x, 9), _mm_set1_epi32(0x3f800000))),
+                      _mm_set1_ps(1.0f));
+}
+
+// 4 floats -> 4 rounded, clamped int32 in S16 range
+static inline __m128i sc_flt_to_s16_sse2(const float *src, __m128i *state, int dither)
+{
+    __m128 v = _mm_mul_ps(_mm_loadu_ps(src), _mm_set1_ps(32768.0f));
+    if (dither)
+        v = _mm_add_ps(v, _mm_sub_ps(sc_uniform_sse2(state), sc_uniform_sse2(state)));
+    v = _mm_min_ps(_mm_max_ps(v, _mm_set1_ps(-32768.0f)), _mm_set1_ps(32767.0f));
+    return _mm_cvtps_epi32(v);
+}
+#endif
+
+#ifdef SC_NEON
+static inline float32x4_t sc_uniform_neon(uint32x4_t *state)
+{
+    uint32x4_t x = *state;
+    x = veorq_u32(x, vshlq_n_u32(x, 13));
+    x = veorq_u32(x, vshrq_n_u32(x, 17));
+    x = veorq_u32(x, vshlq_n_u32(x, 5));
+    *state = x;
+    return vsubq_f32(vreinterpretq_f32_u32(vorrq_u32(vshrq_n_u32(x, 9), vdupq_n_u32(0x3f800000))),
+                     vdupq_n_f32(1.0f));
+}
+
+static inline int32x4_t sc_flt_to_s16_neon(const float *src, uint32x4_t *state, int dither)
+{
+    float32x4_t v = vmulq_n_f32(vld1q_f32(src), 32768.0f);
+    if (dither)
+        v = vaddq_f32(v, vsubq_f32(sc_uniform_neon(state), sc_uniform_neon(state)));
+    v = vminq_f32(vmaxq_f32(v, vdupq_n_f32(-32768.0f)), vdupq_n_f32(32767.0f));
+    return vcvtnq_s32_f32(v);
+}
+#endif
+
+// Interleaved S16 -> planar float
+static inline void sc_s16_to_fltp(float **dst, const int16_t *src, int channels, int nb_samples)
+{
+    const float scale = 1.0f / 32768.0f;
+    int i = 0;
+
+    if (channels == 2)
+    {
+        float *l = dst[0], *r = dst[1];
+#ifdef SC_AVX2
+        // Each 32-bit lane holds one L/R pair: L is the low half, R the high half
+        for (; i + 8 <= nb_samples; i += 8)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(src + 2 * i));
+            __m256 lv = _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16));
+            __m256 rv = _mm256_cvtepi32_ps(_mm256_srai_epi32(v, 16));
+            _mm256_storeu_ps(l + i, _mm256_mul_ps(lv, _mm256_set1_ps(scale)));
+            _mm256_storeu_ps(r + i, _mm256_mul_ps(rv, _mm256_set1_ps(scale)));
+        }
+#endif
+#ifdef SC_SSE2
+        for (; i + 4 <= nb_samples; i += 4)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+            __m128 lv = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_slli_epi32(v, 16), 16));
+            __m128 rv = _mm_cvtepi32_ps(_mm_srai_epi32(v, 16));
+            _mm_storeu_ps(l + i, _mm_mul_ps(lv, _mm_set1_ps(scale)));
+            _mm_storeu_ps(r + i, _mm_mul_ps(rv, _mm_set1_ps(scale)));
+        }
+#elif defined(SC_NEON)
+        for (; i + 8 <= nb_samples; i += 8)
+        {
+            int16x8x2_t v = vld2q_s16(src + 2 * i);
+            vst1q_f32(l + i, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v.val[0]))), scale));
+            vst1q_f32(l + i + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v.val[0]))), scale));
+            vst1q_f32(r + i, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v.val[1]))), scale));
+            vst1q_f32(r + i + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v.val[1]))), scale));
+        }
+#endif
+        for (; i < nb_samples; i++)
+        {
+            l[i] = src[2 * i] * scale;
+            r[i] = src[2 * i + 1] * scale;
+        }
+        return;
+    }
+
+    if (channels == 1)
+    {
+        float *m = dst[0];
+#ifdef SC_SSE2
+        for (; i + 8 <= nb_samples; i += 8)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+            __m128 lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16));
+            __m128 hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16));
+            _mm_storeu_ps(m + i, _mm_mul_ps(lo, _mm_set1_ps(scale)));
+            _mm_storeu_ps(m + i + 4, _mm_mul_ps(hi, _mm_set1_ps(scale)));
+        }
+#elif defined(SC_NEON)
+        for (; i + 8 <= nb_samples; i += 8)
+        {
+            int16x8_t v = vld1q_s16(src + i);
+            vst1q_f32(m + i, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v))), scale));
+            vst1q_f32(m + i + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v))), scale));
+        }
+#endif
+        for (; i < nb_samples; i++)
+            m[i] = src[i] * scale;
+        return;
+    }
+
+    // 3+ channels: one strided pass per channel, the inner loop is simple enough to vectorize
+    for (int ch = 0; ch < channels; ch++)
+    {
+        float *p = dst[ch];
+        for (i = 0; i < nb_samples; i++)
+            p[i] = src[i * channels + ch] * scale;
+    }
+}
+
+// Planar float -> interleaved S16, with optional TPDF dither
+static inline void sc_fltp_to_s16(int16_t *dst, const float *const *src, int channels, int nb_samples,
+                                  SampleDither *dither)
+{
+    int i = 0;
+
+    if (channels <= 2)
+    {
+        const float *l = src[0], *r = channels == 2 ? src[1] : NULL;
+#ifdef SC_SSE2
+        __m128i state = dither ? _mm_loadu_si128((const __m128i *)dither->state) : _mm_set1_epi32(1);
+        for (; i + 8 <= nb_samples; i += 8)
+        {
+            __m128i lp = _mm_packs_epi32(sc_flt_to_s16_sse2(l + i, &state, dither != NULL),
+                                         sc_flt_to_s16_sse2(l + i + 4, &state, dither != NULL));
+            if (!r)
+            {
+                _mm_storeu_si128((__m128i *)(dst + i), lp);
+                continue;
+            }
+            __m128i rp = _mm_packs_epi32(sc_flt_to_s16_sse2(r + i, &state, dither != NULL),
+                                         sc_flt_to_s16_sse2(r + i + 4, &state, dither != NULL));
+            _mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_unpacklo_epi16(lp, rp));
+            _mm_storeu_si128((__m128i *)(dst + 2 * i + 8), _mm_unpackhi_epi16(lp, rp));
+        }
+        if (dither)
+            _mm_storeu_si128((__m128i *)dither->state, state);
+#elif defined(SC_NEON)
+        uint32x4_t state = dither ? vld1q_u32(dither->state) : vdupq_n_u32(1);
+        for (; i + 8 <= nb_samples; i += 8)
+        {
+            int16x8_t lp = vcombine_s16(vqmovn_s32(sc_flt_to_s16_neon(l + i, &state, dither != NULL)),
+                                        vqmovn_s32(sc_flt_to_s16_neon(l + i + 4, &state, dither != NULL)));
+            if (!r)
+            {
+                vst1q_s16(dst + i, lp);
+                continue;
+            }
+            int16x8x2_t out;
+            out.val[0] = lp;
+            out.val[1] = vcombine_s16(vqmovn_s32(sc_flt_to_s16_neon(r + i, &state, dither != NULL)),
+                                      vqmovn_s32(sc_flt_to_s16_neon(r + i + 4, &state, dither != NULL)));
+            vst2q_s16(dst + 2 * i, out);
+        }
+        if (dither)
+            vst1q_u32(dither->state, state);
+#endif
+        for (; i < nb_samples; i++)
+        {
+            dst[i * channels] = sc_flt_to_s16(l[i], sc_scalar_dither(dither));
+            if (r)
+                dst[i * 2 + 1] = sc_flt_to_s16(r[i], sc_scalar_dither(dither));
+        }
+        return;
+    }
+
+    // 3+ channels: run the mono kernel over a block of each channel, then interleave the block
+    int16_t block[64];
+    for (int base = 0; base < nb_samples; base += 64)
+    {
+        int n = nb_samples - base < 64 ? nb_samples - base : 64;
+        for (int ch = 0; ch < channels; ch++)
+        {
+            const float *p = src[ch] + base;
+            sc_fltp_to_s16(block, &p, 1, n, dither);
+            for (i = 0; i < n; i++)
+                dst[(base + i) * channels + ch] = block[i];
+        }
+    }
+}
+
+// Interleaved S32 / FLT <-> planar float: plain loops, vectorized by the compiler
+static inline void sc_s32_to_fltp(float **dst, const int32_t *src, int channels, int nb_samples)
+{
+    const float scale = 1.0f / 2147483648.0f;
+    for (int ch = 0; ch < channels; ch++)
+        for (int i = 0; i < nb_samples; i++)
+            dst[ch][i] = src[i * channels + ch] * scale;
+}
+
+static inline void sc_flt_to_fltp(float **dst, const float *src, int channels, int nb_samples)
+{
+    if (channels == 1)
+    {
+        memcpy(dst[0], src, nb_samples * sizeof(float));
+        return;
+    }
+    for (int ch = 0; ch < channels; ch++)
+        for (int i = 0; i < nb_samples; i++)
+            dst[ch][i] = src[i * channels + ch];
+}
+
+static inline void sc_fltp_to_s32(int32_t *dst, const float *const *src, int channels, int nb_samples)
+{
+    for (int ch = 0; ch < channels; ch++)
+    {
+        for (int i = 0; i < nb_samples; i++)
+        {
+            // 2147483520 is the largest float below 2^31
+            float v = src[ch][i] * 2147483648.0f;
+            v = v < -2147483648.0f ? -2147483648.0f : (v > 2147483520.0f ? 2147483520.0f : v);
+            dst[i * channels + ch] = (int32_t)v;
+        }
+    }
+}
+
+static inline void sc_fltp_to_flt(float *dst, const float *const *src, int channels, int nb_samples)
+{
+    if (channels == 1)
+    {
+        memcpy(dst, src[0], nb_samples * sizeof(float));
+        return;
+    }
+    for (int ch = 0; ch < channels; ch++)
+        for (int i = 0; i < nb_samples; i++)
+            dst[i * channels + ch] = src[ch][i];
+}
+
+// Interleaved S16/S32/FLT -> planar float. Returns AVERROR(ENOSYS) for any other input format,
+// in which case the caller should go through swresample.
+static inline int sample_convert_to_fltp(float **dst, const uint8_t *src, enum AVSampleFormat src_fmt,
+                                         int channels, int nb_samples)
+{
+    switch (src_fmt)
+    {
+    case AV_SAMPLE_FMT_S16:
+        sc_s16_to_fltp(dst, (const int16_t *)src, channels, nb_samples);
+        return 0;
+    case AV_SAMPLE_FMT_S32:
+        sc_s32_to_fltp(dst, (const int32_t *)src, channels, nb_samples);
+        return 0;
+    case AV_SAMPLE_FMT_FLT:
+        sc_flt_to_fltp(dst, (const float *)src, channels, nb_samples);
+        return 0;
+    default:
+        return AVERROR(ENOSYS);
+    }
+}
+
+// Planar float -> interleaved S16/S32/FLT. dither may be NULL; it only applies to S16.
+static inline int sample_convert_from_fltp(uint8_t *dst, enum AVSampleFormat dst_fmt, const float *const *src,
+                                           int channels, int nb_samples, SampleDither *dither)
+{
+    switch (dst_fmt)
+    {
+    case AV_SAMPLE_FMT_S16:
+        sc_fltp_to_s16((int16_t *)dst, src, channels, nb_samples, dither);
+        return 0;
+    case AV_SAMPLE_FMT_S32:
+        sc_fltp_to_s32((int32_t *)dst, src, channels, nb_samples);
+        return 0;
+    case AV_SAMPLE_FMT_FLT:
+        sc_fltp_to_flt((float *)dst, src, channels, nb_samples);
+        return 0;
+    default:
+        return AVERROR(ENOSYS);
+    }
+}
+
+static inline int sample_convert_supported(enum AVSampleFormat fmt)
+{
+    return fmt == AV_SAMPLE_FMT_S16 || fmt == AV_SAMPLE_FMT_S32 || fmt == AV_SAMPLE_FMT_FLT;
+}
+
+#endif // RTSP_AVBRIDGE_SAMPLE_CONVERT_H
@@ -0,0 +1,290 @@
+// Thread placement and scheduling for the capture, encode and playback stages.
+//
+// A policy is a list of stages, one -X option each: "stage:cpus[:class[:priority]]", e.g.
+// "encode:2-7:nice:5" or "capture:1:fifo:70". cpus is a list like "0-3,8" or "*" to leave the
+// affinity alone; class is "other", "fifo", "rr" or "nice", with the real-time priority (1-99) or
+// the nice value as priority. Each thread applies its stage itself once it starts, and threads it
+// creates afterwards inherit it, which is how the encoder's own worker threads are placed. "-X mlock"
+// additionally locks the hot buffers into memory. Hot buffers are also moved to the NUMA node of
+// their stage's first CPU, so the thread working on them does not reach across the interconnect;
+// this uses the mbind system call directly rather than libnuma and is a no-op on single-node hosts.
+//
+// On Windows the classes map to thread priorities (fifo/rr at 50 and over to time critical, below
+// to highest; a negative nice to above normal, a positive one to below normal or lowest), affinity
+// covers the first 64 CPUs and locking uses VirtualLock. There is no NUMA placement there.
+//
+// Header only so every program keeps building from a single source file.
+#ifndef RTSP_AVBRIDGE_SCHED_POLICY_H
+#define RTSP_AVBRIDGE_SCHED_POLICY_H
+
+#include <errno.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <libavutil/error.h>
+#ifdef __cplusplus
+}
+#endif
+
+#include "metrics.h"
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+#define SCHED_POLICY_MAX_STAGES 8
+#define SCHED_POLICY_MAX_CPUS 1024
+#define SCHED_POLICY_MASK_WORDS (SCHED_POLICY_MAX_CPUS / (8 * sizeof(unsigned long)))
+
+enum SchedClass
+{
+    SCHED_CLASS_OTHER,              // Leave the scheduling class alone
+    SCHED_CLASS_FIFO,
+    SCHED_CLASS_RR,
+    SCHED_CLASS_NICE
+};
+
+typedef struct SchedStage
+{
+    char name[16];
+    unsigned long cpus[SCHED_POLICY_MASK_WORDS];
+    int nb_cpus;                    // 0: any CPU
+    int sched_class;
+    int priority;                   // Real-time priority, or nice value for SCHED_CLASS_NICE
+} SchedStage;
+
+typedef struct SchedPolicy
+{
+    SchedStage stages[SCHED_POLICY_MAX_STAGES];
+    int nb_stages;
+    int lock_memory;
+} SchedPolicy;
+
+static inline int sched_policy_has_cpu(const SchedStage *s, int cpu)
+{
+    return (s->cpus[cpu / (8 * sizeof(unsigned long))] >> (cpu % (8 * sizeof(unsigned long)))) & 1;
+}
+
+// The n-th CPU of the stage's set, wrapping around
+static inline int sched_policy_nth_cpu(const SchedStage *s, int n)
+{
+    n %= s->nb_cpus;
+    for (int cpu = 0; cpu < SCHED_POLICY_MAX_CPUS; cpu++)
+        if (sched_policy_has_cpu(s, cpu) && n-- == 0)
+            return cpu;
+    return -1;
+}
+
+static inline SchedStage *sched_policy_stage(SchedPolicy *p, const char *name)
+{
+    for (int i = 0; i < p->nb_stages; i++)
+        if (!strcmp(p->stages[i].name, name))
+            return &p->stages[i];
+    return NULL;
+}
+
+// Add one -X argument; returns 0, or AVERROR(EINVAL) for a malformed one
+static inline int sched_policy_add(SchedPolicy *p, const char *spec)
+{
+    char buf[256], *fields[4] = {NULL}, *save = NULL, *tok;
+    SchedStage *s;
+    int n = 0;
+
+    if (!strcmp(spec, "mlock"))
+    {
+        p->lock_memory = 1;
+        return 0;
+    }
+    snprintf(buf, sizeof(buf), "%s", spec);
+    for (tok = strtok_r(buf, ":", &save); tok && n < 4; tok = strtok_r(NULL, ":", &save))
+        fields[n++] = tok;
+    if (n < 2 || tok || strlen(fields[0]) >= sizeof(s->name))
+        return AVERROR(EINVAL);
+    s = sched_policy_stage(p, fields[0]);
+    if (!s)
+    {
+        if (p->nb_stages == SCHED_POLICY_MAX_STAGES)
+            return AVERROR(EINVAL);
+        s = &p->stages[p->nb_stages++];
+    }
+    memset(s, 0, sizeof(*s));
+    snprintf(s->name, sizeof(s->name), "%s", fields[0]);
+
+    if (strcmp(fields[1], "*"))
+    {
+        for (tok = strtok_r(fields[1], ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+        {
+            char *end;
+            long first = strtol(tok, &end, 10), last = first;
+            if (*end == '-')
+                last = strtol(end + 1, &end, 10);
+            if (end == tok || *end || first < 0 || last < first || last >= SCHED_POLICY_MAX_CPUS)
+                return AVERROR(EINVAL);
+            for (long cpu = first; cpu <= last; cpu++)
+            {
+                if (!sched_policy_has_cpu(s, (int)cpu))
+                    s->nb_cpus++;
+                s->cpus[cpu / (8 * sizeof(unsigned long))] |= 1UL << (cpu % (8 * sizeof(unsigned long)));
+            }
+        }
+    }
+
+    if (n > 2 && !strcmp(fields[2], "fifo"))
+        s->sched_class = SCHED_CLASS_FIFO;
+    else if (n > 2 && !strcmp(fields[2], "rr"))
+        s->sched_class = SCHED_CLASS_RR;
+    else if (n > 2 && !strcmp(fields[2], "nice"))
+        s->sched_class = SCHED_CLASS_NICE;
+    else if (n > 2 && strcmp(fields[2], "other"))
+        return AVERROR(EINVAL);
+    if (n > 3)
+        s->priority = atoi(fields[3]);
+    else if (s->sched_class == SCHED_CLASS_FIFO || s->sched_class == SCHED_CLASS_RR)
+        s->priority = 50;
+    if ((s->sched_class == SCHED_CLASS_FIFO || s->sched_class == SCHED_CLASS_RR) &&
+        (s->priority < 1 || s->priority > 99))
+        return AVERROR(EINVAL);
+    if (s->sched_class == SCHED_CLASS_NICE && (s->priority < -20 || s->priority > 19))
+        return AVERROR(EINVAL);
+    return 0;
+}
+
+// Place the calling thread: on all of the stage's CPUs, or with index >= 0 on the index-th one
+// only, so a set of workers spreads out one per core. A stage that is not configured is left
+// alone. Returns 0 or a negative AVERROR; real-time classes need CAP_SYS_NICE or an rtprio limit.
+static inline int sched_policy_apply(SchedPolicy *p, const char *name, int index)
+{
+    SchedStage *s = sched_policy_stage(p, name);
+
+    if (!s)
+        return 0;
+#ifdef _WIN32
+    if (s->nb_cpus)
+    {
+        const int bits = (int)(8 * sizeof(DWORD_PTR));
+        DWORD_PTR mask = 0;
+        if (index >= 0)
+        {
+            int cpu = sched_policy_nth_cpu(s, index);
+            if (cpu < bits)
+                mask = (DWORD_PTR)1 << cpu;
+        }
+        else
+        {
+            for (int cpu = 0; cpu < bits; cpu++)
+                if (sched_policy_has_cpu(s, cpu))
+                    mask |= (DWORD_PTR)1 << cpu;
+        }
+        if (mask && !SetThreadAffinityMask(GetCurrentThread(), mask))
+            return AVERROR(EINVAL);
+    }
+    if (s->sched_class != SCHED_CLASS_OTHER)
+    {
+        int priority;
+        if (s->sched_class == SCHED_CLASS_NICE)
+            priority = s->priority < 0 ? THREAD_PRIORITY_ABOVE_NORMAL : s->priority >= 10 ? THREAD_PRIORITY_LOWEST :
+                       s->priority > 0 ? THREAD_PRIORITY_BELOW_NORMAL : THREAD_PRIORITY_NORMAL;
+        else
+            priority = s->priority >= 50 ? THREAD_PRIORITY_TIME_CRITICAL : THREAD_PRIORITY_HIGHEST;
+        if (!SetThreadPriority(GetCurrentThread(), priority))
+            return AVERROR(EPERM);
+    }
+#else
+    if (s->nb_cpus)
+    {
+        unsigned long one[SCHED_POLICY_MASK_WORDS] = {0};
+        const unsigned long *mask = s->cpus;
+        if (index >= 0)
+        {
+            int cpu = sched_policy_nth_cpu(s, index);
+            one[cpu / (8 * sizeof(unsigned long))] = 1UL << (cpu % (8 * sizeof(unsigned long)));
+            mask = one;
+        }
+        // Thread id 0 is the calling thread
+        if (syscall(SYS_sched_setaffinity, 0, sizeof(s->cpus), mask) < 0)
+            return AVERROR(errno);
+    }
+    if (s->sched_class == SCHED_CLASS_FIFO || s->sched_class == SCHED_CLASS_RR)
+    {
+        struct sched_param param;
+        int err;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = s->priority;
+        err = pthread_setschedparam(pthread_self(), s->sched_class == SCHED_CLASS_FIFO ? SCHED_FIFO : SCHED_RR, &param);
+        if (err)
+            return AVERROR(err);
+    }
+    else if (s->sched_class == SCHED_CLASS_NICE)
+    {
+        // Linux keeps a nice value per thread
+        if (setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), s->priority) < 0)
+            return AVERROR(errno);
+    }
+#endif
+    return 0;
+}
+
+#ifndef _WIN32
+// NUMA node of a CPU from sysfs, -1 when the kernel does not report one
+static inline int sched_policy_cpu_node(int cpu)
+{
+    char path[64];
+    struct dirent *entry;
+    DIR *dir;
+    int node = -1;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    dir = opendir(path);
+    if (!dir)
+        return -1;
+    while ((entry = readdir(dir)))
+        if (!strncmp(entry->d_name, "node", 4) && entry->d_name[4] >= '0' && entry->d_name[4] <= '9')
+        {
+            node = atoi(entry->d_name + 4);
+            break;
+        }
+    closedir(dir);
+    return node;
+}
+#endif
+
+// A buffer one of the stage's threads works on for every frame: moved next to the stage's first
+// CPU and, with "-X mlock", locked so it is never paged out. Whole pages are affected, including
+// whatever else shares the first and last page. Returns 0 or a negative AVERROR.
+static inline int sched_policy_hot_buffer(SchedPolicy *p, const char *name, void *data, size_t size)
+{
+    SchedStage *s = sched_policy_stage(p, name);
+
+    if (!data || !size)
+        return 0;
+#ifdef _WIN32
+    (void)s;
+    if (p->lock_memory && !VirtualLock(data, size))
+        return AVERROR(ENOMEM);
+#else
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)data & ~(page - 1);
+    uintptr_t end = ((uintptr_t)data + size + page - 1) & ~(page - 1);
+    int node = s && s->nb_cpus ? sched_policy_cpu_node(sched_policy_nth_cpu(s, 0)) : -1;
+
+    if (node >= 0 && node < SCHED_POLICY_MAX_CPUS)
+    {
+        // MPOL_PREFERRED with MPOL_MF_MOVE: also migrate the pages already touched elsewhere
+        unsigned long nodes[SCHED_POLICY_MASK_WORDS] = {0};
+        nodes[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+        if (syscall(SYS_mbind, start, end - start, 1, nodes, (unsigned long)SCHED_POLICY_MAX_CPUS, 1 << 1) < 0 &&
+            errno != ENOSYS)
+            return AVERROR(errno);
+    }
+    if (p->lock_memory && mlock((void *)start, end - start) < 0)
+        return AVERROR(errno);
+#endif
+    return 0;
+}
+
+#endif // RTSP_AVBRIDGE_SCHED_POLICY_H
@@ -0,0 +1,251 @@
+// Work-stealing thread pool for running several capture/encode pipelines on one set of cores.
+//
+// Every worker owns one deque per priority level. Tasks are pushed at the bottom; a worker takes the
+// oldest task of its own deques, and once they are empty steals the oldest of the others', so frames
+// are served in arrival order. Higher priority work is looked for everywhere before lower priority
+// work. A task can split itself into subtasks tagged with a WorkGroup and call work_pool_wait(),
+// which takes its own subtasks back from the bottom (newest first, still warm in cache) until the
+// group completes, while idle workers steal the rest.
+//
+// Header only so every program keeps building from a single source file. Linux only.
+#ifndef RTSP_AVBRIDGE_WORK_POOL_H
+#define RTSP_AVBRIDGE_WORK_POOL_H
+
+#include <sched.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+
+#include "metrics.h"
+
+#define WORK_POOL_MAX_WORKERS 64
+#define WORK_POOL_PRIORITIES 2              // 0 = high, 1 = normal
+#define WORK_QUEUE_SIZE 64                  // Per worker and priority, power of two
+
+typedef void (*WorkFn)(void *arg, int worker);
+
+// Counts the outstanding subtasks of a split task
+typedef struct WorkGroup
+{
+    volatile int64_t remaining;
+} WorkGroup;
+
+typedef struct WorkTask
+{
+    WorkFn fn;
+    void *arg;
+    WorkGroup *group;                       // Set for subtasks, finished tasks decrement it
+} WorkTask;
+
+typedef struct WorkQueue
+{
+    pthread_mutex_t lock;
+    unsigned int top;                       // Next task to steal
+    unsigned int bottom;                    // Next free slot for the owner
+    WorkTask tasks[WORK_QUEUE_SIZE];
+} WorkQueue;
+
+typedef struct WorkPool
+{
+    int nb_workers;
+    WorkQueue queues[WORK_POOL_MAX_WORKERS][WORK_POOL_PRIORITIES];
+    pthread_t threads[WORK_POOL_MAX_WORKERS];
+    volatile int64_t queued;                // Tasks in all queues, lets idle workers sleep
+    volatile int64_t stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    WorkFn init;                            // Run by every worker before it takes tasks, may be NULL
+    void *init_arg;
+    Metric *m_tasks, *m_steals;
+} WorkPool;
+
+typedef struct WorkWorker
+{
+    WorkPool *pool;
+    int index;
+} WorkWorker;
+
+static inline int work_queue_push(WorkQueue *q, const WorkTask *task)
+{
+    int ret = -1;
+    pthread_mutex_lock(&q->lock);
+    if (q->bottom - q->top < WORK_QUEUE_SIZE)
+    {
+        q->tasks[q->bottom++ % WORK_QUEUE_SIZE] = *task;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ret;
+}
+
+// Takes the newest task of group wherever it sits in the deque, so a split task never waits behind
+// work queued after it
+static inline int work_queue_pop_group(WorkQueue *q, WorkTask *task, WorkGroup *group)
+{
+    int ret = -1;
+    pthread_mutex_lock(&q->lock);
+    for (unsigned int i = q->bottom; i != q->top; i--)
+    {
+        if (q->tasks[(i - 1) % WORK_QUEUE_SIZE].group != group)
+            continue;
+        *task = q->tasks[(i - 1) % WORK_QUEUE_SIZE];
+        for (; i != q->bottom; i++)
+            q->tasks[(i - 1) % WORK_QUEUE_SIZE] = q->tasks[i % WORK_QUEUE_SIZE];
+        q->bottom--;
+        ret = 0;
+        break;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ret;
+}
+
+// Takes the oldest task
+static inline int work_queue_take(WorkQueue *q, WorkTask *task)
+{
+    int ret = -1;
+    pthread_mutex_lock(&q->lock);
+    if (q->bottom != q->top)
+    {
+        *task = q->tasks[q->top++ % WORK_QUEUE_SIZE];
+        ret = 0;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ret;
+}
+
+static inline void work_pool_run(WorkPool *pool, WorkTask *task, int worker)
+{
+    metrics_atomic_add(&pool->queued, -1);
+    task->fn(task->arg, worker);
+    if (task->group)
+        metrics_atomic_add(&task->group->remaining, -1);
+    metric_add(pool->m_tasks, 1);
+}
+
+// Own queue first, then steal, highest priority first
+static inline int work_pool_find(WorkPool *pool, int worker, WorkTask *task)
+{
+    for (int p = 0; p < WORK_POOL_PRIORITIES; p++)
+    {
+        if (work_queue_take(&pool->queues[worker][p], task) == 0)
+            return 0;
+        for (int i = 1; i < pool->nb_workers; i++)
+        {
+            if (work_queue_take(&pool->queues[(worker + i) % pool->nb_workers][p], task) == 0)
+            {
+                metric_add(pool->m_steals, 1);
+                return 0;
+            }
+        }
+    }
+    return -1;
+}
+
+static void *work_pool_thread(void *arg)
+{
+    WorkWorker *w = (WorkWorker *)arg;
+    WorkPool *pool = w->pool;
+    int worker = w->index;
+    WorkTask task;
+
+    av_free(w);
+    if (pool->init)
+        pool->init(pool->init_arg, worker);
+    for (;;)
+    {
+        if (work_pool_find(pool, worker, &task) == 0)
+        {
+            work_pool_run(pool, &task, worker);
+            continue;
+        }
+        pthread_mutex_lock(&pool->lock);
+        while (!metrics_atomic_load(&pool->queued) && !metrics_atomic_load(&pool->stop))
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+        if (metrics_atomic_load(&pool->stop) && !metrics_atomic_load(&pool->queued))
+            break;
+    }
+    return NULL;
+}
+
+// Queue a task on the given worker (any worker index for callers outside the pool). Returns 0, or
+// a negative value if that queue is full and the caller should run the task itself.
+static inline int work_pool_submit(WorkPool *pool, int worker, int priority, WorkFn fn, void *arg, WorkGroup *group)
+{
+    WorkTask task = {fn, arg, group};
+    if (work_queue_push(&pool->queues[worker % pool->nb_workers][priority], &task) < 0)
+        return -1;
+    metrics_atomic_add(&pool->queued, 1);
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+// Called from a task on worker: run this group's subtasks still in our queue, then wait for the stolen ones
+static inline void work_pool_wait(WorkPool *pool, int worker, int priority, WorkGroup *group)
+{
+    WorkTask task;
+    while (metrics_atomic_load(&group->remaining) > 0)
+    {
+        if (work_queue_pop_group(&pool->queues[worker][priority], &task, group) == 0)
+            work_pool_run(pool, &task, worker);
+        else
+            sched_yield();
+    }
+}
+
+// Start nb_workers threads, each running init(init_arg, worker) first; registers pool metrics, so
+// call before metrics_start()
+static inline int work_pool_start(WorkPool *pool, int nb_workers, MetricsServer *metrics, WorkFn init, void *init_arg)
+{
+    memset(pool, 0, sizeof(*pool));
+    pool->init = init;
+    pool->init_arg = init_arg;
+    pool->nb_workers = nb_workers < 1 ? 1 : nb_workers > WORK_POOL_MAX_WORKERS ? WORK_POOL_MAX_WORKERS : nb_workers;
+    pool->m_tasks = metrics_counter(metrics, "pool_tasks_total", "Tasks run by the encode pool");
+    pool->m_steals = metrics_counter(metrics, "pool_steals_total", "Tasks taken from another worker's queue");
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    for (int i = 0; i < WORK_POOL_MAX_WORKERS; i++)
+        for (int p = 0; p < WORK_POOL_PRIORITIES; p++)
+            pthread_mutex_init(&pool->queues[i][p].lock, NULL);
+    for (int i = 0; i < pool->nb_workers; i++)
+    {
+        WorkWorker *w = (WorkWorker *)av_malloc(sizeof(*w));
+        if (!w)
+        {
+            pool->nb_workers = i;
+            return AVERROR(ENOMEM);
+        }
+        w->pool = pool;
+        w->index = i;
+        if (pthread_create(&pool->threads[i], NULL, work_pool_thread, w) != 0)
+        {
+            av_free(w);
+            pool->nb_workers = i;
+            return AVERROR(EAGAIN);
+        }
+    }
+    return 0;
+}
+
+// Run everything already queued, then join the workers
+static inline void work_pool_stop(WorkPool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    metrics_atomic_store(&pool->stop, 1);
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->nb_workers; i++)
+        pthread_join(pool->threads[i], NULL);
+    for (int i = 0; i < WORK_POOL_MAX_WORKERS; i++)
+        for (int p = 0; p < WORK_POOL_PRIORITIES; p++)
+            pthread_mutex_destroy(&pool->queues[i][p].lock);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+}
+
+#endif // RTSP_AVBRIDGE_WORK_POOL_H
@@ -0,0 +1,292 @@
+// Cost of the video server's batched RTP output (common/rtp_egress.h, -E) against one sendto() per
+// packet, which is what libavformat's RTSP muxer does, over loopback with no camera, encoder or
+// RTSP server.
+//
+// Frames of -k bytes every -g frames and -p bytes otherwise are cut into RTP packets the size the
+// "rtp" muxer makes (1472 bytes, the last one shorter) and sent at -f fps to a receiver thread on
+// 127.0.0.1 that counts what arrives. The same frames go out three ways: one sendto() per packet,
+// queued and sent with sendmmsg() one message per packet, and sendmmsg() with UDP GSO where the
+// kernel supports it. With -E the two batched outputs are paced at that many Mbit/s, spread over at
+// most half a frame interval as in the server. For each it prints the syscalls and UDP messages per
+// frame, the time to send a frame (queueing included, mean, p99 and max, and the mean of the large
+// frames) and how many packets the receiver got.
+//
+// gcc -O2 egress_bench.c -o egress_bench -lavformat -lavutil -lpthread
+// ./egress_bench                         # 150 kB every 30 frames, 15 kB otherwise, 30 fps, 5 s each
+// ./egress_bench -E 20                   # the batched outputs paced at 20 Mbit/s
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "../common/metrics.h"
+#include "../common/rtp_egress.h"
+
+#define RTP_HEADER 12
+
+enum Mode
+{
+    MODE_SENDTO,
+    MODE_SENDMMSG,
+    MODE_GSO,
+    MODES
+};
+
+static const char *mode_names[MODES] = { "sendto", "sendmmsg", "sendmmsg+gso" };
+
+typedef struct Receiver
+{
+    int fd;
+    volatile int stop;
+    int64_t packets;
+    pthread_t thread;
+} Receiver;
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_until_ns(int64_t t)
+{
+    struct timespec ts = { t / 1000000000, t % 1000000000 };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+        ;
+}
+
+static void *receiver_thread(void *arg)
+{
+    Receiver *r = (Receiver *)arg;
+    uint8_t buf[2048];
+
+    while (!r->stop)
+    {
+        struct pollfd p = { r->fd, POLLIN, 0 };
+        if (poll(&p, 1, 100) <= 0)
+            continue;
+        while (recv(r->fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+            r->packets++;
+    }
+    return NULL;
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// One frame's RTP packets as the muxer hands them over: full packets, the last one shorter, marker
+// bit on the last
+static int make_packets(uint8_t *packets, int *lens, int frame_bytes, uint16_t *seq, uint32_t ts)
+{
+    int n = 0;
+
+    for (int left = frame_bytes; left > 0; n++)
+    {
+        uint8_t *p = packets + (size_t)n * RTP_EGRESS_PACKET_SIZE;
+        int payload = FFMIN(left, RTP_EGRESS_PACKET_SIZE - RTP_HEADER);
+        left -= payload;
+        p[0] = 0x80;
+        p[1] = (uint8_t)(96 | (left ? 0 : 0x80));
+        p[2] = (uint8_t)(*seq >> 8);
+        p[3] = (uint8_t)(*seq & 0xff);
+        (*seq)++;
+        p[4] = (uint8_t)(ts >> 24);
+        p[5] = (uint8_t)(ts >> 16);
+        p[6] = (uint8_t)(ts >> 8);
+        p[7] = (uint8_t)ts;
+        memset(p + 8, 0x5a, 4);
+        lens[n] = RTP_HEADER + payload;
+    }
+    return n;
+}
+
+static int run(enum Mode mode, int port, int seconds, int fps, int gop, int key_bytes, int frame_bytes,
+               int64_t pace_bps)
+{
+    static MetricsServer metrics;
+    int nb_frames = seconds * fps, max_packets = key_bytes / (RTP_EGRESS_PACKET_SIZE - RTP_HEADER) + 1;
+    uint8_t *packets = malloc((size_t)max_packets * RTP_EGRESS_PACKET_SIZE);
+    int *lens = malloc(max_packets * sizeof(*lens));
+    int64_t *times = malloc(nb_frames * sizeof(*times));
+    int64_t sent = 0, syscalls = 0, messages = 0, key_time = 0, nb_key = 0, total = 0, start;
+    struct sockaddr_in addr;
+    AVFormatContext *ctx = avformat_alloc_context();
+    RtpEgress egress;
+    Receiver receiver;
+    int send_fd = -1, ret = -1, rcvbuf = 8 << 20, sndbuf = 4 << 20;
+    uint16_t seq = 0;
+    char url[64];
+
+    memset(&receiver, 0, sizeof(receiver));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    metrics_init(&metrics, "egress_bench", NULL, NULL);
+    rtp_egress_init(&egress, &metrics);
+    receiver.fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (!packets || !lens || !times || !ctx || receiver.fd < 0)
+    {
+        printf("Out of memory\n");
+        goto end;
+    }
+    // Without room for a whole large frame loopback drops packets and the counts mean nothing
+    setsockopt(receiver.fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf));
+    setsockopt(receiver.fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    if (bind(receiver.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        printf("Failed to bind 127.0.0.1:%d\n", port);
+        goto end;
+    }
+
+    if (mode == MODE_SENDTO)
+    {
+        if ((send_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+            goto end;
+        setsockopt(send_fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    }
+    else
+    {
+        snprintf(url, sizeof(url), "rtp://127.0.0.1:%d", port);
+        if ((ret = rtp_egress_open_udp(&egress, ctx, url, pace_bps, 500000 / fps)) < 0)
+        {
+            printf("rtp_egress_open_udp error (%s)\n", av_err2str(ret));
+            ret = -1;
+            goto end;
+        }
+        ret = -1;
+        if (mode == MODE_GSO && !egress.gso)
+        {
+            printf("%-13s UDP GSO not supported by this kernel\n", mode_names[mode]);
+            ret = 0;
+            goto end;
+        }
+        if (mode == MODE_SENDMMSG)
+            egress.gso = 0;
+    }
+    pthread_create(&receiver.thread, NULL, receiver_thread, &receiver);
+
+    start = now_ns() + 10000000;
+    for (int f = 0; f < nb_frames; f++)
+    {
+        int key = f % gop == 0;
+        int n = make_packets(packets, lens, key ? key_bytes : frame_bytes, &seq, (uint32_t)f * (90000 / fps));
+        int64_t t;
+
+        sleep_until_ns(start + f * 1000000000LL / fps);
+        t = now_ns();
+        if (mode == MODE_SENDTO)
+        {
+            for (int i = 0; i < n; i++)
+                if (sendto(send_fd, packets + (size_t)i * RTP_EGRESS_PACKET_SIZE, lens[i], 0,
+                           (struct sockaddr *)&addr, sizeof(addr)) < 0)
+                    printf("sendto error (%s)\n", strerror(errno));
+            syscalls += n;
+            messages += n;
+        }
+        else
+        {
+            for (int i = 0; i < n; i++)
+                rtp_egress_write(&egress, packets + (size_t)i * RTP_EGRESS_PACKET_SIZE, lens[i]);
+            if ((ret = rtp_egress_flush(&egress)) < 0)
+                printf("rtp_egress_flush error (%s)\n", av_err2str(ret));
+        }
+        times[f] = now_ns() - t;
+        total += times[f];
+        if (key)
+        {
+            key_time += times[f];
+            nb_key++;
+        }
+        sent += n;
+    }
+    if (mode != MODE_SENDTO)
+    {
+        syscalls = metric_get(egress.m_syscalls);
+        messages = metric_get(egress.m_messages);
+    }
+    // Let the receiver drain what loopback still holds
+    usleep(200000);
+    receiver.stop = 1;
+    pthread_join(receiver.thread, NULL);
+
+    qsort(times, nb_frames, sizeof(*times), compare_int64);
+    printf("%-13s %7.1f %7.1f %8.1f %9.1f %9.1f %9.1f %10.1f %8lld/%lld\n", mode_names[mode],
+           (double)sent / nb_frames, (double)syscalls / nb_frames, (double)messages / nb_frames,
+           total / 1000.0 / nb_frames, times[nb_frames * 99 / 100] / 1000.0, times[nb_frames - 1] / 1000.0,
+           nb_key ? key_time / 1000.0 / nb_key : 0.0, (long long)receiver.packets, (long long)sent);
+    ret = 0;
+
+end:
+    rtp_egress_close(&egress);
+    avformat_free_context(ctx);
+    if (send_fd >= 0)
+        close(send_fd);
+    if (receiver.fd >= 0)
+        close(receiver.fd);
+    free(packets);
+    free(lens);
+    free(times);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    int port = 25000, seconds = 5, fps = 30, gop = 30, key_bytes = 150000, frame_bytes = 15000;
+    double pace_mbps = 0;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+            seconds = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+            fps = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-g") == 0 && i + 1 < argc)
+            gop = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc)
+            key_bytes = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+            frame_bytes = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-E") == 0 && i + 1 < argc)
+            pace_mbps = atof(argv[++i]);
+        else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc)
+            port = atoi(argv[++i]);
+        else
+        {
+            printf("Usage: %s [-t seconds] [-f fps] [-g gop] [-k key_bytes] [-p frame_bytes] [-E pace_mbps] [-P port]\n",
+                   argv[0]);
+            return 1;
+        }
+    }
+    if (seconds < 1 || fps < 1 || fps > 1000 || gop < 1 || key_bytes < 1 || frame_bytes < 1 || pace_mbps < 0 ||
+        port < 1 || port > 65534 ||
+        FFMAX(key_bytes, frame_bytes) > RTP_EGRESS_MAX_PACKETS * (RTP_EGRESS_PACKET_SIZE - RTP_HEADER))
+    {
+        printf("At least 1 s, 1 to 1000 fps, frames of 1 to %d bytes, a port of 1 to 65534\n",
+               RTP_EGRESS_MAX_PACKETS * (RTP_EGRESS_PACKET_SIZE - RTP_HEADER));
+        return 1;
+    }
+    if (frame_bytes > key_bytes)
+        key_bytes = frame_bytes;
+
+    printf("%d fps, %d byte frames, %d byte frames every %d, %d s each, pacing %s", fps, frame_bytes, key_bytes, gop,
+           seconds, pace_mbps > 0 ? "" : "off\n");
+    if (pace_mbps > 0)
+        printf("%g Mbit/s\n", pace_mbps);
+    printf("output        packets syscalls messages      mean       p99       max  large mean received/sent\n"
+           "              / frame  / frame  / frame  us/frame  us/frame  us/frame    us/frame\n");
+    for (int m = 0; m < MODES; m++)
+        if (run((enum Mode)m, port, seconds, fps, gop, key_bytes, frame_bytes, (int64_t)(pace_mbps * 1e6)) < 0)
+            return 1;
+    return 0;
+}
@@ -0,0 +1,225 @@
+// Cost of the video server's change detection (common/frame_diff.h) at common capture sizes,
+// against a plain scalar version of the same comparison.
+//
+// Frames are YUYV, two bytes per pixel, cut into 32 x 16 byte blocks as with -Z. The scene is random
+// picture content with +-2 of sensor noise on every capture, and in -p percent of the blocks the
+// content moves. For every size it checks the SIMD version against the scalar one on -i captures:
+// every block SAD must match exactly and so must the dirty flags and the reference frame. It then
+// prints the time per capture of both for a static scene (every block compared in full and kept)
+// and for the moving one, and what share of a frame interval at 30 fps the SIMD version takes.
+// 1366 x 766 leaves a row tail the vector loops do not cover and blocks cut off at the bottom.
+//
+// gcc -O2 -march=native frame_diff_bench.c -o frame_diff_bench -lavutil
+// ./frame_diff_bench                     # 480p, 720p, 1080p and 1366 x 766, threshold 3, 10% moving
+// ./frame_diff_bench -Z 1 -p 50
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../common/frame_diff.h"
+
+#define BLOCK_W 32
+#define BLOCK_H 16
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// The references stay scalar: the compiler would otherwise vectorize them and the comparison
+// would be between two SIMD versions
+__attribute__((optimize("no-tree-vectorize")))
+static int64_t ref_block_sad(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int w, int h)
+{
+    int64_t sad = 0;
+    for (int y = 0; y < h; y++)
+        for (int x = 0; x < w; x++)
+        {
+            int v = a[y * a_stride + x] - b[y * b_stride + x];
+            sad += v < 0 ? -v : v;
+        }
+    return sad;
+}
+
+// frame_diff_update() with the scalar SAD and no early exit
+__attribute__((optimize("no-tree-vectorize")))
+static int ref_update(FrameDiff *d, const uint8_t *src, int stride)
+{
+    d->nb_dirty = 0;
+    for (int r = 0; r < d->rows; r++)
+    {
+        int y = r * d->block_h;
+        int h = y + d->block_h <= d->height ? d->block_h : d->height - y;
+        for (int c = 0; c < d->cols; c++)
+        {
+            int x = c * d->block_w;
+            int w = x + d->block_w <= d->width ? d->block_w : d->width - x;
+            const uint8_t *s = src + (ptrdiff_t)y * stride + x;
+            uint8_t *ref = d->ref + (ptrdiff_t)y * d->width + x;
+            int dirty = !d->has_ref || ref_block_sad(s, stride, ref, d->width, w, h) > d->threshold;
+            d->dirty[r * d->cols + c] = (uint8_t)dirty;
+            if (!dirty)
+                continue;
+            d->nb_dirty++;
+            for (int i = 0; i < h; i++)
+                memcpy(ref + (ptrdiff_t)i * d->width, s + (ptrdiff_t)i * stride, w);
+        }
+    }
+    d->has_ref = 1;
+    return d->nb_dirty;
+}
+
+// Capture n of the scene: the base picture with fresh noise, and the moving blocks shifted by n
+static void make_capture(uint8_t *dst, const uint8_t *base, int width, int height, int moving_percent, int n,
+                         unsigned int *seed)
+{
+    int cols = (width + BLOCK_W - 1) / BLOCK_W;
+
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+        {
+            int block = (y / BLOCK_H) * cols + x / BLOCK_W;
+            int v = (block * 37 % 100) < moving_percent ? base[y * width + (x + n * 7) % width]
+                                                        : base[y * width + x];
+            v += rand_r(seed) % 5 - 2;
+            dst[y * width + x] = (uint8_t)(v < 0 ? 0 : v > 255 ? 255 : v);
+        }
+}
+
+static int run(int pixels_w, int pixels_h, int threshold, int moving_percent, int iterations)
+{
+    int width = pixels_w * 2, height = pixels_h;
+    size_t size = (size_t)width * height;
+    uint8_t *base = malloc(size), *captures[2] = { malloc(size), malloc(size) };
+    FrameDiff simd, ref;
+    int64_t t, static_ref = 0, static_simd = 0, moving_ref = 0, moving_simd = 0, dirty = 0;
+    int mismatches = 0;
+    unsigned int seed = 1;
+    int ret = -1;
+
+    memset(&simd, 0, sizeof(simd));
+    memset(&ref, 0, sizeof(ref));
+    if (!base || !captures[0] || !captures[1] ||
+        frame_diff_init(&simd, width, height, BLOCK_W, BLOCK_H, threshold) < 0 ||
+        frame_diff_init(&ref, width, height, BLOCK_W, BLOCK_H, threshold) < 0)
+    {
+        printf("Out of memory\n");
+        goto end;
+    }
+    for (size_t i = 0; i < size; i++)
+        base[i] = (uint8_t)(16 + rand_r(&seed) % 220);
+
+    // Check: every block SAD, then the dirty flags and the reference over a moving sequence
+    make_capture(captures[0], base, width, height, moving_percent, 0, &seed);
+    make_capture(captures[1], base, width, height, moving_percent, 1, &seed);
+    for (int y = 0; y < height; y += BLOCK_H)
+        for (int x = 0; x < width; x += BLOCK_W)
+        {
+            int w = x + BLOCK_W <= width ? BLOCK_W : width - x, h = y + BLOCK_H <= height ? BLOCK_H : height - y;
+            const uint8_t *a = captures[0] + (ptrdiff_t)y * width + x, *b = captures[1] + (ptrdiff_t)y * width + x;
+            mismatches += fd_block_sad(a, width, b, width, w, h, INT64_MAX) != ref_block_sad(a, width, b, width, w, h);
+        }
+    for (int n = 0; n < iterations; n++)
+    {
+        make_capture(captures[0], base, width, height, moving_percent, n, &seed);
+        mismatches += frame_diff_update(&simd, captures[0], width) != ref_update(&ref, captures[0], width);
+        mismatches += memcmp(simd.dirty, ref.dirty, (size_t)simd.cols * simd.rows) != 0;
+        mismatches += memcmp(simd.ref, ref.ref, size) != 0;
+        if (n > 0)
+            dirty += simd.nb_dirty;
+    }
+
+    // Static: the reference is up to date, every block is compared in full and none is taken
+    make_capture(captures[0], base, width, height, 0, 0, &seed);
+    make_capture(captures[1], base, width, height, 0, 0, &seed);
+    frame_diff_update(&simd, captures[0], width);
+    ref_update(&ref, captures[0], width);
+    t = now_ns();
+    for (int n = 0; n < iterations; n++)
+        ref_update(&ref, captures[n & 1], width);
+    static_ref = now_ns() - t;
+    t = now_ns();
+    for (int n = 0; n < iterations; n++)
+        frame_diff_update(&simd, captures[n & 1], width);
+    static_simd = now_ns() - t;
+
+    // Moving: the changed blocks exit early and are copied into the reference
+    make_capture(captures[0], base, width, height, moving_percent, 0, &seed);
+    make_capture(captures[1], base, width, height, moving_percent, 1, &seed);
+    t = now_ns();
+    for (int n = 0; n < iterations; n++)
+        ref_update(&ref, captures[n & 1], width);
+    moving_ref = now_ns() - t;
+    t = now_ns();
+    for (int n = 0; n < iterations; n++)
+        frame_diff_update(&simd, captures[n & 1], width);
+    moving_simd = now_ns() - t;
+
+    printf("%4d x %-4d %9.0f %9.0f %6.1fx %9.0f %9.0f %6.1fx %7.1f%% %7.2f%% %10d\n", pixels_w, pixels_h,
+           static_ref / 1000.0 / iterations, static_simd / 1000.0 / iterations, (double)static_ref / static_simd,
+           moving_ref / 1000.0 / iterations, moving_simd / 1000.0 / iterations, (double)moving_ref / moving_simd,
+           iterations > 1 ? 100.0 * dirty / (iterations - 1) / (simd.cols * simd.rows) : 0.0,
+           static_simd / 1000.0 / iterations / (1000000.0 / 30) * 100, mismatches);
+    ret = mismatches ? 1 : 0;
+
+end:
+    frame_diff_free(&simd);
+    frame_diff_free(&ref);
+    free(base);
+    free(captures[0]);
+    free(captures[1]);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    static const int sizes[][2] = { { 640, 480 }, { 1280, 720 }, { 1920, 1080 }, { 1366, 766 } };
+    int threshold = 3, moving_percent = 10, iterations = 200, failed = 0;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-Z") == 0 && i + 1 < argc)
+            threshold = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+            moving_percent = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc)
+            iterations = atoi(argv[++i]);
+        else
+        {
+            printf("Usage: %s [-Z change_threshold] [-p moving_percent] [-i iterations]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (threshold < 0 || moving_percent < 0 || moving_percent > 100 || iterations < 1)
+    {
+        printf("Threshold at least 0, 0 to 100%% moving, at least 1 iteration\n");
+        return 1;
+    }
+
+#if defined(FD_AVX2)
+    printf("AVX2, ");
+#elif defined(FD_SSE2)
+    printf("SSE2, ");
+#elif defined(FD_NEON)
+    printf("NEON, ");
+#else
+    printf("no SIMD, ");
+#endif
+    printf("YUYV, %d x %d byte blocks, threshold %d, %d%% moving, %d captures, times in us per capture\n", BLOCK_W,
+           BLOCK_H, threshold, moving_percent, iterations);
+    printf("size        static plain   simd speedup moving plain  simd speedup  dirty  of 30 fps mismatches\n");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        int ret = run(sizes[i][0], sizes[i][1], threshold, moving_percent, iterations);
+        if (ret < 0)
+            return 1;
+        failed |= ret;
+    }
+    if (failed)
+        printf("The SIMD comparison does not match the scalar one\n");
+    return failed;
+}
@@ -0,0 +1,151 @@
+// The video client's decode load governor (common/decode_governor.h) run over a load trace, without
+// a decoder, a camera or Softcam.
+//
+// The trace gives the busy time (decode and conversion) of every packet at full quality, in
+// microseconds, one per line; lines starting with # are skipped. Without -T a built-in trace is
+// used: 10 s at 50% load, 20 s at 160%, 30 s at 40%, then 3 min at 100%. Each level makes a packet
+// cheaper by the factor given with -k, so a host that sits on the edge keeps stepping up and back
+// down. Every level change is printed with the packet, the time into the trace, the smoothed load
+// and the packets the next step up will wait for, then the time spent at each level.
+//
+// gcc -O2 governor_replay.c -o governor_replay -lavutil
+// ./governor_replay                        # escalate, recover, then back off on the edge
+// ./governor_replay -T busy.txt -f 25      # a recorded trace of a 25 fps stream
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../common/decode_governor.h"
+
+static const char *level_names[DECODE_LEVELS] = { "full", "skip loop filter", "skip non-ref", "fast convert" };
+
+typedef struct Phase
+{
+    double load;
+    int seconds;
+} Phase;
+
+static const Phase builtin_trace[] = { { 0.5, 10 }, { 1.6, 20 }, { 0.4, 30 }, { 1.0, 180 } };
+
+// Busy time of the next packet at full quality: from the file, or from the built-in phases
+static int next_busy(FILE *trace, int64_t packet, int fps, int64_t budget_us, int64_t *busy_us)
+{
+    char line[64];
+
+    if (!trace)
+    {
+        int64_t start = 0;
+        for (size_t i = 0; i < FF_ARRAY_ELEMS(builtin_trace); i++)
+        {
+            start += (int64_t)builtin_trace[i].seconds * fps;
+            if (packet < start)
+            {
+                *busy_us = (int64_t)(builtin_trace[i].load * budget_us);
+                return 1;
+            }
+        }
+        return 0;
+    }
+    while (fgets(line, sizeof(line), trace))
+    {
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        *busy_us = strtoll(line, NULL, 10);
+        return 1;
+    }
+    return 0;
+}
+
+static int parse_factors(const char *spec, double *factors)
+{
+    const char *p = spec;
+    char *end;
+
+    for (int i = 0; i < DECODE_LEVELS; i++)
+    {
+        factors[i] = strtod(p, &end);
+        if (end == p || factors[i] <= 0)
+            return -1;
+        p = end;
+        if (i < DECODE_LEVELS - 1)
+        {
+            if (*p != ',')
+                return -1;
+            p++;
+        }
+    }
+    return *p ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = NULL;
+    int fps = 30;
+    double factors[DECODE_LEVELS] = { 1.0, 0.55, 0.45, 0.4 };
+    int64_t at_level[DECODE_LEVELS] = { 0 };
+    int64_t escalations = 0, recoveries = 0, busy_us;
+    FILE *trace = NULL;
+    DecodeGovernor g;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-T") == 0 && i + 1 < argc)
+            path = argv[++i];
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+            fps = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc)
+        {
+            if (parse_factors(argv[++i], factors) < 0)
+            {
+                printf("Invalid factors %s, expected %d comma separated numbers above 0\n", argv[i], DECODE_LEVELS);
+                return 1;
+            }
+        }
+        else
+        {
+            printf("Usage: %s [-T busy_trace] [-f fps] [-k full,skip_loop_filter,skip_nonref,fast_convert]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (fps < 1)
+    {
+        printf("At least 1 fps\n");
+        return 1;
+    }
+    if (path && !(trace = fopen(path, "r")))
+    {
+        printf("Failed to open the trace %s\n", path);
+        return 1;
+    }
+
+    decode_governor_init(&g, fps);
+    printf("%s at %d fps, frame interval %lld us, cost per level", path ? path : "Built-in trace", fps,
+           (long long)g.budget_us);
+    for (int i = 0; i < DECODE_LEVELS; i++)
+        printf(" %g", factors[i]);
+    printf("\n  packet   time s   load  change   level                next step up after\n");
+    while (next_busy(trace, g.packets, fps, g.budget_us, &busy_us))
+    {
+        int old = g.level;
+
+        at_level[g.level]++;
+        if (!decode_governor_update(&g, (int64_t)(busy_us * factors[g.level])))
+            continue;
+        if (g.level > old)
+            escalations++;
+        else
+            recoveries++;
+        printf("%8lld %8.1f %5.0f%%  %-8s %d %-18s %5d packets\n", (long long)g.packets, (double)g.packets / fps,
+               g.load * 100, g.level > old ? "escalate" : "recover", g.level, level_names[g.level], g.recover_frames);
+    }
+    if (trace)
+        fclose(trace);
+
+    printf("%lld packets (%.1f s), %lld escalations, %lld recoveries\n", (long long)g.packets,
+           (double)g.packets / fps, (long long)escalations, (long long)recoveries);
+    for (int i = 0; i < DECODE_LEVELS; i++)
+        printf("  level %d %-18s %8.1f s %5.1f%%\n", i, level_names[i], (double)at_level[i] / fps,
+               g.packets ? 100.0 * at_level[i] / g.packets : 0.0);
+    return 0;
+}
@@ -0,0 +1,271 @@
+// The video server's packet pool (common/mem_budget.h, -m) under a stub encoder and recording, and
+// what it does to RSS, without x264, a camera or a disk.
+//
+// For every capture size the pool gets the slots video.c gives it with -m and a recording
+// directory: 4 in flight plus a second of frames, each an eighth of a raw frame. A stub encoder
+// produces -f packets a second: a keyframe of most of a slot every second, every third one larger
+// than a slot, and the rest a few percent of a slot. Every packet is filled with its sequence
+// number, released by the muxer at once and queued for a recording thread that releases it later,
+// from its own thread. Once per run the recording stalls for -s ms, longer than its queue lasts, so
+// it drops packets; the pool must still not run out, since the queue holds at most the slots
+// beyond those in flight, as in video.c. The recording checks every packet it releases: a slot
+// handed out twice would have been overwritten. For every size it prints the pool size, RSS after
+// the pool is allocated and how much it grew while packets flowed, the packets that did not fit a
+// slot or found the pool exhausted, the most slots in use, the packets the recording dropped and
+// those found overwritten.
+//
+// This covers the pool only. x264's frames, the converted frame and libavformat's buffers are not
+// allocated here, so the RSS of the whole server under -m still has to be read from its own exit
+// line (see the README).
+//
+// gcc -O2 mem_budget_bench.c -o mem_budget_bench -lavcodec -lavutil -lpthread
+// ./mem_budget_bench                     # 480p to 1760 x 1328, 30 fps, 4 s each, a 1.5 s stall
+// ./mem_budget_bench -s 0 -t 10          # no stall: nothing dropped
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../common/metrics.h"
+#include "../common/mem_budget.h"
+
+#define INFLIGHT 4                          // VIDEO_POOL_INFLIGHT in video.c
+#define MAX_QUEUE 256
+
+typedef struct Recording
+{
+    pthread_mutex_t lock;
+    AVBufferRef *queue[MAX_QUEUE];
+    int64_t seq[MAX_QUEUE];
+    int size[MAX_QUEUE];
+    int head, count, capacity;
+    int64_t stall_at_us, stall_us;
+    int64_t dropped, checked, corrupt;
+    volatile int stop;
+    pthread_t thread;
+} Recording;
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// VmRSS or VmHWM from /proc/self/status, in bytes
+static int64_t proc_status_bytes(const char *field)
+{
+    char line[256];
+    int64_t kb = -1;
+    size_t len = strlen(field);
+    FILE *f = fopen("/proc/self/status", "r");
+
+    if (!f)
+        return -1;
+    while (fgets(line, sizeof(line), f))
+        if (!strncmp(line, field, len) && line[len] == ':')
+            kb = atoll(line + len + 1);
+    fclose(f);
+    return kb * 1024;
+}
+
+static int packet_intact(const AVBufferRef *buf, int64_t seq, int size)
+{
+    for (int i = 0; i < size; i++)
+        if (buf->data[i] != (uint8_t)(seq + i / 4096))
+            return 0;
+    return 1;
+}
+
+// The recording: writes a packet every few ms, except during the stall
+static void *recording_thread(void *arg)
+{
+    Recording *r = (Recording *)arg;
+
+    while (!r->stop)
+    {
+        AVBufferRef *buf = NULL;
+        int64_t seq = 0;
+        int size = 0;
+        int64_t now = now_us();
+
+        if (r->stall_us && now >= r->stall_at_us && now < r->stall_at_us + r->stall_us)
+        {
+            usleep(1000);
+            continue;
+        }
+        pthread_mutex_lock(&r->lock);
+        if (r->count)
+        {
+            buf = r->queue[r->head];
+            seq = r->seq[r->head];
+            size = r->size[r->head];
+            r->head = (r->head + 1) % MAX_QUEUE;
+            r->count--;
+        }
+        pthread_mutex_unlock(&r->lock);
+        if (!buf)
+        {
+            usleep(2000);
+            continue;
+        }
+        r->corrupt += !packet_intact(buf, seq, size);
+        r->checked++;
+        av_buffer_unref(&buf);
+    }
+    return NULL;
+}
+
+static void recording_push(Recording *r, AVBufferRef *buf, int64_t seq, int size)
+{
+    AVBufferRef *ref = NULL;
+
+    pthread_mutex_lock(&r->lock);
+    if (r->count < r->capacity && (ref = av_buffer_ref(buf)))
+    {
+        int i = (r->head + r->count++) % MAX_QUEUE;
+        r->queue[i] = ref;
+        r->seq[i] = seq;
+        r->size[i] = size;
+    }
+    else
+        r->dropped++;
+    pthread_mutex_unlock(&r->lock);
+}
+
+static int run(int width, int height, int fps, int seconds, int stall_ms)
+{
+    static MetricsServer metrics;
+    PacketPool pool;
+    Recording rec;
+    int slot_bytes = FFALIGN(width * height * 3 / 2 / 8, 4096), nb_slots = INFLIGHT + fps;
+    int64_t rss_before, rss_pool, rss_end, start, too_large = 0, exhausted = 0, max_in_use = 0;
+    unsigned int seed = 1;
+    int ret = -1;
+
+    memset(&rec, 0, sizeof(rec));
+    pthread_mutex_init(&rec.lock, NULL);
+    rec.capacity = FFMIN(nb_slots - INFLIGHT, MAX_QUEUE);
+    metrics_init(&metrics, "mem_budget_bench", NULL, NULL);
+    packet_pool_init(&pool, &metrics);
+
+    rss_before = proc_status_bytes("VmRSS");
+    if (packet_pool_start(&pool, nb_slots, slot_bytes) < 0)
+    {
+        printf("packet_pool_start error\n");
+        goto end;
+    }
+    rss_pool = proc_status_bytes("VmRSS");
+
+    start = now_us();
+    rec.stall_at_us = start + seconds * 1000000LL / 3;
+    rec.stall_us = stall_ms * 1000LL;
+    pthread_create(&rec.thread, NULL, recording_thread, &rec);
+    for (int64_t n = 0; n < (int64_t)seconds * fps; n++)
+    {
+        int64_t due = start + n * 1000000 / fps, now = now_us();
+        int size;
+        AVBufferRef *buf;
+
+        if (due > now)
+            usleep((unsigned int)(due - now));
+        // Keyframes most of a slot, every third of them too large, other frames 1 to 5% of a slot
+        if (n % fps == 0)
+            size = n / fps % 3 == 2 ? slot_bytes * 3 / 2 : slot_bytes * 3 / 4;
+        else
+            size = slot_bytes / 100 + (int)(rand_r(&seed) % (slot_bytes / 25 + 1));
+
+        if (!(buf = packet_pool_get(&pool, size)))
+        {
+            if (size + AV_INPUT_BUFFER_PADDING_SIZE > pool.slot_size)
+                too_large++;
+            else
+                exhausted++;
+            metric_add(pool.m_overflows, 1);
+            // The heap allocation avcodec_default_get_encode_buffer() would make
+            uint8_t *data = (uint8_t *)av_malloc(size + AV_INPUT_BUFFER_PADDING_SIZE);
+            if (!data || !(buf = av_buffer_create(data, size, NULL, NULL, 0)))
+            {
+                av_free(data);
+                printf("Out of memory\n");
+                break;
+            }
+        }
+        for (int i = 0; i < size; i++)
+            buf->data[i] = (uint8_t)(n + i / 4096);
+        max_in_use = FFMAX(max_in_use, metric_get(pool.m_in_use));
+        recording_push(&rec, buf, n, size);
+        av_buffer_unref(&buf);
+    }
+    // Let the recording catch up, so every slot comes back
+    while (1)
+    {
+        pthread_mutex_lock(&rec.lock);
+        int left = rec.count;
+        pthread_mutex_unlock(&rec.lock);
+        if (!left)
+            break;
+        usleep(10000);
+    }
+    rec.stop = 1;
+    pthread_join(rec.thread, NULL);
+    rss_end = proc_status_bytes("VmRSS");
+
+    printf("%4d x %-4d %4d x %4d KB %7.1f %8.1f %8.1f %8lld %6lld %7lld %9lld/%-2d %7lld %7lld\n", width, height,
+           nb_slots, slot_bytes / 1024, (double)nb_slots * slot_bytes / 1048576.0,
+           (rss_pool - rss_before) / 1048576.0, (rss_end - rss_pool) / 1048576.0, (long long)rec.checked,
+           (long long)too_large, (long long)exhausted, (long long)max_in_use, nb_slots, (long long)rec.dropped,
+           (long long)rec.corrupt);
+    ret = rec.corrupt || exhausted || metric_get(pool.m_in_use) ? 1 : 0;
+    if (metric_get(pool.m_in_use))
+        printf("%lld slots still in use after every packet was released\n", (long long)metric_get(pool.m_in_use));
+
+end:
+    packet_pool_free(&pool);
+    pthread_mutex_destroy(&rec.lock);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    static const int sizes[][2] = { { 640, 480 }, { 1280, 720 }, { 1920, 1080 }, { 1760, 1328 } };
+    int fps = 30, seconds = 4, stall_ms = 1500, failed = 0;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+            fps = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+            seconds = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            stall_ms = atoi(argv[++i]);
+        else
+        {
+            printf("Usage: %s [-f fps] [-t seconds] [-s stall_ms]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (fps < 1 || INFLIGHT + fps > MEM_BUDGET_MAX_SLOTS || seconds < 1 || stall_ms < 0)
+    {
+        printf("1 to %d fps, at least 1 s, a stall of at least 0 ms\n", MEM_BUDGET_MAX_SLOTS - INFLIGHT);
+        return 1;
+    }
+    mem_budget_malloc_tune();
+
+    printf("%d fps, %d s per size, recording stalls %d ms once, sizes in MB\n", fps, seconds, stall_ms);
+    printf("size        slots         pool  rss pool rss grew recorded  large   empty  most used dropped corrupt\n");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        int ret = run(sizes[i][0], sizes[i][1], fps, seconds, stall_ms);
+        if (ret < 0)
+            return 1;
+        failed |= ret;
+    }
+    printf("peak RSS of this process %.1f MB\n", proc_status_bytes("VmHWM") / 1048576.0);
+    if (failed)
+        printf("The pool ran out, handed out a slot twice or lost one\n");
+    return failed;
+}
@@ -0,0 +1,197 @@
+// Mix cost and latency of the audio client's mixer (common/audio_mix.h) for 1 to 16 sources,
+// without PortAudio, RTSP or a sound card.
+//
+// Each source is a thread that pushes 1024-frame chunks of a sine (the size of an AAC frame) when
+// they are due, late by a random 0 .. -j ms to stand in for network jitter, and with its clock off
+// by -p ppm. The mixer pulls 10 ms blocks on the beat of a null output device and throws them
+// away. For every run it prints the time one pull takes, what that is of the block period, how
+// long samples wait in the jitter buffers and what the buffers did.
+//
+// gcc -O2 -march=native mix_bench.c -o mix_bench -lavutil -lm -lpthread
+// ./mix_bench                        # 1, 2, 4, 8, 16 sources, 10 s each, 20 ms jitter, 40 ms target
+// ./mix_bench -s 4 -t 60 -p 2000     # a sender 2000 ppm fast: its buffer gets cut back now and then
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "../common/metrics.h"
+#include "../common/audio_mix.h"
+
+#define RATE 48000
+#define CHANNELS 2
+#define BLOCK_FRAMES (RATE / 100)
+#define CHUNK_FRAMES 1024
+
+typedef struct BenchSource
+{
+    AudioMixer *mixer;
+    int index;
+    double ppm;
+    int jitter_us;
+    volatile int64_t *stop;
+    pthread_t thread;
+} BenchSource;
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_until_ns(int64_t t)
+{
+    struct timespec ts = { t / 1000000000LL, t % 1000000000LL };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+        ;
+}
+
+static void *bench_source_thread(void *arg)
+{
+    BenchSource *b = (BenchSource *)arg;
+    float chunk[CHUNK_FRAMES * CHANNELS];
+    double phase = 0, step = 2 * 3.14159265358979 * (220.0 + 110.0 * b->index) / RATE;
+    unsigned int seed = 12345u + b->index;
+    int64_t start = now_ns(), sent = 0;
+
+    while (!metrics_atomic_load(b->stop))
+    {
+        // When the chunk would be due at a rate off by ppm, plus this chunk's share of jitter
+        int64_t due = start + (int64_t)(sent * 1e9 / (RATE * (1.0 + b->ppm * 1e-6)));
+        if (b->jitter_us)
+            due += (rand_r(&seed) % b->jitter_us) * 1000LL;
+        sleep_until_ns(due);
+        for (int i = 0; i < CHUNK_FRAMES; i++, phase += step)
+            chunk[2 * i] = chunk[2 * i + 1] = 0.3f * (float)sin(phase);
+        audio_mixer_push(b->mixer, b->index, chunk, CHUNK_FRAMES);
+        sent += CHUNK_FRAMES;
+    }
+    return NULL;
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int run(int nb_sources, int seconds, int jitter_ms, int target_ms, double ppm)
+{
+    static MetricsServer metrics;
+    AudioMixer mixer;
+    BenchSource sources[AUDIO_MIX_MAX_SOURCES];
+    volatile int64_t stop = 0;
+    int16_t out[BLOCK_FRAMES * CHANNELS];
+    int nb_blocks = seconds * RATE / BLOCK_FRAMES;
+    int64_t *cost = calloc(nb_blocks, sizeof(*cost));
+    int64_t *buffered = calloc(nb_blocks, sizeof(*buffered));
+    int64_t underruns = 0, skipped = 0, dropped = 0, next;
+    double cost_sum = 0, buffered_sum = 0;
+    int ret = -1;
+
+    memset(&mixer, 0, sizeof(mixer));
+    metrics_init(&metrics, "mix_bench", NULL, NULL);
+    if (!cost || !buffered || audio_mixer_init(&mixer, &metrics, CHANNELS, BLOCK_FRAMES, target_ms * RATE / 1000) < 0)
+    {
+        printf("Out of memory\n");
+        goto end;
+    }
+    for (int i = 0; i < nb_sources; i++)
+    {
+        if (audio_mixer_add_source(&mixer, &metrics, 0.0f) < 0)
+        {
+            printf("Out of memory\n");
+            goto end;
+        }
+    }
+    for (int i = 0; i < nb_sources; i++)
+    {
+        sources[i] = (BenchSource){ &mixer, i, i == 0 ? ppm : 0, jitter_ms * 1000, &stop, 0 };
+        pthread_create(&sources[i].thread, NULL, bench_source_thread, &sources[i]);
+    }
+
+    // The null device: one block every 10 ms, right on time
+    next = now_ns();
+    for (int i = 0; i < nb_blocks; i++)
+    {
+        int64_t start = now_ns(), fill = 0;
+        audio_mixer_pull(&mixer, out);
+        cost[i] = now_ns() - start;
+        for (int j = 0; j < nb_sources; j++)
+            fill += metric_get(mixer.sources[j].m_fill);
+        // A sample's wait: the jitter buffer it was in, then the block it was mixed into
+        buffered[i] = (fill / nb_sources + BLOCK_FRAMES) * 1000000LL / RATE;
+        cost_sum += cost[i];
+        buffered_sum += buffered[i];
+        next += BLOCK_FRAMES * 1000000000LL / RATE;
+        sleep_until_ns(next);
+    }
+    metrics_atomic_store(&stop, 1);
+    for (int i = 0; i < nb_sources; i++)
+    {
+        pthread_join(sources[i].thread, NULL);
+        underruns += metric_get(mixer.sources[i].m_underruns);
+        skipped += metric_get(mixer.sources[i].m_skipped);
+        dropped += metric_get(mixer.sources[i].m_dropped);
+    }
+
+    qsort(cost, nb_blocks, sizeof(*cost), compare_int64);
+    qsort(buffered, nb_blocks, sizeof(*buffered), compare_int64);
+    printf("%7d %9.2f %9.2f %9.2f %7.3f%% %8.1f %8.1f %9lld %9lld %9lld %9lld\n", nb_sources,
+           cost_sum / nb_blocks / 1000.0, cost[nb_blocks * 99 / 100] / 1000.0, cost[nb_blocks - 1] / 1000.0,
+           100.0 * cost_sum / nb_blocks / (BLOCK_FRAMES * 1e9 / RATE),
+           buffered_sum / nb_blocks / 1000.0, buffered[nb_blocks * 99 / 100] / 1000.0,
+           (long long)underruns, (long long)skipped, (long long)dropped, (long long)metric_get(mixer.m_clipped));
+    ret = 0;
+
+end:
+    audio_mixer_free(&mixer);
+    free(cost);
+    free(buffered);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    int max_sources = AUDIO_MIX_MAX_SOURCES, seconds = 10, jitter_ms = 20, target_ms = 40;
+    double ppm = 0;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            max_sources = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+            seconds = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+            jitter_ms = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+            target_ms = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+            ppm = atof(argv[++i]);
+        else
+        {
+            printf("Usage: %s [-s max_sources] [-t seconds] [-j jitter_ms] [-b target_ms] [-p ppm]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (max_sources < 1 || max_sources > AUDIO_MIX_MAX_SOURCES || seconds < 1)
+    {
+        printf("1 to %d sources, at least 1 s\n", AUDIO_MIX_MAX_SOURCES);
+        return 1;
+    }
+
+    printf("%d Hz, %d channels, %d frame blocks, %d ms target, %d ms jitter, %g ppm on source 0\n",
+           RATE, CHANNELS, BLOCK_FRAMES, target_ms, jitter_ms, ppm);
+    printf("sources   mix us    p99 us    max us  of block  wait ms   p99 ms underruns   skipped   dropped   clipped\n");
+    for (int n = 1; n <= max_sources; n *= 2)
+    {
+        if (run(n, seconds, jitter_ms, target_ms, ppm) < 0)
+            return 1;
+        if (n < max_sources && n * 2 > max_sources)
+            n = max_sources / 2;
+    }
+    return 0;
+}
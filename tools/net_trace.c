@@ -0,0 +1,362 @@
+// Record what a client receives into a trace, and replay a trace through the clients' decode,
+// conversion and presentation steps on Linux, with no camera, server or network.
+//
+// record opens the stream the way the clients do (-L for the low-latency profile, see ingest.h)
+// and writes every packet with its arrival time until -t seconds have passed or Ctrl+C. replay
+// hands the packets out at their recorded times (see net_trace.h for -N) to what stands in for a
+// client: video is decoded, scaled to BGR24 at -w x -h as the video client does at full quality
+// and copied once more the way Softcam takes a frame; audio is decoded and converted to 48 kHz
+// stereo S16 the way the PortAudio client does it. Only the first video stream is used, or the
+// first audio stream if there is none. It then prints the numbers the README quotes for the clients:
+//   frame time     one read, decode, convert and present iteration, waiting for the packet included
+//   busy           decode and conversion per packet
+//   e2e latency    sender wall clock of the frame to the end of its conversion (scale 1 only)
+// With a scale of 0 the packets come as fast as the path takes them, and the run measures the
+// path's throughput and CPU time instead.
+//
+// gcc -O2 net_trace.c -o net_trace -lavformat -lavcodec -lswscale -lswresample -lavutil -lm -lpthread
+// ./net_trace record -t 60 rtsp://localhost:8554/live cam.avtrace
+// ./net_trace replay cam.avtrace                         # as recorded
+// ./net_trace replay -N 1:2:20:7 cam.avtrace             # 2% loss, up to 20 ms of jitter, seed 7
+// ./net_trace replay -N 0 -w 1920 -h 1080 cam.avtrace    # as fast as possible
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/resource.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/time.h>
+#include <libswscale/swscale.h>
+#include <libswresample/swresample.h>
+
+#include "../common/metrics.h"
+#include "../common/ingest.h"
+#include "../common/net_trace.h"
+#include "../common/sample_convert.h"
+
+#define PLAYBACK_RATE 48000
+#define PLAYBACK_CHANNELS 2
+
+#if NET_TRACE_HAVE_CH_LAYOUT
+#define FRAME_CHANNELS(f) ((f)->ch_layout.nb_channels)
+#else
+#define FRAME_CHANNELS(f) ((f)->channels)
+#endif
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int sig)
+{
+    (void)sig;
+    stop_requested = 1;
+}
+
+// Microsecond samples of one quantity, reported as mean and percentiles in ms
+typedef struct Samples
+{
+    int64_t *v;
+    int n, cap;
+} Samples;
+
+static void samples_add(Samples *s, int64_t v)
+{
+    if (s->n == s->cap)
+    {
+        int cap = s->cap ? 2 * s->cap : 4096;
+        int64_t *grown = (int64_t *)realloc(s->v, cap * sizeof(*grown));
+        if (!grown)
+            return;
+        s->v = grown;
+        s->cap = cap;
+    }
+    s->v[s->n++] = v;
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void samples_report(Samples *s, const char *name)
+{
+    double sum = 0;
+    if (!s->n)
+    {
+        printf("%-14s -\n", name);
+        return;
+    }
+    qsort(s->v, s->n, sizeof(*s->v), compare_int64);
+    for (int i = 0; i < s->n; i++)
+        sum += s->v[i];
+    printf("%-14s mean %8.2f ms  p50 %8.2f ms  p99 %8.2f ms  max %8.2f ms\n", name, sum / s->n / 1000.0,
+           s->v[s->n / 2] / 1000.0, s->v[s->n * 99 / 100] / 1000.0, s->v[s->n - 1] / 1000.0);
+}
+
+static int record(const char *url, const char *path, int low_latency, int seconds)
+{
+    static MetricsServer metrics;
+    AVFormatContext *s = NULL;
+    AVDictionary *options = NULL;
+    AVPacket *pkt = av_packet_alloc();
+    NetTrace trace;
+    int64_t end_us = av_gettime_relative() + seconds * 1000000LL;
+    int ret = -1;
+
+    metrics_init(&metrics, "net_trace", NULL, NULL);
+    net_trace_init(&trace, &metrics);
+    trace.record_path = path;
+    if (ingest_is_sdp(url))
+        ingest_set_sdp_options(&options, low_latency);
+    else
+        ingest_set_options(&options, low_latency, 0);
+    if (!pkt || avformat_open_input(&s, url, NULL, &options) < 0)
+    {
+        printf("Failed to open %s\n", url);
+        goto end;
+    }
+    if (ingest_needs_probe(s, low_latency) && avformat_find_stream_info(s, NULL) < 0)
+    {
+        printf("Failed to retrieve input stream information\n");
+        goto end;
+    }
+    if (net_trace_record_start(&trace, s) < 0)
+        goto end;
+    printf("Recording %s into %s, Ctrl+C to stop\n", url, path);
+    while (!stop_requested && (seconds <= 0 || av_gettime_relative() < end_us))
+    {
+        ret = net_trace_read_frame(&trace, s, pkt);
+        if (ret == AVERROR(EAGAIN))
+            continue;
+        if (ret < 0)
+        {
+            printf("Stream ended\n");
+            break;
+        }
+        av_packet_unref(pkt);
+    }
+    ret = 0;
+
+end:
+    net_trace_record_stop(&trace);
+    av_dict_free(&options);
+    av_packet_free(&pkt);
+    avformat_close_input(&s);
+    return ret;
+}
+
+static int replay(const char *path, const char *spec, int width, int height)
+{
+    static MetricsServer metrics;
+    AVFormatContext *s = NULL;
+    AVCodecContext *dec = NULL;
+    struct SwsContext *sws = NULL;
+    struct SwrContext *swr = NULL;
+    AVPacket *pkt = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    uint8_t *picture = NULL, *presented = NULL, *samples = NULL;
+    int picture_size = 0, samples_size = 0;
+    int linesize[4];
+    uint8_t *planes[4];
+    SampleDither dither;
+    NetTrace trace;
+    Samples frame_time = { 0 }, busy = { 0 }, e2e = { 0 };
+    int64_t packets = 0, frames = 0, errors = 0, start_us, last_us;
+    struct rusage usage;
+    const AVCodec *codec = NULL;
+    int index = -1, ret = -1;
+
+    metrics_init(&metrics, "net_trace", NULL, NULL);
+    net_trace_init(&trace, &metrics);
+    if (spec && net_trace_parse_replay(&trace, spec) < 0)
+    {
+        printf("Invalid replay options %s, expected scale[:loss_percent[:jitter_ms[:seed]]]\n", spec);
+        goto end;
+    }
+    if (!pkt || !frame || net_trace_open_input(&trace, &s, path) < 0)
+    {
+        printf("Failed to open the trace %s\n", path);
+        goto end;
+    }
+    for (unsigned int i = 0; i < s->nb_streams && index < 0; i++)
+        if (s->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+            index = i;
+    for (unsigned int i = 0; i < s->nb_streams && index < 0; i++)
+        if (s->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+            index = i;
+    if (index < 0 || !(codec = avcodec_find_decoder(s->streams[index]->codecpar->codec_id)))
+    {
+        printf("No video or audio stream with a decoder in %s\n", path);
+        goto end;
+    }
+    dec = avcodec_alloc_context3(codec);
+    if (!dec || avcodec_parameters_to_context(dec, s->streams[index]->codecpar) < 0 || avcodec_open2(dec, codec, NULL) < 0)
+    {
+        printf("Failed to open the decoder\n");
+        goto end;
+    }
+    if (dec->codec_type == AVMEDIA_TYPE_VIDEO)
+    {
+        picture_size = av_image_get_buffer_size(AV_PIX_FMT_BGR24, width, height, 1);
+        picture = (uint8_t *)av_malloc(picture_size);
+        presented = (uint8_t *)av_malloc(picture_size);
+        if (!picture || !presented)
+            goto end;
+        av_image_fill_arrays(planes, linesize, picture, AV_PIX_FMT_BGR24, width, height, 1);
+    }
+    else
+    {
+        // Room for 100 ms frames, like the PortAudio client's buffer
+        samples_size = PLAYBACK_RATE / 10 * PLAYBACK_CHANNELS * 2;
+        samples = (uint8_t *)av_malloc(samples_size);
+#if NET_TRACE_HAVE_CH_LAYOUT
+        AVChannelLayout stereo = AV_CHANNEL_LAYOUT_STEREO;
+        swr_alloc_set_opts2(&swr, &stereo, AV_SAMPLE_FMT_S16, PLAYBACK_RATE, &dec->ch_layout, dec->sample_fmt,
+                            dec->sample_rate, 0, NULL);
+#else
+        swr = swr_alloc_set_opts(NULL, AV_CH_LAYOUT_STEREO, AV_SAMPLE_FMT_S16, PLAYBACK_RATE,
+                                 dec->channel_layout ? dec->channel_layout : av_get_default_channel_layout(dec->channels),
+                                 dec->sample_fmt, dec->sample_rate, 0, NULL);
+#endif
+        if (!samples || !swr || swr_init(swr) < 0)
+        {
+            printf("Failed to initialize the resampling context\n");
+            goto end;
+        }
+        sample_dither_init(&dither, 1);
+    }
+
+    printf("Replaying %s: %s %s, scale %g, %g%% loss, %lld ms jitter, seed %u\n", path,
+           av_get_media_type_string(dec->codec_type), codec->name, trace.scale, trace.loss_percent,
+           (long long)(trace.jitter_us / 1000), trace.seed);
+    start_us = last_us = av_gettime_relative();
+    while (!stop_requested && net_trace_read_frame(&trace, s, pkt) >= 0)
+    {
+        int64_t t0 = av_gettime_relative();
+        if (pkt->stream_index != index)
+        {
+            av_packet_unref(pkt);
+            continue;
+        }
+        packets++;
+        if (avcodec_send_packet(dec, pkt) < 0)
+            errors++;
+        av_packet_unref(pkt);
+        while (avcodec_receive_frame(dec, frame) >= 0)
+        {
+            int64_t pts_us = frame->best_effort_timestamp == AV_NOPTS_VALUE ? AV_NOPTS_VALUE :
+                             av_rescale_q(frame->best_effort_timestamp, s->streams[index]->time_base, AV_TIME_BASE_Q);
+            if ((frame->flags & AV_FRAME_FLAG_CORRUPT) || frame->decode_error_flags)
+                errors++;
+            if (dec->codec_type == AVMEDIA_TYPE_VIDEO)
+            {
+                sws = sws_getCachedContext(sws, frame->width, frame->height, (enum AVPixelFormat)frame->format,
+                                           width, height, AV_PIX_FMT_BGR24, SWS_BICUBIC, NULL, NULL, NULL);
+                if (!sws)
+                {
+                    printf("Failed to create conversion context\n");
+                    goto end;
+                }
+                sws_scale(sws, (const uint8_t *const *)frame->data, frame->linesize, 0, frame->height, planes, linesize);
+                memcpy(presented, picture, picture_size);
+            }
+            else if (frame->sample_rate == PLAYBACK_RATE && FRAME_CHANNELS(frame) == PLAYBACK_CHANNELS &&
+                     frame->format == AV_SAMPLE_FMT_FLTP && frame->nb_samples * PLAYBACK_CHANNELS * 2 <= samples_size)
+            {
+                sample_convert_from_fltp(samples, AV_SAMPLE_FMT_S16, (const float *const *)frame->extended_data,
+                                         PLAYBACK_CHANNELS, frame->nb_samples, &dither);
+            }
+            else
+            {
+                uint8_t *out = samples;
+                swr_convert(swr, &out, samples_size / (PLAYBACK_CHANNELS * 2), (const uint8_t **)frame->extended_data,
+                            frame->nb_samples);
+            }
+            frames++;
+            if (trace.scale == 1.0 && s->start_time_realtime != AV_NOPTS_VALUE && pts_us != AV_NOPTS_VALUE)
+                samples_add(&e2e, av_gettime() - (s->start_time_realtime + pts_us));
+        }
+        int64_t now = av_gettime_relative();
+        samples_add(&busy, now - t0);
+        samples_add(&frame_time, now - last_us);
+        last_us = now;
+    }
+
+    getrusage(RUSAGE_SELF, &usage);
+    printf("%lld packets, %lld frames, %lld dropped by the replay, %lld decode errors in %.2f s, %.1f frames/s, CPU %.2f s\n",
+           (long long)packets, (long long)frames, (long long)metric_get(trace.m_dropped), (long long)errors,
+           (av_gettime_relative() - start_us) / 1e6, frames * 1e6 / (av_gettime_relative() - start_us + 1),
+           usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6);
+    samples_report(&frame_time, "frame time");
+    samples_report(&busy, "busy");
+    samples_report(&e2e, "e2e latency");
+    ret = 0;
+
+end:
+    free(frame_time.v);
+    free(busy.v);
+    free(e2e.v);
+    av_free(picture);
+    av_free(presented);
+    av_free(samples);
+    sws_freeContext(sws);
+    swr_free(&swr);
+    avcodec_free_context(&dec);
+    avformat_close_input(&s);
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    return ret;
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s record [-L] [-t seconds] rtsp_url|sdp trace.avtrace\n"
+           "       %s replay [-N scale[:loss_percent[:jitter_ms[:seed]]]] [-w width] [-h height] trace.avtrace\n", name, name);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *spec = NULL;
+    int low_latency = 0, seconds = 0, width = 640, height = 480;
+    int i;
+
+    if (argc < 2)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    for (i = 2; i < argc && argv[i][0] == '-'; ++i)
+    {
+        if (strcmp(argv[i], "-L") == 0)
+            low_latency = 1;
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+            seconds = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-N") == 0 && i + 1 < argc)
+            spec = argv[++i];
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+            width = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-h") == 0 && i + 1 < argc)
+            height = atoi(argv[++i]);
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    signal(SIGINT, request_stop);
+    signal(SIGTERM, request_stop);
+    if (strcmp(argv[1], "record") == 0 && argc - i == 2)
+    {
+        avformat_network_init();
+        int ret = record(argv[i], argv[i + 1], low_latency, seconds);
+        avformat_network_deinit();
+        return ret < 0;
+    }
+    if (strcmp(argv[1], "replay") == 0 && argc - i == 1)
+        return replay(argv[i], spec, width, height) < 0;
+    usage(argv[0]);
+    return 1;
+}
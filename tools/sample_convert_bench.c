@@ -0,0 +1,184 @@
+// Cost of the sample conversion kernels (common/sample_convert.h) for 1 to 8 channels, against
+// plain scalar loops that do the same conversion one sample at a time.
+//
+// For every channel count it converts -i frames of -n samples per channel each way: interleaved
+// S16 -> planar float, as the audio server does before encoding, and planar float -> interleaved
+// S16 with TPDF dither, as the PortAudio client and the mixer do before playback. It prints the
+// time per frame of both versions and the speedup, and checks the kernels against the scalar
+// loops: S16 -> float and undithered float -> S16 must match exactly, and dither must move no
+// sample more than 1 LSB away from the undithered result. The float input is a random signal a
+// little louder than full scale, so the clamp is exercised, with every 8th sample on a rounding
+// tie.
+//
+// gcc -O2 -march=native sample_convert_bench.c -o sample_convert_bench -lm
+// ./sample_convert_bench                 # 1 to 8 channels, 1024-sample frames (one AAC frame)
+// ./sample_convert_bench -n 1021         # a length that leaves a tail for the scalar code
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../common/sample_convert.h"
+
+#define MAX_CHANNELS 8
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// The references stay scalar: the compiler would otherwise vectorize them and the comparison
+// would be between two SIMD versions
+__attribute__((optimize("no-tree-vectorize")))
+static void ref_s16_to_fltp(float **dst, const int16_t *src, int channels, int nb_samples)
+{
+    for (int i = 0; i < nb_samples; i++)
+        for (int ch = 0; ch < channels; ch++)
+            dst[ch][i] = src[i * channels + ch] * (1.0f / 32768.0f);
+}
+
+__attribute__((optimize("no-tree-vectorize")))
+static void ref_fltp_to_s16(int16_t *dst, const float *const *src, int channels, int nb_samples,
+                            SampleDither *dither)
+{
+    for (int i = 0; i < nb_samples; i++)
+        for (int ch = 0; ch < channels; ch++)
+            dst[i * channels + ch] = sc_flt_to_s16(src[ch][i], sc_scalar_dither(dither));
+}
+
+static int run(int channels, int nb_samples, int iterations)
+{
+    float *planes[MAX_CHANNELS], *ref_planes[MAX_CHANNELS];
+    int n = channels * nb_samples;
+    int16_t *s16 = malloc(n * sizeof(*s16));
+    int16_t *out = malloc(n * sizeof(*out)), *ref_out = malloc(n * sizeof(*ref_out));
+    float *flt = malloc(n * sizeof(*flt)), *ref_flt = malloc(n * sizeof(*ref_flt));
+    int64_t t, to_flt_ref, to_flt, to_s16_ref, to_s16;
+    int mismatches = 0, max_lsb = 0;
+    unsigned int seed = 1;
+    SampleDither dither;
+    int ret = -1;
+
+    if (!s16 || !out || !ref_out || !flt || !ref_flt)
+    {
+        printf("Out of memory\n");
+        goto end;
+    }
+    for (int ch = 0; ch < channels; ch++)
+    {
+        planes[ch] = flt + ch * nb_samples;
+        ref_planes[ch] = ref_flt + ch * nb_samples;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        s16[i] = (int16_t)(rand_r(&seed) & 0xffff);
+        if (i % 8 == 7)
+            flt[i] = ((rand_r(&seed) % 65535 - 32767) + 0.5f) / 32768.0f;
+        else
+            flt[i] = (rand_r(&seed) / (float)RAND_MAX * 2.0f - 1.0f) * 1.05f;
+    }
+
+    // Check: S16 -> float, then float -> S16 without and with dither
+    ref_s16_to_fltp(ref_planes, s16, channels, nb_samples);
+    sc_s16_to_fltp(planes, s16, channels, nb_samples);
+    mismatches += memcmp(flt, ref_flt, n * sizeof(*flt)) != 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (i % 8 == 7)
+            flt[i] = ((rand_r(&seed) % 65535 - 32767) + 0.5f) / 32768.0f;
+        else
+            flt[i] = (rand_r(&seed) / (float)RAND_MAX * 2.0f - 1.0f) * 1.05f;
+    }
+    ref_fltp_to_s16(ref_out, (const float *const *)planes, channels, nb_samples, NULL);
+    sc_fltp_to_s16(out, (const float *const *)planes, channels, nb_samples, NULL);
+    for (int i = 0; i < n; i++)
+        mismatches += out[i] != ref_out[i];
+    sample_dither_init(&dither, 1);
+    sc_fltp_to_s16(out, (const float *const *)planes, channels, nb_samples, &dither);
+    for (int i = 0; i < n; i++)
+    {
+        int lsb = abs(out[i] - ref_out[i]);
+        max_lsb = lsb > max_lsb ? lsb : max_lsb;
+    }
+
+    t = now_ns();
+    for (int k = 0; k < iterations; k++)
+        ref_s16_to_fltp(ref_planes, s16, channels, nb_samples);
+    to_flt_ref = now_ns() - t;
+    t = now_ns();
+    for (int k = 0; k < iterations; k++)
+        sc_s16_to_fltp(ref_planes, s16, channels, nb_samples);
+    to_flt = now_ns() - t;
+    t = now_ns();
+    for (int k = 0; k < iterations; k++)
+        ref_fltp_to_s16(ref_out, (const float *const *)planes, channels, nb_samples, &dither);
+    to_s16_ref = now_ns() - t;
+    t = now_ns();
+    for (int k = 0; k < iterations; k++)
+        sc_fltp_to_s16(out, (const float *const *)planes, channels, nb_samples, &dither);
+    to_s16 = now_ns() - t;
+
+    printf("%8d %10.0f %10.0f %7.1fx %10.0f %10.0f %7.1fx %10d %7d\n", channels,
+           (double)to_flt_ref / iterations, (double)to_flt / iterations, (double)to_flt_ref / to_flt,
+           (double)to_s16_ref / iterations, (double)to_s16 / iterations, (double)to_s16_ref / to_s16,
+           mismatches, max_lsb);
+    ret = mismatches || max_lsb > 1 ? 1 : 0;
+
+end:
+    free(s16);
+    free(out);
+    free(ref_out);
+    free(flt);
+    free(ref_flt);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    int max_channels = MAX_CHANNELS, nb_samples = 1024, iterations = 20000, failed = 0;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+            max_channels = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            nb_samples = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc)
+            iterations = atoi(argv[++i]);
+        else
+        {
+            printf("Usage: %s [-c max_channels] [-n samples_per_frame] [-i iterations]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (max_channels < 1 || max_channels > MAX_CHANNELS || nb_samples < 1 || iterations < 1)
+    {
+        printf("1 to %d channels, at least 1 sample and 1 iteration\n", MAX_CHANNELS);
+        return 1;
+    }
+
+#if defined(SC_AVX2)
+    printf("AVX2, ");
+#elif defined(SC_SSE2)
+    printf("SSE2, ");
+#elif defined(SC_NEON)
+    printf("NEON, ");
+#else
+    printf("no SIMD, ");
+#endif
+    printf("%d samples per channel per frame, %d frames, times in ns per frame\n", nb_samples, iterations);
+    printf("channels  s16 plain   s16 simd speedup  flt plain   flt simd speedup mismatches max lsb\n");
+    for (int ch = 1; ch <= max_channels; ch++)
+    {
+        int ret = run(ch, nb_samples, iterations);
+        if (ret < 0)
+            return 1;
+        failed |= ret;
+    }
+    if (failed)
+        printf("The kernels do not match the scalar loops\n");
+    return failed;
+}
@@ -0,0 +1,156 @@
+# Soak harness: runs one pipeline for hours and fails when it does not hold a steady state.
+#
+# The program under test runs against a synthetic source as fast as it can take it, so an hour of
+# soak covers many hours of stream. Every --interval seconds its resident memory and open file
+# descriptors (handles on Windows) are sampled, and its /metrics endpoint is scraped for one
+# latency histogram. After --warmup the first and the last --window of samples are compared:
+#   RSS: the lowest value of the last window may not exceed the highest of the first by --max-rss-mb
+#   fds: the same, by --max-fds
+#   latency: the p99 of the last window may not exceed the first window's by more than --max-p99-ratio
+# The program is then stopped with SIGINT and must exit cleanly.
+#
+# python3 tools/soak.py video --hours 4                 # ./video from a lavfi source to multicast
+# python3 tools/soak.py audio --hours 4
+# python3 tools/soak.py custom --metrics 9102 --latency e2e_latency_seconds -- ./my_pipeline args...
+#
+# Linux reads /proc; elsewhere psutil is needed (pip install psutil).
+import argparse
+import os
+import re
+import signal
+import subprocess
+import sys
+import time
+import urllib.request
+
+# Each preset: command, metrics port and the histogram whose p99 must stay flat. No realtime filter
+# on the sources, and multicast output, so nothing but the program itself sets the pace.
+PRESETS = {
+    'video': (['./video', '-i', 'lavfi', '-d', 'testsrc2=size=640x480:rate=30,format=yuyv422',
+               '-G', '239.255.0.1:5004', '-M', '9100'], 9100, 'frame_latency_seconds'),
+    'audio': (['./audio', '-i', 'lavfi', '-d', 'sine=frequency=440:sample_rate=48000,aformat=channel_layouts=stereo',
+               '-G', '239.255.0.2:5004', '-M', '9101'], 9101, 'encode_seconds'),
+}
+
+BUCKET = re.compile(r'^(\w+)_bucket\{(?:.*,)?le="([^"]+)"\} (\d+)$')
+
+
+def sample_process(pid):
+    """Resident bytes and open descriptors of a running process"""
+    if os.path.isdir('/proc/%d' % pid):
+        with open('/proc/%d/status' % pid) as f:
+            rss = next(int(line.split()[1]) * 1024 for line in f if line.startswith('VmRSS:'))
+        return rss, len(os.listdir('/proc/%d/fd' % pid))
+    import psutil
+    p = psutil.Process(pid)
+    fds = p.num_handles() if hasattr(p, 'num_handles') else p.num_fds()
+    return p.memory_info().rss, fds
+
+
+def scrape_histogram(port, name):
+    """Cumulative bucket counts of one histogram, summed over all its label sets: {le: count}"""
+    buckets = {}
+    with urllib.request.urlopen('http://127.0.0.1:%d/metrics' % port, timeout=5) as r:
+        for line in r.read().decode().splitlines():
+            m = BUCKET.match(line)
+            if m and m.group(1).endswith('_' + name):
+                le = float('inf') if m.group(2) == '+Inf' else float(m.group(2))
+                buckets[le] = buckets.get(le, 0) + int(m.group(3))
+    return buckets
+
+
+def p99(first, last):
+    """Upper bound of the bucket holding the 99th percentile of what was observed between two scrapes"""
+    delta = sorted((le, last.get(le, 0) - first.get(le, 0)) for le in last)
+    if not delta or delta[-1][1] <= 0:
+        return None
+    for le, count in delta:
+        if count >= 0.99 * delta[-1][1]:
+            return le
+    return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Run a pipeline for hours and check it holds a steady state')
+    parser.add_argument('preset', choices=sorted(PRESETS) + ['custom'])
+    parser.add_argument('--hours', type=float, default=1.0)
+    parser.add_argument('--interval', type=float, default=10.0, help='seconds between samples')
+    parser.add_argument('--warmup', type=float, default=120.0, help='seconds before the first window')
+    parser.add_argument('--window', type=int, default=30, help='samples in the first and last window')
+    parser.add_argument('--metrics', type=int, help='metrics port of a custom command')
+    parser.add_argument('--latency', help='histogram to watch for a custom command')
+    parser.add_argument('--max-rss-mb', type=float, default=4.0)
+    parser.add_argument('--max-fds', type=int, default=0)
+    parser.add_argument('--max-p99-ratio', type=float, default=1.5)
+    # Everything after -- is the program and its arguments, which replace the preset's
+    argv = sys.argv[1:]
+    split = argv.index('--') if '--' in argv else len(argv)
+    args = parser.parse_args(argv[:split])
+
+    command, port, latency = PRESETS.get(args.preset, (None, None, None))
+    command = argv[split + 1:] or command
+    port = args.metrics or port
+    latency = args.latency or latency
+    if not command or not port or not latency:
+        parser.error('a custom run needs a command, --metrics and --latency')
+
+    proc = subprocess.Popen(command, stdout=subprocess.DEVNULL)
+    samples = []
+    deadline = time.monotonic() + args.hours * 3600
+    start = time.monotonic()
+    failed = []
+    try:
+        while time.monotonic() < deadline:
+            time.sleep(args.interval)
+            if proc.poll() is not None:
+                failed.append('exited early with status %d' % proc.returncode)
+                break
+            if time.monotonic() - start < args.warmup:
+                continue
+            rss, fds = sample_process(proc.pid)
+            try:
+                hist = scrape_histogram(port, latency)
+            except OSError as e:
+                failed.append('metrics endpoint: %s' % e)
+                break
+            samples.append((rss, fds, hist))
+            print('%6.0f s  rss %7.1f MB  fds %4d' % (time.monotonic() - start, rss / 2**20, fds), flush=True)
+    finally:
+        if proc.poll() is None:
+            proc.send_signal(signal.SIGINT if os.name != 'nt' else signal.CTRL_C_EVENT)
+            try:
+                status = proc.wait(timeout=30)
+                if status != 0 and not failed:
+                    failed.append('exited with status %d after SIGINT' % status)
+            except subprocess.TimeoutExpired:
+                proc.kill()
+                failed.append('did not exit within 30 s of SIGINT')
+
+    if not failed and len(samples) < 2 * args.window:
+        failed.append('only %d samples after warmup, %d needed' % (len(samples), 2 * args.window))
+    if len(samples) >= 2 * args.window:
+        head, tail = samples[:args.window], samples[-args.window:]
+        rss_growth = (min(s[0] for s in tail) - max(s[0] for s in head)) / 2**20
+        fd_growth = min(s[1] for s in tail) - max(s[1] for s in head)
+        p99_head = p99(head[0][2], head[-1][2])
+        p99_tail = p99(tail[0][2], tail[-1][2])
+        print('rss growth %.1f MB, fd growth %d, %s p99 %s -> %s' %
+              (rss_growth, fd_growth, latency, p99_head, p99_tail))
+        if rss_growth > args.max_rss_mb:
+            failed.append('RSS grew by %.1f MB' % rss_growth)
+        if fd_growth > args.max_fds:
+            failed.append('%d more descriptors open' % fd_growth)
+        if p99_head is not None and p99_tail is not None and p99_tail > p99_head * args.max_p99_ratio:
+            failed.append('%s p99 rose from %g to %g' % (latency, p99_head, p99_tail))
+        if p99_tail is None:
+            failed.append('no %s observations in the last window' % latency)
+
+    for reason in failed:
+        print('FAIL: %s' % reason)
+    if not failed:
+        print('PASS')
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
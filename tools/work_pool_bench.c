@@ -0,0 +1,317 @@
+// The video server's multi-camera scheduling (common/work_pool.h) with stub cameras, so it can be
+// checked without cameras, FFmpeg encoders or an RTSP server.
+//
+// Every source is a capture thread that produces a frame every 1/-f s and hands it to the pool the
+// way video.c does: only the newest frame is kept, a frame that arrives while the previous one is
+// still waiting replaces it, and the job resubmits itself while frames keep coming. A frame job
+// spins for -b bands of -c us (the conversion, split into subtasks that idle workers steal) and
+// then -e us (the encode, one task). Source 0 is high priority. With -B a frame older than the
+// budget when its turn comes is skipped. The sources are run against 1, 2, 4 ... up to -w
+// workers; for every run it prints, per source, the frames encoded, replaced and skipped and the
+// capture-to-encoded latency, and the pool's task and steal counts. A run that does not finish
+// within 10 s of its end is reported as a deadlock.
+//
+// gcc -O2 work_pool_bench.c -o work_pool_bench -lavutil -lpthread
+// ./work_pool_bench                        # 4 sources at 30 fps, 4 x 1 ms bands + 8 ms encode, 5 s per run
+// ./work_pool_bench -w 1 -B 50             # overloaded: the normal sources shed, source 0 does not
+//
+// Work is measured in CPU time of the worker thread, so more workers than cores share the cores
+// and take longer, as the encoders would; priorities then only order the queues, not the cores.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../common/metrics.h"
+#include "../common/work_pool.h"
+
+#define MAX_SOURCES 16
+#define MAX_BANDS 16
+
+typedef struct BenchSource
+{
+    WorkPool *pool;
+    int index;
+    int priority;
+    int nb_bands;
+    int band_us, encode_us;
+    int64_t budget_us;
+    pthread_mutex_t lock;
+    int has_pending, busy;
+    int64_t pending_arrival_us;
+    WorkGroup group;
+    int64_t captured, encoded, replaced, late;
+    int64_t *latency;
+    int64_t latency_size;
+} BenchSource;
+
+typedef struct BenchCapture
+{
+    BenchSource *source;
+    int fps;
+    int64_t start_us, end_us;
+    pthread_t thread;
+} BenchCapture;
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void sleep_until_us(int64_t t)
+{
+    struct timespec ts = { t / 1000000, t % 1000000 * 1000 };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+        ;
+}
+
+static int64_t thread_cpu_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// Stands in for real work: us microseconds of CPU time, so workers sharing a core take longer
+static void spin_us(int us)
+{
+    int64_t end = thread_cpu_us() + us;
+    while (thread_cpu_us() < end)
+        ;
+}
+
+static void band_task(void *arg, int worker)
+{
+    BenchSource *s = (BenchSource *)arg;
+    (void)worker;
+    spin_us(s->band_us);
+}
+
+// video_stream_convert: the first band here, the others queued for the pool, then wait for the group
+static void bench_convert(BenchSource *s, int worker)
+{
+    int first = 0;
+
+    if (worker >= 0 && s->nb_bands > 1)
+    {
+        metrics_atomic_store(&s->group.remaining, s->nb_bands - 1);
+        for (first = s->nb_bands - 1; first > 0; first--)
+            if (work_pool_submit(s->pool, worker, s->priority, band_task, s, &s->group) < 0)
+                break;
+        metrics_atomic_add(&s->group.remaining, -first);
+    }
+    else
+        first = s->nb_bands - 1;
+    for (int i = 0; i <= first; i++)
+        band_task(s, worker);
+    if (worker >= 0 && s->nb_bands > 1)
+        work_pool_wait(s->pool, worker, s->priority, &s->group);
+}
+
+// video_stream_job, with the conversion and encode replaced by spinning
+static void bench_job(void *arg, int worker)
+{
+    BenchSource *s = (BenchSource *)arg;
+    int64_t arrival_us;
+    int again;
+
+    do
+    {
+        pthread_mutex_lock(&s->lock);
+        arrival_us = s->pending_arrival_us;
+        s->has_pending = 0;
+        pthread_mutex_unlock(&s->lock);
+
+        if (s->budget_us && now_us() - arrival_us > s->budget_us)
+        {
+            s->late++;
+        }
+        else
+        {
+            bench_convert(s, worker);
+            spin_us(s->encode_us);
+            if (s->encoded < s->latency_size)
+                s->latency[s->encoded] = now_us() - arrival_us;
+            s->encoded++;
+        }
+
+        pthread_mutex_lock(&s->lock);
+        again = s->has_pending;
+        s->busy = again;
+        pthread_mutex_unlock(&s->lock);
+    } while (again && work_pool_submit(s->pool, worker < 0 ? s->index : worker, s->priority, bench_job, s, NULL) < 0);
+}
+
+static void *bench_capture_thread(void *arg)
+{
+    BenchCapture *c = (BenchCapture *)arg;
+    BenchSource *s = c->source;
+    int submit;
+
+    for (int64_t n = 0;; n++)
+    {
+        // Cameras are not in phase with each other
+        int64_t due = c->start_us + s->index * 1000000LL / c->fps / MAX_SOURCES + n * 1000000LL / c->fps;
+        if (due >= c->end_us)
+            break;
+        sleep_until_us(due);
+        pthread_mutex_lock(&s->lock);
+        s->captured++;
+        if (s->has_pending)
+            s->replaced++;
+        s->pending_arrival_us = now_us();
+        s->has_pending = 1;
+        submit = !s->busy;
+        s->busy = 1;
+        pthread_mutex_unlock(&s->lock);
+        if (submit && work_pool_submit(s->pool, s->index, s->priority, bench_job, s, NULL) < 0)
+            bench_job(s, -1);
+    }
+    return NULL;
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void deadlock(int sig)
+{
+    static const char msg[] = "Run did not finish: deadlock\n";
+    ssize_t n = write(STDOUT_FILENO, msg, sizeof(msg) - 1);
+    (void)sig;
+    (void)n;
+    _exit(2);
+}
+
+static int run(int nb_workers, int nb_sources, int seconds, int fps, int nb_bands, int band_us, int encode_us,
+               int budget_ms)
+{
+    static MetricsServer metrics;
+    static WorkPool pool;
+    BenchSource sources[MAX_SOURCES];
+    BenchCapture captures[MAX_SOURCES];
+    int64_t start;
+    int ret = -1;
+
+    memset(sources, 0, sizeof(sources));
+    metrics_init(&metrics, "work_pool_bench", NULL, NULL);
+    for (int i = 0; i < nb_sources; i++)
+    {
+        BenchSource *s = &sources[i];
+        s->pool = &pool;
+        s->index = i;
+        s->priority = i == 0 ? 0 : 1;
+        s->nb_bands = nb_bands;
+        s->band_us = band_us;
+        s->encode_us = encode_us;
+        s->budget_us = budget_ms * 1000LL;
+        s->latency_size = (int64_t)seconds * fps + 1;
+        s->latency = calloc(s->latency_size, sizeof(*s->latency));
+        pthread_mutex_init(&s->lock, NULL);
+        if (!s->latency)
+        {
+            printf("Out of memory\n");
+            goto end;
+        }
+    }
+    if (work_pool_start(&pool, nb_workers, &metrics, NULL, NULL) < 0)
+    {
+        printf("work_pool_start failed\n");
+        work_pool_stop(&pool);
+        goto end;
+    }
+
+    alarm(seconds + 10);
+    start = now_us() + 10000;
+    for (int i = 0; i < nb_sources; i++)
+    {
+        captures[i] = (BenchCapture){ &sources[i], fps, start, start + seconds * 1000000LL, 0 };
+        pthread_create(&captures[i].thread, NULL, bench_capture_thread, &captures[i]);
+    }
+    for (int i = 0; i < nb_sources; i++)
+        pthread_join(captures[i].thread, NULL);
+    work_pool_stop(&pool);
+    alarm(0);
+
+    for (int i = 0; i < nb_sources; i++)
+    {
+        BenchSource *s = &sources[i];
+        int64_t n = s->encoded < s->latency_size ? s->encoded : s->latency_size;
+        qsort(s->latency, n, sizeof(*s->latency), compare_int64);
+        printf("%7d %6d %8s %8lld %8lld %8lld %8lld %8.1f %8.1f %8.1f\n", nb_workers, i, i == 0 ? "high" : "normal",
+               (long long)s->captured, (long long)s->encoded, (long long)s->replaced, (long long)s->late,
+               n ? s->latency[n / 2] / 1000.0 : 0.0, n ? s->latency[n * 99 / 100] / 1000.0 : 0.0,
+               n ? s->latency[n - 1] / 1000.0 : 0.0);
+    }
+    printf("%7d  pool: %lld tasks, %lld steals\n", nb_workers, (long long)metric_get(pool.m_tasks),
+           (long long)metric_get(pool.m_steals));
+    ret = 0;
+
+end:
+    for (int i = 0; i < nb_sources; i++)
+    {
+        free(sources[i].latency);
+        pthread_mutex_destroy(&sources[i].lock);
+    }
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    int max_workers = 4, nb_sources = 4, seconds = 5, fps = 30, nb_bands = 4, band_us = 1000, encode_us = 8000;
+    int budget_ms = 0;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+            max_workers = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            nb_sources = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+            seconds = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+            fps = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+            nb_bands = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+            band_us = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc)
+            encode_us = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-B") == 0 && i + 1 < argc)
+            budget_ms = atoi(argv[++i]);
+        else
+        {
+            printf("Usage: %s [-w max_workers] [-s sources] [-t seconds] [-f fps] [-b bands] [-c band_us] [-e encode_us] [-B budget_ms]\n",
+                   argv[0]);
+            return 1;
+        }
+    }
+    if (max_workers < 1 || max_workers > WORK_POOL_MAX_WORKERS || nb_sources < 1 || nb_sources > MAX_SOURCES ||
+        seconds < 1 || fps < 1 || nb_bands < 1 || nb_bands > MAX_BANDS || band_us < 0 || encode_us < 0 || budget_ms < 0)
+    {
+        printf("1 to %d workers, 1 to %d sources, 1 to %d bands, at least 1 s and 1 fps\n", WORK_POOL_MAX_WORKERS,
+               MAX_SOURCES, MAX_BANDS);
+        return 1;
+    }
+    signal(SIGALRM, deadlock);
+
+    printf("%d sources at %d fps, %d x %d us bands + %d us encode per frame (%.2f cores), budget %d ms\n",
+           nb_sources, fps, nb_bands, band_us, encode_us,
+           (double)nb_sources * fps * (nb_bands * band_us + encode_us) / 1e6, budget_ms);
+    printf("workers source priority captured  encoded replaced  skipped   p50 ms   p99 ms   max ms\n");
+    for (int n = 1; n <= max_workers; n *= 2)
+    {
+        if (run(n, nb_sources, seconds, fps, nb_bands, band_us, encode_us, budget_ms) < 0)
+            return 1;
+        if (n < max_workers && n * 2 > max_workers)
+            n = max_workers / 2;
+    }
+    return 0;
+}